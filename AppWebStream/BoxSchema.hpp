@@ -0,0 +1,83 @@
+#pragma once
+#include <stdexcept>
+#include <type_traits>
+#include "MP4Utils.hpp"
+
+
+/** Compile-time four-character code of an MPEG4 atom type. */
+constexpr uint32_t FourCC(const char (&type)[5]) {
+    return ((uint32_t)(uint8_t)type[0] << 24) | ((uint32_t)(uint8_t)type[1] << 16) | ((uint32_t)(uint8_t)type[2] << 8) | (uint32_t)(uint8_t)type[3];
+}
+
+/** Tag type passed to schema visitors to identify the visited atom type at compile time. */
+template <uint32_t TYPE>
+using BoxTag = std::integral_constant<uint32_t, TYPE>;
+
+
+/** Compile-time description of an MPEG4 atom and the child atoms of interest.
+    CHILD_OFFSET is the number of payload bytes preceding the first child atom (e.g. version, flags & entry count).
+    Schema traversal calls visitor(BoxTag<TYPE>(), atom_ptr) before descending into the children. Child atoms are
+    located in schema order and visited once, whereas atoms that are not part of the schema (e.g. optional "edts" or
+    "udta") are skipped by their size. The traversal is unrolled at compile time, so there are no runtime type lookups.
+
+    Example:
+    using Schema = Box<FourCC("moov"), 0, Box<FourCC("mvhd")>, Box<FourCC("trak"), 0, Box<FourCC("tkhd")>>>; */
+template <uint32_t TYPE, uint32_t CHILD_OFFSET = 0, class... CHILDREN>
+struct Box {
+    static constexpr uint32_t ATOM_TYPE = TYPE;
+    static constexpr uint32_t HEADER_SIZE = 8; // size & type
+
+    /** Visit an atom of this type and all child atoms in the schema. */
+    template <class VISITOR>
+    static void Visit(char* atom_ptr, uint32_t atom_size, VISITOR& visitor) {
+        visitor(BoxTag<TYPE>(), atom_ptr);
+
+        if constexpr (sizeof...(CHILDREN) > 0) {
+            if (atom_size < HEADER_SIZE + CHILD_OFFSET)
+                throw std::runtime_error("truncated atom");
+
+            char* ptr = atom_ptr + HEADER_SIZE + CHILD_OFFSET;
+            char* const end = atom_ptr + atom_size;
+            // visit children in schema order (unrolled at compile time)
+            ((ptr = CHILDREN::Find(ptr, end, visitor)), ...);
+        }
+    }
+
+    /** Scan forward from "ptr" to the next atom of this type, skipping other atoms by their size, and visit it.
+        Returns a pointer to the atom following the visited atom. */
+    template <class VISITOR>
+    static char* Find(char* ptr, char* const end, VISITOR& visitor) {
+        while (ptr + HEADER_SIZE <= end) {
+            uint32_t size = GetAtomSize(ptr);
+            if ((size < HEADER_SIZE) || (size > (uint32_t)(end - ptr)))
+                throw std::runtime_error("invalid atom size");
+
+            if (DeSerialize<uint32_t>(GetAtomType(ptr)) == TYPE) {
+                Visit(ptr, size, visitor);
+                return ptr + size;
+            }
+            ptr += size; // skip unknown atom
+        }
+        throw std::runtime_error("missing atom");
+    }
+};
+
+/** Schema entry for a list of sibling atoms of the same type, e.g. the sample entries in "stsd".
+    Visits the first atom of BOX's type and all following atoms of that type, skipping atoms of other types. */
+template <class BOX>
+struct Each {
+    template <class VISITOR>
+    static char* Find(char* ptr, char* const end, VISITOR& visitor) {
+        ptr = BOX::Find(ptr, end, visitor); // at least one atom
+        while (ptr + BOX::HEADER_SIZE <= end) {
+            uint32_t size = GetAtomSize(ptr);
+            if ((size < BOX::HEADER_SIZE) || (size > (uint32_t)(end - ptr)))
+                throw std::runtime_error("invalid atom size");
+
+            if (DeSerialize<uint32_t>(GetAtomType(ptr)) == BOX::ATOM_TYPE)
+                BOX::Visit(ptr, size, visitor);
+            ptr += size;
+        }
+        return ptr;
+    }
+};
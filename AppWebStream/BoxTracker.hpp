@@ -0,0 +1,169 @@
+#pragma once
+#include <algorithm>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "MP4Utils.hpp"
+
+
+/** Incremental & resumable tracker of top-level ISOBMFF box boundaries in a byte stream.
+    State is kept across Feed() calls, so boxes can be split arbitrarily across buffers. Box payloads are skipped
+    by their declared size without being inspected, except for explicitly captured box types that are accumulated
+    for parsing. The parsing cost is therefore proportional to the number of boxes and not the number of bytes. */
+class BoxTracker {
+public:
+    struct Box {
+        char     type[4] = {};
+        uint64_t size = 0;   ///< total box size, including header (UINT64_MAX if extending to end of stream)
+        uint64_t offset = 0; ///< box start position in stream
+    };
+
+    BoxTracker() = default;
+
+    /** Accumulate boxes of the given types, so that they can be inspected in the Feed() callback. */
+    explicit BoxTracker(std::initializer_list<const char*> capture_types) {
+        for (const char* type : capture_types)
+            m_capture_types.push_back(FourCC(type));
+    }
+
+    /** Process the next chunk of the byte stream.
+        Calls on_box(const Box& box, std::string_view data) for every completed box. "data" contains the full box,
+        including header, for captured box types and is empty for other boxes. */
+    template <class FUNC>
+    void Feed(std::string_view buffer, FUNC on_box) {
+        while (!buffer.empty()) {
+            if (!m_in_payload) {
+                // accumulate box header
+                if (!ReadHeader(buffer))
+                    return; // incomplete header
+
+                if (m_remaining == 0) {
+                    CompleteBox(on_box); // box without payload
+                    continue;
+                }
+            }
+
+            // consume payload bytes
+            size_t count = (size_t)(std::min<uint64_t>)(m_remaining, buffer.size());
+            if (m_capture)
+                m_data.append(buffer.data(), count);
+            buffer.remove_prefix(count);
+            m_remaining -= count;
+            m_position += count;
+
+            if (m_remaining == 0)
+                CompleteBox(on_box);
+        }
+    }
+
+    /** Restart tracking at a box boundary located at the given stream position. */
+    void Reset(uint64_t position = 0) {
+        m_header_len = 0;
+        m_in_payload = false;
+        m_capture = false;
+        m_remaining = 0;
+        m_position = position;
+        m_data.clear();
+    }
+
+    /** Number of bytes processed so far. */
+    uint64_t Position() const {
+        return m_position;
+    }
+
+    /** Current box (valid while inside a box payload). */
+    const Box& CurrentBox() const {
+        return m_box;
+    }
+
+    bool InsideBox() const {
+        return m_in_payload;
+    }
+
+    /** Stream position of the next box boundary, i.e. the start of the box being received.
+        Returns UINT64_MAX inside a box that extends to the end of the stream. */
+    uint64_t NextBoxOffset() const {
+        if (!m_in_payload)
+            return m_position; // partial header bytes are not yet counted
+        if (m_box.size == UINT64_MAX)
+            return UINT64_MAX;
+        return m_box.offset + m_box.size;
+    }
+
+private:
+    static constexpr uint64_t MAX_CAPTURE_SIZE = 4*1024*1024; ///< limit for accumulated boxes, since the size is declared by the peer
+
+    static uint32_t FourCC(const char type[4]) {
+        return DeSerialize<uint32_t>(type);
+    }
+
+    /** Accumulate header bytes. Returns true when the header is complete. */
+    bool ReadHeader(std::string_view& buffer) {
+        constexpr uint32_t HEADER_SIZE = 8;       // size & type
+        constexpr uint32_t LARGE_HEADER_SIZE = 16; // size, type & 64bit largesize
+
+        size_t needed = HEADER_SIZE;
+        if ((m_header_len >= HEADER_SIZE) && (GetAtomSize(m_header) == 1))
+            needed = LARGE_HEADER_SIZE;
+
+        for (;;) {
+            size_t count = (std::min)(needed - m_header_len, buffer.size());
+            memcpy(m_header + m_header_len, buffer.data(), count);
+            m_header_len += count;
+            buffer.remove_prefix(count);
+            if (m_header_len < needed)
+                return false;
+
+            if ((needed == HEADER_SIZE) && (GetAtomSize(m_header) == 1)) {
+                needed = LARGE_HEADER_SIZE; // 64bit largesize follows
+                continue;
+            }
+            break;
+        }
+
+        uint64_t size = GetAtomSize(m_header);
+        if (size == 1)
+            size = DeSerialize<uint64_t>(m_header + HEADER_SIZE);
+        else if (size == 0)
+            size = UINT64_MAX; // box extends to end of stream
+        if (size < m_header_len)
+            throw std::runtime_error("invalid box size");
+
+        memcpy(m_box.type, GetAtomType(m_header), 4);
+        m_box.size = size;
+        m_box.offset = m_position;
+
+        m_remaining = size - m_header_len;
+        m_position += m_header_len;
+        m_in_payload = true;
+
+        m_capture = std::find(m_capture_types.begin(), m_capture_types.end(), FourCC(m_box.type)) != m_capture_types.end();
+        if (m_capture) {
+            if (size > MAX_CAPTURE_SIZE)
+                throw std::runtime_error("invalid box size"); // also rejects boxes extending to end of stream
+            m_data.assign(m_header, m_header_len);
+            m_data.reserve((size_t)size);
+        }
+        m_header_len = 0;
+        return true;
+    }
+
+    template <class FUNC>
+    void CompleteBox(FUNC& on_box) {
+        m_in_payload = false;
+        on_box(m_box, m_capture ? std::string_view(m_data) : std::string_view());
+        m_capture = false;
+    }
+
+    char                  m_header[16] = {}; ///< partial box header
+    size_t                m_header_len = 0;
+    bool                  m_in_payload = false;
+    Box                   m_box;
+    uint64_t              m_remaining = 0;   ///< payload bytes left in current box
+    uint64_t              m_position = 0;
+    bool                  m_capture = false;
+    std::string           m_data;            ///< accumulated captured box
+    std::vector<uint32_t> m_capture_types;
+};
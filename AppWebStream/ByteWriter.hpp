@@ -0,0 +1,35 @@
+#pragma once
+#include <string_view>
+#include "MP4StreamEditor.hpp"
+
+
+class ByteWriter {
+public:
+    virtual ~ByteWriter() = default;
+    virtual int WriteBytes(const std::string_view buffer) = 0;
+
+    /** Vectored write of multiple byte ranges. Default implementation writes one range at a time.
+        Returns total number of bytes written, or -1 on failure. */
+    virtual int WriteVectored(const GatherList& buffers) {
+        int total = 0;
+        for (const std::string_view& buffer : buffers) {
+            int byte_count = WriteBytes(buffer);
+            if (byte_count < 0)
+                return -1;
+            total += byte_count;
+        }
+        return total;
+    }
+
+    virtual void Flush() = 0;
+
+    /** True if nobody consumes the written bytes at the moment, so that frames can be produced at a reduced rate. */
+    virtual bool Idle() const {
+        return false;
+    }
+
+    /** True if a consumer is waiting for a key frame, and the request has not yet been returned. */
+    virtual bool ConsumeKeyFrameRequest() {
+        return false;
+    }
+};
@@ -0,0 +1,335 @@
+#pragma once
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <intrin.h>    // __cpuid, _xgetbv
+#include <emmintrin.h> // SSE2
+#include <immintrin.h> // AVX2
+#include "Mpeg4Transmitter.hpp"
+#include "WorkerPool.hpp"
+
+/* RGBA to YUV 4:2:0 planar conversion for the FFMPEG encoder.
+   All kernels produce bit-identical output to the original per-pixel loop in VideoEncoderFF:
+   * Y = (16000 + 257*r + 504*g + 98*b)/1000 for every pixel
+   * plane 1 = sum of Cr/4 and plane 2 = sum of Cb/4 over each 2x2 pixel block
+   The "Cr" and "Cb" names refer to the R8G8B8A8 struct members. GetDIBits delivers BGRA data, so the planes end up in U,V order.
+   PixelFormat::RGBA sources are converted by swapping the coefficients of the 1st & 3rd byte, which gives the same output as swapping the bytes.
+   src_stride is in pixels and negative for bottom-up images, with src pointing to the top row.
+   Width and height must be even (guaranteed by Align2). */
+
+enum class ColorConvertKernel {
+    Scalar,
+    SSE2,
+    AVX2,
+};
+
+inline uint8_t ClipUint8(int val) {
+    if (val < 0)
+        return 0;
+    if (val > 255)
+        return 255;
+    return (uint8_t)val;
+}
+
+/** Manual RGB to YCbCr conversion, based on rgb_to_yuv in https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/movenc.c */
+inline void RGB_to_YCbCr(const R8G8B8A8 rgb, unsigned char& Y, unsigned char& Cb, unsigned char& Cr) {
+    Y = ClipUint8((  16000 + 257*rgb.r + 504*rgb.g +  98*rgb.b)/1000);
+    Cb = ClipUint8((128000 - 148*rgb.r - 291*rgb.g + 439*rgb.b)/1000);
+    Cr = ClipUint8((128000 + 439*rgb.r - 368*rgb.g -  71*rgb.b)/1000);
+}
+
+/** Original per-pixel conversion loop with read-modify-write chroma accumulation.
+    Kept as bit-exactness reference for the optimized kernels. */
+inline void RGBAToYUV420_Reference(const R8G8B8A8* src, ptrdiff_t src_stride, unsigned int width, unsigned int height, uint8_t* const planes[3], const int linesize[3]) {
+    for (unsigned int y = 0; y < height; y++) {
+        for (unsigned int x = 0; x < width; x++) {
+            R8G8B8A8 rgb = src[(ptrdiff_t)y*src_stride + x];
+            unsigned char Y=0, Cb=0, Cr=0;
+            RGB_to_YCbCr(rgb, Y, Cb, Cr);
+            // write Y value
+            planes[0][y*linesize[0] + x] = Y;
+            // write subsambled Cb,Cr values
+            if (((x % 2) == 0) && ((y % 2) == 0)) {
+                planes[1][y/2*linesize[1] + x/2] = Cr/4;
+                planes[2][y/2*linesize[2] + x/2] = Cb/4;
+            } else {
+                planes[1][y/2*linesize[1] + x/2] += Cr/4;
+                planes[2][y/2*linesize[2] + x/2] += Cb/4;
+            }
+        }
+    }
+}
+
+/** Scalar fallback. Processes one 2x2 block at a time, so that each chroma sample is written once.
+    SWAP_RB: Source with the 1st & 3rd byte swapped relative to the GetDIBits byte order (PixelFormat::RGBA). */
+template <bool SWAP_RB = false>
+inline void RGBAToYUV420_Scalar(const R8G8B8A8* src, ptrdiff_t src_stride, unsigned int width, unsigned int height, uint8_t* const planes[3], const int linesize[3]) {
+    assert((width % 2 == 0) && (height % 2 == 0));
+
+    for (unsigned int y = 0; y < height; y += 2) {
+        const R8G8B8A8* row0 = src + (ptrdiff_t)y*src_stride;
+        const R8G8B8A8* row1 = row0 + src_stride;
+        uint8_t* Y0 = planes[0] + y*linesize[0];
+        uint8_t* Y1 = Y0 + linesize[0];
+        uint8_t* U = planes[1] + y/2*linesize[1];
+        uint8_t* V = planes[2] + y/2*linesize[2];
+
+        for (unsigned int x = 0; x < width; x += 2) {
+            unsigned int u_sum = 0, v_sum = 0;
+            R8G8B8A8 block[4] = {row0[x], row0[x+1], row1[x], row1[x+1]};
+            if (SWAP_RB) {
+                for (R8G8B8A8& px : block)
+                    std::swap(px.r, px.b);
+            }
+            uint8_t* const Y_dst[4] = {Y0 + x, Y0 + x + 1, Y1 + x, Y1 + x + 1};
+            for (int i = 0; i < 4; i++) {
+                unsigned char Yv=0, Cb=0, Cr=0;
+                RGB_to_YCbCr(block[i], Yv, Cb, Cr);
+                *Y_dst[i] = Yv;
+                u_sum += Cr/4;
+                v_sum += Cb/4;
+            }
+            U[x/2] = (uint8_t)u_sum;
+            V[x/2] = (uint8_t)v_sum;
+        }
+    }
+}
+
+#if defined(_M_X64) || defined(_M_IX86)
+#define COLOR_CONVERT_X86
+
+/** Pack two int16 coefficients into each 32bit lane for use with _mm_madd_epi16. */
+inline int MaddCoef(int16_t lo, int16_t hi) {
+    return (int)((uint32_t)(uint16_t)lo | ((uint32_t)(uint16_t)hi << 16));
+}
+
+/** Exact integer division by 1000 for numerators in [0, 2^18) (covers all sums in RGB_to_YCbCr).
+    Single-precision multiplication is exact here, since float(0.001) is slightly larger than 0.001 and the rounding error is below 1/1000. */
+inline __m128i Div1000_SSE2(__m128i val) {
+    return _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(val), _mm_set1_ps(0.001f)));
+}
+
+/** Compute (Y, Cr/4, Cb/4) for 4 RGBA pixels. SWAP_RB swaps the coefficients of the 1st & 3rd byte. */
+template <bool SWAP_RB = false>
+inline void ConvertPixels_SSE2(__m128i px, __m128i& Y, __m128i& U, __m128i& V) {
+    const __m128i mask = _mm_set1_epi32(0x00FF00FF);
+    const __m128i rb = _mm_and_si128(px, mask);                    // r in low 16bit, b in high 16bit
+    const __m128i ga = _mm_and_si128(_mm_srli_epi32(px, 8), mask); // g in low 16bit, a in high 16bit
+
+    Y = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rb, _mm_set1_epi32(SWAP_RB ? MaddCoef(98, 257) : MaddCoef(257, 98))), _mm_madd_epi16(ga, _mm_set1_epi32(MaddCoef(504, 0)))), _mm_set1_epi32(16000));
+    U = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rb, _mm_set1_epi32(SWAP_RB ? MaddCoef(-71, 439) : MaddCoef(439, -71))), _mm_madd_epi16(ga, _mm_set1_epi32(MaddCoef(-368, 0)))), _mm_set1_epi32(128000));
+    V = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rb, _mm_set1_epi32(SWAP_RB ? MaddCoef(439, -148) : MaddCoef(-148, 439))), _mm_madd_epi16(ga, _mm_set1_epi32(MaddCoef(-291, 0)))), _mm_set1_epi32(128000));
+
+    Y = Div1000_SSE2(Y);
+    U = _mm_srli_epi32(Div1000_SSE2(U), 2);
+    V = _mm_srli_epi32(Div1000_SSE2(V), 2);
+}
+
+/** Sum horizontally adjacent lanes. Returns [s0+s1, s2+s3] in the two lower lanes. */
+inline __m128i PairSum_SSE2(__m128i val) {
+    __m128i sum = _mm_add_epi32(val, _mm_srli_epi64(val, 32));
+    return _mm_shuffle_epi32(sum, _MM_SHUFFLE(3, 3, 2, 0));
+}
+
+/** SSE2 kernel. Processes 8x2 pixels per iteration. */
+template <bool SWAP_RB = false>
+inline void RGBAToYUV420_SSE2(const R8G8B8A8* src, ptrdiff_t src_stride, unsigned int width, unsigned int height, uint8_t* const planes[3], const int linesize[3]) {
+    assert((width % 2 == 0) && (height % 2 == 0));
+    const unsigned int simd_width = width & ~7u;
+
+    for (unsigned int y = 0; y < height; y += 2) {
+        const R8G8B8A8* row0 = src + (ptrdiff_t)y*src_stride;
+        const R8G8B8A8* row1 = row0 + src_stride;
+        uint8_t* Y0 = planes[0] + y*linesize[0];
+        uint8_t* Y1 = Y0 + linesize[0];
+        uint8_t* U = planes[1] + y/2*linesize[1];
+        uint8_t* V = planes[2] + y/2*linesize[2];
+
+        for (unsigned int x = 0; x < simd_width; x += 8) {
+            __m128i y00, u00, v00, y01, u01, v01, y10, u10, v10, y11, u11, v11;
+            ConvertPixels_SSE2<SWAP_RB>(_mm_loadu_si128((const __m128i*)(row0 + x)),     y00, u00, v00);
+            ConvertPixels_SSE2<SWAP_RB>(_mm_loadu_si128((const __m128i*)(row0 + x + 4)), y01, u01, v01);
+            ConvertPixels_SSE2<SWAP_RB>(_mm_loadu_si128((const __m128i*)(row1 + x)),     y10, u10, v10);
+            ConvertPixels_SSE2<SWAP_RB>(_mm_loadu_si128((const __m128i*)(row1 + x + 4)), y11, u11, v11);
+
+            // luma
+            __m128i y_row0 = _mm_packs_epi32(y00, y01);
+            __m128i y_row1 = _mm_packs_epi32(y10, y11);
+            __m128i y_bytes = _mm_packus_epi16(y_row0, y_row1);
+            _mm_storel_epi64((__m128i*)(Y0 + x), y_bytes);
+            _mm_storel_epi64((__m128i*)(Y1 + x), _mm_srli_si128(y_bytes, 8));
+
+            // chroma (sum of 2x2 blocks)
+            __m128i u = _mm_unpacklo_epi64(PairSum_SSE2(_mm_add_epi32(u00, u10)), PairSum_SSE2(_mm_add_epi32(u01, u11)));
+            __m128i v = _mm_unpacklo_epi64(PairSum_SSE2(_mm_add_epi32(v00, v10)), PairSum_SSE2(_mm_add_epi32(v01, v11)));
+            __m128i uv_bytes = _mm_packus_epi16(_mm_packs_epi32(u, v), _mm_setzero_si128());
+            int u_val = _mm_cvtsi128_si32(uv_bytes);
+            int v_val = _mm_cvtsi128_si32(_mm_srli_si128(uv_bytes, 4));
+            memcpy(U + x/2, &u_val, 4);
+            memcpy(V + x/2, &v_val, 4);
+        }
+
+        if (simd_width < width) {
+            // remaining columns
+            uint8_t* const tail_planes[3] = {Y0 + simd_width, U + simd_width/2, V + simd_width/2};
+            RGBAToYUV420_Scalar<SWAP_RB>(row0 + simd_width, src_stride, width - simd_width, 2, tail_planes, linesize);
+        }
+    }
+}
+
+/** AVX2 kernel. Processes 16x2 pixels per iteration. */
+template <bool SWAP_RB = false>
+inline void RGBAToYUV420_AVX2(const R8G8B8A8* src, ptrdiff_t src_stride, unsigned int width, unsigned int height, uint8_t* const planes[3], const int linesize[3]) {
+    assert((width % 2 == 0) && (height % 2 == 0));
+    const unsigned int simd_width = width & ~15u;
+
+    const __m256i mask = _mm256_set1_epi32(0x00FF00FF);
+    const __m256 scale = _mm256_set1_ps(0.001f);
+    const __m256i even_lanes = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+
+    auto convert = [&](const R8G8B8A8* ptr, __m256i& Y, __m256i& U, __m256i& V) {
+        const __m256i px = _mm256_loadu_si256((const __m256i*)ptr);
+        const __m256i rb = _mm256_and_si256(px, mask);
+        const __m256i ga = _mm256_and_si256(_mm256_srli_epi32(px, 8), mask);
+
+        Y = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(rb, _mm256_set1_epi32(SWAP_RB ? MaddCoef(98, 257) : MaddCoef(257, 98))), _mm256_madd_epi16(ga, _mm256_set1_epi32(MaddCoef(504, 0)))), _mm256_set1_epi32(16000));
+        U = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(rb, _mm256_set1_epi32(SWAP_RB ? MaddCoef(-71, 439) : MaddCoef(439, -71))), _mm256_madd_epi16(ga, _mm256_set1_epi32(MaddCoef(-368, 0)))), _mm256_set1_epi32(128000));
+        V = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(rb, _mm256_set1_epi32(SWAP_RB ? MaddCoef(439, -148) : MaddCoef(-148, 439))), _mm256_madd_epi16(ga, _mm256_set1_epi32(MaddCoef(-291, 0)))), _mm256_set1_epi32(128000));
+
+        Y = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(Y), scale));
+        U = _mm256_srli_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(U), scale)), 2);
+        V = _mm256_srli_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(V), scale)), 2);
+    };
+    auto pack_luma = [](__m256i a, __m256i b) {
+        __m128i lo = _mm_packs_epi32(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1));
+        __m128i hi = _mm_packs_epi32(_mm256_castsi256_si128(b), _mm256_extracti128_si256(b, 1));
+        return _mm_packus_epi16(lo, hi);
+    };
+    auto pair_sum = [&](__m256i val) {
+        // sum horizontally adjacent lanes & gather the results in the lower 4 lanes
+        __m256i sum = _mm256_add_epi32(val, _mm256_srli_epi64(val, 32));
+        return _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(sum, even_lanes));
+    };
+
+    for (unsigned int y = 0; y < height; y += 2) {
+        const R8G8B8A8* row0 = src + (ptrdiff_t)y*src_stride;
+        const R8G8B8A8* row1 = row0 + src_stride;
+        uint8_t* Y0 = planes[0] + y*linesize[0];
+        uint8_t* Y1 = Y0 + linesize[0];
+        uint8_t* U = planes[1] + y/2*linesize[1];
+        uint8_t* V = planes[2] + y/2*linesize[2];
+
+        for (unsigned int x = 0; x < simd_width; x += 16) {
+            __m256i y00, u00, v00, y01, u01, v01, y10, u10, v10, y11, u11, v11;
+            convert(row0 + x,     y00, u00, v00);
+            convert(row0 + x + 8, y01, u01, v01);
+            convert(row1 + x,     y10, u10, v10);
+            convert(row1 + x + 8, y11, u11, v11);
+
+            // luma
+            _mm_storeu_si128((__m128i*)(Y0 + x), pack_luma(y00, y01));
+            _mm_storeu_si128((__m128i*)(Y1 + x), pack_luma(y10, y11));
+
+            // chroma (sum of 2x2 blocks)
+            __m128i u = _mm_packs_epi32(pair_sum(_mm256_add_epi32(u00, u10)), pair_sum(_mm256_add_epi32(u01, u11)));
+            __m128i v = _mm_packs_epi32(pair_sum(_mm256_add_epi32(v00, v10)), pair_sum(_mm256_add_epi32(v01, v11)));
+            __m128i uv_bytes = _mm_packus_epi16(u, v);
+            _mm_storel_epi64((__m128i*)(U + x/2), uv_bytes);
+            _mm_storel_epi64((__m128i*)(V + x/2), _mm_srli_si128(uv_bytes, 8));
+        }
+
+        if (simd_width < width) {
+            // remaining columns
+            uint8_t* const tail_planes[3] = {Y0 + simd_width, U + simd_width/2, V + simd_width/2};
+            RGBAToYUV420_SSE2<SWAP_RB>(row0 + simd_width, src_stride, width - simd_width, 2, tail_planes, linesize);
+        }
+    }
+}
+
+/** Check for AVX2 support in both CPU and OS. */
+inline bool CpuSupportsAVX2() {
+    int info[4] = {};
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+
+    __cpuid(info, 1);
+    const bool osxsave = info[2] & (1 << 27);
+    const bool avx = info[2] & (1 << 28);
+    if (!osxsave || !avx)
+        return false;
+
+    // check that the OS saves YMM registers on context switches
+    if ((_xgetbv(0) & 0x6) != 0x6)
+        return false;
+
+    __cpuidex(info, 7, 0);
+    return info[1] & (1 << 5);
+}
+#endif
+
+/** Fastest kernel supported by the current CPU. */
+inline ColorConvertKernel BestColorConvertKernel() {
+#ifdef COLOR_CONVERT_X86
+    static const ColorConvertKernel kernel = CpuSupportsAVX2() ? ColorConvertKernel::AVX2 : ColorConvertKernel::SSE2;
+    return kernel;
+#else
+    return ColorConvertKernel::Scalar;
+#endif
+}
+
+/** Convert a RGBA image to YUV 4:2:0 planar format.
+    src_stride is in pixels, whereas linesize is in bytes (same as AVFrame::linesize). */
+inline void RGBAToYUV420(ColorConvertKernel kernel, const R8G8B8A8* src, ptrdiff_t src_stride, unsigned int width, unsigned int height, uint8_t* const planes[3], const int linesize[3], PixelFormat format = PixelFormat::BGRA) {
+    const bool swap_rb = (format == PixelFormat::RGBA);
+    switch (kernel) {
+#ifdef COLOR_CONVERT_X86
+    case ColorConvertKernel::AVX2:
+        return swap_rb ? RGBAToYUV420_AVX2<true>(src, src_stride, width, height, planes, linesize) : RGBAToYUV420_AVX2(src, src_stride, width, height, planes, linesize);
+    case ColorConvertKernel::SSE2:
+        return swap_rb ? RGBAToYUV420_SSE2<true>(src, src_stride, width, height, planes, linesize) : RGBAToYUV420_SSE2(src, src_stride, width, height, planes, linesize);
+#endif
+    default:
+        return swap_rb ? RGBAToYUV420_Scalar<true>(src, src_stride, width, height, planes, linesize) : RGBAToYUV420_Scalar(src, src_stride, width, height, planes, linesize);
+    }
+}
+
+inline void RGBAToYUV420(const R8G8B8A8* src, ptrdiff_t src_stride, unsigned int width, unsigned int height, uint8_t* const planes[3], const int linesize[3], PixelFormat format = PixelFormat::BGRA) {
+    RGBAToYUV420(BestColorConvertKernel(), src, src_stride, width, height, planes, linesize, format);
+}
+
+/** Multi-threaded conversion. The image is split into horizontal bands with an even row count, so that no chroma row is shared between threads. */
+inline void RGBAToYUV420(WorkerPool& pool, ColorConvertKernel kernel, const R8G8B8A8* src, ptrdiff_t src_stride, unsigned int width, unsigned int height, uint8_t* const planes[3], const int linesize[3], PixelFormat format = PixelFormat::BGRA) {
+    const unsigned int row_pairs = height/2;
+    const unsigned int band_count = (std::min)(pool.Size(), row_pairs);
+    if (band_count <= 1)
+        return RGBAToYUV420(kernel, src, src_stride, width, height, planes, linesize, format);
+
+    pool.ParallelFor(band_count, [&](unsigned int band) {
+        const unsigned int y_begin = 2*(row_pairs*band/band_count);
+        const unsigned int y_end = 2*(row_pairs*(band + 1)/band_count);
+
+        uint8_t* const band_planes[3] = {planes[0] + y_begin*linesize[0], planes[1] + y_begin/2*linesize[1], planes[2] + y_begin/2*linesize[2]};
+        RGBAToYUV420(kernel, src + (ptrdiff_t)y_begin*src_stride, src_stride, width, y_end - y_begin, band_planes, linesize, format);
+    });
+}
+
+inline void RGBAToYUV420(WorkerPool& pool, const R8G8B8A8* src, ptrdiff_t src_stride, unsigned int width, unsigned int height, uint8_t* const planes[3], const int linesize[3], PixelFormat format = PixelFormat::BGRA) {
+    RGBAToYUV420(pool, BestColorConvertKernel(), src, src_stride, width, height, planes, linesize, format);
+}
+
+/** Copy an image into a BGRA buffer, for encoders that convert colors internally (Media Foundation).
+    Strides are in pixels, and either may be negative to flip the image vertically. */
+inline void CopyToBGRA(const R8G8B8A8* src, ptrdiff_t src_stride, PixelFormat format, unsigned int width, unsigned int height, R8G8B8A8* dst, ptrdiff_t dst_stride) {
+    for (unsigned int y = 0; y < height; y++) {
+        const R8G8B8A8* src_row = src + (ptrdiff_t)y*src_stride;
+        R8G8B8A8* dst_row = dst + (ptrdiff_t)y*dst_stride;
+        if (format == PixelFormat::BGRA) {
+            memcpy(dst_row, src_row, width*sizeof(R8G8B8A8));
+        } else {
+            for (unsigned int x = 0; x < width; x++)
+                dst_row[x] = {src_row[x].b, src_row[x].g, src_row[x].r, src_row[x].a};
+        }
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+/** Fixed-capacity ring buffer of reference-counted stream fragments.
+    Written by a single producer and read by any number of consumers, where each consumer keeps its own sequence number cursor.
+    Neither publishing nor reading blocks. Fragments are shared, so that a consumer can finish sending a fragment after it has been overwritten. */
+class FragmentRing {
+public:
+    using Fragment = std::shared_ptr<const std::string>;
+
+    /** Published fragments not yet consumed by a reader. */
+    struct Backlog {
+        uint64_t fragments = 0;
+        uint64_t bytes = 0;
+    };
+
+    explicit FragmentRing(size_t capacity = 256) : m_slots(capacity), m_offsets(capacity) {
+    }
+
+    // non-copyable
+    FragmentRing(const FragmentRing&) = delete;
+    FragmentRing& operator = (const FragmentRing&) = delete;
+
+    /** Append a fragment. The oldest fragment is overwritten if the ring is full. */
+    void Publish(Fragment fragment) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_offsets[m_end % m_slots.size()] = m_end_offset;
+        m_end_offset += fragment->size();
+        m_slots[m_end % m_slots.size()] = std::move(fragment);
+        m_end++;
+    }
+
+    /** Sequence number of the oldest fragment still in the ring. */
+    uint64_t Begin() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return (m_end > m_slots.size()) ? m_end - m_slots.size() : 0;
+    }
+
+    /** Sequence number of the next fragment to be published. */
+    uint64_t End() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_end;
+    }
+
+    /** Get the fragment with sequence number "seq" without blocking.
+        Returns nullptr if the fragment is not yet published, or if it has already been overwritten (consumer too slow).
+        The optional "backlog" receives the fragments published from "seq" onwards, including the returned one. */
+    Fragment Get(uint64_t seq, Backlog* backlog = nullptr) const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (seq >= m_end)
+            return nullptr; // not yet published
+        if (m_end - seq > m_slots.size())
+            return nullptr; // overwritten
+
+        if (backlog) {
+            backlog->fragments = m_end - seq;
+            backlog->bytes = m_end_offset - m_offsets[seq % m_slots.size()];
+        }
+        return m_slots[seq % m_slots.size()];
+    }
+
+private:
+    mutable std::mutex      m_mutex;
+    std::vector<Fragment>   m_slots;
+    std::vector<uint64_t>   m_offsets;        ///< byte offset of each fragment in the published stream
+    uint64_t                m_end = 0;        ///< sequence number of the next fragment
+    uint64_t                m_end_offset = 0; ///< total number of bytes published
+};
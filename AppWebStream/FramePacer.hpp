@@ -0,0 +1,175 @@
+#pragma once
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <Windows.h>
+#include "Metrics.hpp"
+#include "MP4Utils.hpp"
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002 // Windows 10 1803 and newer
+#endif
+
+
+/** Frame rate scheduler with absolute deadlines on the monotonic clock.
+    Frame N is due at start + N/fps, which is the frame grid of the MPEG4 timeline, so that processing time and sleep inaccuracies don't accumulate into a frame rate
+    drift against the fixed frame duration of the MPEG4 timeline. A caller falling behind by more than a frame interval
+    skips the missed deadlines and continues with the most recent one instead of catching up with a burst of frames.
+    Lateness against the deadline & skipped frames are recorded in TransmitterMetrics. */
+class FramePacer {
+public:
+    using clock = std::chrono::steady_clock;
+
+    /** Scheduled frame. */
+    struct Tick {
+        uint64_t          index = 0;    ///< deadline number since start (increases by more than one after skips)
+        clock::time_point deadline;     ///< when the frame was due
+        clock::time_point time;         ///< when the frame was released (never before "deadline" with WaitNextFrame)
+        FILETIME          capture_time{}; ///< "time" as wall-clock time for Mpeg4Transmitter::WriteFrameBegin
+        uint64_t          skipped = 0;  ///< deadlines missed since the previous tick
+    };
+
+    /** Lateness statistics [seconds]. */
+    struct Stats {
+        uint64_t ticks = 0;
+        uint64_t skipped = 0;
+        double   mean_lateness = 0;
+        double   max_lateness = 0;
+        double   jitter = 0; ///< standard deviation of the lateness
+    };
+
+    /** start_time: Stream start time passed to Mpeg4Transmitter, and "start" the corresponding monotonic time.
+        The first frame is due at the first deadline not before construction, so that the time spent on creating the
+        encoder is not counted as lateness. */
+    FramePacer(unsigned int fps, FILETIME start_time, clock::time_point start) : m_fps(fps), m_start(start), m_start_time(start_time) {
+        assert(fps > 0);
+        const clock::time_point now = clock::now();
+        if (now > m_start) {
+            m_next_index = DueIndex(now);
+            if (Deadline(m_next_index) < now)
+                m_next_index++;
+        }
+
+        m_timer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+        if (!m_timer)
+            m_timer = CreateWaitableTimerW(nullptr, TRUE, nullptr); // fallback with system timer resolution
+    }
+
+    ~FramePacer() {
+        if (m_timer)
+            CloseHandle(m_timer);
+    }
+
+    // non-copyable
+    FramePacer(const FramePacer&) = delete;
+    FramePacer& operator = (const FramePacer&) = delete;
+
+    /** Sleep until the next deadline, and release the frame. Returns immediately if the deadline has already passed. */
+    Tick WaitNextFrame() {
+        const clock::time_point deadline = NextDeadline();
+        clock::time_point now = clock::now();
+        if (now < deadline) {
+            WaitUntil(deadline);
+            now = clock::now();
+        }
+        return Advance(now);
+    }
+
+    /** Release the frame due at "now" without waiting. Deadlines passed before the most recent one are skipped.
+        Called by WaitNextFrame, and directly by callers that wait by other means. */
+    Tick Advance(clock::time_point now) {
+        Tick tick;
+        tick.index = m_next_index;
+        if (now >= Deadline(m_next_index + 1)) {
+            // more than one frame interval late, so continue with the most recent deadline
+            tick.index = DueIndex(now);
+            tick.skipped = tick.index - m_next_index;
+        }
+        tick.deadline = Deadline(tick.index);
+        tick.time = now;
+        tick.capture_time = U64ToFileTime(FileTimeToU64(m_start_time) + std::chrono::duration_cast<FileTimeDuration>(now - m_start).count());
+        m_next_index = tick.index + 1;
+
+        // statistics (early releases count as punctual)
+        const uint64_t lateness_ns = (now > tick.deadline) ? (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now - tick.deadline).count() : 0;
+        const double lateness = lateness_ns*MetricHistogram::SECONDS_PER_NANOSECOND;
+        m_ticks++;
+        m_skipped += tick.skipped;
+        m_lateness_sum += lateness;
+        m_lateness_sum_sq += lateness*lateness;
+        if (lateness > m_lateness_max)
+            m_lateness_max = lateness;
+
+        TransmitterMetrics& metrics = TransmitterMetrics::Instance();
+        metrics.pacing_lateness.Observe(lateness_ns);
+        if (tick.skipped)
+            metrics.pacing_skipped_frames.Add(tick.skipped);
+        return tick;
+    }
+
+    /** Deadline of the next frame. */
+    clock::time_point NextDeadline() const {
+        return Deadline(m_next_index);
+    }
+
+    Stats GetStats() const {
+        Stats stats;
+        stats.ticks = m_ticks;
+        stats.skipped = m_skipped;
+        if (m_ticks > 0) {
+            stats.mean_lateness = m_lateness_sum/m_ticks;
+            stats.max_lateness = m_lateness_max;
+            const double variance = m_lateness_sum_sq/m_ticks - stats.mean_lateness*stats.mean_lateness;
+            stats.jitter = (variance > 0) ? std::sqrt(variance) : 0;
+        }
+        return stats;
+    }
+
+private:
+    using FileTimeDuration = std::chrono::duration<int64_t, std::ratio<1, FILETIME_PER_SECONDS>>; ///< 100ns units
+
+    /** Computed from the index instead of accumulated, so that rounding errors don't add up. */
+    clock::time_point Deadline(uint64_t index) const {
+        return m_start + std::chrono::duration_cast<clock::duration>(std::chrono::nanoseconds(index*1'000'000'000ull/m_fps));
+    }
+
+    /** Index of the most recent deadline at or before "now". */
+    uint64_t DueIndex(clock::time_point now) const {
+        const uint64_t elapsed_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_start).count();
+        uint64_t index = elapsed_ns*m_fps/1'000'000'000ull;
+        while (Deadline(index + 1) <= now)
+            index++; // compensate for rounding in Deadline
+        while ((index > 0) && (Deadline(index) > now))
+            index--;
+        return index;
+    }
+
+    void WaitUntil(clock::time_point deadline) {
+        const auto remaining = deadline - clock::now();
+        if (remaining <= clock::duration::zero())
+            return;
+
+        if (m_timer) {
+            LARGE_INTEGER due_time{};
+            due_time.QuadPart = -std::chrono::duration_cast<FileTimeDuration>(remaining).count(); // negative for relative time
+            if (SetWaitableTimer(m_timer, &due_time, 0, nullptr, nullptr, FALSE)) {
+                WaitForSingleObject(m_timer, INFINITE);
+                return;
+            }
+        }
+        Sleep((DWORD)std::chrono::duration_cast<std::chrono::milliseconds>(remaining).count());
+    }
+
+    const unsigned int      m_fps = 0;
+    const clock::time_point m_start;
+    const FILETIME          m_start_time{};
+    uint64_t                m_next_index = 0; ///< index of the next deadline
+    HANDLE                  m_timer = nullptr; ///< waitable timer for sub-millisecond sleep accuracy
+
+    uint64_t                m_ticks = 0;
+    uint64_t                m_skipped = 0;
+    double                  m_lateness_sum = 0;    ///< [seconds]
+    double                  m_lateness_sum_sq = 0; ///< [seconds^2]
+    double                  m_lateness_max = 0;    ///< [seconds]
+};
@@ -0,0 +1,255 @@
+#pragma once
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include "Metrics.hpp"
+
+
+/** Fixed-size heap array aligned to cache lines & SIMD registers, for frame pixels that are allocated once and reused. */
+template <class T>
+class AlignedArray {
+    static_assert(std::is_trivial<T>::value, "AlignedArray holds pixel data");
+public:
+    static constexpr size_t ALIGNMENT = 64;
+
+    AlignedArray() = default;
+
+    explicit AlignedArray(size_t size) : m_data(static_cast<T*>(::operator new(size*sizeof(T), std::align_val_t(ALIGNMENT)))), m_size(size) {
+    }
+
+    ~AlignedArray() {
+        if (m_data)
+            ::operator delete(m_data, std::align_val_t(ALIGNMENT));
+    }
+
+    // non-copyable
+    AlignedArray(const AlignedArray&) = delete;
+    AlignedArray& operator = (const AlignedArray&) = delete;
+
+    T* data() {
+        return m_data;
+    }
+    const T* data() const {
+        return m_data;
+    }
+    size_t size() const {
+        return m_size;
+    }
+
+private:
+    T*     m_data = nullptr;
+    size_t m_size = 0;
+};
+
+
+/** Bounded lock-free queue of pointers with a single producer and a single consumer.
+    Besides the consumer, TryPop may also be called by the producer, so that the producer can reclaim the oldest item
+    when the queue is full. Head & tail are monotonic 64bit indices, so that the head CAS is free of ABA problems. */
+template <class T>
+class SpscQueue {
+    static_assert(std::is_pointer<T>::value, "SpscQueue stores pointers");
+public:
+    explicit SpscQueue(size_t capacity) : m_capacity(capacity), m_slots(std::make_unique<std::atomic<T>[]>(capacity)) {
+        assert(capacity > 0);
+    }
+
+    // non-copyable
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator = (const SpscQueue&) = delete;
+
+    /** Append an item. Producer only. Returns false if the queue is full. */
+    bool TryPush(T item) {
+        const uint64_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) >= m_capacity)
+            return false;
+        m_slots[tail % m_capacity].store(item, std::memory_order_relaxed);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Remove the oldest item. Returns false if the queue is empty. */
+    bool TryPop(T& item) {
+        uint64_t head = m_head.load(std::memory_order_acquire);
+        for (;;) {
+            if (head == m_tail.load(std::memory_order_acquire))
+                return false;
+            T candidate = m_slots[head % m_capacity].load(std::memory_order_relaxed);
+            if (m_head.compare_exchange_weak(head, head + 1, std::memory_order_acq_rel)) {
+                item = candidate;
+                return true;
+            }
+            // lost against the other side, so retry with the updated head
+        }
+    }
+
+    /** Number of queued items. Approximate while the queue is modified concurrently. */
+    size_t Size() const {
+        return (size_t)(m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire));
+    }
+
+    size_t Capacity() const {
+        return m_capacity;
+    }
+
+private:
+    const size_t                         m_capacity = 0;
+    std::unique_ptr<std::atomic<T>[]>    m_slots;
+    alignas(64) std::atomic<uint64_t>    m_head = 0; ///< index of the oldest item (consumer side)
+    alignas(64) std::atomic<uint64_t>    m_tail = 0; ///< index of the next item (producer side)
+};
+
+
+/** Auto-reset event for waking up a thread blocked on an empty queue. */
+class WakeupEvent {
+public:
+    void Signal() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_signaled = true;
+        }
+        m_cond.notify_one();
+    }
+
+    void Wait() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this] { return m_signaled; });
+        m_signaled = false;
+    }
+
+private:
+    std::mutex              m_mutex;
+    std::condition_variable m_cond;
+    bool                    m_signaled = false;
+};
+
+
+/** Behavior of a FrameChannel when the consumer stage falls behind & all frames are in flight. */
+enum class QueuePolicy {
+    BLOCK,       ///< producer waits for the consumer to release a frame
+    DROP_OLDEST, ///< producer reclaims the oldest submitted frame that the consumer has not yet received
+};
+
+
+/** Handoff of pooled frames from one pipeline stage to the next.
+    The producer stage acquires a free frame, fills it and submits it. The consumer stage receives it, processes it and
+    releases it back to the pool. Frames travel through two SpscQueue instances (free & submitted), so that neither
+    side takes a lock on the data path, and no frame is allocated after construction. */
+template <class FRAME>
+class FrameChannel {
+public:
+    /** "frames" are owned by the caller and shall outlive the channel. The queue depth is thereby limited by the pool
+        size, i.e. frames.size() - 1 frames can wait while the consumer is processing a frame.
+        "occupancy" & "drops" optionally receive the queue depth & number of reclaimed frames. */
+    FrameChannel(std::vector<FRAME*> frames, QueuePolicy policy, MetricGauge* occupancy = nullptr, MetricCounter* drops = nullptr)
+        : m_free(frames.size()), m_submitted(frames.size()), m_policy(policy), m_occupancy(occupancy), m_drops(drops) {
+        assert(frames.size() >= 2);
+        m_spare.reserve(frames.size()); // no allocation in Discard
+        for (FRAME* frame : frames)
+            m_free.TryPush(frame);
+    }
+
+    // non-copyable
+    FrameChannel(const FrameChannel&) = delete;
+    FrameChannel& operator = (const FrameChannel&) = delete;
+
+    /** Get a frame to fill. Producer only. Blocks with the BLOCK policy until a frame is released.
+        The producer may hold several frames at a time, and submit them in any order. */
+    FRAME* Acquire() {
+        if (!m_spare.empty()) {
+            FRAME* frame = m_spare.back();
+            m_spare.pop_back();
+            return frame;
+        }
+        for (;;) {
+            FRAME* frame = nullptr;
+            if (m_free.TryPop(frame))
+                return frame;
+            if ((m_policy == QueuePolicy::DROP_OLDEST) && m_submitted.TryPop(frame)) {
+                // consumer too slow, so discard the oldest frame in favor of the new one
+                if (m_occupancy)
+                    m_occupancy->Add(-1);
+                if (m_drops)
+                    m_drops->Add();
+                m_dropped++;
+                return frame;
+            }
+            m_free_event.Wait();
+        }
+    }
+
+    /** Pass a filled frame to the consumer. Producer only. */
+    void Submit(FRAME* frame) {
+        if (m_occupancy)
+            m_occupancy->Add(+1); // before pushing, so that the consumer never observes a negative depth
+        bool ok = m_submitted.TryPush(frame);
+        assert(ok && "more frames in flight than the pool size allows"); ok;
+        m_submitted_event.Signal();
+    }
+
+    /** Return an acquired frame without submitting it. Producer only. The frame is handed out by the next Acquire. */
+    void Discard(FRAME* frame) {
+        assert(m_spare.size() < m_spare.capacity());
+        m_spare.push_back(frame);
+    }
+
+    /** Signal that no more frames will be submitted. Producer only. */
+    void Close() {
+        m_closed = true;
+        m_submitted_event.Signal();
+    }
+
+    /** Wait for the next submitted frame. Consumer only. Returns nullptr once the channel is closed & drained. */
+    FRAME* Receive() {
+        for (;;) {
+            FRAME* frame = nullptr;
+            if (m_submitted.TryPop(frame)) {
+                if (m_occupancy)
+                    m_occupancy->Add(-1);
+                return frame;
+            }
+            if (m_closed && (m_submitted.Size() == 0))
+                return nullptr;
+            m_submitted_event.Wait();
+        }
+    }
+
+    /** Return a processed frame to the pool. Consumer only. */
+    void Release(FRAME* frame) {
+        bool ok = m_free.TryPush(frame);
+        assert(ok); ok;
+        m_free_event.Signal();
+    }
+
+    /** Number of submitted frames waiting for the consumer. */
+    size_t Occupancy() const {
+        return m_submitted.Size();
+    }
+
+    /** Max number of submitted frames, which is the pool size. */
+    size_t Capacity() const {
+        return m_submitted.Capacity();
+    }
+
+    /** Number of frames reclaimed with the DROP_OLDEST policy. */
+    uint64_t Dropped() const {
+        return m_dropped;
+    }
+
+private:
+    SpscQueue<FRAME*>     m_free;      ///< released frames (consumer to producer)
+    SpscQueue<FRAME*>     m_submitted; ///< filled frames (producer to consumer)
+    WakeupEvent           m_free_event;
+    WakeupEvent           m_submitted_event;
+    const QueuePolicy     m_policy = QueuePolicy::BLOCK;
+    std::vector<FRAME*>   m_spare;     ///< discarded frames (producer only)
+    std::atomic<bool>     m_closed = false;
+    std::atomic<uint64_t> m_dropped = 0;
+    MetricGauge*          m_occupancy = nullptr;
+    MetricCounter*        m_drops = nullptr;
+};
@@ -0,0 +1,178 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+/** CRC-32 (ISO 3309) as used by gzip. */
+inline uint32_t Crc32(std::string_view data, uint32_t crc = 0) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : (c >> 1);
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    for (char ch : data)
+        crc = table[(crc ^ (uint8_t)ch) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+
+/** gzip (RFC 1952) compressor for static assets.
+    Uses LZ77 matching with hash chains and the fixed Huffman codes of deflate (RFC 1951), which avoids dynamic
+    Huffman tables at the cost of a few percent compression ratio. Intended for one-time compression at startup. */
+class GzipCompressor {
+public:
+    static std::string Compress(std::string_view data) {
+        GzipCompressor gz;
+
+        // header: magic, deflate, no flags, no mtime, no extra flags, unknown OS
+        const char HEADER[] = {'\x1F', '\x8B', 8, 0, 0, 0, 0, 0, 0, '\xFF'};
+        gz.m_out.assign(HEADER, sizeof(HEADER));
+
+        gz.Deflate(data);
+
+        // trailer: CRC-32 & input size (little-endian)
+        gz.PutLE32(Crc32(data));
+        gz.PutLE32((uint32_t)data.size());
+        return std::move(gz.m_out);
+    }
+
+private:
+    static constexpr size_t WINDOW_SIZE = 32*1024;
+    static constexpr size_t MIN_MATCH = 3;
+    static constexpr size_t MAX_MATCH = 258;
+    static constexpr unsigned int MAX_CHAIN = 64; ///< max match candidates examined per position
+    static constexpr unsigned int HASH_BITS = 15;
+
+    GzipCompressor() = default;
+
+    /** Single final block with fixed Huffman codes. */
+    void Deflate(std::string_view data) {
+        PutBits(1, 1); // BFINAL
+        PutBits(1, 2); // BTYPE = fixed Huffman
+
+        std::vector<int64_t> head(size_t(1) << HASH_BITS, -1); // most recent position per hash
+        std::vector<int64_t> prev(WINDOW_SIZE, -1);             // previous position with the same hash
+
+        auto Hash = [&](size_t pos) {
+            uint32_t val = ((uint8_t)data[pos] << 16) | ((uint8_t)data[pos+1] << 8) | (uint8_t)data[pos+2];
+            return (val * 2654435761u) >> (32 - HASH_BITS);
+        };
+        auto Insert = [&](size_t pos) {
+            if (pos + MIN_MATCH > data.size())
+                return;
+            uint32_t h = Hash(pos);
+            prev[pos % WINDOW_SIZE] = head[h];
+            head[h] = pos;
+        };
+
+        size_t pos = 0;
+        while (pos < data.size()) {
+            // find longest match within the window
+            size_t best_len = 0, best_dist = 0;
+            if (pos + MIN_MATCH <= data.size()) {
+                const size_t max_len = (std::min)(MAX_MATCH, data.size() - pos);
+                int64_t candidate = head[Hash(pos)];
+                for (unsigned int chain = 0; (candidate >= 0) && (pos - candidate <= WINDOW_SIZE) && (chain < MAX_CHAIN); chain++) {
+                    size_t len = 0;
+                    while ((len < max_len) && (data[candidate + len] == data[pos + len]))
+                        len++;
+                    if (len > best_len) {
+                        best_len = len;
+                        best_dist = pos - candidate;
+                        if (len == max_len)
+                            break;
+                    }
+                    candidate = prev[candidate % WINDOW_SIZE];
+                }
+            }
+
+            if (best_len >= MIN_MATCH) {
+                PutLength(best_len);
+                PutDistance(best_dist);
+                for (size_t i = 0; i < best_len; i++)
+                    Insert(pos + i);
+                pos += best_len;
+            } else {
+                PutLiteral((uint8_t)data[pos]);
+                Insert(pos);
+                pos++;
+            }
+        }
+
+        PutLiteral(256); // end of block
+        if (m_bit_count > 0)
+            m_out.push_back((char)m_bit_buf); // pad to byte boundary
+        m_bit_buf = 0;
+        m_bit_count = 0;
+    }
+
+    /** Fixed Huffman code for a literal/length symbol. */
+    void PutLiteral(unsigned int symbol) {
+        if (symbol < 144)
+            PutCode(0x30 + symbol, 8);
+        else if (symbol < 256)
+            PutCode(0x190 + (symbol - 144), 9);
+        else if (symbol < 280)
+            PutCode(symbol - 256, 7);
+        else
+            PutCode(0xC0 + (symbol - 280), 8);
+    }
+
+    void PutLength(size_t length) {
+        static const uint16_t BASE[] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+        static const uint8_t  EXTRA[] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+        unsigned int idx = 28;
+        while (BASE[idx] > length)
+            idx--;
+        PutLiteral(257 + idx);
+        PutBits((uint32_t)(length - BASE[idx]), EXTRA[idx]);
+    }
+
+    void PutDistance(size_t distance) {
+        static const uint16_t BASE[] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+        static const uint8_t  EXTRA[] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+        unsigned int idx = 29;
+        while (BASE[idx] > distance)
+            idx--;
+        PutCode(idx, 5);
+        PutBits((uint32_t)(distance - BASE[idx]), EXTRA[idx]);
+    }
+
+    /** Huffman codes are stored starting with the most significant bit. */
+    void PutCode(uint32_t code, unsigned int length) {
+        uint32_t reversed = 0;
+        for (unsigned int i = 0; i < length; i++)
+            reversed |= ((code >> i) & 1) << (length - 1 - i);
+        PutBits(reversed, length);
+    }
+
+    /** Other values are stored starting with the least significant bit. */
+    void PutBits(uint32_t value, unsigned int count) {
+        m_bit_buf |= value << m_bit_count;
+        m_bit_count += count;
+        while (m_bit_count >= 8) {
+            m_out.push_back((char)(m_bit_buf & 0xFF));
+            m_bit_buf >>= 8;
+            m_bit_count -= 8;
+        }
+    }
+
+    void PutLE32(uint32_t value) {
+        for (int i = 0; i < 4; i++)
+            m_out.push_back((char)(value >> (8*i)));
+    }
+
+    std::string  m_out;
+    uint32_t     m_bit_buf = 0;
+    unsigned int m_bit_count = 0;
+};
@@ -0,0 +1,271 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+
+/** Parsed HTTP/1.x request. All strings refer to the parser buffer and stay valid until HttpRequestParser::Consume(). */
+struct HttpRequest {
+    std::string_view method;
+    std::string_view target;
+    unsigned int     version_minor = 1;      ///< HTTP/1.x
+    bool             keep_alive = true;      ///< connection to be kept open after the response
+    bool             has_range = false;      ///< "Range: bytes=first-[last]" header present
+    uint64_t         range_first = 0;
+    uint64_t         range_last = UINT64_MAX; ///< UINT64_MAX if open-ended
+    bool             connection_upgrade = false; ///< "Connection: Upgrade"
+    bool             upgrade_websocket = false;  ///< "Upgrade: websocket"
+    std::string_view websocket_key;              ///< "Sec-WebSocket-Key" value
+    std::string_view websocket_version;          ///< "Sec-WebSocket-Version" value
+    bool             accept_gzip = false;        ///< "Accept-Encoding" includes gzip
+    std::string_view if_none_match;              ///< "If-None-Match" value
+};
+
+
+/** Incremental HTTP/1.x request parser over a fixed-size buffer.
+    Received bytes are written directly into the parser buffer, and each byte is scanned only once regardless of
+    how the request is split across packets. Requests are parsed in place without heap allocations, and pipelined
+    requests are returned one at a time. Message bodies are not supported, since only GET requests are served. */
+class HttpRequestParser {
+public:
+    static constexpr size_t CAPACITY = 8*1024; ///< max request header size
+
+    enum class Result {
+        INCOMPLETE, ///< more data needed
+        COMPLETE,   ///< Request() is valid until Consume()
+        INVALID,    ///< malformed or too large request
+    };
+
+    HttpRequestParser() = default;
+
+    // non-copyable (string_views refer to the buffer)
+    HttpRequestParser(const HttpRequestParser&) = delete;
+    HttpRequestParser& operator = (const HttpRequestParser&) = delete;
+
+    /** Free space for receiving data. Call Commit() with the number of bytes written. */
+    char* FreeSpace() {
+        return m_buf + m_size;
+    }
+    size_t FreeSize() const {
+        return CAPACITY - m_size;
+    }
+    void Commit(size_t byte_count) {
+        m_size += byte_count;
+    }
+
+    /** Copy data into the buffer. Returns the number of bytes accepted. */
+    size_t Feed(std::string_view data) {
+        size_t count = (data.size() < FreeSize()) ? data.size() : FreeSize();
+        memcpy(FreeSpace(), data.data(), count);
+        Commit(count);
+        return count;
+    }
+
+    /** Continue parsing the received bytes. */
+    Result Parse() {
+        if (m_state == State::INVALID)
+            return Result::INVALID;
+        if (m_state == State::COMPLETE)
+            return Result::COMPLETE;
+
+        while (m_scan < m_size) {
+            const char* line_end = (const char*)memchr(m_buf + m_scan, '\n', m_size - m_scan);
+            if (!line_end) {
+                m_scan = m_size;
+                break; // incomplete line
+            }
+
+            // line without "\r\n" or "\n" terminator
+            std::string_view line(m_buf + m_line_start, line_end - (m_buf + m_line_start));
+            if (!line.empty() && (line.back() == '\r'))
+                line.remove_suffix(1);
+            m_scan = m_line_start = (size_t)(line_end + 1 - m_buf);
+
+            if (m_state == State::REQUEST_LINE) {
+                if (line.empty())
+                    continue; // ignore empty lines before the request line (RFC 7230 3.5)
+                m_state = ParseRequestLine(line) ? State::HEADERS : State::INVALID;
+            } else if (line.empty()) {
+                m_state = State::COMPLETE; // end of header
+            } else {
+                m_state = ParseHeader(line) ? State::HEADERS : State::INVALID;
+            }
+
+            if (m_state == State::INVALID)
+                return Result::INVALID;
+            if (m_state == State::COMPLETE)
+                return Result::COMPLETE;
+        }
+
+        if (FreeSize() == 0)
+            m_state = State::INVALID; // header too large
+        return (m_state == State::INVALID) ? Result::INVALID : Result::INCOMPLETE;
+    }
+
+    const HttpRequest& Request() const {
+        return m_request;
+    }
+
+    /** Discard the completed request, and move the bytes of pipelined requests to the start of the buffer. */
+    void Consume() {
+        memmove(m_buf, m_buf + m_line_start, m_size - m_line_start);
+        m_size -= m_line_start;
+        m_scan = m_line_start = 0;
+        m_request = HttpRequest();
+        m_state = State::REQUEST_LINE;
+    }
+
+    /** Number of received bytes not yet consumed. */
+    size_t BufferedBytes() const {
+        return m_size;
+    }
+
+private:
+    enum class State {
+        REQUEST_LINE,
+        HEADERS,
+        COMPLETE,
+        INVALID,
+    };
+
+    /** Parse "METHOD target HTTP/1.x". */
+    bool ParseRequestLine(std::string_view line) {
+        size_t sp1 = line.find(' ');
+        if ((sp1 == std::string_view::npos) || (sp1 == 0))
+            return false;
+        size_t sp2 = line.find(' ', sp1 + 1);
+        if ((sp2 == std::string_view::npos) || (sp2 == sp1 + 1))
+            return false;
+
+        m_request.method = line.substr(0, sp1);
+        m_request.target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+
+        std::string_view version = line.substr(sp2 + 1);
+        if ((version.size() != 8) || (version.substr(0, 7) != "HTTP/1.") || (version[7] < '0') || (version[7] > '9'))
+            return false;
+        m_request.version_minor = version[7] - '0';
+        m_request.keep_alive = (m_request.version_minor >= 1); // persistent by default since HTTP/1.1
+        return true;
+    }
+
+    /** Parse "Name: value" and interpret the headers relevant for the server. Other headers are skipped. */
+    bool ParseHeader(std::string_view line) {
+        size_t colon = line.find(':');
+        if ((colon == std::string_view::npos) || (colon == 0))
+            return false;
+        std::string_view name = line.substr(0, colon);
+        std::string_view value = Trim(line.substr(colon + 1));
+
+        if (EqualsNoCase(name, "Connection")) {
+            // comma-separated list of options
+            while (!value.empty()) {
+                size_t comma = value.find(',');
+                std::string_view option = Trim(value.substr(0, comma));
+                if (EqualsNoCase(option, "close"))
+                    m_request.keep_alive = false;
+                else if (EqualsNoCase(option, "keep-alive"))
+                    m_request.keep_alive = true;
+                else if (EqualsNoCase(option, "upgrade"))
+                    m_request.connection_upgrade = true;
+                value = (comma == std::string_view::npos) ? std::string_view() : value.substr(comma + 1);
+            }
+        } else if (EqualsNoCase(name, "Range")) {
+            ParseRange(value); // unsupported ranges are ignored (RFC 7233 3.1)
+        } else if (EqualsNoCase(name, "Upgrade")) {
+            m_request.upgrade_websocket = EqualsNoCase(value, "websocket");
+        } else if (EqualsNoCase(name, "Sec-WebSocket-Key")) {
+            m_request.websocket_key = value;
+        } else if (EqualsNoCase(name, "Sec-WebSocket-Version")) {
+            m_request.websocket_version = value;
+        } else if (EqualsNoCase(name, "Accept-Encoding")) {
+            m_request.accept_gzip = AcceptsCoding(value, "gzip");
+        } else if (EqualsNoCase(name, "If-None-Match")) {
+            m_request.if_none_match = value;
+        }
+        return true;
+    }
+
+    /** Parse a single "bytes=first-[last]" range. */
+    void ParseRange(std::string_view value) {
+        const std::string_view UNIT = "bytes=";
+        if ((value.size() < UNIT.size()) || !EqualsNoCase(value.substr(0, UNIT.size()), UNIT))
+            return;
+        value.remove_prefix(UNIT.size());
+
+        uint64_t first = 0;
+        if (!ParseNumber(value, first) || value.empty() || (value[0] != '-'))
+            return;
+        value.remove_prefix(1);
+
+        uint64_t last = UINT64_MAX;
+        if (!value.empty() && (!ParseNumber(value, last) || !value.empty() || (last < first)))
+            return; // malformed or multiple ranges
+
+        m_request.has_range = true;
+        m_request.range_first = first;
+        m_request.range_last = last;
+    }
+
+    /** Check if a comma-separated "coding;q=value" list accepts "coding". Codings with q=0 are rejected. */
+    static bool AcceptsCoding(std::string_view list, std::string_view coding) {
+        while (!list.empty()) {
+            size_t comma = list.find(',');
+            std::string_view item = Trim(list.substr(0, comma));
+            list = (comma == std::string_view::npos) ? std::string_view() : list.substr(comma + 1);
+
+            size_t semicolon = item.find(';');
+            if (!EqualsNoCase(Trim(item.substr(0, semicolon)), coding))
+                continue;
+            if (semicolon == std::string_view::npos)
+                return true;
+
+            // reject "q=0", "q=0.0", "q=0.00" & "q=0.000"
+            std::string_view param = Trim(item.substr(semicolon + 1));
+            if ((param.size() < 3) || !EqualsNoCase(param.substr(0, 2), "q=") || (param[2] != '0'))
+                return true;
+            return param.substr(3).find_first_not_of(".0") != std::string_view::npos;
+        }
+        return false;
+    }
+
+    /** Parse leading decimal digits and remove them from "str". */
+    static bool ParseNumber(std::string_view& str, uint64_t& number) {
+        size_t digits = 0;
+        number = 0;
+        while ((digits < str.size()) && (str[digits] >= '0') && (str[digits] <= '9')) {
+            if (number > (UINT64_MAX - 9)/10)
+                return false; // overflow
+            number = 10*number + (str[digits] - '0');
+            digits++;
+        }
+        str.remove_prefix(digits);
+        return digits > 0;
+    }
+
+    static std::string_view Trim(std::string_view str) {
+        while (!str.empty() && ((str.front() == ' ') || (str.front() == '\t')))
+            str.remove_prefix(1);
+        while (!str.empty() && ((str.back() == ' ') || (str.back() == '\t')))
+            str.remove_suffix(1);
+        return str;
+    }
+
+    static bool EqualsNoCase(std::string_view a, std::string_view b) {
+        if (a.size() != b.size())
+            return false;
+        for (size_t i = 0; i < a.size(); i++) {
+            char ca = ((a[i] >= 'A') && (a[i] <= 'Z')) ? a[i] - 'A' + 'a' : a[i];
+            char cb = ((b[i] >= 'A') && (b[i] <= 'Z')) ? b[i] - 'A' + 'a' : b[i];
+            if (ca != cb)
+                return false;
+        }
+        return true;
+    }
+
+    char        m_buf[CAPACITY];
+    size_t      m_size = 0;        ///< received bytes in m_buf
+    size_t      m_scan = 0;        ///< bytes already scanned for line breaks
+    size_t      m_line_start = 0;  ///< start of the current line
+    State       m_state = State::REQUEST_LINE;
+    HttpRequest m_request;
+};
@@ -1,6 +1,12 @@
+#pragma once
+#include <array>
 #include <cassert>
+#include <deque>
 #include <stdexcept>
 #include <vector>
+#include "BoxSchema.hpp"
+#include "BoxTracker.hpp"
+#include "Metrics.hpp"
 #include "MP4Utils.hpp"
 
 
@@ -9,8 +15,65 @@ struct TimeHandler {
 
     uint64_t startTime = 0;       // creation- & modification time
     uint32_t sample_duration = 0; // frame duration (typ 1000)
-    uint64_t cur_time = 0;
+    uint64_t cur_time = 0;        // baseMediaDecodeTime of the next fragment
     uint32_t timeScale = 0;       // time units per second: 1000*fps (50000 = 50fps) [unused]
+
+    std::deque<uint64_t> frame_times; // time of frames not yet part of a fragment
+
+    /** Align decode time with the first frame of the next fragment. */
+    void BeginFragment() {
+        if (!frame_times.empty())
+            cur_time = frame_times.front();
+    }
+
+    /** Discard frame times for the samples in a completed fragment. */
+    void EndFragment(uint32_t sample_count) {
+        for (uint32_t i = 0; (i < sample_count) && !frame_times.empty(); i++)
+            frame_times.pop_front();
+    }
+};
+
+/** Fixed-capacity list of byte ranges for vectored (scatter-gather) output. */
+class GatherList {
+public:
+    static constexpr size_t CAPACITY = 8;
+
+    void clear() {
+        m_count = 0;
+    }
+
+    /** Append a byte range. Empty ranges are ignored. */
+    void push_back(std::string_view range) {
+        if (range.empty())
+            return;
+        assert(m_count < CAPACITY);
+        m_ranges[m_count++] = range;
+    }
+
+    size_t size() const {
+        return m_count;
+    }
+    const std::string_view& operator [] (size_t idx) const {
+        return m_ranges[idx];
+    }
+    const std::string_view* begin() const {
+        return m_ranges.data();
+    }
+    const std::string_view* end() const {
+        return m_ranges.data() + m_count;
+    }
+
+    /** Total number of bytes across all ranges. */
+    size_t ByteCount() const {
+        size_t sum = 0;
+        for (const std::string_view& range : *this)
+            sum += range.size();
+        return sum;
+    }
+
+private:
+    std::array<std::string_view, CAPACITY> m_ranges;
+    size_t                                 m_count = 0;
 };
 
 /** Process atoms within a MPEG4 MovieFragment (moof) to make the stream comply with ISO base media file format (https://b.goeswhere.com/ISO_IEC_14496-12_2015.pdf , https://github.com/MPEGGroup/isobmff).
@@ -48,7 +111,66 @@ class MP4StreamEditor {
     static constexpr uint32_t BASE_DATA_OFFSET_SIZE = 8; // size of tfhd flag to remove
     static constexpr uint32_t TFDT_SIZE = 20;    // size of new tfdt atom that is added
 
+    // TrackFragmentHeaderAtom ("tfhd") flags (from https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/isom.h)
+    static constexpr uint32_t MOV_TFHD_BASE_DATA_OFFSET = 0x01;
+    static constexpr uint32_t MOV_TFHD_STSD_ID = 0x02;
+    static constexpr uint32_t MOV_TFHD_DEFAULT_DURATION = 0x08;
+    static constexpr uint32_t MOV_TFHD_DEFAULT_SIZE = 0x10;
+    static constexpr uint32_t MOV_TFHD_DEFAULT_FLAGS = 0x20;
+    //static constexpr uint32_t MOV_TFHD_DURATION_IS_EMPTY = 0x010000;
+    static constexpr uint32_t MOV_TFHD_DEFAULT_BASE_IS_MOOF = 0x020000;
+
+    // TrackRunAtom ("trun") flags (from https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/isom.h)
+    static constexpr uint32_t MOV_TRUN_DATA_OFFSET = 0x01;
+    static constexpr uint32_t MOV_TRUN_FIRST_SAMPLE_FLAGS = 0x04;
+    static constexpr uint32_t MOV_TRUN_SAMPLE_DURATION = 0x100;
+    static constexpr uint32_t MOV_TRUN_SAMPLE_SIZE = 0x200;
+    static constexpr uint32_t MOV_TRUN_SAMPLE_FLAGS = 0x400;
+    static constexpr uint32_t MOV_TRUN_SAMPLE_CTS = 0x800;
+
+    /** Max size of the synthesized bytes in ModifyMoofGather: moof header + traf header + shortened tfhd start + tfdt + trun start. */
+    static constexpr uint32_t GATHER_PATCH_SIZE = HEADER_SIZE + (2*HEADER_SIZE + VERSION_FLAGS_SIZE + 4) + TFDT_SIZE + (HEADER_SIZE + VERSION_FLAGS_SIZE + 4 + 4);
+
+    /** Muxer-flavor policy for the Media Foundation MPEG4 file sink.
+        Fragments use absolute base-data-offset addressing without "tfdt", and are therefore rewritten. */
+    struct MuxerMF {
+        static constexpr bool    ADD_TFDT = true; ///< shrink "tfhd", insert "tfdt" & update "trun" data_offset
+        static constexpr uint8_t TRUN_VERSION = 1;
+
+        static constexpr bool IsTfhdFlags(uint32_t flags) {
+            return flags == MOV_TFHD_BASE_DATA_OFFSET;
+        }
+
+        static constexpr bool IsTrunFlags(uint32_t flags) {
+            // dataOffset, sampleDuration, sampleSize, sampleFlags & sampleCts
+            return flags == (MOV_TRUN_DATA_OFFSET | MOV_TRUN_SAMPLE_DURATION | MOV_TRUN_SAMPLE_SIZE | MOV_TRUN_SAMPLE_FLAGS | MOV_TRUN_SAMPLE_CTS);
+        }
+    };
+
+    /** Muxer-flavor policy for the FFMPEG "mp4" muxer with "empty_moov+default_base_moof" flags.
+        Fragments already comply with MSE, so they're passed through unchanged with only timing bookkeeping. */
+    struct MuxerFF {
+        static constexpr bool    ADD_TFDT = false;
+        static constexpr uint8_t TRUN_VERSION = 0;
+
+        static constexpr bool IsTfhdFlags(uint32_t flags) {
+            // typ. default-base-is-moof with default duration, size & flags (0x00020038)
+            return (flags & MOV_TFHD_DEFAULT_BASE_IS_MOOF) && !(flags & MOV_TFHD_BASE_DATA_OFFSET);
+        }
+        static constexpr bool IsTrunFlags(uint32_t flags) {
+            // per-sample fields are only present in fragments with multiple samples
+            return (flags & MOV_TRUN_DATA_OFFSET) && !(flags & ~(MOV_TRUN_DATA_OFFSET | MOV_TRUN_FIRST_SAMPLE_FLAGS | MOV_TRUN_SAMPLE_DURATION | MOV_TRUN_SAMPLE_SIZE | MOV_TRUN_SAMPLE_FLAGS | MOV_TRUN_SAMPLE_CTS));
+        }
+    };
+
 public:
+    /** Encoder that produced the bitstream. Detected from the first "moof" atom. */
+    enum class MuxerFlavor {
+        Unknown,
+        MediaFoundation, ///< needs "moof" rewrite
+        FFMPEG,          ///< MSE compliant "moof"
+    };
+
     MP4StreamEditor() = default;
 
     /** SetDPI() needs to be called after construction. */
@@ -57,52 +179,31 @@ public:
     }
 
     /** Parse MPEG4 bitstream to extract parameters that are not directly accessible through the Media Foundation and/or FFMPEG APIs.
+        The bitstream can be passed in arbitrary chunks, since box boundaries are tracked across calls. Only "moov" boxes
+        are accumulated & parsed, whereas other boxes (incl. "mdat" payload) are skipped by their declared size.
         Returns true if a new parameter have been extracted. */
     bool ParseStream (std::string_view buffer) {
-        if (buffer.size() < HEADER_SIZE)
-            return false; // buffer too small for MPEG atom header parsing
-
-        const char* ptr = buffer.data();
-
-        if (!IsAtomType(ptr, "ftyp")) {
-            // Check if MPEG4 type header can be found in the middle of the buffer. This can happen if restarting the stream after a DPI change.
-            // TODO: Figure out how to avoid this sequential search.
-            constexpr char FTYP_ATOM[] = {0, 0, 0, 24, 'f', 't', 'y', 'p', 'm', 'p', '4', '2', 0, 0, 0, 0, 'm', 'p', '4', '1', 'i', 's', 'o', 'm'};
-            size_t ftyp_idx = buffer.find(std::string_view(FTYP_ATOM, std::size(FTYP_ATOM)));
-            if (ftyp_idx == buffer.npos)
-                return false;
-            
-            ptr += ftyp_idx;
-        }
-        // ptr now points to a "ftyp" atom
-
-        {
-            // "ftyp" atom
-            uint32_t ftyp_size = GetAtomSize(ptr);
-            ptr += ftyp_size;
-        }
+        bool updated = false;
+        m_parse_tracker.Feed(buffer, [&](const BoxTracker::Box& /*box*/, std::string_view data) {
+            if (!data.empty()) // "moov" box
+                updated |= ParseMoov(data);
+        });
+        return updated;
+    }
 
-        if (IsAtomType(ptr, "uuid")) {
-            // "uuid" atom
-            uint32_t uuid_size = GetAtomSize(ptr);
-            ptr += uuid_size;
-        }
+    /** Restart ParseStream at a box boundary located at the given stream position, e.g. after the bitstream was repositioned. */
+    void ResetParse (uint64_t position = 0) {
+        m_parse_tracker.Reset(position);
+    }
 
-        if (IsAtomType(ptr, "pdin")) {
-            // "pdin" atom
-            uint32_t pdin_size = GetAtomSize(ptr);
-            ptr += pdin_size;
-        }
+    /** Number of bytes passed to ParseStream since the last reset, plus the reset position. */
+    uint64_t ParsePosition () const {
+        return m_parse_tracker.Position();
+    }
 
-        if (!IsAtomType(ptr, "moov"))
-            return false;
-        {
-            // Movie box (moov)
-            uint32_t moov_size = GetAtomSize(ptr);
-            std::string_view moov_buf = buffer.substr(ptr - buffer.data());
-            assert(moov_size <= moov_buf.size()); moov_size;
-            return ParseMoov(moov_buf);
-        }
+    /** Stream position of the next box boundary known to ParseStream (UINT64_MAX if unknown). */
+    uint64_t NextParseBoxOffset () const {
+        return m_parse_tracker.NextBoxOffset();
     }
 
     /** Edit MPEG4 bitstream to update parameters that are not directly accessible through the Media Foundation and/or FFMPEG APIs.
@@ -117,19 +218,28 @@ public:
             assert(atom_size == buffer.size()); atom_size;
 
             // Movie box (moov)
-            ModifyMoov(buffer);
+            if (m_moov_layout.Matches(buffer)) {
+                PatchMoovCached(const_cast<char*>(buffer.data())); // same layout as previous init segment
+                TransmitterMetrics::Instance().moov_cached_patches.Add();
+            } else {
+                ModifyMoov(buffer);
+                TransmitterMetrics::Instance().moov_rewrites.Add();
+            }
             return buffer;
         } else if (IsAtomType(buffer.data(), "moof")) {
             uint32_t atom_size = GetAtomSize(buffer.data());
             assert(atom_size <= buffer.size()); atom_size;
 
             // Movie Fragment (moof)
-#ifdef ENABLE_FFMPEG
-            return ModifyMoof(buffer.data(), (ULONG)buffer.size(), false);
-#else
+            if (m_muxer == MuxerFlavor::Unknown)
+                m_muxer = ProbeMuxer(buffer);
+            TransmitterMetrics::Instance().moof_rewrites.Add();
+
+            if (m_muxer == MuxerFlavor::FFMPEG)
+                return ModifyMoof<MuxerFF>(buffer.data(), (ULONG)buffer.size());
+
             assert(atom_size == buffer.size());
-            return ModifyMoof(buffer.data(), (ULONG)buffer.size(), true);
-#endif
+            return ModifyMoof<MuxerMF>(buffer.data(), (ULONG)buffer.size());
         } else if (IsAtomType(buffer.data(), "mdat")) {
             //uint32_t atom_size = GetAtomSize(buffer.data());
             // don't check buffer size, since the payload arrives in a later call
@@ -142,8 +252,104 @@ public:
         }
     }
 
+    /** Zero-copy alternative to EditStream that leaves the input buffer untouched.
+        Returns a list of byte ranges that together form the edited bitstream. The ranges point to either the input
+        buffer or small internal patch buffers, and stay valid until the next call. */
+    const GatherList& EditStreamGather (std::string_view buffer) {
+        if ((buffer.size() >= HEADER_SIZE) && IsAtomType(buffer.data(), "moof") && !m_time.updateSampleDuration) {
+            if (m_muxer == MuxerFlavor::Unknown)
+                m_muxer = ProbeMuxer(buffer);
+
+            if (m_muxer == MuxerFlavor::MediaFoundation) {
+                uint32_t atom_size = GetAtomSize(buffer.data());
+                assert(atom_size == buffer.size()); atom_size;
+
+                // Movie Fragment (moof)
+                TransmitterMetrics::Instance().moof_gather_rewrites.Add();
+                return ModifyMoofGather(buffer.data(), (ULONG)buffer.size());
+            }
+        }
+        // fallback to in-place or copy-based editing
+        m_gather.clear();
+        m_gather.push_back(EditStream(buffer));
+        return m_gather;
+    }
+
+    MuxerFlavor GetMuxerFlavor() const {
+        return m_muxer;
+    }
+
+    /** Check if the first sample in a "moof" atom is a sync sample (IDR frame), so that decoding can start at the fragment.
+        The sample flags are read from "trun" first-sample or per-sample flags, with fallback to the "tfhd" default sample flags.
+        Fragments without sample flags are assumed to start with a sync sample. Works both before and after EditStream. */
+    static bool IsKeyFrameFragment (std::string_view moof) {
+        constexpr uint32_t SAMPLE_IS_NON_SYNC = 0x010000; // sample_is_non_sync_sample bit in sample_flags
+
+        const char* const end = moof.data() + moof.size();
+        const char* traf_ptr = nullptr;
+        for (const char* ptr = moof.data() + HEADER_SIZE; ptr + HEADER_SIZE <= end; ptr += GetAtomSize(ptr)) {
+            if (GetAtomSize(ptr) < HEADER_SIZE)
+                throw std::runtime_error("invalid atom size");
+            if (IsAtomType(ptr, "traf")) {
+                traf_ptr = ptr;
+                break;
+            }
+        }
+        if (!traf_ptr)
+            throw std::runtime_error("not a \"traf\" atom");
+
+        bool has_flags = false;
+        uint32_t sample_flags = 0; // first sample flags
+        const char* const traf_end = (std::min)(traf_ptr + GetAtomSize(traf_ptr), end);
+        for (const char* ptr = traf_ptr + HEADER_SIZE; ptr + HEADER_SIZE + VERSION_FLAGS_SIZE <= traf_end; ptr += GetAtomSize(ptr)) {
+            if (GetAtomSize(ptr) < HEADER_SIZE)
+                throw std::runtime_error("invalid atom size");
+            const uint32_t flags = DeSerialize<uint24_t>(ptr + HEADER_SIZE + 1);
+            const char* payload = ptr + HEADER_SIZE + VERSION_FLAGS_SIZE;
+            const char* const atom_end = ptr + GetAtomSize(ptr);
+            auto read_sample_flags = [&]() {
+                if ((payload + sizeof(uint32_t) > atom_end) || (atom_end > traf_end))
+                    throw std::runtime_error("truncated sample flags");
+                sample_flags = DeSerialize<uint32_t>(payload);
+                has_flags = true;
+            };
+
+            if (IsAtomType(ptr, "tfhd") && (flags & MOV_TFHD_DEFAULT_FLAGS)) {
+                payload += sizeof(uint32_t); // track-ID
+                if (flags & MOV_TFHD_BASE_DATA_OFFSET)
+                    payload += sizeof(uint64_t);
+                if (flags & MOV_TFHD_STSD_ID)
+                    payload += sizeof(uint32_t);
+                if (flags & MOV_TFHD_DEFAULT_DURATION)
+                    payload += sizeof(uint32_t);
+                if (flags & MOV_TFHD_DEFAULT_SIZE)
+                    payload += sizeof(uint32_t);
+                read_sample_flags();
+            } else if (IsAtomType(ptr, "trun")) {
+                payload += sizeof(uint32_t); // sample_count
+                if (flags & MOV_TRUN_DATA_OFFSET)
+                    payload += sizeof(int32_t);
+
+                if (flags & MOV_TRUN_FIRST_SAMPLE_FLAGS) {
+                    read_sample_flags();
+                } else if (flags & MOV_TRUN_SAMPLE_FLAGS) {
+                    if (flags & MOV_TRUN_SAMPLE_DURATION)
+                        payload += sizeof(uint32_t);
+                    if (flags & MOV_TRUN_SAMPLE_SIZE)
+                        payload += sizeof(uint32_t);
+                    read_sample_flags();
+                }
+                break; // only first "trun" is relevant
+            }
+        }
+
+        return !has_flags || !(sample_flags & SAMPLE_IS_NON_SYNC);
+    }
+
+    /** Set the time of the next frame. Fragments with multiple samples get the time of their first frame as
+        baseMediaDecodeTime, also if the fragment is emitted after later frames have been passed to the encoder. */
     void SetNextFrameTime(uint64_t nextTime) {
-        m_time.cur_time = nextTime;
+        m_time.frame_times.push_back(nextTime);
     }
 
     double GetDPI() const {
@@ -183,21 +389,79 @@ public:
     }
 
 private:
-    bool ParseMoov(const std::string_view buffer) {
-        const char* ptr = (char*)buffer.data();
+    /** Atoms inspected or modified in "moov" init segments. Other atoms, such as optional "edts" & "udta", are skipped by size.
+        REF: https://developer.apple.com/documentation/quicktime-file-format/movie_atom */
+    using MoovSchema =
+        Box<FourCC("moov"), 0,
+            Box<FourCC("mvhd")>,
+            Box<FourCC("trak"), 0,
+                Box<FourCC("tkhd")>,
+                Box<FourCC("mdia"), 0,
+                    Box<FourCC("mdhd")>,
+                    Box<FourCC("minf"), 0,
+                        Box<FourCC("stbl"), 0,
+                            Box<FourCC("stsd"), 8/*version, flags & entry count*/,
+                                Each<Box<FourCC("avc1")>>>>>>>>; // all sample entries
+
+    /** Byte offsets of the fields patched in a "moov" atom, relative to the start of the atom.
+        Recorded during a full ModifyMoov traversal, so that later init segments with the same layout can be patched
+        with direct stores. The layout is identified by the "moov" size together with the header, version & flags of
+        the patched atoms, since any change in preceding atoms would shift them. Only layouts with a single "avc1"
+        sample entry are recorded. */
+    struct MoovLayout {
+        static constexpr uint32_t SIGNATURE_SIZE = HEADER_SIZE + VERSION_FLAGS_SIZE;
+
+        enum Atom { MVHD, TKHD, MDHD, AVC1, ATOM_COUNT };
+
+        /** Time fields in "mvhd", "tkhd" & "mdhd". */
+        struct TimeField {
+            uint32_t offset = 0;  ///< creation time offset
+            uint8_t  version = 0; ///< 32bit times for version 0, 64bit times for version 1
+        };
+
+        uint32_t  moov_size = 0; ///< 0 if no layout is recorded
+        uint32_t  atom_offsets[ATOM_COUNT] = {};
+        char      signatures[ATOM_COUNT][SIGNATURE_SIZE] = {}; ///< atom size, type, version & flags
+        TimeField times[AVC1] = {};
+        uint32_t  timescale_offset = 0; ///< "mvhd" timescale
+        uint32_t  matrix_offset = 0;    ///< "mvhd" transformation matrix
+        uint32_t  dpi_offset = 0;       ///< "avc1" horizontal & vertical DPI
+        bool      cacheable = true;     ///< false if the patched fields are not covered by the offsets above
+
+        void RecordAtom(Atom atom, const char* moov_ptr, const char* atom_ptr) {
+            atom_offsets[atom] = static_cast<uint32_t>(atom_ptr - moov_ptr);
+            memcpy(signatures[atom], atom_ptr, SIGNATURE_SIZE);
+        }
 
-        assert(IsAtomType(ptr, "moov"));
-        assert(GetAtomSize(ptr) <= buffer.size());
-        ptr += HEADER_SIZE; // skip size & type
+        /** Check if "moov" has the same layout as the recorded one. */
+        bool Matches(std::string_view moov) const {
+            if ((moov_size == 0) || (moov.size() != moov_size))
+                return false;
 
-        // NOTE: Optional "prfl" atom here
+            for (int atom = 0; atom < ATOM_COUNT; atom++) {
+                if (memcmp(moov.data() + atom_offsets[atom], signatures[atom], SIGNATURE_SIZE) != 0)
+                    return false;
+            }
+            return true;
+        }
+    };
+
+    /** Single-pass "moov" visitor for MoovSchema.
+        Reads parameters from the bitstream if MODIFY is false, and patches them otherwise. */
+    template <bool MODIFY>
+    struct MoovVisitor {
+        MP4StreamEditor& editor;
+        const char*      moov_ptr = nullptr;
+        MoovLayout*      layout = nullptr; ///< patch offsets to record (optional)
+
+        template <uint32_t TYPE>
+        void operator () (BoxTag<TYPE>, char* /*atom_ptr*/) {
+            // container atom without fields of interest
+        }
 
-        {
-            // entering "mvhd" atom
+        void operator () (BoxTag<FourCC("mvhd")>, char* atom_ptr) {
             // REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/iso14496/part12/MovieHeaderBox.java
-            assert(IsAtomType(ptr, "mvhd"));
-            uint32_t mvhd_len = GetAtomSize(ptr);
-            ptr += HEADER_SIZE; // skip size & type
+            char* ptr = atom_ptr + HEADER_SIZE; // skip size & type
 
             auto version = DeSerialize<uint8_t>(ptr);
             ptr += 1;
@@ -205,21 +469,27 @@ private:
             //uint32_t flags = DeSerialize<uint24_t>(ptr);
             ptr += sizeof(uint24_t);
 
-            uint64_t modifyTime = 0;
-            std::tie(m_time.startTime, modifyTime, ptr) = ParseCreateModifyTime(ptr, version);
+            if constexpr (MODIFY) {
+                if (layout) {
+                    layout->RecordAtom(MoovLayout::MVHD, moov_ptr, atom_ptr);
+                    layout->times[MoovLayout::MVHD] = {static_cast<uint32_t>(ptr - moov_ptr), version};
+                }
+                ptr = UpdateCreateModifyTime(ptr, version, editor.m_time.startTime);
+            } else {
+                uint64_t modifyTime = 0;
+                const char* next = nullptr;
+                std::tie(editor.m_time.startTime, modifyTime, next) = ParseCreateModifyTime(ptr, version);
+                ptr = const_cast<char*>(next);
+            }
 
             // read timescale (number of time units per second)
-            m_time.timeScale = DeSerialize<uint32_t>(ptr); // 1000*fps
+            if (layout)
+                layout->timescale_offset = static_cast<uint32_t>(ptr - moov_ptr);
+            editor.m_time.timeScale = DeSerialize<uint32_t>(ptr); // 1000*fps
             ptr += 4;
 
-            uint64_t total_duration = 0; // [timescale unit]
-            if (version == 1) {
-                total_duration = DeSerialize<uint64_t>(ptr);
-                ptr += 8;
-            } else {
-                total_duration = DeSerialize<uint32_t>(ptr);
-                ptr += 4;
-            }
+            // skip total duration [timescale unit]
+            ptr += (version == 1) ? 8 : 4;
 
             //double rate = ReadFixed1616(ptr); // preferred playback rate (16+16 fraction) (typ 1.0)
             ptr += 4;
@@ -231,8 +501,14 @@ private:
             ptr += sizeof(uint32_t) * 2; // reserved
 
             // matrix to map points from one coordinate space into another
-            m_xform.Read(ptr);
-            ptr += matrix::SIZE;
+            if constexpr (MODIFY) {
+                if (layout)
+                    layout->matrix_offset = static_cast<uint32_t>(ptr - moov_ptr);
+                ptr = editor.m_xform.Write(ptr);
+            } else {
+                editor.m_xform.Read(ptr);
+                ptr += matrix::SIZE;
+            }
 
             ptr += sizeof(uint32_t) * 6; // reserved
 
@@ -240,393 +516,161 @@ private:
             ptr += 4;
 
             // end of "mvhd" atom
-            assert(ptr == buffer.data() + HEADER_SIZE + mvhd_len); mvhd_len;
+            assert(ptr == atom_ptr + GetAtomSize(atom_ptr)); ptr;
         }
 
-        // NOTE: Optional "clip" atom here
-
-        //NOTE: It might be more than one "track" atom here
-        {
-            // entering "trak" atom
-            assert(IsAtomType(ptr, "trak"));
-            //uint32_t trak_len = GetAtomSize(ptr);
-            ptr += HEADER_SIZE; // skip size & type
-
-            // NOTE: Optional "prfl" atom here
-
-            {
-                // skip over "tkhd" atom
-                // REF: https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/mov.c#L5478
-                assert(IsAtomType(ptr, "tkhd"));
-                uint32_t tkhd_len = GetAtomSize(ptr);
-                ptr += tkhd_len;
-            }
-
-            // NOTE: Optional "tapt", "clip", "matt", "edts", "tref", "txas", "load", "imap" atoms here
-
-            {
-                // entring "mdia" atom
-                assert(IsAtomType(ptr, "mdia"));
-                //uint32_t mdia_len = GetAtomSize(ptr);
-                ptr += HEADER_SIZE; // skip size & type
-
-                {
-                    // skip over "mdhd" atom
-                    // REF: https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/mov.c#L1864
-                    assert(IsAtomType(ptr, "mdhd"));
-                    uint32_t mdhd_len = GetAtomSize(ptr);
-                    ptr += mdhd_len;
-                }
-
-                // NOTE: Optional "elng" atom here
-
-                {
-                    // skip over "hdlr" atom
-                    assert(IsAtomType(ptr, "hdlr"));
-                    uint32_t hdlr_len = GetAtomSize(ptr);
-                    ptr += hdlr_len;
+        void operator () (BoxTag<FourCC("tkhd")>, char* atom_ptr) {
+            // REF: https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/mov.c#L5478
+            if constexpr (MODIFY) {
+                if (layout) {
+                    layout->RecordAtom(MoovLayout::TKHD, moov_ptr, atom_ptr);
+                    layout->times[MoovLayout::TKHD] = {static_cast<uint32_t>(atom_ptr + HEADER_SIZE + VERSION_FLAGS_SIZE - moov_ptr), DeSerialize<uint8_t>(atom_ptr + HEADER_SIZE)};
                 }
+                UpdateFullBoxCreateModifyTime(atom_ptr, editor.m_time.startTime);
+            }
+        }
 
-                {
-                    // entering "minf" atom
-                    assert(IsAtomType(ptr, "minf"));
-                    //uint32_t minf_len = GetAtomSize(ptr);
-                    ptr += HEADER_SIZE; // skip size & type
-
-                    {
-                        // skip over "vmhd" atom
-                        assert(IsAtomType(ptr, "vmhd"));
-                        uint32_t vmhd_len = GetAtomSize(ptr);
-                        ptr += vmhd_len;
-                    }
-
-                    // NOTE: Optional "hdlr" atom here
-
-                    {
-                        // skip over "dinf" atom
-                        assert(IsAtomType(ptr, "dinf"));
-                        uint32_t dinf_len = GetAtomSize(ptr);
-                        ptr += dinf_len;
-                    }
-
-                    {
-                        // entering "stbl" atmom
-                        assert(IsAtomType(ptr, "stbl"));
-                        //uint32_t stbl_len = GetAtomSize(ptr);
-                        ptr += HEADER_SIZE; // skip size & type
-
-                        {
-                            // entering "stsd" atom (see https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/movenc.c)
-                            // REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/iso14496/part12/SampleDescriptionBox.java
-                            assert(IsAtomType(ptr, "stsd"));
-                            //uint32_t stsd_len = GetAtomSize(ptr);
-                            ptr += HEADER_SIZE; // skip size & type
-
-                            auto version = DeSerialize<uint8_t>(ptr);
-                            assert(version == 0); version;
-                            ptr += sizeof(uint8_t);
-
-                            uint32_t flags = DeSerialize<uint24_t>(ptr);
-                            assert(flags == 0); flags;
-                            ptr += sizeof(uint24_t);
-
-                            uint32_t entryCount = DeSerialize<uint32_t>(ptr);
-                            ptr += sizeof(uint32_t);
-
-                            for (uint32_t entry = 0; entry < entryCount; entry++) {
-                                // entering "avc1" atom
-                                // REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/sampleentry/VisualSampleEntry.java
-                                assert(IsAtomType(ptr, "avc1"));
-                                //uint32_t avc1_len = GetAtomSize(ptr);
-                                ptr += HEADER_SIZE; // skip size & type
-
-                                ptr += 6; // skip first 6 bytes
-
-                                //auto dataReferenceIdx = DeSerialize<uint16_t>(ptr);
-                                ptr += sizeof(uint16_t);
-
-                                auto reserved = DeSerialize<uint16_t>(ptr);
-                                assert(reserved == 0);
-                                ptr += sizeof(uint16_t);
-
-                                reserved = DeSerialize<uint16_t>(ptr);
-                                assert(reserved == 0);
-                                ptr += sizeof(uint16_t);
-
-                                ptr += 3 * sizeof(uint32_t); // skip 3 "predefined" values that should all be zero
-
-                                //auto width = DeSerialize<uint16_t>(ptr);
-                                ptr += 2;
-                                //auto height = DeSerialize<uint16_t>(ptr);
-                                ptr += 2;
-                                //printf("avc1 atom resolution: (%u, %u)\n", width, height);
-
-                                // read horizontal and vertical video DPI in fixed-point 16+16 format
-                                m_dpi = ReadFixed1616(ptr);
-                                double vdpi = ReadFixed1616(ptr + 4);
-                                assert(m_dpi == vdpi); vdpi; // same horizontal and vertical DPI
-
-                                // ignore the remaining parameters
-                            }
-                        }
-
-                        // ignore the remaining parameters
-                    }
+        void operator () (BoxTag<FourCC("mdhd")>, char* atom_ptr) {
+            // REF: https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/mov.c#L1864
+            if constexpr (MODIFY) {
+                if (layout) {
+                    layout->RecordAtom(MoovLayout::MDHD, moov_ptr, atom_ptr);
+                    layout->times[MoovLayout::MDHD] = {static_cast<uint32_t>(atom_ptr + HEADER_SIZE + VERSION_FLAGS_SIZE - moov_ptr), DeSerialize<uint8_t>(atom_ptr + HEADER_SIZE)};
                 }
-
-                // NOTE: Optional "udta" atom here
+                UpdateFullBoxCreateModifyTime(atom_ptr, editor.m_time.startTime);
             }
         }
 
-        //NOTE: Ignore remaining "udta", "ctab", ,"cmov", "rmra" child atoms
+        void operator () (BoxTag<FourCC("avc1")>, char* atom_ptr) {
+            // VisualSampleEntry atom with codingname="avc1"
+            // REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/sampleentry/VisualSampleEntry.java
+            char* ptr = atom_ptr + HEADER_SIZE; // skip size & type
 
-        return true;
-    }
+            ptr += 6; // skip first 6 bytes
 
-    void ModifyMoov (std::string_view buffer) {
-        char* ptr = (char*)buffer.data();
-        // REF: https://developer.apple.com/documentation/quicktime-file-format/movie_atom
-        assert(IsAtomType(ptr, "moov"));
-        assert(GetAtomSize(ptr) == buffer.size());
-        ptr += HEADER_SIZE; // skip size & type
-
-        // NOTE: Optional "prfl" atom here
-
-        {
-            // entering "mvhd" atom
-            // REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/iso14496/part12/MovieHeaderBox.java
-            assert(IsAtomType(ptr, "mvhd"));
-            uint32_t mvhd_len = GetAtomSize(ptr);
-            ptr += HEADER_SIZE; // skip size & type
+            //auto dataReferenceIdx = DeSerialize<uint16_t>(ptr);
+            ptr += sizeof(uint16_t);
 
-            auto version = DeSerialize<uint8_t>(ptr);
-            ptr += 1;
+            auto reserved = DeSerialize<uint16_t>(ptr);
+            assert(reserved == 0);
+            ptr += sizeof(uint16_t);
 
-            //uint32_t flags = DeSerialize<uint24_t>(ptr);
-            ptr += sizeof(uint24_t);
+            reserved = DeSerialize<uint16_t>(ptr);
+            assert(reserved == 0); reserved;
+            ptr += sizeof(uint16_t);
 
-            ptr = UpdateCreateModifyTime(ptr, version, m_time.startTime);
+            ptr += 3 * sizeof(uint32_t); // skip 3 "predefined" values that should all be zero
 
-            // read timescale (number of time units per second)
-            m_time.timeScale = DeSerialize<uint32_t>(ptr); // 1000*fps
-            ptr += 4;
+            auto width = DeSerialize<uint16_t>(ptr);
+            ptr += 2;
+            auto height = DeSerialize<uint16_t>(ptr);
+            ptr += 2;
 
-            uint64_t duration = 0;
-            if (version == 1) {
-                duration = DeSerialize<uint64_t>(ptr);
-                ptr += 8;
+            if constexpr (MODIFY) {
+#ifndef NDEBUG
+                printf("avc1 frame resolution: (%u x %u)\n", width, height);
+#endif
+                if (layout) {
+                    if (layout->atom_offsets[MoovLayout::AVC1])
+                        layout->cacheable = false; // several sample entries
+                    layout->RecordAtom(MoovLayout::AVC1, moov_ptr, atom_ptr);
+                    layout->dpi_offset = static_cast<uint32_t>(ptr - moov_ptr);
+                }
+                // DPI hardcoded to 72dpi (0x00480000) in both the FFMPEG (https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/movenc.c) and MF encoders
+                // update video DPI in fixed-point 16+16 format
+                WriteFixed1616(ptr, editor.m_dpi);    // horizontal DPI
+                WriteFixed1616(ptr + 4, editor.m_dpi);// vertical DPI
             } else {
-                duration = DeSerialize<uint32_t>(ptr);
-                ptr += 4;
+                // read horizontal and vertical video DPI in fixed-point 16+16 format
+                editor.m_dpi = ReadFixed1616(ptr);
+                double vdpi = ReadFixed1616(ptr + 4);
+                assert(editor.m_dpi == vdpi); vdpi; // same horizontal and vertical DPI
             }
-            
-#if 0
-            double rate = ReadFixed1616(ptr); // preferred playback rate (16+16 fraction) (typ 1.0)
-            WriteFixed1616(ptr, 2 * rate); // set 2x playback rate (doesn't seem to reduce latency)
-#endif
-            ptr += 4;
+            width; height; // only used for logging
 
-            //double volume = ReadFixed88(ptr); // master volume of file (8+8 fraction) (typ 1.0)
-            ptr += 2;
-
-            ptr += sizeof(uint16_t); // reserved
-            ptr += sizeof(uint32_t) * 2; // reserved
-
-            // matrix to map points from one coordinate space into another
-            ptr = m_xform.Write(ptr);
-
-            ptr += sizeof(uint32_t) * 6; // reserved
-
-            //auto nextTrackId = DeSerialize<uint32_t>(ptr); // (typ 2)
-            ptr += 4;
-
-            // end of "mvhd" atom
-            assert(ptr == buffer.data() + HEADER_SIZE + mvhd_len); mvhd_len;
+            // ignore the remaining parameters
         }
+    };
 
-        // NOTE: Optional "clip" atom here
-
-        //NOTE: It might be more than one "track" atom here
-        {
-            // entering "trak" atom
-            assert(IsAtomType(ptr, "trak"));
-            //uint32_t trak_len = GetAtomSize(ptr);
-            ptr += HEADER_SIZE; // skip size & type
-
-            // NOTE: Optional "prfl" atom here
-
-            {
-                // partially parse "tkhd" atom
-                // REF: https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/mov.c#L5478
-                assert(IsAtomType(ptr, "tkhd"));
-                uint32_t tkhd_len = GetAtomSize(ptr);
-
-                char* tkhd_ptr = ptr + HEADER_SIZE;
-
-                auto version = DeSerialize<uint8_t>(tkhd_ptr);
-                tkhd_ptr += 1;
-
-                //uint32_t flags = DeSerialize<uint24_t>(tkhd_ptr);
-                tkhd_ptr += sizeof(uint24_t);
-
-                tkhd_ptr = UpdateCreateModifyTime(tkhd_ptr, version, m_time.startTime);
-
-                ptr += tkhd_len;
-            }
-
-            // NOTE: Optional "tapt", "clip", "matt", "edts", "tref", "txas", "load", "imap" atoms here
-
-            {
-                // entring "mdia" atom
-                assert(IsAtomType(ptr, "mdia"));
-                //uint32_t mdia_len = GetAtomSize(ptr);
-                ptr += HEADER_SIZE; // skip size & type
+    bool ParseMoov(const std::string_view buffer) {
+        assert(IsAtomType(buffer.data(), "moov"));
+        assert(GetAtomSize(buffer.data()) <= buffer.size());
 
-                {
-                    // partially parse "mdhd" atom
-                    // REF: https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/mov.c#L1864
-                    assert(IsAtomType(ptr, "mdhd"));
-                    uint32_t mdhd_len = GetAtomSize(ptr);
-                    char* mdhd_ptr = ptr + HEADER_SIZE;
+        // read-only traversal
+        MoovVisitor<false> visitor{*this, buffer.data()};
+        MoovSchema::Visit(const_cast<char*>(buffer.data()), GetAtomSize(buffer.data()), visitor);
+        return true;
+    }
 
-                    auto version = DeSerialize<uint8_t>(mdhd_ptr);
-                    mdhd_ptr += 1;
+    void ModifyMoov (std::string_view buffer) {
+        assert(IsAtomType(buffer.data(), "moov"));
+        assert(GetAtomSize(buffer.data()) == buffer.size());
 
-                    //uint32_t flags = DeSerialize<uint24_t>(mdhd_ptr);
-                    mdhd_ptr += sizeof(uint24_t);
+        // full traversal that also records the patch offsets for later init segments with the same layout
+        MoovLayout layout;
+        MoovVisitor<true> visitor{*this, buffer.data(), &layout};
+        MoovSchema::Visit(const_cast<char*>(buffer.data()), GetAtomSize(buffer.data()), visitor);
 
-                    mdhd_ptr = UpdateCreateModifyTime(mdhd_ptr, version, m_time.startTime);
+        layout.moov_size = layout.cacheable ? static_cast<uint32_t>(buffer.size()) : 0; // size 0 never matches
+        m_moov_layout = layout;
+    }
 
-                    ptr += mdhd_len;
-                }
+    /** Patch a "moov" atom matching m_moov_layout with direct stores, without traversing the atom tree.
+        Has the same effect as ModifyMoov. */
+    void PatchMoovCached (char* moov_ptr) {
+        for (const MoovLayout::TimeField& time : m_moov_layout.times)
+            UpdateCreateModifyTime(moov_ptr + time.offset, time.version, m_time.startTime);
 
-                // NOTE: Optional "elng" atom here
+        m_time.timeScale = DeSerialize<uint32_t>(moov_ptr + m_moov_layout.timescale_offset); // 1000*fps
+        m_xform.Write(moov_ptr + m_moov_layout.matrix_offset);
 
-                {
-                    // skip over "hdlr" atom
-                    assert(IsAtomType(ptr, "hdlr"));
-                    uint32_t hdlr_len = GetAtomSize(ptr);
-                    ptr += hdlr_len;
-                }
+        WriteFixed1616(moov_ptr + m_moov_layout.dpi_offset, m_dpi);    // horizontal DPI
+        WriteFixed1616(moov_ptr + m_moov_layout.dpi_offset + 4, m_dpi);// vertical DPI
+    }
 
-                {
-                    // entering "minf" atom
-                    assert(IsAtomType(ptr, "minf"));
-                    //uint32_t minf_len = GetAtomSize(ptr);
-                    ptr += HEADER_SIZE; // skip size & type
-
-                    {
-                        // skip over "vmhd" atom
-                        assert(IsAtomType(ptr, "vmhd"));
-                        uint32_t vmhd_len = GetAtomSize(ptr);
-                        ptr += vmhd_len;
-                    }
-
-                    // NOTE: Optional "hdlr" atom here
-
-                    {
-                        // skip over "dinf" atom
-                        assert(IsAtomType(ptr, "dinf"));
-                        uint32_t dinf_len = GetAtomSize(ptr);
-                        ptr += dinf_len;
-                    }
-
-                    {
-                        // entering "stbl" atmom
-                        assert(IsAtomType(ptr, "stbl"));
-                        //uint32_t stbl_len = GetAtomSize(ptr);
-                        ptr += HEADER_SIZE; // skip size & type
-
-                        {
-                            // entering "stsd" atom (see https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/movenc.c)
-                            // REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/iso14496/part12/SampleDescriptionBox.java
-                            assert(IsAtomType(ptr, "stsd"));
-                            //uint32_t stsd_len = GetAtomSize(ptr);
-                            ptr += HEADER_SIZE; // skip size & type
-
-                            auto version = DeSerialize<uint8_t>(ptr);
-                            assert(version == 0); version;
-                            ptr += sizeof(uint8_t);
-
-                            uint32_t flags = DeSerialize<uint24_t>(ptr);
-                            assert(flags == 0); flags;
-                            ptr += sizeof(uint24_t);
-
-                            uint32_t entryCount = DeSerialize<uint32_t>(ptr);
-                            ptr += sizeof(uint32_t);
-
-                            for (uint32_t entry = 0; entry < entryCount; entry++) {
-                                // entering VisualSampleEntry atom with codingname="avc1"
-                                // REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/sampleentry/VisualSampleEntry.java
-                                assert(IsAtomType(ptr, "avc1"));
-                                //uint32_t avc1_len = GetAtomSize(ptr);
-                                ptr += HEADER_SIZE; // skip size & type
-
-                                ptr += 6; // skip first 6 bytes
-
-                                //auto dataReferenceIdx = DeSerialize<uint16_t>(ptr);
-                                ptr += sizeof(uint16_t);
-
-                                auto reserved = DeSerialize<uint16_t>(ptr);
-                                assert(reserved == 0);
-                                ptr += sizeof(uint16_t);
-
-                                reserved = DeSerialize<uint16_t>(ptr);
-                                assert(reserved == 0);
-                                ptr += sizeof(uint16_t);
-
-                                ptr += 3 * sizeof(uint32_t); // skip 3 "predefined" values that should all be zero
-
-                                auto width = DeSerialize<uint16_t>(ptr);
-                                ptr += 2;
-                                auto height = DeSerialize<uint16_t>(ptr);
-                                ptr += 2;
-#ifndef NDEBUG
-                                printf("avc1 frame resolution: (%u x %u)\n", width, height);
-#endif
+    /** Detect the muxer flavor from the track fragment header (tfhd) of a "moof" atom.
+        Fragments with default-base-is-moof addressing and a "tfdt" atom are already MSE compliant. */
+    static MuxerFlavor ProbeMuxer (std::string_view moof) {
+        const char* const end = moof.data() + moof.size();
 
-#if 0
-                                // DPI hardcoded to 72dpi (0x00480000) in FFMPEG encoder (https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/movenc.c)
-                                // It also appear to be hardocded in the MF encoder. I've at least not found a parameter for adjusting it.
-                                double dpi = ReadFixed1616(ptr);
-                                assert(dpi == 72); // 72.00 horizontal DPI
-                                dpi = ReadFixed1616(ptr + 4);
-                                assert(dpi == 72); // 72.00 vertical DPI
-#endif
-                                // update video DPI in fixed-point 16+16 format
-                                WriteFixed1616(ptr, m_dpi);    // horizontal DPI
-                                WriteFixed1616(ptr + 4, m_dpi);// vertical DPI
+        const char* mfhd_ptr = moof.data() + HEADER_SIZE;
+        if ((mfhd_ptr + HEADER_SIZE > end) || !IsAtomType(mfhd_ptr, "mfhd")) // movie fragment header
+            throw std::runtime_error("not a \"mfhd\" atom");
 
-                                // ignore the remaining parameters
-                            }
-                        }
+        const char* traf_ptr = mfhd_ptr + GetAtomSize(mfhd_ptr);
+        if ((traf_ptr + 2*HEADER_SIZE + VERSION_FLAGS_SIZE > end) || !IsAtomType(traf_ptr, "traf")) // track fragment
+            throw std::runtime_error("not a \"traf\" atom");
 
-                        // ignore the remaining parameters
-                    }
-                }
+        const char* tfhd_ptr = traf_ptr + HEADER_SIZE;
+        if (!IsAtomType(tfhd_ptr, "tfhd")) // track fragment header
+            throw std::runtime_error("not a \"tfhd\" atom");
+        uint32_t tfhd_flags = DeSerialize<uint24_t>(tfhd_ptr + HEADER_SIZE + 1);
 
-                // NOTE: Optional "udta" atom here
-            }
-        }
+        const char* next_ptr = tfhd_ptr + GetAtomSize(tfhd_ptr);
+        bool has_tfdt = (next_ptr + HEADER_SIZE <= end) && IsAtomType(next_ptr, "tfdt");
 
-        //NOTE: Ignore remaining "udta", "ctab", ,"cmov", "rmra" child atoms
+        if (has_tfdt && (tfhd_flags & MOV_TFHD_DEFAULT_BASE_IS_MOOF) && !(tfhd_flags & MOV_TFHD_BASE_DATA_OFFSET))
+            return MuxerFlavor::FFMPEG;
+        return MuxerFlavor::MediaFoundation;
     }
 
-    /** REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/iso14496/part12/MovieFragmentBox.java */
-    std::string_view ModifyMoof (const char* buf, const ULONG buf_size, bool add_tfdt) {
+    /** Edit "moof" atom according to the MUXER policy. Returns the input buffer if no edits are needed.
+        REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/iso14496/part12/MovieFragmentBox.java */
+    template <class MUXER>
+    std::string_view ModifyMoof (const char* buf, const ULONG buf_size) {
         assert(IsAtomType(buf, "moof"));
         assert(GetAtomSize(buf) <= buf_size);
+        m_time.BeginFragment();
 
         uint32_t new_buf_size = buf_size;
-        if (add_tfdt)
+        if constexpr (MUXER::ADD_TFDT) {
             new_buf_size = buf_size - BASE_DATA_OFFSET_SIZE + TFDT_SIZE;
 
-        if (add_tfdt) {
             // copy to temporary buffer to make room for "tfdt" atom insertion
             m_moof_buf.resize(new_buf_size);
             memcpy(m_moof_buf.data()/*dst*/, buf, buf_size);
         }
-        char* const moof_ptr = add_tfdt ? m_moof_buf.data() : (char*)buf;
+        char* const moof_ptr = MUXER::ADD_TFDT ? m_moof_buf.data() : (char*)buf;
 
         // "mfhd" atom immediately follows
         char* ptr = moof_ptr + HEADER_SIZE;
@@ -656,9 +700,9 @@ private:
         char* tfhd_ptr = traf_ptr + HEADER_SIZE;
 
         unsigned long tfhd_idx = static_cast<unsigned long>(tfhd_ptr - moof_ptr);
-        ProcessTrackFrameChildren(moof_ptr+tfhd_idx, buf_size-tfhd_idx, new_buf_size, add_tfdt);
+        ProcessTrackFrameChildren<MUXER>(moof_ptr+tfhd_idx, buf_size-tfhd_idx, new_buf_size);
 
-        if (add_tfdt) {
+        if constexpr (MUXER::ADD_TFDT) {
             // update "moof" parent atom size after size change
             Serialize<uint32_t>(moof_ptr, new_buf_size);
             Serialize<uint32_t>(traf_ptr, traf_size - BASE_DATA_OFFSET_SIZE + TFDT_SIZE);
@@ -666,6 +710,104 @@ private:
         return std::string_view(moof_ptr, new_buf_size);
     }
 
+    /** Scatter-gather variant of ModifyMoof<MuxerMF>(buf, buf_size).
+        Avoids copying the "moof" atom by emitting the unmodified parts as slices of the input buffer. Only the
+        changed header fields, the new "tfdt" atom and the start of "trun" are synthesized into m_patch_buf. */
+    const GatherList& ModifyMoofGather (const char* buf, const ULONG buf_size) {
+        assert(IsAtomType(buf, "moof"));
+        assert(GetAtomSize(buf) <= buf_size);
+        const uint32_t new_moof_size = buf_size - BASE_DATA_OFFSET_SIZE + TFDT_SIZE;
+        m_time.BeginFragment();
+
+        const char* mfhd_ptr = buf + HEADER_SIZE;
+        if (!IsAtomType(mfhd_ptr, "mfhd")) // movie fragment header
+            throw std::runtime_error("not a \"mfhd\" atom");
+        const uint32_t mfhd_size = GetAtomSize(mfhd_ptr);
+
+        const char* traf_ptr = mfhd_ptr + mfhd_size;
+        if (!IsAtomType(traf_ptr, "traf")) // track fragment
+            throw std::runtime_error("not a \"traf\" atom");
+        const uint32_t traf_size = GetAtomSize(traf_ptr);
+
+        const char* tfhd_ptr = traf_ptr + HEADER_SIZE;
+        assert(IsAtomType(tfhd_ptr, "tfhd")); // TrackFragmentHeaderAtom
+        const uint32_t tfhd_size = GetAtomSize(tfhd_ptr);
+        uint32_t tfhd_flags = DeSerialize<uint24_t>(tfhd_ptr + HEADER_SIZE + 1);
+        assert(MuxerMF::IsTfhdFlags(tfhd_flags));
+
+        const char* trun_ptr = tfhd_ptr + tfhd_size;
+        if (!IsAtomType(trun_ptr, "trun")) // track run box
+            throw std::runtime_error("not a \"trun\" atom");
+        const uint32_t trun_flags = DeSerialize<uint24_t>(trun_ptr + HEADER_SIZE + 1);
+        // trun header, version & flags, sample_count and optional data_offset
+        const uint32_t trun_prefix = HEADER_SIZE + VERSION_FLAGS_SIZE + sizeof(uint32_t) + ((trun_flags & MOV_TRUN_DATA_OFFSET) ? sizeof(int32_t) : 0);
+
+        m_gather.clear();
+        char* ptr = m_patch_buf.data();
+        {
+            // patch: "moof" header with updated size
+            char* patch = ptr;
+            ptr = Serialize<uint32_t>(ptr, new_moof_size);
+            memcpy(ptr, "moof", 4);
+            ptr += 4;
+            m_gather.push_back(std::string_view(patch, ptr - patch));
+        }
+
+        // unmodified "mfhd" atom
+        m_gather.push_back(std::string_view(mfhd_ptr, mfhd_size));
+
+        {
+            // patch: "traf" header with updated size & start of "tfhd" without base-data-offset
+            char* patch = ptr;
+            ptr = Serialize<uint32_t>(ptr, traf_size - BASE_DATA_OFFSET_SIZE + TFDT_SIZE);
+            memcpy(ptr, "traf", 4);
+            ptr += 4;
+
+            ptr = Serialize<uint32_t>(ptr, tfhd_size - BASE_DATA_OFFSET_SIZE);
+            memcpy(ptr, "tfhd", 4);
+            ptr += 4;
+
+            *ptr = tfhd_ptr[HEADER_SIZE]; // version
+            ptr += sizeof(uint8_t);
+            // set default-base-is-moof flag & remove base-data-offset flag
+            tfhd_flags |= MOV_TFHD_DEFAULT_BASE_IS_MOOF;
+            tfhd_flags &= ~MOV_TFHD_BASE_DATA_OFFSET;
+            ptr = Serialize<uint24_t>(ptr, tfhd_flags);
+
+            memcpy(ptr, tfhd_ptr + HEADER_SIZE + VERSION_FLAGS_SIZE, sizeof(uint32_t)); // track-ID
+            ptr += sizeof(uint32_t);
+            m_gather.push_back(std::string_view(patch, ptr - patch));
+        }
+
+        {
+            // remaining "tfhd" fields after base-data-offset
+            const char* tfhd_rest = tfhd_ptr + HEADER_SIZE + VERSION_FLAGS_SIZE + sizeof(uint32_t) + BASE_DATA_OFFSET_SIZE;
+            m_gather.push_back(std::string_view(tfhd_rest, trun_ptr - tfhd_rest));
+        }
+
+        {
+            // patch: new "tfdt" atom & start of "trun" with updated data_offset
+            char* patch = ptr;
+            ptr = WriteTfdt(ptr);
+
+            memcpy(ptr, trun_ptr, trun_prefix);
+            if (trun_flags & MOV_TRUN_DATA_OFFSET)
+                Serialize<int32_t>(ptr + trun_prefix - sizeof(int32_t), new_moof_size + HEADER_SIZE); // add "mdat" header size
+            ptr += trun_prefix;
+            m_gather.push_back(std::string_view(patch, ptr - patch));
+        }
+        assert(ptr <= m_patch_buf.data() + m_patch_buf.size());
+
+        // unmodified "trun" sample table and trailing bytes
+        m_gather.push_back(std::string_view(trun_ptr + trun_prefix, buf + buf_size - (trun_ptr + trun_prefix)));
+
+        // timing bookkeeping (read-only, since sample durations are not updated in this mode)
+        ProcessTrun<MuxerMF>(const_cast<char*>(trun_ptr), new_moof_size, false);
+
+        assert(m_gather.ByteCount() == new_moof_size);
+        return m_gather;
+    }
+
 
     /** Modify the FrackFrame (traf) child atoms to comply with https://www.w3.org/TR/mse-byte-stream-format-isobmff/#movie-fragment-relative-addressing
     Changes done:
@@ -676,8 +818,10 @@ private:
     * Modify track run box (trun):
       - modify data_offset
 
-    Returns the relative size of the modified child atoms (bytes shrunk or grown). */
-    void ProcessTrackFrameChildren (char* tfhd_ptr, const ULONG buf_size, const ULONG new_moof_size, bool add_tfdt) {
+    The atoms are only inspected for timing bookkeeping if MUXER::ADD_TFDT is false. */
+    template <class MUXER>
+    void ProcessTrackFrameChildren (char* tfhd_ptr, const ULONG buf_size, const ULONG new_moof_size) {
+        constexpr bool add_tfdt = MUXER::ADD_TFDT;
         assert(buf_size >= 2 * HEADER_SIZE + 8);
 
         // REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/iso14496/part12/TrackFragmentHeaderBox.java
@@ -690,25 +834,10 @@ private:
             assert(version == 0); version;
             payload += sizeof(uint8_t);
 
+            uint32_t flags = DeSerialize<uint24_t>(payload);
+            assert(MUXER::IsTfhdFlags(flags));
             {
-                // TrackFragmentHeaderAtom ("tfhd") flags (from https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/isom.h)
-                constexpr uint32_t MOV_TFHD_BASE_DATA_OFFSET = 0x01;
-                //constexpr uint32_t MOV_TFHD_STSD_ID = 0x02;
-#ifdef ENABLE_FFMPEG
-                constexpr uint32_t MOV_TFHD_DEFAULT_DURATION = 0x08;
-                constexpr uint32_t MOV_TFHD_DEFAULT_SIZE = 0x10;
-                constexpr uint32_t MOV_TFHD_DEFAULT_FLAGS = 0x20;
-#endif
-                //constexpr uint32_t MOV_TFHD_DURATION_IS_EMPTY = 0x010000;
-                constexpr uint32_t MOV_TFHD_DEFAULT_BASE_IS_MOOF = 0x020000;
-
-                uint32_t flags = DeSerialize<uint24_t>(payload);
-#ifdef ENABLE_FFMPEG
-                assert(flags == (MOV_TFHD_DEFAULT_DURATION | MOV_TFHD_DEFAULT_SIZE | MOV_TFHD_DEFAULT_FLAGS | MOV_TFHD_DEFAULT_BASE_IS_MOOF)); // 0x00020038
-#else
-                assert(flags == MOV_TFHD_BASE_DATA_OFFSET);
-#endif
-                if (add_tfdt) {
+                if constexpr (add_tfdt) {
                     // 1: set default-base-is-moof flag
                     flags |= MOV_TFHD_DEFAULT_BASE_IS_MOOF;
                     // 2: remove base-data-offset flag
@@ -718,43 +847,39 @@ private:
                 payload += sizeof(uint24_t);
             }
 
-            if (add_tfdt)
+            if constexpr (add_tfdt)
                 Serialize<uint32_t>(tfhd_ptr, tfhd_size-BASE_DATA_OFFSET_SIZE); // shrink atom size
 
             //auto track_id = DeSerialize<uint32_t>(payload);
             payload += sizeof(uint32_t);          // skip track-ID field (4bytes)
 
-            if (add_tfdt) {
+            if constexpr (add_tfdt) {
                 // move remaining tfhd fields over data_offset
                 size_t remaining_size = tfhd_size-HEADER_SIZE-VERSION_FLAGS_SIZE-sizeof(uint32_t)-BASE_DATA_OFFSET_SIZE;
                 MemMove(payload/*dst*/, payload+BASE_DATA_OFFSET_SIZE/*src*/, remaining_size/*size*/);
+            } else {
+                if (flags & MOV_TFHD_STSD_ID)
+                    payload += sizeof(uint32_t); // skip sample-description-index
+
+                // default sample duration for "trun" atoms without per-sample durations
+                if (flags & MOV_TFHD_DEFAULT_DURATION)
+                    m_time.sample_duration = DeSerialize<uint32_t>(payload);
+                else
+                    m_time.sample_duration = 1024; // almost matches MediaFoundation
             }
         }
         // pointer to right after shrunken tfhd atom
         char* ptr = tfhd_ptr + tfhd_size;
-        if (add_tfdt) {
+        if constexpr (add_tfdt) {
             ptr -= BASE_DATA_OFFSET_SIZE;
 
             // move TrackRunAtom ("trun") to make room for a new TrackFragmentHeaderAtom ("tfhd")
-            MemMove(ptr+TFDT_SIZE-BASE_DATA_OFFSET_SIZE/*dst*/, ptr/*src*/, buf_size-tfhd_size/*size*/);
+            MemMove(ptr+TFDT_SIZE/*dst*/, ptr+BASE_DATA_OFFSET_SIZE/*src*/, buf_size-tfhd_size/*size*/);
         }
 
-        if (add_tfdt) {
+        if constexpr (add_tfdt) {
             // insert new TrackFragmentHeaderAtom ("tfdt") atom (20bytes)
-            // REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/iso14496/part12/TrackFragmentBaseMediaDecodeTimeBox.java
-            char* tfdt_ptr = ptr;
-
-            Serialize<uint32_t>(tfdt_ptr, TFDT_SIZE);
-            memcpy(tfdt_ptr+4/*dst*/, "tfdt", 4); // track fragment base media decode timebox
-            tfdt_ptr += HEADER_SIZE;
-
-            *tfdt_ptr = 1; // version 1 (no other flags)
-            tfdt_ptr += VERSION_FLAGS_SIZE; // skip flags
-            // write tfdt/baseMediaDecodeTime
-            tfdt_ptr = Serialize<uint64_t>(tfdt_ptr, m_time.cur_time);
-
-            assert(tfdt_ptr == ptr + TFDT_SIZE);
-            ptr += TFDT_SIZE;
+            ptr = WriteTfdt(ptr);
         } else {
             // inspect existing tfdt atom
             char* tfdt_ptr = ptr;
@@ -767,100 +892,100 @@ private:
 
             // check baseMediaDecodeTime
             auto baseMediaDecodeTime = DeSerialize<uint64_t>(tfdt_ptr);
-#ifndef ENABLE_FFMPEG
-            assert(baseMediaDecodeTime == m_time.cur_time); baseMediaDecodeTime;
-#else
             baseMediaDecodeTime;
-#endif
             tfdt_ptr += sizeof(uint64_t);
 
             assert(tfdt_ptr == ptr + tfdt_size);
             ptr += tfdt_size;
         }
 
-        {
-            // modify TrackRunAtom ("trun")
-            // REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/iso14496/part12/TrackRunBox.java
-            char* trun_ptr = ptr;
-            uint32_t trun_size = GetAtomSize(trun_ptr);
-            if (!IsAtomType(trun_ptr, "trun")) // track run box
-                throw std::runtime_error("not a \"trun\" atom");
-            char* payload = trun_ptr + HEADER_SIZE;
+        ProcessTrun<MUXER>(ptr, new_moof_size, add_tfdt);
+    }
 
-            auto version = DeSerialize<uint8_t>(payload);
-            payload += sizeof(uint8_t);
-#ifdef ENABLE_FFMPEG
-            assert(version == 0); version; // check version
-#else
-            assert(version == 1); version; // check version
-#endif
+    /** Write a new TrackFragmentBaseMediaDecodeTimeBox ("tfdt") atom (20bytes) with the current time.
+        REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/iso14496/part12/TrackFragmentBaseMediaDecodeTimeBox.java */
+    char* WriteTfdt (char* tfdt_ptr) const {
+        char* const start = tfdt_ptr;
 
-            // TrackRunAtom ("trun") flags (from https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/isom.h)
-            constexpr uint32_t MOV_TRUN_DATA_OFFSET = 0x01;
-            constexpr uint32_t MOV_TRUN_FIRST_SAMPLE_FLAGS = 0x04;
-            constexpr uint32_t MOV_TRUN_SAMPLE_DURATION = 0x100;
-            constexpr uint32_t MOV_TRUN_SAMPLE_SIZE = 0x200;
-            constexpr uint32_t MOV_TRUN_SAMPLE_FLAGS = 0x400;
-            constexpr uint32_t MOV_TRUN_SAMPLE_CTS = 0x800;
+        Serialize<uint32_t>(tfdt_ptr, TFDT_SIZE);
+        memcpy(tfdt_ptr+4/*dst*/, "tfdt", 4); // track fragment base media decode timebox
+        tfdt_ptr += HEADER_SIZE;
 
-            uint32_t flags = DeSerialize<uint24_t>(payload);
-            // verify that dataOffset, sampleDuration, sampleSize, sampleFlags & sampleCts are set
-#ifdef ENABLE_FFMPEG
-            assert((flags == MOV_TRUN_DATA_OFFSET) || (flags == (MOV_TRUN_DATA_OFFSET|MOV_TRUN_FIRST_SAMPLE_FLAGS)));
-#else
-            assert(flags == (MOV_TRUN_DATA_OFFSET | MOV_TRUN_SAMPLE_DURATION | MOV_TRUN_SAMPLE_SIZE | MOV_TRUN_SAMPLE_FLAGS | MOV_TRUN_SAMPLE_CTS));
-#endif
-            payload += sizeof(uint24_t);
+        *tfdt_ptr = 1; // version 1 (no other flags)
+        memset(tfdt_ptr+1, 0, VERSION_FLAGS_SIZE-1);
+        tfdt_ptr += VERSION_FLAGS_SIZE;
+        // write tfdt/baseMediaDecodeTime
+        tfdt_ptr = Serialize<uint64_t>(tfdt_ptr, m_time.cur_time);
 
-            auto sample_count = DeSerialize<uint32_t>(payload); // frame count (typ 1)
-            assert(sample_count > 0);
-            payload += sizeof(uint32_t);
+        assert(tfdt_ptr == start + TFDT_SIZE); start;
+        return tfdt_ptr;
+    }
 
-            if (flags & MOV_TRUN_DATA_OFFSET) {
-                // overwrite data_offset field (https://learn.microsoft.com/en-us/openspecs/windows_protocols/ms-sstr/6d796f37-b4f0-475f-becd-13f1c86c2d1f)
-                // offset from the beginning of the "moof" field
-                // DataOffset field MUST be the sum of the lengths of the "moof" and all the fields in the "mdat" field
-                if (add_tfdt)
-                    Serialize<int32_t>(payload, new_moof_size + HEADER_SIZE); // add "mdat" header size
-                payload += sizeof(int32_t);
-            }
+    /** Process TrackRunAtom ("trun") to update time bookkeeping. Also updates data_offset if update_data_offset is set.
+        REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/iso14496/part12/TrackRunBox.java */
+    template <class MUXER>
+    void ProcessTrun (char* trun_ptr, const ULONG new_moof_size, bool update_data_offset) {
+        uint32_t trun_size = GetAtomSize(trun_ptr);
+        if (!IsAtomType(trun_ptr, "trun")) // track run box
+            throw std::runtime_error("not a \"trun\" atom");
+        char* payload = trun_ptr + HEADER_SIZE;
+
+        auto version = DeSerialize<uint8_t>(payload);
+        payload += sizeof(uint8_t);
+        assert(version == MUXER::TRUN_VERSION); version; // check version
+
+        uint32_t flags = DeSerialize<uint24_t>(payload);
+        assert(MUXER::IsTrunFlags(flags));
+        payload += sizeof(uint24_t);
+
+        auto sample_count = DeSerialize<uint32_t>(payload); // frame count (typ 1)
+        assert(sample_count > 0);
+        payload += sizeof(uint32_t);
+
+        if (flags & MOV_TRUN_DATA_OFFSET) {
+            // overwrite data_offset field (https://learn.microsoft.com/en-us/openspecs/windows_protocols/ms-sstr/6d796f37-b4f0-475f-becd-13f1c86c2d1f)
+            // offset from the beginning of the "moof" field
+            // DataOffset field MUST be the sum of the lengths of the "moof" and all the fields in the "mdat" field
+            if (update_data_offset)
+                Serialize<int32_t>(payload, new_moof_size + HEADER_SIZE); // add "mdat" header size
+            payload += sizeof(int32_t);
+        }
 
-            if (flags & MOV_TRUN_FIRST_SAMPLE_FLAGS) {
+        if (flags & MOV_TRUN_FIRST_SAMPLE_FLAGS) {
+            payload += sizeof(uint32_t);
+        }
+
+        for (uint32_t i = 0; i < sample_count; i++) {
+            if (flags & MOV_TRUN_SAMPLE_DURATION) {
+                if (m_time.updateSampleDuration)
+                    Serialize<uint32_t>(payload, m_time.sample_duration);
+                else
+                    m_time.sample_duration = DeSerialize<uint32_t>(payload);
                 payload += sizeof(uint32_t);
             }
 
-            for (uint32_t i = 0; i < sample_count; i++) {
-                if (flags & MOV_TRUN_SAMPLE_DURATION) {
-                    if (m_time.updateSampleDuration)
-                        Serialize<uint32_t>(payload, m_time.sample_duration);
-                    else
-                        m_time.sample_duration = DeSerialize<uint32_t>(payload);
-                    payload += sizeof(uint32_t);
-                } else {
-                    m_time.sample_duration = 1024; // almost matches MediaFoundation
-                }
+            // update baseMediaDecodeTime for next fragment
+            m_time.cur_time += m_time.sample_duration;
 
-                // update baseMediaDecodeTime for next fragment
-                m_time.cur_time += m_time.sample_duration;
-
-                if (flags & MOV_TRUN_SAMPLE_SIZE) {
-                    //auto sample_size = DeSerialize<uint32_t>(payload);
-                    payload += sizeof(uint32_t);
-                }
-
-                if (flags & MOV_TRUN_SAMPLE_FLAGS) {
-                    //auto sample_flags = DeSerialize<uint32_t>(payload);
-                    payload += sizeof(uint32_t);
-                }
+            if (flags & MOV_TRUN_SAMPLE_SIZE) {
+                //auto sample_size = DeSerialize<uint32_t>(payload);
+                payload += sizeof(uint32_t);
+            }
 
-                if (flags & MOV_TRUN_SAMPLE_CTS) {
-                    //auto sample_composition_time_offset = DeSerialize<int32_t>(payload); // uint32_t for version==0, int32_t for version > 0
-                    payload += sizeof(int32_t);
-                }
+            if (flags & MOV_TRUN_SAMPLE_FLAGS) {
+                //auto sample_flags = DeSerialize<uint32_t>(payload);
+                payload += sizeof(uint32_t);
             }
 
-            assert(payload == trun_ptr + trun_size); trun_size;
+            if (flags & MOV_TRUN_SAMPLE_CTS) {
+                //auto sample_composition_time_offset = DeSerialize<int32_t>(payload); // uint32_t for version==0, int32_t for version > 0
+                payload += sizeof(int32_t);
+            }
         }
+
+        m_time.EndFragment(sample_count);
+
+        assert(payload == trun_ptr + trun_size); trun_size;
     }
 
     static char* UpdateCreateModifyTime(char* ptr, uint8_t version, uint64_t newTime) {
@@ -883,6 +1008,19 @@ private:
         return ptr;
     }
 
+    /** Update creation & modification time of a full box (version & flags followed by times), such as "tkhd" or "mdhd". */
+    static void UpdateFullBoxCreateModifyTime(char* atom_ptr, uint64_t newTime) {
+        char* ptr = atom_ptr + HEADER_SIZE;
+
+        auto version = DeSerialize<uint8_t>(ptr);
+        ptr += 1;
+
+        //uint32_t flags = DeSerialize<uint24_t>(ptr);
+        ptr += sizeof(uint24_t);
+
+        UpdateCreateModifyTime(ptr, version, newTime);
+    }
+
     static std::tuple<uint64_t, uint64_t, const char*> ParseCreateModifyTime(const char* ptr, uint8_t version) {
         // seconds since Fri Jan 1 00:00:00 1904
         uint64_t creationTime = 0;
@@ -910,4 +1048,9 @@ private:
     TimeHandler       m_time;
     matrix            m_xform;    ///< pixel-to-world coordinate system mapping
     std::vector<char> m_moof_buf; ///< "moof" atom modification buffer
+    std::array<char, GATHER_PATCH_SIZE> m_patch_buf; ///< synthesized bytes for ModifyMoofGather
+    GatherList        m_gather;   ///< output of EditStreamGather
+    BoxTracker        m_parse_tracker{"moov"}; ///< box boundary tracking for ParseStream
+    MoovLayout        m_moov_layout;  ///< patch offsets from the last ModifyMoov traversal
+    MuxerFlavor       m_muxer = MuxerFlavor::Unknown;
 };
@@ -1,114 +1,155 @@
 #pragma once
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <string>
 #include <tuple>
+#include <type_traits>
+#if __has_include(<version>)
+#include <version>
+#endif
+#ifdef __cpp_lib_byteswap
+#include <bit>
+#endif
 #include <Windows.h>
 
 
+/** C++17 replacement for std::is_constant_evaluated(). */
+constexpr bool IsConstantEvaluated() {
+    return __builtin_is_constant_evaluated();
+}
+
+/** Reverse the byte order of an integer. Maps to a single bswap instruction at runtime. */
+template <typename T>
+constexpr T ByteSwap(T val) {
+    static_assert(std::is_integral_v<T>, "ByteSwap requires an integer type");
+#ifdef __cpp_lib_byteswap
+    return std::byteswap(val);
+#else
+    using U = std::make_unsigned_t<T>;
+    auto uval = static_cast<U>(val);
+
+    if constexpr (sizeof(T) == 1) {
+        return val;
+    } else if (!IsConstantEvaluated()) {
+#ifdef _MSC_VER
+        if constexpr (sizeof(T) == 2)
+            return static_cast<T>(_byteswap_ushort(uval));
+        else if constexpr (sizeof(T) == 4)
+            return static_cast<T>(_byteswap_ulong(uval));
+        else
+            return static_cast<T>(_byteswap_uint64(uval));
+#else
+        if constexpr (sizeof(T) == 2)
+            return static_cast<T>(__builtin_bswap16(uval));
+        else if constexpr (sizeof(T) == 4)
+            return static_cast<T>(__builtin_bswap32(uval));
+        else
+            return static_cast<T>(__builtin_bswap64(uval));
+#endif
+    }
+
+    // compile-time evaluation
+    U res = 0;
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        res = static_cast<U>((res << 8) | (uval & 0xFF));
+        uval = static_cast<U>(uval >> 8);
+    }
+    return static_cast<T>(res);
+#endif
+}
+
+/** 24bit unsigned integer, as used for MPEG4 atom flags. */
 struct uint24_t {
-    uint8_t raw[3]{};
+    uint8_t raw[3]{}; // little-endian
 
-    uint24_t() = default;
+    constexpr uint24_t() = default;
 
-    uint24_t(uint32_t val) {
-        raw[0] = (val >> 0) & 0xFF;
-        raw[1] = (val >> 8) & 0xFF;
-        raw[2] = (val >> 16) & 0xFF;
+    constexpr uint24_t(uint32_t val) : raw{(uint8_t)(val >> 0), (uint8_t)(val >> 8), (uint8_t)(val >> 16)} {
     }
 
-    operator uint32_t () const {
-        // no endianess conversion here, since it's already done in the (De)Serialize function
-        uint32_t val = 0;
-        val |= raw[0] << 0;
-        val |= raw[1] << 8;
-        val |= raw[2] << 16;
-        return val;
+    constexpr operator uint32_t () const {
+        return (uint32_t)raw[0] | ((uint32_t)raw[1] << 8) | ((uint32_t)raw[2] << 16);
     }
 };
 static_assert(sizeof(uint24_t) == 3);
 
 /** Deserialize & conververt from big-endian. */
 template <typename T>
-static T DeSerialize(const char* buf) {
-    T val = {};
-    for (size_t i = 0; i < sizeof(T); ++i)
-        reinterpret_cast<BYTE*>(&val)[i] = buf[sizeof(T) - 1 - i];
-
-    return val;
+constexpr T DeSerialize(const char* buf) {
+    if constexpr (std::is_same_v<T, uint24_t>) {
+        return uint24_t(((uint32_t)(uint8_t)buf[0] << 16) | ((uint32_t)(uint8_t)buf[1] << 8) | (uint32_t)(uint8_t)buf[2]);
+    } else {
+        if (!IsConstantEvaluated()) {
+            // unaligned load followed by byteswap
+            T val{};
+            memcpy(&val, buf, sizeof(T));
+            return ByteSwap(val);
+        }
+
+        // compile-time evaluation
+        std::make_unsigned_t<T> val = 0;
+        for (size_t i = 0; i < sizeof(T); ++i)
+            val = static_cast<decltype(val)>((val << 8) | (uint8_t)buf[i]);
+        return static_cast<T>(val);
+    }
 }
 
 /** Serialize & conververt to big-endian. */
 template <typename T>
-static char* Serialize(char* buf, T val) {
-    for (size_t i = 0; i < sizeof(T); ++i)
-        buf[i] = reinterpret_cast<BYTE*>(&val)[sizeof(T) - 1 - i];
-
+constexpr char* Serialize(char* buf, T val) {
+    if constexpr (std::is_same_v<T, uint24_t>) {
+        uint32_t uval = val;
+        buf[0] = (char)(uval >> 16);
+        buf[1] = (char)(uval >> 8);
+        buf[2] = (char)uval;
+    } else {
+        if (!IsConstantEvaluated()) {
+            // byteswap followed by unaligned store
+            val = ByteSwap(val);
+            memcpy(buf, &val, sizeof(T));
+            return buf + sizeof(T);
+        }
+
+        // compile-time evaluation
+        auto uval = static_cast<std::make_unsigned_t<T>>(val);
+        for (size_t i = 0; i < sizeof(T); ++i)
+            buf[i] = (char)(uval >> (8*(sizeof(T) - 1 - i)));
+    }
     return buf + sizeof(T);
 }
 
 /** Read big-endian fixed-point 8+8 float.
     REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/tools/IsoTypeReader.java */
-inline double ReadFixed88(const char* buf) {
-    int16_t val = 0;
-    val |= (unsigned char)buf[0] << 8;
-    val |= (unsigned char)buf[1] << 0;
-
-    return ((double)val) / (1 << 8);
+constexpr double ReadFixed88(const char* buf) {
+    return ((double)DeSerialize<int16_t>(buf)) / (1 << 8);
 }
 /** Write big-endian fixed-point 8+8 float. */
-inline char* WriteFixed88(char* buf, double in) {
-    auto val = (int16_t)(in * (1 << 8));
-
-    buf[0] = (val & 0xFF00) >> 8;
-    buf[1] = (val & 0x00FF);
-    return buf + 2;
+constexpr char* WriteFixed88(char* buf, double in) {
+    return Serialize<int16_t>(buf, (int16_t)(in * (1 << 8)));
 }
 
 /** Read big-endian fixed-point 16+16 float.
     REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/tools/IsoTypeReader.java */
-inline double ReadFixed1616(const char* buf) {
-    int32_t val = 0;
-    val |= (unsigned char)buf[0] << 24;
-    val |= (unsigned char)buf[1] << 16;
-    val |= (unsigned char)buf[2] << 8;
-    val |= (unsigned char)buf[3] << 0;
-
-    return ((double)val) / (1 << 16);
+constexpr double ReadFixed1616(const char* buf) {
+    return ((double)DeSerialize<int32_t>(buf)) / (1 << 16);
 }
 /** Write big-endian fixed-point 16+16 float.
     REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/tools/IsoTypeWriter.java */
-inline char* WriteFixed1616(char* buf, double in) {
-    auto val = (int32_t)(in * (1 << 16));
-
-    buf[0] = (val & 0xFF000000) >> 24;
-    buf[1] = (char)((val & 0x00FF0000) >> 16);
-    buf[2] = (val & 0x0000FF00) >> 8;
-    buf[3] = (val & 0x000000FF);
-    return buf + 4;
+constexpr char* WriteFixed1616(char* buf, double in) {
+    return Serialize<int32_t>(buf, (int32_t)(in * (1 << 16)));
 }
 
 /** Read big-endian fixed-point 2+30 float.
     REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/tools/IsoTypeReader.java */
-inline double ReadFixed0230(const char* buf) {
-    int32_t val = 0;
-    val |= (unsigned char)buf[0] << 24;
-    val |= (unsigned char)buf[1] << 16;
-    val |= (unsigned char)buf[2] << 8;
-    val |= (unsigned char)buf[3] << 0;
-
-    return ((double)val) / (1 << 30);
+constexpr double ReadFixed0230(const char* buf) {
+    return ((double)DeSerialize<int32_t>(buf)) / (1 << 30);
 }
 /** Write big-endian fixed-point 2+30 float.
     REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/tools/IsoTypeWriter.java */
-inline char* WriteFixed0230(char* buf, double in) {
-    auto val = (int32_t)(in * (1 << 30));
-
-    buf[0] = (val & 0xFF000000) >> 24;
-    buf[1] = (char)((val & 0x00FF0000) >> 16);
-    buf[2] = (val & 0x0000FF00) >> 8;
-    buf[3] = (val & 0x000000FF);
-    return buf + 4;
+constexpr char* WriteFixed0230(char* buf, double in) {
+    return Serialize<int32_t>(buf, (int32_t)(in * (1 << 30)));
 }
 
 /* QuickTime transformation matrix.
@@ -1,5 +1,6 @@
 #include <sstream>
 #include <iostream>
+#include "FramePacer.hpp"
 #include "Mpeg4Transmitter.hpp"
 #include "ScreenCapture.hpp"
 
@@ -20,13 +21,13 @@ inline double ComputeDPI(unsigned int samples, double distance_m) {
     return samples / distance_inches;
 }
 
-static HRESULT EncodeFrame (Mpeg4Transmitter& encoder, window_dc& wnd_dc, unsigned int dims[2]) {
+static HRESULT EncodeFrame (Mpeg4Transmitter& encoder, window_dc& wnd_dc, unsigned int dims[2], FILETIME capture_time) {
     // create offscreen bitmap for screen capture (pad window size to be compatible with FFMPEG encoder)
     offscreen_bmp bmp(wnd_dc.m_dc, dims[0], dims[1]);
 
     // copy window content encoder buffer
-    auto* img_ptr = encoder.WriteFrameBegin();
-    int scan_lines = bmp.CopyToRGBABuffer(wnd_dc, (uint32_t*)img_ptr);
+    auto* img_ptr = encoder.WriteFrameBegin(capture_time);
+    int scan_lines = bmp.CopyToRGBABuffer(wnd_dc, Mpeg4Transmitter::NATIVE_ORIENTATION, (uint32_t*)img_ptr);
     if (scan_lines != (int)dims[1]) {
         encoder.AbortWrite(); // still need to unlock buffer
         return E_FAIL;
@@ -94,19 +95,36 @@ int main (int argc, char *argv[]) {
     constexpr unsigned int FPS = 25;
 
     // create H.264/MPEG4 encoder
-    Mpeg4Transmitter encoder(dims, FPS, CurrentTime(), port_filename);
+    const auto start = FramePacer::clock::now();
+    const FILETIME start_time = CurrentTime();
+    Mpeg4Transmitter encoder(dims, FPS, start_time, port_filename);
     encoder.SetDPI(ComputeDPI(dims[0], G_XFORM[0]));
     encoder.SetXform(G_XFORM);
-    printf("Connecting to client...\n");
-
-    // encode & transmit frames
+    printf("Waiting for clients...\n");
+
+    // encode & transmit frames on absolute deadlines, so that the frame rate doesn't drift against the stream timeline
+    constexpr unsigned int IDLE_FRAME_INTERVAL = FPS; // one frame per second while no client is connected
+    constexpr unsigned int STATS_INTERVAL = 60*FPS;   // pacing statistics once per minute
+    FramePacer pacer(FPS, start_time, start);
+    uint64_t next_idle_frame = 0;
+    uint64_t next_stats = STATS_INTERVAL;
     for (;;) {
-        HRESULT hr = EncodeFrame(encoder, wnd_dc, dims);
-        if (FAILED(hr))
-            break;
-
-        // synchronize framerate
-        Sleep(1000/FPS);
+        FramePacer::Tick tick = pacer.WaitNextFrame();
+
+        // check for clients every frame interval, so that connecting clients receive live frames without delay
+        if (!encoder.Idle() || (tick.index >= next_idle_frame)) {
+            next_idle_frame = tick.index + IDLE_FRAME_INTERVAL;
+            HRESULT hr = EncodeFrame(encoder, wnd_dc, dims, tick.capture_time); // time-stamped with the actual capture time
+            if (FAILED(hr))
+                break;
+        }
+
+        if (tick.index >= next_stats) {
+            next_stats = tick.index + STATS_INTERVAL;
+            FramePacer::Stats stats = pacer.GetStats();
+            printf("\nPacing: %llu frames, %llu skipped, lateness mean %.2f ms, max %.2f ms, jitter %.2f ms\n", stats.ticks, stats.skipped,
+                1000*stats.mean_lateness, 1000*stats.max_lateness, 1000*stats.jitter);
+        }
     }
 
     return 0;
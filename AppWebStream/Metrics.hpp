@@ -0,0 +1,302 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+/** Index of the accumulator slot used by the calling thread.
+    Threads are assigned round-robin, so that concurrently updating threads normally hit separate cache lines. */
+inline unsigned int MetricSlot() {
+    static std::atomic<unsigned int> s_next_slot = 0;
+    thread_local const unsigned int slot = s_next_slot.fetch_add(1, std::memory_order_relaxed);
+    return slot;
+}
+
+
+/** Monotonic counter with one cache-line sized accumulator per thread slot.
+    Updates are relaxed atomic additions without locks or contended cache lines. Readers sum all slots, so that
+    collecting never blocks or slows down the updating threads. */
+class MetricCounter {
+public:
+    static constexpr unsigned int SLOTS = 16;
+
+    MetricCounter() = default;
+
+    // non-copyable
+    MetricCounter(const MetricCounter&) = delete;
+    MetricCounter& operator = (const MetricCounter&) = delete;
+
+    void Add(uint64_t value = 1) {
+        m_slots[MetricSlot() % SLOTS].value.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    uint64_t Value() const {
+        uint64_t sum = 0;
+        for (const Slot& slot : m_slots)
+            sum += slot.value.load(std::memory_order_relaxed);
+        return sum;
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> value = 0;
+    };
+    std::array<Slot, SLOTS> m_slots;
+};
+
+
+/** Current level of a quantity that goes up & down, like a queue depth. A single atomic, since updates are exact
+    increments & decrements from the threads that change the level. */
+class MetricGauge {
+public:
+    MetricGauge() = default;
+
+    // non-copyable
+    MetricGauge(const MetricGauge&) = delete;
+    MetricGauge& operator = (const MetricGauge&) = delete;
+
+    void Add(int64_t delta) {
+        m_value.fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    int64_t Value() const {
+        return m_value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<int64_t> m_value = 0;
+};
+
+
+/** Histogram with fixed bucket bounds and per-thread accumulators, like MetricCounter.
+    Observations are integers (e.g. nanoseconds or bytes), and "scale" converts them to the exported unit. */
+class MetricHistogram {
+public:
+    static constexpr unsigned int SLOTS = MetricCounter::SLOTS;
+    static constexpr double SECONDS_PER_NANOSECOND = 1e-9;
+
+    /** Latency buckets from 100us to 1s, in nanoseconds. Use with SECONDS_PER_NANOSECOND scale. */
+    static std::vector<uint64_t> LatencyBounds() {
+        return {100'000, 250'000, 500'000, 1'000'000, 2'500'000, 5'000'000, 10'000'000, 25'000'000, 50'000'000, 100'000'000, 250'000'000, 1'000'000'000};
+    }
+
+    /** Size buckets from 1kB to 4MB, in bytes. */
+    static std::vector<uint64_t> SizeBounds() {
+        return {1024, 4*1024, 16*1024, 64*1024, 256*1024, 1024*1024, 4*1024*1024};
+    }
+
+    /** bounds: Ascending bucket upper bounds (inclusive), in observation units. An implicit "+Inf" bucket follows. */
+    MetricHistogram(std::vector<uint64_t> bounds, double scale = 1.0) : m_bounds(std::move(bounds)), m_scale(scale) {
+        // round each slot up to whole cache lines: buckets, "+Inf" bucket & sum
+        const size_t values = m_bounds.size() + 2;
+        m_stride = (values + VALUES_PER_LINE - 1)/VALUES_PER_LINE*VALUES_PER_LINE;
+        m_values = std::make_unique<Line[]>(SLOTS*m_stride/VALUES_PER_LINE);
+    }
+
+    // non-copyable
+    MetricHistogram(const MetricHistogram&) = delete;
+    MetricHistogram& operator = (const MetricHistogram&) = delete;
+
+    void Observe(uint64_t value) {
+        size_t bucket = 0;
+        while ((bucket < m_bounds.size()) && (value > m_bounds[bucket]))
+            bucket++;
+
+        std::atomic<uint64_t>* slot = Values(MetricSlot() % SLOTS);
+        slot[bucket].fetch_add(1, std::memory_order_relaxed);
+        slot[m_bounds.size() + 1].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    /** Observe the time elapsed since "start" in nanoseconds. */
+    void ObserveSince(std::chrono::steady_clock::time_point start) {
+        Observe((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    /** Accumulated state of all slots. */
+    struct Snapshot {
+        std::vector<uint64_t> counts; ///< per bucket (not cumulative), incl. the "+Inf" bucket
+        uint64_t              count = 0;
+        uint64_t              sum = 0;
+    };
+
+    Snapshot Read() const {
+        Snapshot snapshot;
+        snapshot.counts.resize(m_bounds.size() + 1);
+        for (unsigned int s = 0; s < SLOTS; s++) {
+            const std::atomic<uint64_t>* slot = const_cast<MetricHistogram*>(this)->Values(s);
+            for (size_t b = 0; b < snapshot.counts.size(); b++)
+                snapshot.counts[b] += slot[b].load(std::memory_order_relaxed);
+            snapshot.sum += slot[m_bounds.size() + 1].load(std::memory_order_relaxed);
+        }
+        for (uint64_t count : snapshot.counts)
+            snapshot.count += count;
+        return snapshot;
+    }
+
+    const std::vector<uint64_t>& Bounds() const {
+        return m_bounds;
+    }
+
+    double Scale() const {
+        return m_scale;
+    }
+
+private:
+    static constexpr size_t VALUES_PER_LINE = 64/sizeof(uint64_t);
+
+    struct alignas(64) Line {
+        std::atomic<uint64_t> values[VALUES_PER_LINE] = {};
+    };
+
+    std::atomic<uint64_t>* Values(unsigned int slot) {
+        return m_values[slot*m_stride/VALUES_PER_LINE].values;
+    }
+
+    const std::vector<uint64_t> m_bounds;
+    const double                m_scale = 1.0;
+    size_t                      m_stride = 0; ///< values per slot
+    std::unique_ptr<Line[]>     m_values;     ///< per slot: bucket counts, "+Inf" count & sum
+};
+
+
+/** Process-wide counters for the capture, encoding & muxing stages. */
+struct TransmitterMetrics {
+    MetricCounter   frames_captured;   ///< frames started with Mpeg4Transmitter::WriteFrameBegin
+    MetricCounter   frames_encoded;    ///< frames successfully passed to the encoder
+    MetricCounter   frames_dropped;    ///< aborted frames & encoder failures
+    MetricCounter   frames_unchanged;  ///< encoded frames identical to the previously encoded frame
+    MetricCounter   rows_converted;    ///< pixel rows color-converted, since they changed (FFMPEG only)
+    MetricCounter   rows_unchanged;    ///< pixel rows not color-converted, since they are unchanged (FFMPEG only)
+    MetricHistogram convert_latency{MetricHistogram::LatencyBounds(), MetricHistogram::SECONDS_PER_NANOSECOND}; ///< RGBA to YUV conversion (FFMPEG only)
+    MetricHistogram encode_latency{MetricHistogram::LatencyBounds(), MetricHistogram::SECONDS_PER_NANOSECOND};  ///< encoding & muxing of one frame
+    MetricHistogram fragment_bytes{MetricHistogram::SizeBounds()}; ///< published "moof" & "mdat" size
+
+    /** Pipeline stages fed by a frame queue. */
+    enum Stage {
+        STAGE_CONVERT, ///< RGBA to YUV conversion (FFMPEG only)
+        STAGE_ENCODE,  ///< encoding & muxing
+        STAGE_COUNT,
+    };
+    static constexpr const char* STAGE_NAMES[STAGE_COUNT] = {"convert", "encode"};
+    MetricGauge     stage_queue_frames[STAGE_COUNT]; ///< frames waiting for the stage
+    MetricCounter   stage_queue_drops[STAGE_COUNT];  ///< frames discarded since the stage fell behind
+
+    MetricHistogram pacing_lateness{MetricHistogram::LatencyBounds(), MetricHistogram::SECONDS_PER_NANOSECOND}; ///< frame release after the FramePacer deadline
+    MetricCounter   pacing_skipped_frames; ///< FramePacer deadlines skipped since the caller fell behind
+
+    MetricCounter   moov_rewrites;        ///< "moov" atoms edited with a full traversal
+    MetricCounter   moov_cached_patches;  ///< "moov" atoms patched from the cached layout
+    MetricCounter   moof_rewrites;        ///< "moof" atoms edited in place or copied
+    MetricCounter   moof_gather_rewrites; ///< "moof" atoms edited without copying
+
+    static TransmitterMetrics& Instance() {
+        static TransmitterMetrics s_metrics;
+        return s_metrics;
+    }
+};
+
+
+/** Prometheus text exposition format (version 0.0.4) writer. */
+class PrometheusWriter {
+public:
+    static constexpr char CONTENT_TYPE[] = "text/plain; version=0.0.4; charset=utf-8";
+
+    /** Start a metric family. Must precede the samples of the family. */
+    void Family(std::string_view name, std::string_view type, std::string_view help) {
+        m_out += "# HELP ";
+        m_out += name;
+        m_out += ' ';
+        m_out += help;
+        m_out += "\n# TYPE ";
+        m_out += name;
+        m_out += ' ';
+        m_out += type;
+        m_out += '\n';
+    }
+
+    /** Add a sample. "labels" is either empty or a comma-separated list like client="1". */
+    void Sample(std::string_view name, std::string_view labels, double value) {
+        m_out += name;
+        if (!labels.empty()) {
+            m_out += '{';
+            m_out += labels;
+            m_out += '}';
+        }
+        char buf[32] = {};
+        snprintf(buf, sizeof(buf), " %.15g\n", value);
+        m_out += buf;
+    }
+
+    void Counter(std::string_view name, std::string_view help, uint64_t value) {
+        Family(name, "counter", help);
+        Sample(name, "", (double)value);
+    }
+
+    /** Add the "_bucket", "_sum" & "_count" samples of a histogram, whose family has already been started. */
+    void HistogramSamples(std::string_view name, std::string_view labels, const MetricHistogram& histogram) {
+        const MetricHistogram::Snapshot snapshot = histogram.Read();
+        const std::string prefix = labels.empty() ? std::string() : std::string(labels) + ",";
+
+        uint64_t cumulative = 0;
+        for (size_t b = 0; b < snapshot.counts.size(); b++) {
+            cumulative += snapshot.counts[b];
+            std::string le = "+Inf";
+            if (b < histogram.Bounds().size()) {
+                char buf[32] = {};
+                snprintf(buf, sizeof(buf), "%.15g", histogram.Bounds()[b]*histogram.Scale());
+                le = buf;
+            }
+            Sample(std::string(name) + "_bucket", prefix + "le=\"" + le + "\"", (double)cumulative);
+        }
+        Sample(std::string(name) + "_sum", labels, snapshot.sum*histogram.Scale());
+        Sample(std::string(name) + "_count", labels, (double)snapshot.count);
+    }
+
+    void Histogram(std::string_view name, std::string_view help, const MetricHistogram& histogram) {
+        Family(name, "histogram", help);
+        HistogramSamples(name, "", histogram);
+    }
+
+    /** Add the process-wide stage counters. */
+    void Transmitter(const TransmitterMetrics& metrics) {
+        Counter("webstream_frames_captured_total", "Frames captured for encoding.", metrics.frames_captured.Value());
+        Counter("webstream_frames_encoded_total", "Frames passed to the encoder.", metrics.frames_encoded.Value());
+        Counter("webstream_frames_dropped_total", "Frames aborted or rejected by the encoder.", metrics.frames_dropped.Value());
+        Counter("webstream_frames_unchanged_total", "Encoded frames identical to the previous frame.", metrics.frames_unchanged.Value());
+        Family("webstream_convert_rows_total", "counter", "Pixel rows processed by damage-aware color conversion.");
+        Sample("webstream_convert_rows_total", "state=\"converted\"", (double)metrics.rows_converted.Value());
+        Sample("webstream_convert_rows_total", "state=\"unchanged\"", (double)metrics.rows_unchanged.Value());
+        Histogram("webstream_convert_latency_seconds", "RGBA to YUV color conversion time per frame.", metrics.convert_latency);
+        Histogram("webstream_encode_latency_seconds", "Encoding & muxing time per frame.", metrics.encode_latency);
+        Histogram("webstream_fragment_bytes", "Size of published moof & mdat fragments.", metrics.fragment_bytes);
+
+        Family("webstream_stage_queue_frames", "gauge", "Frames queued for a pipeline stage.");
+        for (int stage = 0; stage < TransmitterMetrics::STAGE_COUNT; stage++)
+            Sample("webstream_stage_queue_frames", std::string("stage=\"") + TransmitterMetrics::STAGE_NAMES[stage] + "\"", (double)metrics.stage_queue_frames[stage].Value());
+        Family("webstream_stage_dropped_frames_total", "counter", "Queued frames discarded since a pipeline stage fell behind.");
+        for (int stage = 0; stage < TransmitterMetrics::STAGE_COUNT; stage++)
+            Sample("webstream_stage_dropped_frames_total", std::string("stage=\"") + TransmitterMetrics::STAGE_NAMES[stage] + "\"", (double)metrics.stage_queue_drops[stage].Value());
+
+        Histogram("webstream_pacing_lateness_seconds", "Frame capture delay after the scheduled deadline.", metrics.pacing_lateness);
+        Counter("webstream_pacing_skipped_frames_total", "Frame deadlines skipped since capture & encoding fell behind.", metrics.pacing_skipped_frames.Value());
+
+        Family("webstream_editor_rewrites_total", "counter", "Atoms rewritten by MP4StreamEditor.");
+        Sample("webstream_editor_rewrites_total", "atom=\"moov\",mode=\"traverse\"", (double)metrics.moov_rewrites.Value());
+        Sample("webstream_editor_rewrites_total", "atom=\"moov\",mode=\"cached\"", (double)metrics.moov_cached_patches.Value());
+        Sample("webstream_editor_rewrites_total", "atom=\"moof\",mode=\"copy\"", (double)metrics.moof_rewrites.Value());
+        Sample("webstream_editor_rewrites_total", "atom=\"moof\",mode=\"gather\"", (double)metrics.moof_gather_rewrites.Value());
+    }
+
+    const std::string& Text() const {
+        return m_out;
+    }
+
+private:
+    std::string m_out;
+};
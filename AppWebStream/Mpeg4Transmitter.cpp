@@ -1,50 +1,414 @@
 #include "Mpeg4Transmitter.hpp"
+#include <cstring>
+#include "ColorConvert.hpp"
+#include "Metrics.hpp"
 #include "OutputStream.hpp"
+#include "TileHash.hpp"
 #include "VideoEncoder.hpp"
 
 
-Mpeg4Transmitter::Mpeg4Transmitter(unsigned int dimensions[2], unsigned int fps, FILETIME startTime, const char* port_filename) {
+/** Parameters that apply to a frame. Captured together with the pixels, since the frame is encoded asynchronously.
+    DPI & xform are the current settings instead of changes, so that they survive frames dropped by the pipeline. */
+struct Mpeg4Transmitter::FrameParams {
+    FILETIME time{};        ///< frame time (zero if unspecified)
+    double   dpi = 0;       ///< zero if unspecified
+    bool     has_xform = false;
+    double   xform[6] = {};
+    bool     refresh = false; ///< convert in full, even if unchanged (FFMPEG only)
+};
+
+/** Max time between full conversions of static content [100ns]. */
+static constexpr uint64_t REFRESH_INTERVAL = FILETIME_PER_SECONDS;
+
+/** RGBA frame written by the caller. */
+struct Mpeg4Transmitter::CapturedFrame : FrameBuffer {
+#ifdef ENABLE_FFMPEG
+    explicit CapturedFrame(size_t pixel_count) : rgba(pixel_count) {
+    }
+
+    AlignedArray<R8G8B8A8> rgba;
+    const R8G8B8A8*        external = nullptr; ///< top row of caller memory to convert instead of "rgba"
+    ptrdiff_t              external_stride = 0; ///< pixels, negative for bottom-up images
+    PixelFormat            external_format = PixelFormat::BGRA;
+#else
+    IMFSamplePtr           sample; ///< encoded without copy
+    IMFMediaBufferPtr      buffer; ///< locked while owned by the caller
+    TileHashGrid           tiles;  ///< hashes of the submitted pixels
+#endif
+    FrameParams            params;
+};
+
+/** YUV frame converted from a CapturedFrame (FFMPEG only). */
+struct Mpeg4Transmitter::ConvertedFrame {
+#ifdef ENABLE_FFMPEG
+    ~ConvertedFrame() {
+        av_frame_free(&frame);
+    }
+
+    AVFrame*     frame = nullptr;
+    TileHashGrid tiles; ///< hashes of the frame content (invalid until converted)
+#endif
+    FrameParams params;
+};
+
+
+Mpeg4Transmitter::Mpeg4Transmitter(unsigned int dimensions[2], unsigned int fps, FILETIME startTime, const char* port_filename, unsigned int convert_threads, unsigned int frames_per_fragment,
+                                   unsigned int queue_frames, QueuePolicy queue_policy) {
     m_stream = CreateLocalInstance<OutputStream>();
 
     m_stream->Initialize(startTime); // start time
 
-    m_stream->SetPortOrFilename(port_filename); // blocking call
+    m_stream->SetPortOrFilename(port_filename); // doesn't wait for clients
 
 #ifdef ENABLE_FFMPEG
-    m_encoder = std::make_unique<VideoEncoderFF>(dimensions, fps, m_stream);
+    m_encoder = std::make_unique<VideoEncoderFF>(dimensions, fps, m_stream, convert_threads, frames_per_fragment);
+#else
+    m_encoder = std::make_unique<VideoEncoderMF>(dimensions, fps, m_stream, frames_per_fragment);
+    (void)convert_threads; // color conversion is done by Media Foundation
+#endif
+
+    m_width = Align2(dimensions[0]);
+    m_height = Align2(dimensions[1]);
+    m_params = std::make_unique<FrameParams>();
+    m_applied_params = std::make_unique<FrameParams>();
+
+    // pool sized for the queue plus one frame being filled by the producing stage & one processed by the consuming stage
+    if (queue_frames < 1)
+        queue_frames = 1;
+    const size_t pool_size = queue_frames + 2;
+    TransmitterMetrics& metrics = TransmitterMetrics::Instance();
+
+    std::vector<CapturedFrame*> captured;
+    for (size_t i = 0; i < pool_size; i++) {
+#ifdef ENABLE_FFMPEG
+        m_captured_pool.push_back(std::make_unique<CapturedFrame>(m_width*m_height));
+        m_captured_pool.back()->pixels = m_captured_pool.back()->rgba.data();
+#else
+        m_captured_pool.push_back(std::make_unique<CapturedFrame>());
+        m_captured_pool.back()->sample = m_encoder->AllocateSample();
+        COM_CHECK(m_captured_pool.back()->sample->GetBufferByIndex(0, &m_captured_pool.back()->buffer));
+        m_captured_pool.back()->tiles = TileHashGrid(m_width, m_height);
+#endif
+        m_captured_pool.back()->stride = m_width;
+        captured.push_back(m_captured_pool.back().get());
+    }
+
+#ifdef ENABLE_FFMPEG
+    // capture -> convert -> encode
+    m_captured = std::make_unique<FrameChannel<CapturedFrame>>(captured, queue_policy,
+        &metrics.stage_queue_frames[TransmitterMetrics::STAGE_CONVERT], &metrics.stage_queue_drops[TransmitterMetrics::STAGE_CONVERT]);
+
+    std::vector<ConvertedFrame*> converted;
+    for (size_t i = 0; i < pool_size; i++) {
+        m_converted_pool.push_back(std::make_unique<ConvertedFrame>());
+        m_converted_pool.back()->frame = m_encoder->AllocateFrame();
+        m_converted_pool.back()->tiles = TileHashGrid(m_width, m_height);
+        converted.push_back(m_converted_pool.back().get());
+    }
+    m_converted = std::make_unique<FrameChannel<ConvertedFrame>>(converted, queue_policy,
+        &metrics.stage_queue_frames[TransmitterMetrics::STAGE_ENCODE], &metrics.stage_queue_drops[TransmitterMetrics::STAGE_ENCODE]);
+
+    m_convert_thread = std::thread(&Mpeg4Transmitter::ConvertThread, this);
 #else
-    m_encoder = std::make_unique<VideoEncoderMF>(dimensions, fps, m_stream);
+    // capture -> encode (Media Foundation converts colors internally)
+    m_captured = std::make_unique<FrameChannel<CapturedFrame>>(captured, queue_policy,
+        &metrics.stage_queue_frames[TransmitterMetrics::STAGE_ENCODE], &metrics.stage_queue_drops[TransmitterMetrics::STAGE_ENCODE]);
 #endif
+    m_encode_thread = std::thread(&Mpeg4Transmitter::EncodeThread, this);
 }
 
 Mpeg4Transmitter::~Mpeg4Transmitter() {
+    if (m_cur_frame)
+        AbortWrite();
+
+    // drain the pipeline, so that all submitted frames are encoded before the encoder flushes the stream
+    m_captured->Close();
+    if (m_convert_thread.joinable())
+        m_convert_thread.join();
+    m_encode_thread.join();
+
+    m_encoder.reset(); // before the pooled frames are freed
 }
 
 void Mpeg4Transmitter::SetDPI(double dpi) {
-    double prevDpi = m_stream->SetNextFrameDPI(dpi);
-    if (prevDpi && (dpi != prevDpi))
-        m_encoder->StartNewStream(m_stream);
+    m_params->dpi = dpi;
 }
 
 void Mpeg4Transmitter::SetXform(const double xform[6]) {
-    m_stream->SetXform(xform);
+    m_params->has_xform = true;
+    for (size_t i = 0; i < 6; i++)
+        m_params->xform[i] = xform[i];
 }
 
-R8G8B8A8* Mpeg4Transmitter::WriteFrameBegin(FILETIME curTime) {
-    if (curTime.dwHighDateTime || curTime.dwLowDateTime)
-        m_stream->SetNextFrameTime(curTime);
+bool Mpeg4Transmitter::Idle() const {
+    return m_stream->Idle();
+}
+
+Mpeg4Transmitter::FrameBuffer* Mpeg4Transmitter::AcquireFrame(FILETIME curTime) {
+    TransmitterMetrics::Instance().frames_captured.Add();
+
+    CapturedFrame* frame = m_captured->Acquire();
+    frame->params.time = curTime;
+#ifndef ENABLE_FFMPEG
+    COM_CHECK(frame->buffer->Lock(reinterpret_cast<BYTE**>(&frame->pixels), nullptr, nullptr));
+#endif
+    return frame;
+}
+
+HRESULT Mpeg4Transmitter::SubmitFrame(FrameBuffer* buffer) {
+    CapturedFrame* frame = static_cast<CapturedFrame*>(buffer);
+#ifndef ENABLE_FFMPEG
+    frame->tiles.Compute(frame->pixels, frame->stride); // while still locked
+    COM_CHECK(frame->buffer->Unlock());
+    frame->pixels = nullptr;
+#endif
+
+    // attach current DPI & xform (frame time was set by AcquireFrame)
+    FrameParams& params = frame->params;
+    params.dpi = m_params->dpi;
+    params.has_xform = m_params->has_xform;
+    for (size_t i = 0; i < 6; i++)
+        params.xform[i] = m_params->xform[i];
+    params.refresh = RefreshDue(params.time);
 
-    return m_encoder->WriteFrameBegin();
+    m_captured->Submit(frame);
+    return m_encode_result;
 }
 
-HRESULT Mpeg4Transmitter::WriteFrameEnd() {
-    HRESULT hr = m_encoder->WriteFrameEnd();
-    if (FAILED(hr))
-        return hr;
+void Mpeg4Transmitter::ReleaseFrame(FrameBuffer* buffer) {
+    CapturedFrame* frame = static_cast<CapturedFrame*>(buffer);
+#ifndef ENABLE_FFMPEG
+    COM_CHECK(frame->buffer->Unlock());
+    frame->pixels = nullptr;
+#endif
+    TransmitterMetrics::Instance().frames_dropped.Add();
+    m_captured->Discard(frame);
+}
+
+HRESULT Mpeg4Transmitter::SubmitFrame(const void* pixels, ptrdiff_t pitch, unsigned int width, unsigned int height, PixelFormat format, FrameOrientation orientation, FILETIME curTime) {
+    if (!pixels || (Align2(width) != m_width) || (Align2(height) != m_height))
+        return E_INVALIDARG;
+    if ((pitch < (ptrdiff_t)(width*sizeof(R8G8B8A8))) || (pitch % sizeof(R8G8B8A8)))
+        return E_INVALIDARG;
+
+    // address the image from the top row, with a negative stride for bottom-up images
+    const R8G8B8A8* top = static_cast<const R8G8B8A8*>(pixels);
+    ptrdiff_t stride = pitch/(ptrdiff_t)sizeof(R8G8B8A8);
+    if (orientation == FrameOrientation::BOTTOM_UP) {
+        top += (ptrdiff_t)(height - 1)*stride;
+        stride = -stride;
+    }
+
+    FrameBuffer* buffer = AcquireFrame(curTime);
+#ifdef ENABLE_FFMPEG
+    if ((width != m_width) || (height != m_height)) {
+        // odd dimensions: the conversion would read past the image, so copy it & repeat the last column & row into the padding
+        R8G8B8A8* dst = buffer->pixels;
+        const ptrdiff_t dst_stride = buffer->stride;
+        CopyToBGRA(top, stride, format, width, height, dst, dst_stride);
+        for (unsigned int y = 0; (y < height) && (width < m_width); y++)
+            dst[y*dst_stride + width] = dst[y*dst_stride + width - 1];
+        if (height < m_height)
+            memcpy(dst + height*dst_stride, dst + (height - 1)*dst_stride, m_width*sizeof(R8G8B8A8));
+        return SubmitFrame(buffer);
+    }
+
+    CapturedFrame* frame = static_cast<CapturedFrame*>(buffer);
+    frame->external = top;
+    frame->external_stride = stride;
+    frame->external_format = format;
+    HRESULT hr = SubmitFrame(frame);
+
+    // the caller still owns "pixels", so wait until the convert thread no longer reads them
+    m_external_converted.Wait();
+    return hr;
+#else
+    // single pass that swizzles & flips into the bottom-up layout of the pooled sample
+    static_assert(NATIVE_ORIENTATION == FrameOrientation::BOTTOM_UP, "Media Foundation RGB32 samples are bottom-up");
+    const ptrdiff_t dst_stride = buffer->stride;
+    CopyToBGRA(top, stride, format, m_width, m_height, buffer->pixels + (ptrdiff_t)(m_height - 1)*dst_stride, -dst_stride);
+    return SubmitFrame(buffer);
+#endif
+}
 
-    return m_stream->Flush();
+R8G8B8A8* Mpeg4Transmitter::WriteFrameBegin(FILETIME curTime) {
+    m_cur_frame = AcquireFrame(curTime);
+    return m_cur_frame->pixels;
+}
+
+HRESULT Mpeg4Transmitter::WriteFrameEnd() {
+    FrameBuffer* frame = m_cur_frame;
+    m_cur_frame = nullptr;
+    return SubmitFrame(frame);
 }
 
 void Mpeg4Transmitter::AbortWrite() {
-    return m_encoder->AbortWrite();
+    ReleaseFrame(m_cur_frame);
+    m_cur_frame = nullptr;
+}
+
+Mpeg4Transmitter::StageStatus Mpeg4Transmitter::GetStageStatus(TransmitterMetrics::Stage stage) const {
+#ifdef ENABLE_FFMPEG
+    const auto* channel_captured = (stage == TransmitterMetrics::STAGE_CONVERT) ? m_captured.get() : nullptr;
+    const auto* channel_converted = (stage == TransmitterMetrics::STAGE_ENCODE) ? m_converted.get() : nullptr;
+#else
+    const auto* channel_captured = (stage == TransmitterMetrics::STAGE_ENCODE) ? m_captured.get() : nullptr;
+    const FrameChannel<ConvertedFrame>* channel_converted = nullptr;
+#endif
+
+    StageStatus status;
+    if (channel_captured) {
+        status.queued = channel_captured->Occupancy();
+        status.capacity = channel_captured->Capacity();
+        status.dropped = channel_captured->Dropped();
+    } else if (channel_converted) {
+        status.queued = channel_converted->Occupancy();
+        status.capacity = channel_converted->Capacity();
+        status.dropped = channel_converted->Dropped();
+    }
+    return status;
+}
+
+void Mpeg4Transmitter::ConvertThread() {
+#ifdef ENABLE_FFMPEG
+    SetThreadDescription(GetCurrentThread(), L"Mpeg4TransmitterConvert");
+    TransmitterMetrics& metrics = TransmitterMetrics::Instance();
+
+    TileHashGrid tiles(m_width, m_height); // hashes of the received frame
+    std::vector<RowBand> bands;
+    bands.reserve(tiles.TilesY());
+
+    while (CapturedFrame* captured = m_captured->Receive()) {
+        ConvertedFrame* converted = m_converted->Acquire();
+        const bool external = (captured->external != nullptr);
+        if (SUCCEEDED(m_encode_result)) { // no point in converting frames that cannot be encoded
+            const R8G8B8A8* src = external ? captured->external : captured->rgba.data();
+            const ptrdiff_t stride = external ? captured->external_stride : (ptrdiff_t)captured->stride;
+            const PixelFormat format = external ? captured->external_format : PixelFormat::BGRA;
+
+            // only convert the tile rows that differ from the previous content of the pooled frame
+            tiles.Compute(src, stride);
+            if (captured->params.refresh || m_full_convert.exchange(false))
+                converted->tiles.Invalidate(); // convert in full, in case a tile hash collision left stale rows
+            const unsigned int changed_rows = tiles.ChangedBands(converted->tiles, bands);
+            m_encoder->ConvertFrame(src, stride, format, converted->frame, bands.data(), bands.size());
+            std::swap(converted->tiles, tiles);
+            metrics.rows_converted.Add(changed_rows);
+            metrics.rows_unchanged.Add(m_height - changed_rows);
+        } else {
+            converted->tiles.Invalidate();
+        }
+        converted->params = captured->params;
+        captured->external = nullptr;
+        m_captured->Release(captured);
+        if (external)
+            m_external_converted.Signal(); // caller memory can be reused
+
+        m_converted->Submit(converted);
+    }
+
+    m_converted->Close(); // end of stream for the encode thread
+#endif
+}
+
+void Mpeg4Transmitter::EncodeThread() {
+    SetThreadDescription(GetCurrentThread(), L"Mpeg4TransmitterEncode");
+    TransmitterMetrics& metrics = TransmitterMetrics::Instance();
+
+    TileHashGrid encoded_tiles(m_width, m_height); // content of the last encoded frame
+
+    for (;;) {
+#ifdef ENABLE_FFMPEG
+        ConvertedFrame* frame = m_converted->Receive();
+#else
+        CapturedFrame* frame = m_captured->Receive();
+#endif
+        if (!frame)
+            break; // end of stream
+
+        if (FAILED(m_encode_result)) {
+            // keep draining, so that the caller isn't blocked after an error
+            metrics.frames_dropped.Add();
+#ifdef ENABLE_FFMPEG
+            m_converted->Release(frame);
+#else
+            m_captured->Release(frame);
+#endif
+            continue;
+        }
+
+        HRESULT hr = S_OK;
+        try {
+            const bool key_frame = m_stream->ConsumeKeyFrameRequest(); // new client cannot start decoding before the next key frame
+            ApplyFrameParams(frame->params);
+            if (key_frame) {
+                m_encoder->RequestKeyFrame();
+#ifdef ENABLE_FFMPEG
+                m_full_convert = true; // key frames start decoding without references, so also refresh stale rows
+#endif
+            }
+
+            // identical frames are still encoded, so that the media timeline stays continuous. The encoder turns them
+            // into near-empty P-frames, since the reference frame is unchanged
+            const bool unchanged = frame->tiles.Equals(encoded_tiles);
+            const auto start = std::chrono::steady_clock::now();
+#ifdef ENABLE_FFMPEG
+            hr = m_encoder->EncodeFrame(frame->frame);
+#else
+            hr = m_encoder->WriteSample(frame->sample); // frame was written directly into the sample buffer
+#endif
+            if (SUCCEEDED(hr)) {
+                metrics.encode_latency.ObserveSince(start);
+                metrics.frames_encoded.Add();
+                if (unchanged)
+                    metrics.frames_unchanged.Add();
+                encoded_tiles = frame->tiles;
+                hr = m_stream->Flush();
+            } else {
+                metrics.frames_dropped.Add();
+                encoded_tiles.Invalidate();
+            }
+        } catch (const std::exception&) {
+            metrics.frames_dropped.Add();
+            hr = E_FAIL;
+        }
+
+#ifdef ENABLE_FFMPEG
+        m_converted->Release(frame);
+#else
+        m_captured->Release(frame);
+#endif
+        if (FAILED(hr))
+            m_encode_result = hr; // reported by the next WriteFrameEnd
+    }
+}
+
+void Mpeg4Transmitter::ApplyFrameParams(const FrameParams& params) {
+    FrameParams& applied = *m_applied_params;
+    if (params.dpi && (params.dpi != applied.dpi)) {
+        double prevDpi = m_stream->SetNextFrameDPI(params.dpi);
+        if (prevDpi && (params.dpi != prevDpi))
+            m_encoder->StartNewStream(m_stream);
+        applied.dpi = params.dpi;
+    }
+    if (params.has_xform && (!applied.has_xform || memcmp(params.xform, applied.xform, sizeof(params.xform)))) {
+        m_stream->SetXform(params.xform);
+        applied.has_xform = true;
+        memcpy(applied.xform, params.xform, sizeof(params.xform));
+    }
+
+    if (params.time.dwHighDateTime || params.time.dwLowDateTime)
+        m_stream->SetNextFrameTime(params.time);
+}
+
+bool Mpeg4Transmitter::RefreshDue(FILETIME time) {
+    // frame time if specified, so that the refresh follows the media timeline, otherwise wall-clock time
+    uint64_t now = FileTimeToU64(time);
+    if (!now)
+        now = std::chrono::duration_cast<std::chrono::duration<uint64_t, std::ratio<1, FILETIME_PER_SECONDS>>>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    if (m_last_refresh && (now >= m_last_refresh) && (now - m_last_refresh < REFRESH_INTERVAL))
+        return false;
+    m_last_refresh = now; // also restarts after the frame time jumped backwards
+    return true;
 }
@@ -1,7 +1,11 @@
 #pragma once
 #include <Windows.h>
 #include <atlbase.h>
+#include <atomic>
 #include <memory>
+#include <thread>
+#include <vector>
+#include "FramePipeline.hpp"
 
 /** 32bit color value. */
 struct R8G8B8A8 {
@@ -11,6 +15,18 @@ struct R8G8B8A8 {
     unsigned char a;
 };
 
+/** Byte order of 32bit pixels in memory. */
+enum class PixelFormat {
+    BGRA, ///< GetDIBits, DXGI_FORMAT_B8G8R8A8_UNORM & MFVideoFormat_RGB32 (byte order of FrameBuffer pixels)
+    RGBA, ///< DXGI_FORMAT_R8G8B8A8_UNORM & most image libraries
+};
+
+/** Row order of an image in memory. */
+enum class FrameOrientation {
+    TOP_DOWN,  ///< first row in memory is the top row
+    BOTTOM_UP, ///< first row in memory is the bottom row (default for DIBs)
+};
+
 /** FFMPEG only: Grow size to become a multiple of 2 (libx264 requirement). */
 static unsigned int Align2(unsigned int size) {
 #ifdef ENABLE_FFMPEG
@@ -29,9 +45,47 @@ class VideoEncoderFF;
 class VideoEncoderMF;
 
 
+/** H.264/MPEG4 encoder & transmitter.
+    Frames are processed by a pipeline with one thread per stage: capture (caller) -> color conversion (FFMPEG only)
+    -> encoding & muxing. The stages are connected by bounded lock-free queues of pooled frames, so that throughput is
+    bounded by the slowest stage instead of the sum of all stages.
+    Frames are written directly into pooled, 64-byte aligned buffers that are allocated once at construction.
+    Unchanged screen content is detected with tile hashes, so that only changed rows are color-converted (FFMPEG only).
+    Every frame is still encoded, so that the media timeline has no gaps. Frames identical to the previously encoded
+    frame are cheap to encode, since the encoder produces near-empty P-frames against the unchanged reference. Static
+    content is converted in full once per second of frame time, which bounds the lifetime of stale rows after a tile
+    hash collision. */
 class Mpeg4Transmitter {
 public:
-    Mpeg4Transmitter(unsigned int dimensions[2], unsigned int fps, FILETIME startTime, const char* port_filename);
+    /** Row order of FrameBuffer pixels. Bottom-up with Media Foundation, which expects RGB32 samples with a negative stride. */
+#ifdef ENABLE_FFMPEG
+    static constexpr FrameOrientation NATIVE_ORIENTATION = FrameOrientation::TOP_DOWN;
+#else
+    static constexpr FrameOrientation NATIVE_ORIENTATION = FrameOrientation::BOTTOM_UP;
+#endif
+
+    /** Pooled frame buffer. Owned by the caller between AcquireFrame and SubmitFrame/ReleaseFrame. */
+    struct FrameBuffer {
+        R8G8B8A8*    pixels = nullptr; ///< PixelFormat::BGRA rows in NATIVE_ORIENTATION, 64-byte aligned
+        unsigned int stride = 0;       ///< pixels per row
+    };
+
+    /** Occupancy of the frame queue in front of a pipeline stage. */
+    struct StageStatus {
+        size_t   queued = 0;   ///< frames waiting for the stage
+        size_t   capacity = 0; ///< max queued frames
+        uint64_t dropped = 0;  ///< frames discarded with QueuePolicy::DROP_OLDEST
+    };
+
+    /** convert_threads: FFMPEG only: Number of threads for RGBA to YUV conversion (0 = hardware concurrency capped to 8).
+        frames_per_fragment: Number of frames per MPEG4 fragment (0 = one fragment per GOP). Values other than 1 reduce
+        per-frame overhead at the expense of latency, and are intended for recording or latency-tolerant viewers.
+        queue_frames: Max frames queued in front of each pipeline stage.
+        queue_policy: Behavior when a stage falls behind. DROP_OLDEST keeps the latency low for live viewing, whereas
+        BLOCK throttles the caller so that no frame is lost, e.g. for recording.
+        Returns without waiting for clients, so that encoder startup doesn't delay the first viewer. */
+    Mpeg4Transmitter(unsigned int dimensions[2], unsigned int fps, FILETIME startTime, const char* port_filename, unsigned int convert_threads = 0, unsigned int frames_per_fragment = 1,
+                     unsigned int queue_frames = 2, QueuePolicy queue_policy = QueuePolicy::DROP_OLDEST);
     ~Mpeg4Transmitter();
 
     /** Update DPI for the next frame.
@@ -44,15 +98,72 @@ public:
         where xform = [a,b, c, d, tx, ty] */
     void SetXform(const double xform[6]);
 
+    /** True if no client is receiving the stream. Frames can then be produced at a reduced rate that keeps the
+        encoder warm and the late-join caches fresh. */
+    bool Idle() const;
+
+    /** Get a buffer from the pool for filling a frame captured at "curTime" (zero if unspecified). Several frames may be
+        acquired at a time, e.g. to capture the next frame before the previous one is complete.
+        May block with QueuePolicy::BLOCK until the pipeline releases a buffer. */
+    FrameBuffer* AcquireFrame(FILETIME curTime = {});
+    /** Pass a filled frame to the pipeline without waiting for it to be encoded. Frames are encoded in submission order.
+        Returns the first error from encoding earlier frames, since encoding is asynchronous. */
+    HRESULT      SubmitFrame(FrameBuffer* frame);
+    /** Return an acquired frame to the pool without encoding it. */
+    void         ReleaseFrame(FrameBuffer* frame);
+
+    /** Encode a frame from caller-owned memory, e.g. a mapped DXGI staging texture, without first copying it into a
+        FrameBuffer. "width" & "height" are the image dimensions, which shall be the dimensions passed to the constructor
+        (with or without Align2 padding). "pitch" is the distance between rows in memory [bytes], and shall be a multiple
+        of 4 that covers "width" pixels. Returns E_INVALIDARG otherwise.
+        FFMPEG: Color conversion reads directly from "pixels", so the call blocks until the frames queued in front of the
+        conversion stage and this frame have been converted. Images without Align2 padding are copied into a pooled
+        frame instead, with the last column & row repeated into the padding. Media Foundation: The pixels are copied into
+        a pooled sample, since the encoder requires BGRA bottom-up samples.
+        "pixels" can be reused after return. Returns the first error from encoding earlier frames, like SubmitFrame. */
+    HRESULT      SubmitFrame(const void* pixels, ptrdiff_t pitch, unsigned int width, unsigned int height, PixelFormat format, FrameOrientation orientation, FILETIME curTime = {});
+
+    /** Single-frame shorthands for AcquireFrame, SubmitFrame & ReleaseFrame. */
     R8G8B8A8* WriteFrameBegin(FILETIME curTime = {});
     HRESULT   WriteFrameEnd();
     void      AbortWrite();
 
+    /** Queue occupancy in front of the STAGE_CONVERT or STAGE_ENCODE stage. STAGE_CONVERT is unused with Media
+        Foundation, which converts colors internally. */
+    StageStatus GetStageStatus(TransmitterMetrics::Stage stage) const;
+
 private:
+    struct FrameParams;
+    struct CapturedFrame;
+    struct ConvertedFrame;
+
+    void ConvertThread();
+    void EncodeThread();
+    /** Apply DPI, xform & frame time before encoding a frame. Encode thread only. */
+    void ApplyFrameParams(const FrameParams& params);
+    /** True if a frame at "time" shall be converted in full even if unchanged. Caller thread only. */
+    bool RefreshDue(FILETIME time);
+
     CComPtr<OutputStream>           m_stream;
 #ifdef ENABLE_FFMPEG
     std::unique_ptr<VideoEncoderFF> m_encoder;
 #else
     std::unique_ptr<VideoEncoderMF> m_encoder;
 #endif
+
+    unsigned int                    m_width = 0;  ///< frame width after Align2
+    unsigned int                    m_height = 0; ///< frame height after Align2
+    uint64_t                        m_last_refresh = 0; ///< time of the last refresh frame [100ns] (caller thread)
+    std::atomic<bool>               m_full_convert = false; ///< convert the next frame in full, set on key frame requests (FFMPEG only)
+    std::unique_ptr<FrameParams>    m_params;         ///< current DPI & xform (caller thread)
+    std::unique_ptr<FrameParams>    m_applied_params; ///< DPI & xform passed to the stream (encode thread)
+    FrameBuffer*                    m_cur_frame = nullptr; ///< frame of WriteFrameBegin (caller thread)
+    std::vector<std::unique_ptr<CapturedFrame>>  m_captured_pool;
+    std::unique_ptr<FrameChannel<CapturedFrame>> m_captured;  ///< caller to convert thread (FFMPEG) or encode thread
+    std::vector<std::unique_ptr<ConvertedFrame>> m_converted_pool;
+    std::unique_ptr<FrameChannel<ConvertedFrame>> m_converted; ///< convert to encode thread (FFMPEG only)
+    WakeupEvent                     m_external_converted; ///< signaled after converting a frame from caller memory (FFMPEG only)
+    std::atomic<HRESULT>            m_encode_result = S_OK; ///< first encoding error
+    std::thread                     m_convert_thread;
+    std::thread                     m_encode_thread;
 };
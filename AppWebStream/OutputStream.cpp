@@ -1,102 +1,8 @@
 #define WIN32_LEAN_AND_MEAN
-#include <atomic>
-#include <comdef.h> // for _com_error
 #include <Mfapi.h>
+#include <mferror.h>
 #include "OutputStream.hpp"
-#include "WebSocket.hpp"
-
-
-class WebStream : public ByteWriter, StreamSockSetter {
-public:
-    WebStream(const char * port_str) : m_server(port_str), m_block_ctor(true) {
-        // start server thread
-        m_thread = std::thread(&WebStream::WaitForClientsThread, this);
-
-        // wait for video request or socket failure
-        std::mutex mutex;
-        std::unique_lock<std::mutex> lock(mutex);
-        while (m_block_ctor)
-            m_cond_var.wait(lock);
-
-        // start streaming video
-    }
-
-    void WaitForClientsThread() {
-        SetThreadDescription(GetCurrentThread(), L"WaitForClientsThread");
-
-        for (;;) {
-            auto current = m_server.WaitForClient();
-            if (!current)
-                break;
-
-            // create a thread to the handle client connection
-            current->Start(this);
-            m_clients.push_back(std::move(current));
-        }
-
-        Unblock();
-    }
-
-    void SetStreamSocket(ClientSock & s) override {
-        for (size_t i = 0; i < m_clients.size(); ++i) {
-            if (m_clients[i].get() == &s) {
-                m_stream_client = std::move(m_clients[i]);
-                return;
-            }
-        }
-    }
-
-    void Unblock() override {
-        m_block_ctor = false;
-        m_cond_var.notify_all();
-    }
-
-    ~WebStream() override {
-        // close open sockets (forces blocking calls to complete)
-        m_server  = ServerSock();
-        m_thread.join();
-
-        m_stream_client.reset();
-
-        // wait for client threads to complete
-        for (auto & c : m_clients) {
-            if (c)
-                c.reset();
-        }
-    }
-
-    int WriteBytes(const std::string_view buffer) override {
-        // transmit data over socket
-        int byte_count = send(m_stream_client->Socket(), buffer.data(), (int)buffer.size(), 0);
-        if (byte_count == SOCKET_ERROR) {
-            // WSAECONNABORTED expected on client disconnect
-            int err = WSAGetLastError();
-            _com_error err_str(err);
-            wprintf(L"Socket send error %u: %s\n", err, err_str.ErrorMessage());
-            assert((err == WSAECONNABORTED) || (err == WSAECONNRESET));
-
-            // destroy failing client socket (typ. caused by client-side closing)
-            m_stream_client.reset();
-            return -1;
-        }
-
-#ifndef _NDEBUG
-        printf("."); // log "x" to signal that a TCP packet have been transmitted
-#endif
-        return byte_count;
-    }
-
-    void Flush() override {
-    }
-
-private:
-    ServerSock              m_server;  ///< listens for new connections
-    std::unique_ptr<ClientSock> m_stream_client;  ///< video streaming socket
-    std::atomic<bool>       m_block_ctor;
-    std::condition_variable m_cond_var;
-    std::thread             m_thread;
-    std::vector<std::unique_ptr<ClientSock>> m_clients; // heap allocated objects to ensure that they never change addreess
-};
+#include "WebStream.hpp"
 
 
 class FileStream : public ByteWriter {
@@ -148,6 +54,8 @@ void OutputStream::SetPortOrFilename(const char * port_or_filename) {
 }
 
 void OutputStream::SetNextFrameTime(FILETIME timeStamp) {
+    std::lock_guard<std::mutex> lock(m_mutex); // frame times are consumed on the Media Foundation write threads
+
     // compute 100-nanosecond intervals since startTime
     uint64_t duration = FileTimeToU64(timeStamp) - FileTimeToU64(m_startTime);
 
@@ -158,15 +66,27 @@ void OutputStream::SetNextFrameTime(FILETIME timeStamp) {
 }
 
 double OutputStream::SetNextFrameDPI(double dpi) {
+    std::lock_guard<std::mutex> lock(m_mutex);
     double prevDpi = m_stream_editor->GetDPI();
     m_stream_editor->SetDPI(dpi);
     return prevDpi;
 }
 
 void OutputStream::SetXform(const double xform[6]) {
+    std::lock_guard<std::mutex> lock(m_mutex);
     m_stream_editor->SetXform(xform);
 }
 
+bool OutputStream::Idle() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_writer && m_writer->Idle();
+}
+
+bool OutputStream::ConsumeKeyFrameRequest() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_writer && m_writer->ConsumeKeyFrameRequest();
+}
+
 HRESULT OutputStream::GetCapabilities(/*out*/DWORD *capabilities) {
     *capabilities = MFBYTESTREAM_IS_WRITABLE | MFBYTESTREAM_IS_REMOTE;
     return S_OK;
@@ -206,9 +126,14 @@ HRESULT OutputStream::EndRead(/*in*/IMFAsyncResult* /*result*/, /*out*/ULONG* /*
 }
 
 HRESULT OutputStream::WriteImpl(std::string_view buffer) {
-    buffer = m_stream_editor->EditStream(buffer);
-
-    int byte_count = m_writer->WriteBytes(buffer);
+    // edit without copying and transmit the resulting byte ranges in one vectored write
+    int byte_count = 0;
+    try {
+        const GatherList& buffers = m_stream_editor->EditStreamGather(buffer);
+        byte_count = m_writer->WriteVectored(buffers);
+    } catch (const std::exception&) {
+        return MF_E_INVALID_FILE_FORMAT; // malformed atom, which must not propagate across the COM boundary
+    }
     if (byte_count < 0)
         return E_FAIL;
 
@@ -221,7 +146,7 @@ HRESULT OutputStream::Write(/*in*/const BYTE* pb, /*in*/ULONG cb, /*out*/ULONG*
 
      HRESULT hr = WriteImpl(std::string_view((char*)pb, cb));
      if (FAILED(hr))
-         return E_FAIL;
+         return hr;
      
     *cbWritten = cb;
     return S_OK;
@@ -233,7 +158,7 @@ HRESULT OutputStream::BeginWrite(/*in*/const BYTE* pb, /*in*/ULONG cb, /*in*/IMF
      HRESULT hr = WriteImpl(std::string_view((char*)pb, cb));
      if (FAILED(hr)) {
          m_mutex.unlock();
-         return E_FAIL;
+         return hr;
      }
 
      m_tmp_bytes_written = cb;
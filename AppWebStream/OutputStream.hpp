@@ -8,17 +8,10 @@
 #include <MFidl.h>
 #include <Mfreadwrite.h>
 #include "Resource.h"
+#include "ByteWriter.hpp"
 #include "MP4StreamEditor.hpp"
 
 
-class ByteWriter {
-public:
-    virtual ~ByteWriter() = default;
-    virtual int WriteBytes(const std::string_view buffer) = 0;
-    virtual void Flush() = 0;
-};
-
-
 class ATL_NO_VTABLE OutputStream :
     public CComObjectRootEx<CComMultiThreadModel>,
     public CComCoClass<OutputStream>,
@@ -38,6 +31,12 @@ public:
 
     void SetXform(const double xform[6]);
 
+    /** True if no client is receiving the stream. */
+    bool Idle() const;
+
+    /** True once after a client has started waiting for a key frame. */
+    bool ConsumeKeyFrameRequest();
+
     HRESULT GetCapabilities(/*out*/DWORD *capabilities) override;
 
     HRESULT GetLength(/*out*/QWORD* length) override;
@@ -75,7 +74,7 @@ public:
 private:
     HRESULT WriteImpl(std::string_view buffer);
 
-    mutable std::mutex m_mutex;
+    mutable std::mutex m_mutex; ///< serializes Media Foundation write threads with the frame parameter setters
     unsigned long      m_tmp_bytes_written = 0;
 
     std::unique_ptr<ByteWriter> m_writer;
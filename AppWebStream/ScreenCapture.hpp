@@ -1,5 +1,6 @@
 #pragma once
 #include <Windows.h>
+#include "Mpeg4Transmitter.hpp"
 
 
 class window_dc {
@@ -53,7 +54,8 @@ public:
         DeleteDC(m_dc);
     }
 
-    int CopyToRGBABuffer(window_dc& src, /*out*/uint32_t* dst_ptr) {
+    /** Copy window content as BGRA pixels with the requested row order (Mpeg4Transmitter::NATIVE_ORIENTATION for FrameBuffer pixels). */
+    int CopyToRGBABuffer(window_dc& src, FrameOrientation orientation, /*out*/uint32_t* dst_ptr) {
         // copy window content to bitmap
         if (!BitBlt(/*dst*/m_dc, 0, 0, m_width, m_height, /*src*/src.m_dc, 0, 0, SRCCOPY))
             return -1;
@@ -67,11 +69,10 @@ public:
                 return E_FAIL;
             bmp_info.bmiHeader.biBitCount = 32;     // request 32bit RGBA image 
             bmp_info.bmiHeader.biCompression = BI_RGB; // disable compression
-#ifdef ENABLE_FFMPEG
-            bmp_info.bmiHeader.biHeight = -abs(bmp_info.bmiHeader.biHeight); // request bitmap with origin in top-left corner
-#else
-            bmp_info.bmiHeader.biHeight = abs(bmp_info.bmiHeader.biHeight); // request bottom-up bitmap, with origin in lower-left corner
-#endif
+            if (orientation == FrameOrientation::TOP_DOWN)
+                bmp_info.bmiHeader.biHeight = -abs(bmp_info.bmiHeader.biHeight); // request bitmap with origin in top-left corner
+            else
+                bmp_info.bmiHeader.biHeight = abs(bmp_info.bmiHeader.biHeight); // request bottom-up bitmap, with origin in lower-left corner
         }
 
         // copy bitmap content to destination buffer
@@ -0,0 +1,119 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "Gzip.hpp"
+#include "HttpParser.hpp"
+
+
+/** In-memory cache of static web assets with precomputed responses.
+    Each asset is stored uncompressed and gzip-compressed together with its complete response headers, so that
+    requests are answered by queuing shared buffers without per-request allocation, resource loading or compression.
+    Clients revalidating with a matching ETag receive "304 Not Modified" without body. */
+class StaticAssetCache {
+public:
+    using Buffer = std::shared_ptr<const std::string>;
+
+    /** Precomputed response. "header" lacks the final empty line, so that connection headers can be appended. */
+    struct Response {
+        Buffer header;
+        Buffer body; ///< nullptr for responses without body
+    };
+
+    StaticAssetCache() = default;
+
+    // non-copyable
+    StaticAssetCache(const StaticAssetCache&) = delete;
+    StaticAssetCache& operator = (const StaticAssetCache&) = delete;
+
+    /** Add an asset. The gzip variant is only kept if smaller than the uncompressed content. */
+    void Add(std::string path, std::string_view content_type, std::string_view content) {
+        Asset asset;
+        asset.path = std::move(path);
+        asset.etag = MakeETag(content);
+
+        // headers common to all responses
+        std::string common = "Cache-Control: no-cache\r\n"; // revalidate with ETag before use
+        common += "ETag: " + asset.etag + "\r\n";
+        common += "Vary: Accept-Encoding\r\n";
+
+        std::string content_headers = "Content-Type: " + std::string(content_type) + "\r\n";
+        content_headers += "Accept-Ranges: none\r\n"; // no support for partial requests
+        content_headers += common;
+
+        asset.identity.header = std::make_shared<const std::string>("HTTP/1.1 200 OK\r\n" + content_headers
+            + "Content-Length: " + std::to_string(content.size()) + "\r\n");
+        asset.identity.body = std::make_shared<const std::string>(content);
+
+        std::string compressed = GzipCompressor::Compress(content);
+        if (compressed.size() < content.size()) {
+            asset.gzip.header = std::make_shared<const std::string>("HTTP/1.1 200 OK\r\n" + content_headers
+                + "Content-Encoding: gzip\r\n" + "Content-Length: " + std::to_string(compressed.size()) + "\r\n");
+            asset.gzip.body = std::make_shared<const std::string>(std::move(compressed));
+        }
+
+        asset.not_modified.header = std::make_shared<const std::string>("HTTP/1.1 304 Not Modified\r\n" + common);
+
+        m_assets.push_back(std::move(asset));
+    }
+
+    /** Select the response to a request. Returns nullptr if no asset matches the request target. */
+    const Response* Find(const HttpRequest& request) const {
+        for (const Asset& asset : m_assets) {
+            if (asset.path != request.target)
+                continue;
+
+            if (MatchesETag(request.if_none_match, asset.etag))
+                return &asset.not_modified;
+            if (request.accept_gzip && asset.gzip.body)
+                return &asset.gzip;
+            return &asset.identity;
+        }
+        return nullptr;
+    }
+
+private:
+    struct Asset {
+        std::string path;
+        std::string etag;
+        Response    identity;
+        Response    gzip;
+        Response    not_modified;
+    };
+
+    /** Strong ETag from a 64bit FNV-1a hash of the content. */
+    static std::string MakeETag(std::string_view content) {
+        uint64_t hash = 0xCBF29CE484222325ull;
+        for (char ch : content) {
+            hash ^= (uint8_t)ch;
+            hash *= 0x100000001B3ull;
+        }
+        char etag[24] = {};
+        snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)hash);
+        return etag;
+    }
+
+    /** Check if a comma-separated "If-None-Match" list contains "etag" or "*". Weak comparison (RFC 7232 3.2). */
+    static bool MatchesETag(std::string_view list, std::string_view etag) {
+        while (!list.empty()) {
+            size_t comma = list.find(',');
+            std::string_view item = list.substr(0, comma);
+            list = (comma == std::string_view::npos) ? std::string_view() : list.substr(comma + 1);
+
+            while (!item.empty() && (item.front() == ' '))
+                item.remove_prefix(1);
+            while (!item.empty() && (item.back() == ' '))
+                item.remove_suffix(1);
+            if ((item.size() >= 2) && (item.substr(0, 2) == "W/"))
+                item.remove_prefix(2);
+            if ((item == "*") || (item == etag))
+                return true;
+        }
+        return false;
+    }
+
+    std::vector<Asset> m_assets;
+};
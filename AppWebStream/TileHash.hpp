@@ -0,0 +1,230 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <nmmintrin.h> // SSE4.2 (crc32)
+#include "ColorConvert.hpp"
+
+/* Damage detection for screen content, which is static most of the time.
+   Frames are split into 64x64 pixel tiles, and each tile is hashed with CRC32C in 4 independent chains, one per
+   16 pixel wide column strip, so that the latency of the hardware CRC instructions of the chains overlaps. CRC32C
+   detects every change confined to 32 consecutive bits of a chain, and other changes collide with a probability of
+   2^-32 per chain. Since a collision would leave stale rows behind, static content is still converted in full and
+   re-encoded periodically (see Mpeg4Transmitter).
+   The tile hashes of a frame are compared against those of a previous frame, instead of keeping a copy of its pixels. */
+
+/** Hash of one tile. */
+struct TileHash {
+    static constexpr unsigned int STRIP_WIDTH = 16; ///< pixels per CRC chain
+
+    uint32_t crc[4] = {}; ///< CRC32C of each column strip
+
+    bool operator == (const TileHash& other) const {
+        return memcmp(this, &other, sizeof(TileHash)) == 0;
+    }
+    bool operator != (const TileHash& other) const {
+        return !(*this == other);
+    }
+};
+
+/** Pixel rows [begin, end) of a frame. */
+struct RowBand {
+    unsigned int begin = 0;
+    unsigned int end = 0;
+};
+
+/** CRC32C (Castagnoli polynomial, reflected) lookup table for the scalar fallback. */
+inline const uint32_t* Crc32cTable() {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> result{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78u : 0);
+            result[i] = crc;
+        }
+        return result;
+    }();
+    return table.data();
+}
+
+/** Scalar fallback. Accumulates "height" rows with "width" <= 64 pixels of one tile into "hash". */
+inline void HashTileRows_Scalar(const R8G8B8A8* src, ptrdiff_t src_stride, unsigned int width, unsigned int height, TileHash& hash) {
+    assert(width <= 4*TileHash::STRIP_WIDTH);
+    const uint32_t* table = Crc32cTable();
+    for (unsigned int y = 0; y < height; y++) {
+        const R8G8B8A8* row = src + (ptrdiff_t)y*src_stride;
+        for (unsigned int strip = 0; strip < 4; strip++) {
+            const unsigned int begin = strip*TileHash::STRIP_WIDTH;
+            const unsigned int end = (std::min)(begin + TileHash::STRIP_WIDTH, width);
+            const uint8_t* bytes = reinterpret_cast<const uint8_t*>(row + begin);
+            uint32_t crc = hash.crc[strip];
+            for (unsigned int i = 0; begin + i/4 < end; i++)
+                crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+            hash.crc[strip] = crc;
+        }
+    }
+}
+
+#ifdef COLOR_CONVERT_X86
+/** Check for SSE4.2 support (crc32 instruction). */
+inline bool CpuSupportsSSE42() {
+    int info[4] = {};
+    __cpuid(info, 1);
+    return info[2] & (1 << 20);
+}
+
+/** SSE4.2 kernel with the crc32 instruction. Gives the same hash as the scalar kernel. */
+inline void HashTileRows_SSE42(const R8G8B8A8* src, ptrdiff_t src_stride, unsigned int width, unsigned int height, TileHash& hash) {
+    assert(width <= 4*TileHash::STRIP_WIDTH);
+    constexpr unsigned int STRIP = TileHash::STRIP_WIDTH;
+    uint32_t crc[4] = {hash.crc[0], hash.crc[1], hash.crc[2], hash.crc[3]};
+
+    for (unsigned int y = 0; y < height; y++) {
+        const R8G8B8A8* row = src + (ptrdiff_t)y*src_stride;
+        if (width == 4*STRIP) {
+            // full tile: interleave the 4 chains, kept in separate variables so that they stay in registers
+            const R8G8B8A8* strip0 = row;
+            const R8G8B8A8* strip1 = row + STRIP;
+            const R8G8B8A8* strip2 = row + 2*STRIP;
+            const R8G8B8A8* strip3 = row + 3*STRIP;
+#ifdef _M_X64
+            uint64_t crc0 = crc[0], crc1 = crc[1], crc2 = crc[2], crc3 = crc[3];
+            for (unsigned int x = 0; x < STRIP; x += 2) {
+                uint64_t val0, val1, val2, val3;
+                memcpy(&val0, strip0 + x, sizeof(uint64_t));
+                memcpy(&val1, strip1 + x, sizeof(uint64_t));
+                memcpy(&val2, strip2 + x, sizeof(uint64_t));
+                memcpy(&val3, strip3 + x, sizeof(uint64_t));
+                crc0 = _mm_crc32_u64(crc0, val0);
+                crc1 = _mm_crc32_u64(crc1, val1);
+                crc2 = _mm_crc32_u64(crc2, val2);
+                crc3 = _mm_crc32_u64(crc3, val3);
+            }
+#else
+            uint32_t crc0 = crc[0], crc1 = crc[1], crc2 = crc[2], crc3 = crc[3];
+            for (unsigned int x = 0; x < STRIP; x++) {
+                uint32_t val0, val1, val2, val3;
+                memcpy(&val0, strip0 + x, sizeof(uint32_t));
+                memcpy(&val1, strip1 + x, sizeof(uint32_t));
+                memcpy(&val2, strip2 + x, sizeof(uint32_t));
+                memcpy(&val3, strip3 + x, sizeof(uint32_t));
+                crc0 = _mm_crc32_u32(crc0, val0);
+                crc1 = _mm_crc32_u32(crc1, val1);
+                crc2 = _mm_crc32_u32(crc2, val2);
+                crc3 = _mm_crc32_u32(crc3, val3);
+            }
+#endif
+            crc[0] = (uint32_t)crc0;
+            crc[1] = (uint32_t)crc1;
+            crc[2] = (uint32_t)crc2;
+            crc[3] = (uint32_t)crc3;
+        } else {
+            // partial tile at the right frame edge
+            for (unsigned int strip = 0; strip < 4; strip++) {
+                for (unsigned int x = strip*STRIP; x < (std::min)((strip + 1)*STRIP, width); x++) {
+                    uint32_t val = 0;
+                    memcpy(&val, row + x, sizeof(val));
+                    crc[strip] = _mm_crc32_u32(crc[strip], val);
+                }
+            }
+        }
+    }
+
+    for (unsigned int strip = 0; strip < 4; strip++)
+        hash.crc[strip] = crc[strip];
+}
+#endif
+
+inline void HashTileRows(const R8G8B8A8* src, ptrdiff_t src_stride, unsigned int width, unsigned int height, TileHash& hash) {
+#ifdef COLOR_CONVERT_X86
+    static const bool sse42 = CpuSupportsSSE42();
+    if (sse42)
+        return HashTileRows_SSE42(src, src_stride, width, height, hash);
+#endif
+    HashTileRows_Scalar(src, src_stride, width, height, hash);
+}
+
+
+/** Tile hashes of a frame. Allocated once per frame size, so that hashing & copying grids doesn't allocate. */
+class TileHashGrid {
+public:
+    static constexpr unsigned int TILE_SIZE = 64; ///< even, so that tile rows don't split chroma rows
+
+    TileHashGrid() = default;
+
+    /** Invalid grid for frames of the given size. */
+    TileHashGrid(unsigned int width, unsigned int height) : m_width(width), m_height(height), m_tiles_x((width + TILE_SIZE - 1)/TILE_SIZE), m_tiles_y((height + TILE_SIZE - 1)/TILE_SIZE) {
+        m_hashes.resize(m_tiles_x*m_tiles_y);
+    }
+
+    /** Hash all tiles of a frame. src points to the top row, and src_stride is in pixels (negative for bottom-up images). */
+    void Compute(const R8G8B8A8* src, ptrdiff_t src_stride) {
+        for (unsigned int ty = 0; ty < m_tiles_y; ty++) {
+            const unsigned int y = ty*TILE_SIZE;
+            const unsigned int tile_height = (std::min)(TILE_SIZE, m_height - y);
+            for (unsigned int tx = 0; tx < m_tiles_x; tx++) {
+                const unsigned int x = tx*TILE_SIZE;
+                TileHash& hash = m_hashes[ty*m_tiles_x + tx];
+                hash = TileHash();
+                HashTileRows(src + (ptrdiff_t)y*src_stride + x, src_stride, (std::min)(TILE_SIZE, m_width - x), tile_height, hash);
+            }
+        }
+        m_valid = true;
+    }
+
+    /** Mark the grid as not matching any frame, e.g. after the frame content was lost. */
+    void Invalidate() {
+        m_valid = false;
+    }
+
+    bool Valid() const {
+        return m_valid;
+    }
+
+    /** True if both grids are valid and all tiles are equal. */
+    bool Equals(const TileHashGrid& other) const {
+        return m_valid && other.m_valid && (m_hashes == other.m_hashes);
+    }
+
+    /** Collect the pixel rows of the tile rows that differ from "other", with adjacent tile rows merged into one band.
+        All rows are changed if either grid is invalid. Returns the number of changed pixel rows. */
+    unsigned int ChangedBands(const TileHashGrid& other, std::vector<RowBand>& bands) const {
+        assert((other.m_tiles_x == m_tiles_x) && (other.m_tiles_y == m_tiles_y));
+        bands.clear();
+        unsigned int changed_rows = 0;
+        for (unsigned int ty = 0; ty < m_tiles_y; ty++) {
+            bool changed = !m_valid || !other.m_valid;
+            for (unsigned int tx = 0; (tx < m_tiles_x) && !changed; tx++)
+                changed = (m_hashes[ty*m_tiles_x + tx] != other.m_hashes[ty*m_tiles_x + tx]);
+            if (!changed)
+                continue;
+
+            const RowBand band{ty*TILE_SIZE, (std::min)((ty + 1)*TILE_SIZE, m_height)};
+            if (!bands.empty() && (bands.back().end == band.begin))
+                bands.back().end = band.end;
+            else
+                bands.push_back(band);
+            changed_rows += band.end - band.begin;
+        }
+        return changed_rows;
+    }
+
+    unsigned int TilesX() const {
+        return m_tiles_x;
+    }
+    unsigned int TilesY() const {
+        return m_tiles_y;
+    }
+
+private:
+    unsigned int          m_width = 0;
+    unsigned int          m_height = 0;
+    unsigned int          m_tiles_x = 0;
+    unsigned int          m_tiles_y = 0;
+    std::vector<TileHash> m_hashes; ///< row-major
+    bool                  m_valid = false;
+};
@@ -5,6 +5,7 @@
 #include <Windows.h>
 #include <mfapi.h>
 #include "ComUtil.hpp"
+#include "Metrics.hpp"
 
 #ifndef ENABLE_FFMPEG
 #include <mfidl.h>
@@ -34,6 +35,7 @@ _COM_SMARTPTR_TYPEDEF(IMFAttributes,  __uuidof(IMFAttributes));
 
 #include <cassert>
 #include <fstream>
+#include <string>
 #include <tuple>
 #include <vector>
 
@@ -42,6 +44,8 @@ extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 }
+#include "ColorConvert.hpp"
+#include "TileHash.hpp"
 
 #endif
 
@@ -59,6 +63,9 @@ public:
     virtual HRESULT   WriteFrameEnd () = 0;
     virtual void      AbortWrite() = 0;
 
+    /** Encode the next frame as key frame (IDR), so that new clients can start decoding without waiting for the next GOP. */
+    virtual void      RequestKeyFrame() = 0;
+
 protected:
     const unsigned int m_width = 0;  ///< horizontal img. resolution (excluding padding)
     const unsigned int m_height = 0; ///< vertical img. resolution (excluding padding)
@@ -106,12 +113,15 @@ class VideoEncoderMF : public VideoEncoder {
         COM_CHECK(MFSetAttributeSize(mediaTypeOut, MF_MT_FRAME_SIZE, Align2(m_width), Align2(m_height)));
         COM_CHECK(MFSetAttributeRatio(mediaTypeOut, MF_MT_FRAME_RATE, m_fps, 1));
         COM_CHECK(MFSetAttributeRatio(mediaTypeOut, MF_MT_PIXEL_ASPECT_RATIO, 1, 1));
+        if (m_frames_per_fragment == 0)
+            COM_CHECK(mediaTypeOut->SetUINT32(MF_MPEG4SINK_MAX_CODED_SEQUENCES_PER_FRAGMENT, 1)); // one GOP per fragment
         return mediaTypeOut;
     }
 
 public:
-    /** Stream-based video encoding. */
-    VideoEncoderMF (unsigned int dimensions[2], unsigned int fps, IMFByteStream * stream) : VideoEncoder(dimensions, fps) {
+    /** Stream-based video encoding.
+        frames_per_fragment: Number of frames per MPEG4 fragment (0 = one fragment per GOP). */
+    VideoEncoderMF (unsigned int dimensions[2], unsigned int fps, IMFByteStream * stream, unsigned int frames_per_fragment = 1) : VideoEncoder(dimensions, fps), m_frames_per_fragment(frames_per_fragment) {
         COM_CHECK(MFStartup(MF_VERSION));
         COM_CHECK(MFFrameRateToAverageTimePerFrame(fps, 1, const_cast<unsigned long long*>(&m_frame_duration)));
 
@@ -177,6 +187,11 @@ public:
         // so far been unable to get IMFSinkWriter::AddStream to work.
         m_buffer.Release();
 
+        // transmit partial fragment, so that the frames are not lost
+        if ((m_frames_per_fragment == 0) || (m_frame_count % m_frames_per_fragment != 0))
+            COM_CHECK(m_sink_writer->NotifyEndOfSegment(m_stream_index));
+        m_frame_count = 0;
+
         // create fragmented MPEG4 sink
         m_media_sink.Release();
         COM_CHECK(MFCreateFMPEG4MediaSink(stream, /*videoType*/GetOutputType(), /*audioType*/nullptr, &m_media_sink));
@@ -220,6 +235,27 @@ public:
         COM_CHECK(MFCreateSample(&sample));
         COM_CHECK(sample->AddBuffer(m_buffer));
 
+        return WriteSample(sample);
+    }
+
+    /** Allocate a reusable sample with a 64-byte aligned frame buffer, so that frames can be written directly into
+        pooled samples instead of being copied into the shared buffer of WriteFrameBegin. */
+    IMFSamplePtr AllocateSample () const {
+        const DWORD frame_size = 4*Align2(m_width)*Align2(m_height);
+
+        IMFMediaBufferPtr buffer;
+        COM_CHECK(MFCreateAlignedMemoryBuffer(frame_size, MF_64_BYTE_ALIGNMENT, &buffer));
+        COM_CHECK(buffer->SetCurrentLength(frame_size));
+
+        IMFSamplePtr sample;
+        COM_CHECK(MFCreateSample(&sample));
+        COM_CHECK(sample->AddBuffer(buffer));
+        return sample;
+    }
+
+    /** Encode a sample from AllocateSample or WriteFrameEnd. The sample can be refilled after returning, as with the
+        shared buffer of WriteFrameBegin. */
+    HRESULT WriteSample (IMFSample* sample) {
         // Set the time stamp and the duration.
         COM_CHECK(sample->SetSampleTime(m_time_stamp));
         COM_CHECK(sample->SetSampleDuration(m_frame_duration));
@@ -229,8 +265,10 @@ public:
         if (FAILED(hr))
             return hr;
 
-        // transmit frame immediately
-        COM_CHECK(m_sink_writer->NotifyEndOfSegment(m_stream_index));
+        // transmit fragment when complete (the sink cuts GOP-sized fragments by itself)
+        m_frame_count++;
+        if (m_frames_per_fragment && (m_frame_count % m_frames_per_fragment == 0))
+            COM_CHECK(m_sink_writer->NotifyEndOfSegment(m_stream_index));
         //COM_CHECK(m_sink_writer->Flush(m_stream_index));
 
         // increment time
@@ -242,10 +280,21 @@ public:
         COM_CHECK(m_buffer->Unlock());
     }
 
+    void RequestKeyFrame() override {
+        // REF: https://learn.microsoft.com/en-us/windows/win32/medfound/codecapi-avencvideoforcekeyframe
+        CComPtr<ICodecAPI> codec;
+        if (FAILED(m_sink_writer->GetServiceForStream(m_stream_index, GUID_NULL, IID_ICodecAPI, (void**)&codec)))
+            return; // encoder not accessible, so clients wait for the next regular key frame
+        CComVariant force_key_frame = (unsigned int)1; // VT_UI4 type
+        codec->SetValue(&CODECAPI_AVEncVideoForceKeyFrame, &force_key_frame); // errors ignored for the same reason
+    }
+
 private:
     unsigned int             m_bitrate = 0;
     const uint64_t           m_frame_duration = 0; // frame duration in 100-nanosecond units
     int64_t                  m_time_stamp = 0;
+    const unsigned int       m_frames_per_fragment = 1; // 0 = one fragment per GOP
+    uint64_t                 m_frame_count = 0;
 
     CComPtr<IMFMediaSink>    m_media_sink;
     IMFSinkWriterPtr         m_sink_writer;
@@ -258,7 +307,9 @@ private:
 /** FFMPEG-based H.264 video encoder. */
 class VideoEncoderFF : public VideoEncoder {
 public:
-    VideoEncoderFF (unsigned int dimensions[2], unsigned int fps, IMFByteStream * socket) : VideoEncoder(dimensions, fps) {
+    /** convert_threads: Number of threads for RGBA to YUV conversion (0 = hardware concurrency capped to 8).
+        frames_per_fragment: Number of frames per MPEG4 fragment (0 = one fragment per GOP). */
+    VideoEncoderFF (unsigned int dimensions[2], unsigned int fps, IMFByteStream * socket, unsigned int convert_threads = 0, unsigned int frames_per_fragment = 1) : VideoEncoder(dimensions, fps), m_frames_per_fragment(frames_per_fragment), m_convert_pool(convert_threads) {
         //av_log_set_level(AV_LOG_VERBOSE);
 
         /* allocate the output media context */
@@ -289,7 +340,12 @@ public:
         // REF: https://ffmpeg.org/ffmpeg-formats.html#Options-8 (-movflags arguments)
         // REF: https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/movenc.c
         AVDictionary *opt = nullptr;
-        int ret = av_dict_set(&opt, "movflags", "empty_moov+default_base_moof+frag_every_frame", 0); // fragmented MP4
+        const char* frag_flag = "frag_every_frame";
+        if (m_frames_per_fragment == 0)
+            frag_flag = "frag_keyframe"; // cut fragments at keyframes (one GOP per fragment)
+        else if (m_frames_per_fragment > 1)
+            frag_flag = "frag_custom"; // fragments are cut manually in EncodeFrame
+        int ret = av_dict_set(&opt, "movflags", (std::string("empty_moov+default_base_moof+") + frag_flag).c_str(), 0); // fragmented MP4
         assert(ret >= 0);
         ret = av_dict_set_int(&opt, "movie_timescale", 1000*m_fps, 0); // match MediaFoundation timescale
         assert(ret >= 0);
@@ -316,6 +372,9 @@ public:
         }
 
         m_frame = allocate_frame(m_codec_ctx);
+        m_packet = av_packet_alloc();
+        if (!m_packet)
+            throw std::runtime_error("Could not allocate packet");
 
         // copy the stream parameters to the muxer
         ret = avcodec_parameters_from_context(/*out*/m_stream->codecpar, /*in*/m_codec_ctx);
@@ -342,12 +401,13 @@ public:
 
     ~VideoEncoderFF() {
         // flush encoder to mark end of stream
-        WriteFrameImpl(false);
+        EncodeFrame(nullptr);
 
         // write file ending (discard error codes)
         av_write_trailer(m_out_ctx);
 
         av_frame_free(&m_frame);
+        av_packet_free(&m_packet);
 
         avcodec_free_context(&m_codec_ctx);
 
@@ -367,49 +427,70 @@ public:
     }
 
     HRESULT   WriteFrameEnd () override {
-        return WriteFrameImpl(true);
+        ConvertFrame(m_rgb_buf.data(), m_frame);
+        return EncodeFrame(m_frame);
+    }
+
+    /** Allocate an additional input frame for ConvertFrame & EncodeFrame. Free with av_frame_free. */
+    AVFrame* AllocateFrame () const {
+        return allocate_frame(m_codec_ctx);
+    }
+
+    /** RGB to YCbCR conversion into an input frame. Can run on a different thread than EncodeFrame, as long as the
+        frame is not concurrently encoded. */
+    void ConvertFrame (const R8G8B8A8* rgba, AVFrame* frame) {
+        ConvertFrame(rgba, m_codec_ctx->width, PixelFormat::BGRA, frame);
+    }
+
+    /** Conversion from an image in any row order & byte order. src points to the top row, and src_stride is in pixels (negative for bottom-up images). */
+    void ConvertFrame (const R8G8B8A8* src, ptrdiff_t src_stride, PixelFormat format, AVFrame* frame) {
+        const RowBand all_rows{0, (unsigned int)m_codec_ctx->height};
+        ConvertFrame(src, src_stride, format, frame, &all_rows, 1);
+    }
+
+    /** Partial conversion of the rows in "bands" (even row numbers). The other rows keep the content of the previous conversion into "frame". */
+    void ConvertFrame (const R8G8B8A8* src, ptrdiff_t src_stride, PixelFormat format, AVFrame* frame, const RowBand* bands, size_t band_count) {
+        if (band_count == 0)
+            return; // unchanged
+
+        if (av_frame_make_writable(frame) < 0) // copies the content if still referenced by the encoder
+            exit(1);
+
+        assert(m_codec_ctx->pix_fmt == AV_PIX_FMT_YUV420P);
+
+        // SIMD kernel selected at runtime, split into row bands across the worker pool
+        const auto convert_start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < band_count; i++) {
+            const RowBand& band = bands[i];
+            assert((band.begin % 2 == 0) && (band.end % 2 == 0));
+            const int* linesize = frame->linesize;
+            uint8_t* const band_planes[3] = {frame->data[0] + band.begin*linesize[0], frame->data[1] + band.begin/2*linesize[1], frame->data[2] + band.begin/2*linesize[2]};
+            RGBAToYUV420(m_convert_pool, src + (ptrdiff_t)band.begin*src_stride, src_stride, m_codec_ctx->width, band.end - band.begin, band_planes, linesize, format);
+        }
+        TransmitterMetrics::Instance().convert_latency.ObserveSince(convert_start);
     }
 
-    HRESULT WriteFrameImpl (bool has_frame) {
+    /** Encode a converted frame & write the resulting packets. nullptr flushes the encoder at the end of the stream. */
+    HRESULT EncodeFrame (AVFrame* frame) {
+        const bool has_frame = (frame != nullptr);
         if (has_frame) {
-            if (av_frame_make_writable(m_frame) < 0)
-                exit(1);
-
-            assert(m_codec_ctx->pix_fmt == AV_PIX_FMT_YUV420P);
-
-            // RGB to YCbCR conversion
-            for (unsigned int y = 0; y < m_height; y++) {
-                for (unsigned int x = 0; x < m_width; x++) {
-                    R8G8B8A8 rgb = m_rgb_buf[y* m_codec_ctx->width + x];
-                    unsigned char Y=0, Cb=0, Cr=0;
-                    RGB_to_YCbCr(rgb, Y, Cb, Cr);
-                    // write Y value
-                    m_frame->data[0][y* m_frame->linesize[0] + x] = Y;
-                    // write subsambled Cb,Cr values
-                    if (((x % 2) == 0) && ((y % 2) == 0)) {
-                        m_frame->data[1][y/2* m_frame->linesize[1] + x/2] = Cr/4;
-                        m_frame->data[2][y/2* m_frame->linesize[2] + x/2] = Cb/4;
-                    } else {
-                        m_frame->data[1][y/2* m_frame->linesize[1] + x/2] += Cr/4;
-                        m_frame->data[2][y/2* m_frame->linesize[2] + x/2] += Cb/4;
-                    }
-                }
-            }
+            frame->pict_type = m_force_key_frame ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE; // I-frames become IDR frames with closed GOPs
+            m_force_key_frame = false;
 
-            m_frame->pts = m_next_pts;
+            frame->pts = m_next_pts;
             m_next_pts += 4; // gives sample_dur=4*256=1024 to almost match MediaFoundation
         }
 
         // encode frame
-        int ret = avcodec_send_frame(m_codec_ctx, has_frame ? m_frame : nullptr);
+        int ret = avcodec_send_frame(m_codec_ctx, frame);
         if (ret < 0)
             throw std::runtime_error("Error encoding video frame");
 
-        std::unique_ptr<AVPacket, decltype(&av_packet_unref)> pkt(av_packet_alloc(), av_packet_unref);
+        AVPacket* pkt = m_packet; // reused, so that no packet is allocated per frame
 
         // process packages
         for (;;) {
-            ret = avcodec_receive_packet(m_codec_ctx, pkt.get());
+            ret = avcodec_receive_packet(m_codec_ctx, pkt);
             if (ret == AVERROR(EAGAIN))
                 break; // not yet available
             else if (!has_frame && (ret == AVERROR_EOF))
@@ -418,13 +499,20 @@ public:
                 throw std::runtime_error("avcodec_receive_packet failed");
 
             // rescale output packet timestamp values from codec to stream timebase
-            av_packet_rescale_ts(pkt.get(), m_codec_ctx->time_base, m_stream->time_base);
+            av_packet_rescale_ts(pkt, m_codec_ctx->time_base, m_stream->time_base);
             pkt->stream_index = m_stream->index;
 
             // write compressed frame to stream
-            ret = av_interleaved_write_frame(m_out_ctx, pkt.get());
+            ret = av_interleaved_write_frame(m_out_ctx, pkt); // takes ownership of the packet data & resets "pkt"
             if (ret < 0)
                 return E_FAIL;
+
+            if ((m_frames_per_fragment > 1) && (++m_packet_count % m_frames_per_fragment == 0)) {
+                // write fragment with the packets so far ("frag_custom" mode)
+                ret = av_write_frame(m_out_ctx, nullptr);
+                if (ret < 0)
+                    return E_FAIL;
+            }
         }
 
         return S_OK;
@@ -434,6 +522,10 @@ public:
         // do nothing
     }
 
+    void RequestKeyFrame() override {
+        m_force_key_frame = true;
+    }
+
 private:
     /* Add an output stream. */
     AVCodecContext* configure_context (const AVCodec* codec) {
@@ -486,13 +578,6 @@ private:
         return frame;
     }
 
-    /** Manual RGB to YCbCr conversion, based on rgb_to_yuv in https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/movenc.c */
-    static void RGB_to_YCbCr(const R8G8B8A8 rgb, unsigned char& Y, unsigned char& Cb, unsigned char& Cr) {
-        Y = av_clip_uint8((  16000 + 257*rgb.r + 504*rgb.g +  98*rgb.b)/1000);
-        Cb = av_clip_uint8((128000 - 148*rgb.r - 291*rgb.g + 439*rgb.b)/1000);
-        Cr = av_clip_uint8((128000 + 439*rgb.r - 368*rgb.g -  71*rgb.b)/1000);
-    }
-
     /** Stream writing callback. */
     static int WritePackage(void* opaque, const uint8_t* buf, int buf_size) {
         IMFByteStream* stream = reinterpret_cast<IMFByteStream*>(opaque);
@@ -504,12 +589,17 @@ private:
     }
 
     int64_t                m_next_pts = 0; // presentation timestamp (PTS) [time_base unit] for the next frame
+    const unsigned int     m_frames_per_fragment = 1; // 0 = one fragment per GOP
+    uint64_t               m_packet_count = 0;
+    bool                   m_force_key_frame = false; ///< encode the next frame as key frame
     AVFormatContext*       m_out_ctx = nullptr;
     AVCodecContext*        m_codec_ctx = nullptr;
     AVStream*              m_stream = nullptr;
     AVFrame*               m_frame = nullptr;
+    AVPacket*              m_packet = nullptr; ///< encoder output
 
     std::vector<R8G8B8A8>  m_rgb_buf;
+    WorkerPool             m_convert_pool; ///< color conversion threads
     unsigned char*         m_out_buf = nullptr;
     CComPtr<IMFByteStream> m_socket;
 };
@@ -1,7 +1,16 @@
 #pragma once
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include "HttpParser.hpp"
+#include "Metrics.hpp"
+#include "StaticAssets.hpp"
+#include "WebSocketProtocol.hpp"
 
 #pragma comment (lib, "Ws2_32.lib")
 
@@ -14,6 +23,20 @@ static HMODULE CurrentModule() {
     return module;
 }
 
+/** Static web assets embedded into DLL/EXE. Loaded & compressed on first use. */
+static const StaticAssetCache& WebStreamAssets() {
+    static const std::unique_ptr<StaticAssetCache> assets = [] {
+        auto cache = std::make_unique<StaticAssetCache>();
+
+        HRSRC   html_info = FindResource(CurrentModule(), MAKEINTRESOURCE(IDR_WebStreamHtml), RT_RCDATA);
+        HGLOBAL html_handle = LoadResource(CurrentModule(), html_info);
+        unsigned int html_len = SizeofResource(CurrentModule(), html_info);
+        cache->Add("/", "text/html; charset=utf-8", std::string_view((char*)LockResource(html_handle), html_len));
+        return cache;
+    }();
+    return *assets;
+}
+
 enum class Connect {
     END,
     CONTINUE,
@@ -22,41 +45,195 @@ enum class Connect {
     SOCKET_FAILURE,
 };
 
-class ClientSock; // forward decl
-
-class StreamSockSetter {
+/** Loopback UDP socket connected to itself. Used to wake up a thread blocked in WSAPoll from other threads. */
+class WakeupSock final {
 public:
-    virtual ~StreamSockSetter() = default;
-    virtual void SetStreamSocket(ClientSock & s) = 0;
-    virtual void Unblock() = 0;
+    WakeupSock() {
+        m_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (m_sock == INVALID_SOCKET)
+            throw std::runtime_error("socket failure");
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0; // pick any free port
+        int addr_len = sizeof(addr);
+        if ((bind(m_sock, (sockaddr*)&addr, addr_len) == SOCKET_ERROR) || (getsockname(m_sock, (sockaddr*)&addr, &addr_len) == SOCKET_ERROR)
+            || (connect(m_sock, (sockaddr*)&addr, addr_len) == SOCKET_ERROR))
+            throw std::runtime_error("wakeup socket failure");
+
+        u_long non_blocking = 1;
+        ioctlsocket(m_sock, FIONBIO, &non_blocking);
+    }
+
+    // non-copyable
+    WakeupSock(const WakeupSock&) = delete;
+    WakeupSock& operator = (const WakeupSock&) = delete;
+
+    ~WakeupSock() {
+        closesocket(m_sock);
+    }
+
+    /** Make the socket readable. Thread safe. */
+    void Signal() {
+        char val = 0;
+        send(m_sock, &val, 1, 0); // errors ignored, since a full socket buffer already signals
+    }
+
+    /** Consume pending signals. */
+    void Drain() {
+        char buf[64];
+        while (recv(m_sock, buf, sizeof(buf), 0) > 0) {
+        }
+    }
+
+    SOCKET Socket() {
+        return m_sock;
+    }
+
+private:
+    SOCKET m_sock = INVALID_SOCKET;
 };
 
+
+/** Non-blocking client connection, driven by a single reactor thread.
+    Incoming bytes are parsed incrementally, so that requests split across packets and pipelined requests on
+    persistent connections are handled. Outgoing data is queued as reference-counted buffers, so that stream
+    fragments can be shared between connections without copying. */
 class ClientSock final {
 public:
+    using Buffer = std::shared_ptr<const std::string>;
+    using MetricsHandler = std::function<std::string()>; ///< renders the "/metrics" response body
+
     explicit ClientSock(SOCKET cs) : m_sock(cs) {
+        u_long non_blocking = 1;
+        ioctlsocket(m_sock, FIONBIO, &non_blocking);
     }
 
     // non-assignable
     ClientSock(const ClientSock&) = delete;
     ClientSock& operator = (const ClientSock&) = delete;
-    // non-movable (not safe due to threading)
+    // non-movable (referenced by the reactor)
     ClientSock(ClientSock&& other) = delete;
     ClientSock& operator = (ClientSock&& other) = delete;
 
-    Connect Handshake () {
-        // receive request
-        std::string receive_buf;
-        receive_buf.resize(1024);
-        int res = recv(m_sock, const_cast<char*>(receive_buf.data()), static_cast<int>(receive_buf.size()), 0);
-        if (res == SOCKET_ERROR)
-            return Connect::SOCKET_FAILURE;
-        if (res == 0)
-            return Connect::SOCKET_EMPTY;
-        receive_buf.resize(res);
+    /** Receive the available bytes without blocking, and respond to complete requests.
+        Returns STREAM when a video request has been answered, SOCKET_EMPTY if the peer closed the connection,
+        SOCKET_FAILURE on error and CONTINUE otherwise. */
+    Connect OnReadable () {
+        Connect result = Connect::CONTINUE;
+        for (;;) {
+            char discard[4096];
+            const bool parse = !m_streaming && !m_close_after_flush;
+            char* buf = parse ? m_parser.FreeSpace() : discard;
+            int   len = parse ? static_cast<int>(m_parser.FreeSize()) : sizeof(discard);
+
+            int res = recv(m_sock, buf, len, 0);
+            if (res == 0)
+                return Connect::SOCKET_EMPTY;
+            if (res == SOCKET_ERROR) {
+                if (WSAGetLastError() == WSAEWOULDBLOCK)
+                    return result; // no more data available
+                return Connect::SOCKET_FAILURE;
+            }
+            if (!parse) {
+                // discard data after the last response, except for WebSocket control frames from the client
+                if (m_websocket) {
+                    Connect type = OnWebSocketFrames(std::string_view(buf, res));
+                    if (type != Connect::CONTINUE)
+                        return type;
+                }
+                continue;
+            }
+
+            m_parser.Commit(res);
+            for (;;) {
+                HttpRequestParser::Result state = m_parser.Parse();
+                if (state == HttpRequestParser::Result::INCOMPLETE)
+                    break;
+
+                Connect type = Connect::CONTINUE;
+                if (state == HttpRequestParser::Result::COMPLETE) {
+                    type = Handshake(m_parser.Request());
+                    m_parser.Consume();
+                } else {
+                    printf("WARNING: Malformed HTTP request.\n");
+                    std::string header = "HTTP/1.1 400 Bad Request\r\n";
+                    header += "Content-Length: 0\r\n";
+                    header += "Connection: close\r\n";
+                    header += "\r\n";
+                    type = SendResponse(header, Connect::CONTINUE);
+                    m_close_after_flush = true;
+                }
+
+                if (type == Connect::SOCKET_FAILURE)
+                    return type;
+                if (type == Connect::STREAM)
+                    result = type;
+                if (m_streaming || m_close_after_flush)
+                    break; // ignore subsequent pipelined requests
+            }
+        }
+    }
 
-        const std::string NO_CONTENT_RESPONSE = "HTTP/1.1 204 No Content\r\n\r\n";
+    /** Respond to control frames received on a WebSocket connection. Pings are answered with a pong, and a close
+        frame is echoed before closing. Data frames & unsolicited pongs are discarded. */
+    Connect OnWebSocketFrames (std::string_view data) {
+        for (;;) {
+            WebSocketProtocol::FrameParser::Result state = m_ws_parser.Parse(data);
+            if (state == WebSocketProtocol::FrameParser::Result::INCOMPLETE)
+                return Connect::CONTINUE;
+            if (state == WebSocketProtocol::FrameParser::Result::INVALID) {
+                printf("WARNING: Malformed WebSocket frame.\n");
+                return Connect::SOCKET_FAILURE;
+            }
+
+            const std::string& payload = m_ws_parser.Payload();
+            if (m_ws_parser.FrameOpcode() == WebSocketProtocol::OP_PING) {
+                // queued after complete messages, since stream messages are queued as a whole
+                Queue(std::make_shared<const std::string>(WebSocketProtocol::FrameHeader(WebSocketProtocol::OP_PONG, payload.size()) + payload));
+                if (!Flush())
+                    return Connect::SOCKET_FAILURE;
+            } else if (m_ws_parser.FrameOpcode() == WebSocketProtocol::OP_CLOSE) {
+                // echo the status code, and close without waiting for queued stream messages
+                const std::string status = payload.substr(0, 2);
+                Queue(std::make_shared<const std::string>(WebSocketProtocol::FrameHeader(WebSocketProtocol::OP_CLOSE, status.size()) + status));
+                Flush(); // best effort
+                return Connect::SOCKET_EMPTY;
+            }
+        }
+    }
 
-        if ((receive_buf.find("Range: bytes=0-") != std::string::npos) || (receive_buf.find("GET /movie.mp4") != std::string::npos)) {
+    /** Respond to a complete HTTP request. */
+    Connect Handshake (const HttpRequest & request) {
+        if (!request.keep_alive)
+            m_close_after_flush = true; // close after responses with a known length
+
+        if (request.target == "/ws") {
+            if ((request.method != "GET") || !request.upgrade_websocket || !request.connection_upgrade || request.websocket_key.empty() || (request.websocket_version != "13")) {
+                printf("WARNING: Invalid WebSocket request.\n");
+
+                std::string header = "HTTP/1.1 400 Bad Request\r\n";
+                header += "Content-Length: 0\r\n";
+                header += "Sec-WebSocket-Version: 13\r\n";
+                header += "Connection: close\r\n";
+                header += "\r\n";
+                m_close_after_flush = true;
+                return SendResponse(header, Connect::CONTINUE);
+            }
+            printf("INFO: streaming video WebSocket request.\n");
+
+            // switch to WebSocket protocol with one binary message per init segment or fragment
+            std::string header = "HTTP/1.1 101 Switching Protocols\r\n";
+            header += "Upgrade: websocket\r\n";
+            header += "Connection: Upgrade\r\n";
+            header += "Sec-WebSocket-Accept: " + WebSocketProtocol::AcceptKey(request.websocket_key) + "\r\n";
+            header += "\r\n";
+            m_streaming = true;
+            m_websocket = true;
+            m_close_after_flush = false;
+            return SendResponse(header, Connect::STREAM);
+        } else if ((request.target == "/movie.mp4") || (request.has_range && (request.range_first == 0))) {
             printf("INFO: streaming video request.\n");
 
             // send HTTP header
@@ -66,53 +243,191 @@ public:
             header += "Access-Control-Allow-Origin: *\r\n";
             header += "Cache-Control: no-store, must-revalidate\r\n";
             header += "\r\n";
+            m_streaming = true;
+            m_close_after_flush = false; // stream until the server closes
             return SendResponse(header, Connect::STREAM);
-        } else if (receive_buf.find("GET / ") != std::string::npos) {
-            printf("INFO: index.html request.\n");
-
-            // load HTML page from resource embedded into DLL/EXE
-            HRSRC   html_info = FindResource(CurrentModule(), MAKEINTRESOURCE(IDR_WebStreamHtml), RT_RCDATA);
-            HGLOBAL html_handle = LoadResource(CurrentModule(), html_info);
-            unsigned int html_len = SizeofResource(CurrentModule(), html_info);
-
-            // send HTTP header
+        } else if ((request.target == "/metrics") && (request.method == "GET") && m_metrics_handler) {
+            // Prometheus scrape, rendered on demand
+            auto body = std::make_shared<const std::string>(m_metrics_handler());
             std::string header = "HTTP/1.1 200 OK\r\n";
-            header += "Content-Type: text/html; charset=utf-8\r\n";
-            header += "Accept-Ranges: none\r\n"; // no support for partial requests
-            header += "Cache-Control: no-store, must-revalidate\r\n";
-            header += "Content-Length: "+std::to_string(html_len)+"\r\n";
-            header += "\r\n";
-            res = send(m_sock, header.data(), static_cast<int>(header.size()), 0);
-            if (res == SOCKET_ERROR)
+            header += "Content-Type: " + std::string(PrometheusWriter::CONTENT_TYPE) + "\r\n";
+            header += "Cache-Control: no-store\r\n";
+            header += "Content-Length: " + std::to_string(body->size()) + "\r\n";
+            Queue(std::make_shared<const std::string>(std::move(header)));
+            Queue(HeaderEnd(request));
+            Queue(std::move(body));
+            if (!Flush())
                 return Connect::SOCKET_FAILURE;
-
-            res = send(m_sock, (char*)LockResource(html_handle), html_len, 0);
-            if (res == SOCKET_ERROR)
+            return Connect::CONTINUE;
+        } else if (const StaticAssetCache::Response* response = (request.method == "GET") ? WebStreamAssets().Find(request) : nullptr) {
+            // precomputed response from the asset cache, sent without copying
+            Queue(response->header);
+            Queue(HeaderEnd(request));
+            if (response->body)
+                Queue(response->body);
+            if (!Flush())
                 return Connect::SOCKET_FAILURE;
-
             return Connect::CONTINUE;
         } else {
             printf("WARNING: Unknown HTTP request.\n");
 
             std::string header = "HTTP/1.1 404 Not found\r\n";
             header += "Content-Length: 0\r\n";
-            header += "\r\n";
+            header += *HeaderEnd(request);
             return SendResponse(header, Connect::CONTINUE);
         }
     }
 
+    /** Connection header & empty line terminating a precomputed response header. */
+    static Buffer HeaderEnd(const HttpRequest & request) {
+        static const Buffer CLOSE = std::make_shared<const std::string>("Connection: close\r\n\r\n");
+        static const Buffer KEEP_ALIVE = std::make_shared<const std::string>("Connection: keep-alive\r\n\r\n");
+        static const Buffer DEFAULT = std::make_shared<const std::string>("\r\n");
+        if (!request.keep_alive)
+            return CLOSE;
+        if (request.version_minor == 0)
+            return KEEP_ALIVE;
+        return DEFAULT;
+    }
+
     Connect SendResponse(const std::string & message, Connect success_code) {
-        int res = send(m_sock, message.data(), static_cast<int>(message.size()), 0);
-        if (res == SOCKET_ERROR)
+        Queue(std::make_shared<const std::string>(message));
+        if (!Flush())
             return Connect::SOCKET_FAILURE;
 
         return success_code;
     }
 
+    /** Append a buffer to the output queue. Call Flush() to transmit. */
+    void Queue (Buffer buffer) {
+        if (buffer->empty())
+            return;
+        m_output_bytes += buffer->size();
+        m_output.push_back({std::move(buffer), std::chrono::steady_clock::now()});
+    }
+
+    /** Serve "/metrics" requests with the given handler. Requests are answered with 404 if no handler is set. */
+    void SetMetricsHandler(MetricsHandler handler) {
+        m_metrics_handler = std::move(handler);
+    }
+
+    /** Send large output buffers without copying them into the socket send buffer.
+        The socket send buffer is disabled, so that overlapped sends are transmitted directly from the queued buffers,
+        which are kept alive until the send completes. "wakeup" is signaled on completion. */
+    void EnableZeroCopy(WakeupSock & wakeup) {
+        if (m_zc_event)
+            return; // already enabled
+
+        int send_buffer_size = 0;
+        setsockopt(m_sock, SOL_SOCKET, SO_SNDBUF, (char*)&send_buffer_size, sizeof(send_buffer_size));
+
+        m_zc_event = CreateEvent(nullptr, FALSE, FALSE, nullptr); // auto-reset
+        RegisterWaitForSingleObject(&m_zc_wait, m_zc_event, OnZeroCopyComplete, &wakeup, INFINITE, WT_EXECUTEINWAITTHREAD);
+    }
+
+    /** Send as much of the queued output as the socket accepts without blocking. The queued buffers are
+        transmitted with gather sends, so that a complete fragment only requires a single send call.
+        Returns false on failure. */
+    bool Flush () {
+        while (!m_output.empty()) {
+            if (m_zc_pending) {
+                // check for completion of the overlapped send
+                DWORD byte_count = 0, flags = 0;
+                if (!WSAGetOverlappedResult(m_sock, &m_zc_overlapped, &byte_count, FALSE, &flags))
+                    return WSAGetLastError() == WSA_IO_INCOMPLETE; // still in progress
+                m_zc_pending = false;
+                ConsumeOutput(byte_count);
+                continue;
+            }
+
+            WSABUF buffers[MAX_GATHER_BUFFERS] = {};
+            DWORD buffer_count = GatherOutput(buffers);
+
+            if (m_zc_event && (m_output_bytes >= ZERO_COPY_MIN_SIZE)) {
+                // overlapped send of the queued buffers
+                m_zc_overlapped = {};
+                m_zc_overlapped.hEvent = m_zc_event;
+                int res = WSASend(m_sock, buffers, buffer_count, nullptr, 0, &m_zc_overlapped, nullptr);
+                if (res == SOCKET_ERROR) {
+                    int err = WSAGetLastError();
+                    if (err == WSAEWOULDBLOCK)
+                        return true; // retry when writable
+                    if (err != WSA_IO_PENDING)
+                        return false;
+                }
+                m_send_calls++;
+                m_zc_pending = true; // completion is also reported for immediately completed sends
+                continue;
+            }
+
+            // non-blocking send for small buffers, where copying is cheaper than locking pages
+            DWORD byte_count = 0;
+            int res = WSASend(m_sock, buffers, buffer_count, &byte_count, 0, nullptr, nullptr);
+            if (res == SOCKET_ERROR)
+                return WSAGetLastError() == WSAEWOULDBLOCK; // socket buffer full
+
+            m_send_calls++;
+            ConsumeOutput(byte_count);
+        }
+        return true;
+    }
+
+    /** True if Flush() is waiting for the socket to become writable, and not for an overlapped send to complete. */
+    bool WantsWrite() const {
+        return !m_output.empty() && !m_zc_pending;
+    }
+
+    /** True if the connection shall be closed, since the last response has been sent. */
+    bool Finished() const {
+        return m_close_after_flush && m_output.empty();
+    }
+
+    /** True if the video stream is sent as WebSocket messages instead of a plain HTTP response body. */
+    bool IsWebSocket() const {
+        return m_websocket;
+    }
+
+    /** Number of send calls that transmitted data, where each call transmits all queued buffers as a single gather send.
+        Calls rejected with WSAEWOULDBLOCK are not counted. */
+    uint64_t SendCalls() const {
+        return m_send_calls;
+    }
+
+    /** Number of buffers not yet fully sent. */
+    size_t QueuedBuffers() const {
+        return m_output.size();
+    }
+
+    /** Number of queued bytes not yet sent. */
+    size_t QueuedBytes() const {
+        return m_output_bytes;
+    }
+
+    /** Time from queuing each buffer until its last byte has been passed to the socket. */
+    const MetricHistogram& SendLatency() const {
+        return m_send_latency;
+    }
+
     ~ClientSock() {
         if (m_sock == INVALID_SOCKET)
             return; // already destroyed
 
+        if (m_zc_event) {
+            // unregister first, so that the registered wait cannot consume the completion signal awaited below
+            UnregisterWaitEx(m_zc_wait, INVALID_HANDLE_VALUE); // wait for callback completion
+            m_zc_wait = nullptr;
+        }
+        if (m_zc_pending) {
+            // queued buffers must outlive the overlapped send. Returns immediately if the send already completed,
+            // also if its completion signal was consumed by the registered wait before it was unregistered.
+            CancelIoEx((HANDLE)m_sock, &m_zc_overlapped);
+            DWORD byte_count = 0, flags = 0;
+            WSAGetOverlappedResult(m_sock, &m_zc_overlapped, &byte_count, TRUE, &flags);
+            m_zc_pending = false;
+        }
+        if (m_zc_event)
+            CloseHandle(m_zc_event);
+
         int res = shutdown(m_sock, SD_SEND);
         // deliberately discard errors
 
@@ -120,13 +435,6 @@ public:
         // deliberately discard errors
 
         m_sock = INVALID_SOCKET;
-
-        if (m_thread.joinable())
-            m_thread.join();
-    }
-
-    void Start (StreamSockSetter* parent) {
-        m_thread = std::thread(&ClientSock::ConnectionThread, this, parent);
     }
 
     SOCKET Socket() {
@@ -134,24 +442,62 @@ public:
     }
 
 private:
-    void ConnectionThread (StreamSockSetter* parent) {
-        SetThreadDescription(GetCurrentThread(), L"ConnectionThread");
-
-        Connect type;
-        do {
-            type = Handshake();
-        } while (type == Connect::CONTINUE);
-
-        if (type == Connect::SOCKET_FAILURE) {
-            parent->Unblock();
-        } else if (type == Connect::STREAM) {
-            parent->SetStreamSocket(*this);
-            parent->Unblock();
+    static constexpr size_t ZERO_COPY_MIN_SIZE = 64*1024; ///< smaller output is copied into the socket send buffer
+    static constexpr DWORD  MAX_GATHER_BUFFERS = 16;
+
+    struct QueuedBuffer {
+        Buffer                                data;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    /** Describe the queued output, starting at the first unsent byte. Returns the number of buffers. */
+    DWORD GatherOutput(WSABUF buffers[MAX_GATHER_BUFFERS]) const {
+        DWORD buffer_count = 0;
+        size_t offset = m_output_offset;
+        for (auto it = m_output.begin(); (it != m_output.end()) && (buffer_count < MAX_GATHER_BUFFERS); ++it, ++buffer_count) {
+            buffers[buffer_count].buf = const_cast<char*>(it->data->data() + offset);
+            buffers[buffer_count].len = static_cast<ULONG>(it->data->size() - offset);
+            offset = 0;
+        }
+        return buffer_count;
+    }
+
+    /** Remove sent bytes from the output queue. */
+    void ConsumeOutput(size_t byte_count) {
+        m_output_bytes -= byte_count;
+        while (byte_count > 0) {
+            size_t remaining = m_output.front().data->size() - m_output_offset;
+            if (byte_count < remaining) {
+                m_output_offset += byte_count;
+                return;
+            }
+            byte_count -= remaining;
+            m_send_latency.ObserveSince(m_output.front().queued);
+            m_output.pop_front();
+            m_output_offset = 0;
         }
     }
 
-    SOCKET      m_sock = INVALID_SOCKET;
-    std::thread m_thread;
+    static void CALLBACK OnZeroCopyComplete(void* wakeup, BOOLEAN /*timeout*/) {
+        static_cast<WakeupSock*>(wakeup)->Signal();
+    }
+
+    SOCKET             m_sock = INVALID_SOCKET;
+    bool               m_streaming = false;  ///< video request answered
+    bool               m_websocket = false;  ///< WebSocket upgrade performed
+    bool               m_close_after_flush = false; ///< non-persistent connection or malformed request
+    HttpRequestParser  m_parser;             ///< received bytes of incomplete & pipelined requests
+    WebSocketProtocol::FrameParser m_ws_parser; ///< client frames received after the WebSocket upgrade
+    std::deque<QueuedBuffer> m_output;       ///< queued output buffers
+    size_t             m_output_offset = 0;  ///< bytes of m_output.front() already sent
+    size_t             m_output_bytes = 0;   ///< unsent bytes in m_output
+    HANDLE             m_zc_event = nullptr; ///< overlapped send completion event (zero-copy enabled)
+    HANDLE             m_zc_wait = nullptr;  ///< registered wait for m_zc_event
+    WSAOVERLAPPED      m_zc_overlapped = {};
+    bool               m_zc_pending = false; ///< overlapped send in progress
+    uint64_t           m_send_calls = 0;
+    MetricHistogram    m_send_latency{MetricHistogram::LatencyBounds(), MetricHistogram::SECONDS_PER_NANOSECOND};
+    MetricsHandler     m_metrics_handler;
 };
 
 
@@ -193,6 +539,9 @@ public:
         res = listen(m_sock, SOMAXCONN);
         if (res == SOCKET_ERROR)
             throw std::runtime_error("listen failure");
+
+        u_long non_blocking = 1;
+        ioctlsocket(m_sock, FIONBIO, &non_blocking);
     }
 
     // non-assignable class (only movable)
@@ -222,10 +571,11 @@ public:
             std::terminate();
     }
 
-    std::unique_ptr<ClientSock> WaitForClient () {
+    /** Accept a pending connection without blocking. Returns nullptr if no connection is pending. */
+    std::unique_ptr<ClientSock> AcceptClient () {
         SOCKET cs = accept(m_sock, NULL, NULL);
         if (cs == INVALID_SOCKET)
-            return std::unique_ptr<ClientSock>(); // aborted
+            return std::unique_ptr<ClientSock>(); // no pending connection
 
 #if 0
         DWORD val = 1;
@@ -236,6 +586,10 @@ public:
         return std::make_unique<ClientSock>(cs);
     }
 
+    SOCKET Socket() {
+        return m_sock;
+    }
+
 private:
     SOCKET m_sock = INVALID_SOCKET;
 };
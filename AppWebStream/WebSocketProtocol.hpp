@@ -0,0 +1,246 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+
+/** WebSocket (RFC 6455) handshake, server-to-client framing & client-to-server frame parsing helpers. */
+namespace WebSocketProtocol {
+
+/** Frame opcodes. */
+enum Opcode : uint8_t {
+    OP_CONTINUATION = 0x0,
+    OP_TEXT         = 0x1,
+    OP_BINARY       = 0x2,
+    OP_CLOSE        = 0x8,
+    OP_PING         = 0x9,
+    OP_PONG         = 0xA,
+};
+
+/** SHA-1 digest (FIPS 180-4). Only used for the handshake, so simplicity is preferred over speed. */
+inline std::string Sha1(std::string_view message) {
+    auto rotl = [](uint32_t val, int bits) { return (val << bits) | (val >> (32 - bits)); };
+
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+    // pad with 0x80, zeros & 64bit big-endian bit length to a multiple of 64 bytes
+    std::string data(message);
+    data.push_back((char)0x80);
+    while (data.size() % 64 != 56)
+        data.push_back(0);
+    const uint64_t bit_len = 8ull*message.size();
+    for (int i = 7; i >= 0; i--)
+        data.push_back((char)(bit_len >> (8*i)));
+
+    for (size_t chunk = 0; chunk < data.size(); chunk += 64) {
+        uint32_t w[80] = {};
+        for (int i = 0; i < 16; i++) {
+            const uint8_t* p = (const uint8_t*)data.data() + chunk + 4*i;
+            w[i] = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+        }
+        for (int i = 16; i < 80; i++)
+            w[i] = rotl(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f = 0, k = 0;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotl(b, 30);
+            b = a;
+            a = temp;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    std::string digest(20, '\0');
+    for (int i = 0; i < 20; i++)
+        digest[i] = (char)(h[i/4] >> (24 - 8*(i%4)));
+    return digest;
+}
+
+inline std::string Base64Encode(std::string_view data) {
+    const char ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::string result;
+    result.reserve(4*((data.size() + 2)/3));
+    for (size_t i = 0; i < data.size(); i += 3) {
+        uint32_t val = uint32_t((uint8_t)data[i]) << 16;
+        if (i + 1 < data.size())
+            val |= uint32_t((uint8_t)data[i+1]) << 8;
+        if (i + 2 < data.size())
+            val |= (uint8_t)data[i+2];
+
+        result.push_back(ALPHABET[(val >> 18) & 0x3F]);
+        result.push_back(ALPHABET[(val >> 12) & 0x3F]);
+        result.push_back((i + 1 < data.size()) ? ALPHABET[(val >> 6) & 0x3F] : '=');
+        result.push_back((i + 2 < data.size()) ? ALPHABET[val & 0x3F] : '=');
+    }
+    return result;
+}
+
+/** Compute the "Sec-WebSocket-Accept" response header value from the "Sec-WebSocket-Key" request header. */
+inline std::string AcceptKey(std::string_view websocket_key) {
+    const char GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    std::string key(websocket_key);
+    key += GUID;
+    return Base64Encode(Sha1(key));
+}
+
+/** Header of an unmasked, unfragmented server-to-client frame. The payload is sent separately after the header. */
+inline std::string FrameHeader(Opcode opcode, uint64_t payload_size) {
+    std::string header;
+    header.push_back((char)(0x80 | opcode)); // FIN bit set
+    if (payload_size < 126) {
+        header.push_back((char)payload_size);
+    } else if (payload_size <= 0xFFFF) {
+        header.push_back((char)126);
+        header.push_back((char)(payload_size >> 8));
+        header.push_back((char)payload_size);
+    } else {
+        header.push_back((char)127);
+        for (int i = 7; i >= 0; i--)
+            header.push_back((char)(payload_size >> (8*i)));
+    }
+    return header;
+}
+
+/** Incremental parser for client-to-server frames, which are always masked.
+    The payload of control frames (close, ping & pong) is unmasked and made available to the caller, whereas data
+    frames are skipped by their size, since the server doesn't consume client messages. */
+class FrameParser {
+public:
+    enum class Result {
+        INCOMPLETE, ///< all bytes consumed, waiting for more data
+        CONTROL,    ///< control frame available through FrameOpcode() & Payload()
+        INVALID,    ///< protocol violation, the connection should be closed
+    };
+
+    /** Consume bytes from the start of "data" until a control frame is complete. "data" is advanced past the
+        consumed bytes, so that the remaining bytes can be passed to the next call. */
+    Result Parse(std::string_view & data) {
+        while (!data.empty()) {
+            if (!m_in_payload) {
+                m_header[m_header_len++] = (uint8_t)data[0];
+                data.remove_prefix(1);
+                if (m_header_len < HeaderSize())
+                    continue;
+                if (!ParseHeader())
+                    return Result::INVALID;
+            } else {
+                const size_t count = (size_t)std::min<uint64_t>(data.size(), m_remaining);
+                if (IsControl()) {
+                    for (size_t i = 0; i < count; i++, m_mask_pos++)
+                        m_payload.push_back(data[i] ^ m_mask[m_mask_pos % 4]);
+                }
+                data.remove_prefix(count);
+                m_remaining -= count;
+            }
+
+            if (m_remaining == 0) {
+                // frame complete
+                m_in_payload = false;
+                m_header_len = 0;
+                if (IsControl())
+                    return Result::CONTROL;
+            }
+        }
+        return Result::INCOMPLETE;
+    }
+
+    /** Opcode of the last complete control frame. */
+    Opcode FrameOpcode() const {
+        return m_opcode;
+    }
+
+    /** Unmasked payload of the last complete control frame. */
+    const std::string& Payload() const {
+        return m_payload;
+    }
+
+private:
+    static constexpr uint64_t MAX_CONTROL_PAYLOAD = 125;
+
+    bool IsControl() const {
+        return (m_opcode & 0x8) != 0;
+    }
+
+    /** Header size including extended payload length & masking key. Only valid after the first two bytes. */
+    size_t HeaderSize() const {
+        if (m_header_len < 2)
+            return 2;
+        const uint8_t len7 = m_header[1] & 0x7F;
+        size_t size = 2 + ((len7 == 126) ? 2 : (len7 == 127) ? 8 : 0);
+        if (m_header[1] & 0x80)
+            size += 4; // masking key
+        return size;
+    }
+
+    /** Validate a complete frame header. Returns false on protocol violations. */
+    bool ParseHeader() {
+        const bool fin = (m_header[0] & 0x80) != 0;
+        if (m_header[0] & 0x70)
+            return false; // reserved bits without negotiated extensions
+        if (!(m_header[1] & 0x80))
+            return false; // unmasked client frame
+
+        m_opcode = (Opcode)(m_header[0] & 0x0F);
+        switch (m_opcode) {
+        case OP_CONTINUATION: case OP_TEXT: case OP_BINARY: case OP_CLOSE: case OP_PING: case OP_PONG:
+            break;
+        default:
+            return false; // reserved opcode
+        }
+
+        const uint8_t len7 = m_header[1] & 0x7F;
+        size_t pos = 2;
+        if (len7 == 126) {
+            m_remaining = ((uint64_t)m_header[2] << 8) | m_header[3];
+            pos = 4;
+        } else if (len7 == 127) {
+            if (m_header[2] & 0x80)
+                return false; // most significant bit must be zero
+            m_remaining = 0;
+            for (pos = 2; pos < 10; pos++)
+                m_remaining = (m_remaining << 8) | m_header[pos];
+        } else {
+            m_remaining = len7;
+        }
+        for (size_t i = 0; i < 4; i++)
+            m_mask[i] = (char)m_header[pos + i];
+
+        if (IsControl() && (!fin || (m_remaining > MAX_CONTROL_PAYLOAD)))
+            return false; // control frames cannot be fragmented
+
+        m_payload.clear();
+        m_mask_pos = 0;
+        m_in_payload = true;
+        return true;
+    }
+
+    uint8_t     m_header[14] = {}; ///< received header bytes
+    size_t      m_header_len = 0;
+    bool        m_in_payload = false;
+    uint64_t    m_remaining = 0;   ///< payload bytes not yet received
+    Opcode      m_opcode = OP_CONTINUATION;
+    char        m_mask[4] = {};
+    size_t      m_mask_pos = 0;
+    std::string m_payload;         ///< unmasked control frame payload
+};
+
+} // namespace WebSocketProtocol
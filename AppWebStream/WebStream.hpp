@@ -0,0 +1,475 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Resource.h"
+#include "BoxTracker.hpp"
+#include "ByteWriter.hpp"
+#include "FragmentRing.hpp"
+#include "Metrics.hpp"
+#include "MP4StreamEditor.hpp"
+#include "WebSocket.hpp"
+#include "WebSocketProtocol.hpp"
+
+
+/** HTTP server that transmits the video stream to any number of clients.
+    All connections are served by a single reactor thread with non-blocking sockets, so the thread count doesn't grow
+    with the number of clients, and closed connections are released immediately.
+    Each top-level box in the written stream is published once into a shared fragment ring, and every streaming client
+    has a private ring cursor. The encoding cost is therefore independent of the client count.
+    The latest init segment (ftyp & moov) and all boxes since the most recent key frame fragment are cached, so that
+    clients connecting mid-stream can start decoding immediately without restarting the encoder.
+    Writing never blocks on the network. Clients whose queue of unsent fragments exceeds the configured bounds skip
+    fragments until the next key frame instead.
+    Construction doesn't wait for clients, so that the encoder can start and fill the caches before the first viewer
+    connects. Writing without clients only updates the caches.
+    Stage & per-client counters are served in Prometheus text format on "/metrics". */
+class WebStream : public ByteWriter {
+public:
+    /** Per-client transmission statistics. */
+    struct StreamClientStats {
+        uint64_t sent_bytes = 0;
+        uint64_t sent_fragments = 0;    ///< top-level boxes sent
+        uint64_t dropped_fragments = 0; ///< "moof" boxes skipped due to queue overflow or while waiting for a key frame
+        uint64_t send_calls = 0;        ///< socket send calls that transmitted data, including the HTTP response header
+    };
+
+    /** ring_capacity: Number of top-level boxes kept for all clients.
+        queue_fragments & queue_bytes: Max backlog per client before fragments are dropped. Shall be below ring_capacity.
+        zero_copy: Send large fragments directly from the ring instead of copying them into the socket send buffers. */
+    WebStream(const char * port_str, size_t ring_capacity = 256, size_t queue_fragments = 128, size_t queue_bytes = 8*1024*1024, bool zero_copy = true)
+        : m_server(port_str), m_ring(ring_capacity), m_ring_capacity(ring_capacity), m_queue_fragments(queue_fragments), m_queue_bytes(queue_bytes), m_zero_copy(zero_copy) {
+        assert(queue_fragments < ring_capacity);
+        WebStreamAssets(); // load & compress static assets before accepting clients
+        // start server thread
+        m_thread = std::thread(&WebStream::ReactorThread, this);
+    }
+
+    ~WebStream() override {
+        // let streaming clients send the remaining fragments before closing all connections
+        m_stop = true;
+        m_wakeup.Signal();
+        m_thread.join();
+    }
+
+    /** Number of open client connections. */
+    size_t ConnectionCount() const {
+        return m_connection_count;
+    }
+
+    /** Number of clients currently receiving the video stream. */
+    size_t StreamClientCount() const {
+        std::lock_guard<std::mutex> lock(m_stream_mutex);
+        return m_stream_clients.size();
+    }
+
+    /** True if no client is receiving the video stream. */
+    bool Idle() const override {
+        return StreamClientCount() == 0;
+    }
+
+    /** True once after a client has started waiting for a key frame, since the caches contain no decodable GOP, or
+        since the first client discarded the GOP encoded while idle. */
+    bool ConsumeKeyFrameRequest() override {
+        return m_key_frame_request.exchange(false);
+    }
+
+    /** Statistics for the clients currently receiving the video stream, in connection order. */
+    std::vector<StreamClientStats> GetStreamClientStats() const {
+        std::lock_guard<std::mutex> lock(m_stream_mutex);
+        std::vector<StreamClientStats> stats;
+        for (const ClientCounters& counters : m_stream_clients)
+            stats.push_back({counters.sent_bytes, counters.sent_fragments, counters.dropped_fragments, counters.send_calls});
+        return stats;
+    }
+
+    int WriteBytes(const std::string_view buffer) override {
+        // split stream into top-level boxes that are published once for all clients
+        const uint64_t buffer_pos = m_box_tracker.Position(); // stream position of "buffer"
+        uint64_t box_end = m_pending_pos;
+        m_box_tracker.Feed(buffer, [&](const BoxTracker::Box& box, std::string_view /*data*/) {
+            std::string data;
+            if (box.offset < buffer_pos) {
+                // box started in an earlier write
+                assert(box.offset == m_pending_pos);
+                data.reserve((size_t)box.size);
+                data.append(m_pending);
+                data.append(buffer.substr(0, (size_t)(box.offset + box.size - buffer_pos)));
+            } else {
+                data.assign(buffer.substr((size_t)(box.offset - buffer_pos), (size_t)box.size));
+            }
+            PublishBox(std::make_shared<const std::string>(std::move(data)));
+            box_end = box.offset + box.size;
+        });
+
+        // retain incomplete box for the next write
+        if (box_end >= buffer_pos)
+            m_pending.assign(buffer.substr((size_t)(box_end - buffer_pos)));
+        else
+            m_pending.append(buffer);
+        m_pending_pos = box_end;
+
+        return (int)buffer.size();
+    }
+
+    void Flush() override {
+    }
+
+private:
+    /** Counters updated by the reactor thread while read by GetStreamClientStats. */
+    struct ClientCounters {
+        std::atomic<uint64_t> sent_bytes = 0;
+        std::atomic<uint64_t> sent_fragments = 0;
+        std::atomic<uint64_t> dropped_fragments = 0;
+        std::atomic<uint64_t> send_calls = 0;
+    };
+
+    /** Reactor-side state of a client connection. */
+    struct Connection {
+        std::unique_ptr<ClientSock> sock;
+        bool     closed = false;
+        bool     streaming = false;
+        uint64_t cursor = 0;                  ///< next ring fragment to send
+        bool     wait_for_key_frame = false;  ///< skip fragments until decoding can start
+        uint64_t client_id = 0;               ///< "/metrics" label, assigned when streaming starts
+        std::list<ClientCounters>::iterator counters;
+    };
+
+    /** Max ring fragments queued on a streaming socket. Further fragments stay in the ring, so that the backlog
+        bounds are evaluated when the client is ready to receive more data. */
+    static constexpr size_t MAX_QUEUED_FRAGMENTS = 2;
+
+    void ReactorThread() {
+        SetThreadDescription(GetCurrentThread(), L"WebStreamReactor");
+
+        const auto DRAIN_TIMEOUT = std::chrono::seconds(5);
+        std::chrono::steady_clock::time_point drain_deadline{};
+        std::vector<WSAPOLLFD> fds;
+        for (;;) {
+            // transmit queued data & reap closed connections
+            bool drained = true;
+            for (Connection& c : m_connections) {
+                if (c.streaming && !c.closed)
+                    PumpStream(c);
+                if (!c.closed && (!c.sock->Flush() || c.sock->Finished()))
+                    c.closed = true;
+                if (c.streaming)
+                    c.counters->send_calls = c.sock->SendCalls();
+                if (c.streaming && !c.closed && ((c.cursor < m_ring.End()) || c.sock->QueuedBuffers()))
+                    drained = false;
+            }
+            ReapConnections();
+
+            int timeout_ms = -1;
+            if (m_stop) {
+                // let streaming clients receive the published fragments, with a deadline for stalled clients
+                if (drain_deadline == std::chrono::steady_clock::time_point{})
+                    drain_deadline = std::chrono::steady_clock::now() + DRAIN_TIMEOUT;
+                if (drained || (std::chrono::steady_clock::now() > drain_deadline))
+                    break;
+                timeout_ms = 10;
+            }
+
+            fds.clear();
+            fds.push_back({m_wakeup.Socket(), POLLRDNORM, 0});
+            fds.push_back({m_server.Socket(), POLLRDNORM, 0});
+            for (Connection& c : m_connections)
+                fds.push_back({c.sock->Socket(), (SHORT)(POLLRDNORM | (c.sock->WantsWrite() ? POLLWRNORM : 0)), 0});
+
+            int res = WSAPoll(fds.data(), (ULONG)fds.size(), timeout_ms);
+            if (res == SOCKET_ERROR)
+                break;
+
+            if (fds[0].revents)
+                m_wakeup.Drain();
+
+            for (size_t i = 0; i < m_connections.size(); ++i) {
+                const SHORT events = fds[i + 2].revents;
+                Connection& c = m_connections[i];
+                if (events & (POLLERR | POLLNVAL)) {
+                    c.closed = true;
+                } else if (events & (POLLRDNORM | POLLHUP)) {
+                    Connect type = c.sock->OnReadable();
+                    if (type == Connect::STREAM)
+                        AttachStream(c);
+                    else if ((type == Connect::SOCKET_FAILURE) || (type == Connect::SOCKET_EMPTY))
+                        c.closed = true;
+                }
+            }
+
+            if (fds[1].revents) {
+                // accept all pending connections
+                while (auto client = m_server.AcceptClient()) {
+                    client->SetMetricsHandler([this] { return RenderMetrics(); });
+                    m_connections.push_back(Connection{std::move(client)});
+                }
+            }
+            m_connection_count = m_connections.size();
+        }
+
+        for (Connection& c : m_connections)
+            c.closed = true;
+        ReapConnections();
+    }
+
+    /** Start streaming to a client that has requested the video. */
+    void AttachStream(Connection & c) {
+        const bool first_client = Idle();
+
+        // start with cached init segment & GOP, followed by boxes published from now on
+        {
+            std::lock_guard<std::mutex> lock(m_cache_mutex);
+            if (first_client) {
+                // GOP produced at the reduced idle frame rate, whose frames are stamped with the nominal frame duration,
+                // so that they would play back as stale, fast-forwarded content
+                m_gop_cache.clear();
+                m_gop_valid = false;
+            }
+            std::vector<FragmentRing::Fragment> boxes(m_init_cache);
+            boxes.insert(boxes.end(), m_gop_cache.begin(), m_gop_cache.end());
+            c.cursor = m_ring.End();
+            c.wait_for_key_frame = !m_gop_valid;
+            if (c.wait_for_key_frame)
+                m_key_frame_request = true; // let the encoder start a new GOP instead of waiting for the next regular one
+
+            if (!boxes.empty() && (MessageBoxCount(*boxes.back()) > 1)) {
+                // last cached box is the most recently published, so let the ring pump send it together with the next box
+                boxes.pop_back();
+                c.cursor--;
+            }
+            for (size_t i = 0; i < boxes.size();) {
+                size_t count = (std::min)(MessageBoxCount(*boxes[i]), boxes.size() - i);
+                QueueMessage(c, &boxes[i], count);
+                i += count;
+            }
+        }
+        c.streaming = true;
+        c.client_id = ++m_client_ids;
+        if (m_zero_copy)
+            c.sock->EnableZeroCopy(m_wakeup);
+        {
+            std::lock_guard<std::mutex> lock(m_stream_mutex);
+            c.counters = m_stream_clients.emplace(m_stream_clients.end());
+        }
+    }
+
+    /** Queue fragments from the ring on a streaming socket. */
+    void PumpStream(Connection & c) {
+        while (c.sock->QueuedBuffers() < MAX_QUEUED_FRAGMENTS) {
+            FragmentRing::Backlog queue;
+            FragmentRing::Fragment boxes[2];
+            boxes[0] = m_ring.Get(c.cursor, &queue);
+            if (!boxes[0]) {
+                if (c.cursor < m_ring.Begin())
+                    DisconnectSlowClient(c);
+                return; // no new fragments
+            }
+
+            if (IsBox(*boxes[0], "moof")) {
+                // only drop at fragment boundaries, so that the client never receives partial fragments
+                if (c.wait_for_key_frame) {
+                    c.wait_for_key_frame = !MP4StreamEditor::IsKeyFrameFragment(*boxes[0]);
+                } else if ((queue.fragments > m_queue_fragments) || (queue.bytes > m_queue_bytes)) {
+                    // client queue overflow: drop fragments & resync at the next key frame
+                    c.wait_for_key_frame = true;
+                }
+                if (c.wait_for_key_frame)
+                    c.counters->dropped_fragments++;
+            }
+            if (c.wait_for_key_frame && !IsBox(*boxes[0], "ftyp") && !IsBox(*boxes[0], "moov")) {
+                c.cursor++;
+                continue; // not decodable
+            }
+
+            size_t count = 1;
+            if (MessageBoxCount(*boxes[0]) > 1) {
+                // wait for the second box, so that the complete fragment is sent together
+                boxes[1] = m_ring.Get(c.cursor + 1);
+                if (!boxes[1]) {
+                    if (c.cursor + 1 < m_ring.Begin())
+                        DisconnectSlowClient(c);
+                    return;
+                }
+                count = 2;
+            }
+            c.cursor += count;
+
+            for (size_t i = 0; i < count; i++) {
+                c.counters->sent_bytes += boxes[i]->size();
+                c.counters->sent_fragments++;
+            }
+            QueueMessage(c, boxes, count);
+        }
+    }
+
+    void DisconnectSlowClient(Connection & c) {
+        printf("WARNING: Disconnecting client that is too slow to keep up with the stream.\n");
+        c.closed = true;
+    }
+
+    /** Number of consecutive top-level boxes queued together ("ftyp" & "moov", or "moof" & "mdat"). They are
+        transmitted with a single gather send, and as one message to WebSocket clients. */
+    static size_t MessageBoxCount(std::string_view box) {
+        return (IsBox(box, "ftyp") || IsBox(box, "moof")) ? 2 : 1;
+    }
+
+    /** Queue boxes on a streaming socket. WebSocket clients receive them as one binary message, where the frame
+        header is queued as a separate buffer in front of the shared boxes, so that the payload is never copied. */
+    static void QueueMessage(Connection & c, const FragmentRing::Fragment* boxes, size_t count) {
+        if (c.sock->IsWebSocket()) {
+            uint64_t payload_size = 0;
+            for (size_t i = 0; i < count; i++)
+                payload_size += boxes[i]->size();
+            c.sock->Queue(std::make_shared<const std::string>(WebSocketProtocol::FrameHeader(WebSocketProtocol::OP_BINARY, payload_size)));
+        }
+        for (size_t i = 0; i < count; i++)
+            c.sock->Queue(boxes[i]);
+    }
+
+    /** Render the "/metrics" response body. Called on the reactor thread, so the connections are read without locking. */
+    std::string RenderMetrics() const {
+        PrometheusWriter writer;
+        writer.Transmitter(TransmitterMetrics::Instance());
+        writer.Counter("webstream_fragments_published_total", "Top-level boxes published to the fragment ring.", m_ring.End());
+
+        writer.Family("webstream_connections", "gauge", "Open client connections.");
+        writer.Sample("webstream_connections", "", (double)m_connections.size());
+
+        std::vector<const Connection*> clients;
+        for (const Connection& c : m_connections) {
+            if (c.streaming && !c.closed)
+                clients.push_back(&c);
+        }
+        auto Label = [](const Connection& c) {
+            return "client=\"" + std::to_string(c.client_id) + "\"";
+        };
+
+        writer.Family("webstream_client_queue_fragments", "gauge", "Boxes published but not yet sent to the client.");
+        for (const Connection* c : clients) {
+            FragmentRing::Backlog backlog;
+            m_ring.Get(c->cursor, &backlog); // zero backlog if the client is up to date
+            writer.Sample("webstream_client_queue_fragments", Label(*c), (double)(backlog.fragments + c->sock->QueuedBuffers()));
+        }
+        writer.Family("webstream_client_queue_bytes", "gauge", "Bytes published but not yet sent to the client.");
+        for (const Connection* c : clients) {
+            FragmentRing::Backlog backlog;
+            m_ring.Get(c->cursor, &backlog);
+            writer.Sample("webstream_client_queue_bytes", Label(*c), (double)(backlog.bytes + c->sock->QueuedBytes()));
+        }
+        writer.Family("webstream_client_sent_bytes_total", "counter", "Bytes of the video stream sent to the client.");
+        for (const Connection* c : clients)
+            writer.Sample("webstream_client_sent_bytes_total", Label(*c), (double)c->counters->sent_bytes);
+        writer.Family("webstream_client_dropped_fragments_total", "counter", "Fragments skipped due to queue overflow or while waiting for a key frame.");
+        for (const Connection* c : clients)
+            writer.Sample("webstream_client_dropped_fragments_total", Label(*c), (double)c->counters->dropped_fragments);
+        writer.Family("webstream_client_send_latency_seconds", "histogram", "Time from queuing a buffer on the socket until it has been sent.");
+        for (const Connection* c : clients)
+            writer.HistogramSamples("webstream_client_send_latency_seconds", Label(*c), c->sock->SendLatency());
+
+        return writer.Text();
+    }
+
+    /** Release closed connections. */
+    void ReapConnections() {
+        for (size_t i = 0; i < m_connections.size();) {
+            Connection& c = m_connections[i];
+            if (!c.closed) {
+                ++i;
+                continue;
+            }
+
+            if (c.streaming) {
+                std::lock_guard<std::mutex> lock(m_stream_mutex);
+                m_stream_clients.erase(c.counters);
+            }
+            m_connections[i] = std::move(m_connections.back());
+            m_connections.pop_back();
+        }
+        m_connection_count = m_connections.size();
+    }
+
+    static bool IsBox(std::string_view box, const char type[4]) {
+        return (box.size() >= 8) && IsAtomType(box.data(), type);
+    }
+
+    /** Update init segment & GOP caches before publishing a complete top-level box. */
+    void PublishBox(FragmentRing::Fragment box) {
+        std::lock_guard<std::mutex> lock(m_cache_mutex);
+
+        if (IsBox(*box, "moof")) {
+            m_fragment_bytes = box->size();
+        } else if (IsBox(*box, "mdat") && m_fragment_bytes) {
+            TransmitterMetrics::Instance().fragment_bytes.Observe(m_fragment_bytes + box->size());
+            m_fragment_bytes = 0;
+        }
+
+        if (IsBox(*box, "ftyp") || IsBox(*box, "moov")) {
+            // new init segment (stream restart)
+            if (IsBox(*box, "ftyp") || m_init_complete) {
+                m_init_cache.clear();
+                m_init_complete = false;
+            }
+            m_init_cache.push_back(box);
+            m_init_complete |= IsBox(*box, "moov");
+
+            m_gop_cache.clear();
+            m_gop_valid = false;
+        } else {
+            if (IsBox(*box, "moof") && MP4StreamEditor::IsKeyFrameFragment(*box)) {
+                // decoding can start here
+                m_gop_cache.clear();
+                m_gop_valid = true;
+            }
+
+            if (m_gop_valid) {
+                if (m_gop_cache.size() < m_ring_capacity) {
+                    m_gop_cache.push_back(box);
+                } else {
+                    // GOP too long to cache, so new clients wait for the next key frame
+                    m_gop_cache.clear();
+                    m_gop_valid = false;
+                }
+            }
+        }
+
+        m_ring.Publish(std::move(box));
+        m_wakeup.Signal();
+
+#ifndef _NDEBUG
+        printf("."); // log "x" to signal that a box have been published
+#endif
+    }
+
+    ServerSock              m_server;  ///< listens for new connections
+    WakeupSock              m_wakeup;  ///< wakes up the reactor thread
+    FragmentRing            m_ring;    ///< recently published boxes shared by all streaming clients
+    const size_t            m_ring_capacity = 0;
+    const size_t            m_queue_fragments = 0; ///< max unsent fragments per client
+    const size_t            m_queue_bytes = 0;     ///< max unsent bytes per client
+    const bool              m_zero_copy = false;
+
+    BoxTracker              m_box_tracker;     ///< top-level box boundaries in the written stream
+    std::string             m_pending;         ///< start of an incomplete box
+    uint64_t                m_pending_pos = 0; ///< stream position of m_pending
+    uint64_t                m_fragment_bytes = 0; ///< size of the last "moof" until its "mdat" is published
+
+    std::mutex              m_cache_mutex;
+    std::vector<FragmentRing::Fragment> m_init_cache;  ///< latest "ftyp" & "moov"
+    bool                    m_init_complete = false;
+    std::vector<FragmentRing::Fragment> m_gop_cache;   ///< boxes since the most recent key frame "moof"
+    bool                    m_gop_valid = false;       ///< m_gop_cache starts with a key frame
+    std::atomic<bool>       m_key_frame_request = false;
+    std::atomic<bool>       m_stop = false;
+    mutable std::mutex      m_stream_mutex;
+    std::list<ClientCounters> m_stream_clients; ///< one entry per streaming client (list for stable addresses)
+    std::atomic<size_t>     m_connection_count = 0;
+    std::vector<Connection> m_connections;      ///< reactor thread only
+    uint64_t                m_client_ids = 0;   ///< last assigned Connection::client_id
+    std::thread             m_thread;
+};
@@ -0,0 +1,133 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <Windows.h>
+
+
+/** Persistent pool of worker threads for data-parallel loops.
+    The threads are started once and reused, so that per-frame work avoids thread creation overhead. */
+class WorkerPool {
+public:
+    /** thread_count includes the calling thread. 0 = hardware concurrency capped to 8. */
+    explicit WorkerPool(unsigned int thread_count = 0) {
+        if (thread_count == 0)
+            thread_count = std::clamp(std::thread::hardware_concurrency(), 1u, 8u);
+
+        for (unsigned int i = 1; i < thread_count; i++)
+            m_threads.emplace_back(&WorkerPool::WorkerThread, this);
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_shutdown = true;
+        }
+        m_start.notify_all();
+
+        for (std::thread& t : m_threads)
+            t.join();
+    }
+
+    // non-copyable
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator = (const WorkerPool&) = delete;
+
+    /** Number of threads, including the calling thread. */
+    unsigned int Size() const {
+        return (unsigned int)m_threads.size() + 1;
+    }
+
+    /** Call func(idx) for idx in [0, task_count). The calling thread also execute tasks.
+        Blocks until all tasks have completed. Not reentrant.
+        "func" is passed by reference to the workers without type erasure into a std::function, so that large lambda
+        captures don't cause a heap allocation per call. */
+    template <class FUNC>
+    void ParallelFor(unsigned int task_count, const FUNC& func) {
+        RunParallel(task_count, [](const void* context, unsigned int idx) { (*static_cast<const FUNC*>(context))(idx); }, &func);
+    }
+
+private:
+    using TaskFunc = void (*)(const void* context, unsigned int idx);
+
+    void RunParallel(unsigned int task_count, TaskFunc func, const void* context) {
+        if ((task_count <= 1) || m_threads.empty()) {
+            for (unsigned int i = 0; i < task_count; i++)
+                func(context, i);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_func = func;
+            m_context = context;
+            m_task_count = task_count;
+            m_next_task = 0;
+            m_busy_workers = (unsigned int)m_threads.size();
+            m_generation++;
+        }
+        m_start.notify_all();
+
+        RunTasks(func, context, task_count);
+
+        // wait for workers to finish their tasks
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [this] { return m_busy_workers == 0; });
+        m_func = nullptr;
+        m_context = nullptr;
+    }
+
+    void RunTasks(TaskFunc func, const void* context, unsigned int task_count) {
+        for (;;) {
+            unsigned int idx = m_next_task.fetch_add(1);
+            if (idx >= task_count)
+                break;
+            func(context, idx);
+        }
+    }
+
+    void WorkerThread() {
+        SetThreadDescription(GetCurrentThread(), L"WorkerPool");
+
+        uint64_t generation = 0;
+        for (;;) {
+            TaskFunc func = nullptr;
+            const void* context = nullptr;
+            unsigned int task_count = 0;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_start.wait(lock, [&] { return m_shutdown || (m_generation != generation); });
+                if (m_shutdown)
+                    return;
+
+                generation = m_generation;
+                func = m_func;
+                context = m_context;
+                task_count = m_task_count;
+            }
+
+            RunTasks(func, context, task_count);
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_busy_workers--;
+            }
+            m_done.notify_one();
+        }
+    }
+
+    std::vector<std::thread>  m_threads;
+    std::mutex                m_mutex;
+    std::condition_variable   m_start;
+    std::condition_variable   m_done;
+    bool                      m_shutdown = false;
+    uint64_t                  m_generation = 0;   ///< incremented for each ParallelFor call
+    TaskFunc                  m_func = nullptr;
+    const void*               m_context = nullptr; ///< argument of m_func
+    unsigned int              m_task_count = 0;
+    std::atomic<unsigned int> m_next_task = 0;
+    unsigned int              m_busy_workers = 0;
+};
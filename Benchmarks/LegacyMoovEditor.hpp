@@ -0,0 +1,491 @@
+#pragma once
+#include <cassert>
+#include <cstdio>
+#include <string_view>
+#include <tuple>
+#include "../AppWebStream/MP4Utils.hpp"
+
+
+/** Hand-written "moov" parsing & editing that MP4StreamEditor used before the compile-time box schema (BoxSchema.hpp).
+    Kept unchanged as baseline for MoovEditingBenchmark. Only supports the Media Foundation layout without optional atoms. */
+struct LegacyMoovEditor {
+    static constexpr uint32_t HEADER_SIZE = 8; // atom header size (4bytes size + 4byte name)
+
+    struct {
+        uint64_t startTime = 0;
+        uint32_t timeScale = 0;
+    }      m_time;
+    double m_dpi = 0;
+    matrix m_xform;
+
+    bool ParseMoov(const std::string_view buffer) {
+        const char* ptr = (char*)buffer.data();
+
+        assert(IsAtomType(ptr, "moov"));
+        assert(GetAtomSize(ptr) <= buffer.size());
+        ptr += HEADER_SIZE; // skip size & type
+
+        // NOTE: Optional "prfl" atom here
+
+        {
+            // entering "mvhd" atom
+            // REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/iso14496/part12/MovieHeaderBox.java
+            assert(IsAtomType(ptr, "mvhd"));
+            uint32_t mvhd_len = GetAtomSize(ptr);
+            ptr += HEADER_SIZE; // skip size & type
+
+            auto version = DeSerialize<uint8_t>(ptr);
+            ptr += 1;
+
+            //uint32_t flags = DeSerialize<uint24_t>(ptr);
+            ptr += sizeof(uint24_t);
+
+            uint64_t modifyTime = 0;
+            std::tie(m_time.startTime, modifyTime, ptr) = ParseCreateModifyTime(ptr, version);
+
+            // read timescale (number of time units per second)
+            m_time.timeScale = DeSerialize<uint32_t>(ptr); // 1000*fps
+            ptr += 4;
+
+            uint64_t total_duration = 0; // [timescale unit]
+            if (version == 1) {
+                total_duration = DeSerialize<uint64_t>(ptr);
+                ptr += 8;
+            } else {
+                total_duration = DeSerialize<uint32_t>(ptr);
+                ptr += 4;
+            }
+
+            //double rate = ReadFixed1616(ptr); // preferred playback rate (16+16 fraction) (typ 1.0)
+            ptr += 4;
+
+            //double volume = ReadFixed88(ptr); // master volume of file (8+8 fraction) (typ 1.0)
+            ptr += 2;
+
+            ptr += sizeof(uint16_t); // reserved
+            ptr += sizeof(uint32_t) * 2; // reserved
+
+            // matrix to map points from one coordinate space into another
+            m_xform.Read(ptr);
+            ptr += matrix::SIZE;
+
+            ptr += sizeof(uint32_t) * 6; // reserved
+
+            //auto nextTrackId = DeSerialize<uint32_t>(ptr); // (typ 2)
+            ptr += 4;
+
+            // end of "mvhd" atom
+            assert(ptr == buffer.data() + HEADER_SIZE + mvhd_len); mvhd_len;
+        }
+
+        // NOTE: Optional "clip" atom here
+
+        //NOTE: It might be more than one "track" atom here
+        {
+            // entering "trak" atom
+            assert(IsAtomType(ptr, "trak"));
+            //uint32_t trak_len = GetAtomSize(ptr);
+            ptr += HEADER_SIZE; // skip size & type
+
+            // NOTE: Optional "prfl" atom here
+
+            {
+                // skip over "tkhd" atom
+                // REF: https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/mov.c#L5478
+                assert(IsAtomType(ptr, "tkhd"));
+                uint32_t tkhd_len = GetAtomSize(ptr);
+                ptr += tkhd_len;
+            }
+
+            // NOTE: Optional "tapt", "clip", "matt", "edts", "tref", "txas", "load", "imap" atoms here
+
+            {
+                // entring "mdia" atom
+                assert(IsAtomType(ptr, "mdia"));
+                //uint32_t mdia_len = GetAtomSize(ptr);
+                ptr += HEADER_SIZE; // skip size & type
+
+                {
+                    // skip over "mdhd" atom
+                    // REF: https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/mov.c#L1864
+                    assert(IsAtomType(ptr, "mdhd"));
+                    uint32_t mdhd_len = GetAtomSize(ptr);
+                    ptr += mdhd_len;
+                }
+
+                // NOTE: Optional "elng" atom here
+
+                {
+                    // skip over "hdlr" atom
+                    assert(IsAtomType(ptr, "hdlr"));
+                    uint32_t hdlr_len = GetAtomSize(ptr);
+                    ptr += hdlr_len;
+                }
+
+                {
+                    // entering "minf" atom
+                    assert(IsAtomType(ptr, "minf"));
+                    //uint32_t minf_len = GetAtomSize(ptr);
+                    ptr += HEADER_SIZE; // skip size & type
+
+                    {
+                        // skip over "vmhd" atom
+                        assert(IsAtomType(ptr, "vmhd"));
+                        uint32_t vmhd_len = GetAtomSize(ptr);
+                        ptr += vmhd_len;
+                    }
+
+                    // NOTE: Optional "hdlr" atom here
+
+                    {
+                        // skip over "dinf" atom
+                        assert(IsAtomType(ptr, "dinf"));
+                        uint32_t dinf_len = GetAtomSize(ptr);
+                        ptr += dinf_len;
+                    }
+
+                    {
+                        // entering "stbl" atmom
+                        assert(IsAtomType(ptr, "stbl"));
+                        //uint32_t stbl_len = GetAtomSize(ptr);
+                        ptr += HEADER_SIZE; // skip size & type
+
+                        {
+                            // entering "stsd" atom (see https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/movenc.c)
+                            // REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/iso14496/part12/SampleDescriptionBox.java
+                            assert(IsAtomType(ptr, "stsd"));
+                            //uint32_t stsd_len = GetAtomSize(ptr);
+                            ptr += HEADER_SIZE; // skip size & type
+
+                            auto version = DeSerialize<uint8_t>(ptr);
+                            assert(version == 0); version;
+                            ptr += sizeof(uint8_t);
+
+                            uint32_t flags = DeSerialize<uint24_t>(ptr);
+                            assert(flags == 0); flags;
+                            ptr += sizeof(uint24_t);
+
+                            uint32_t entryCount = DeSerialize<uint32_t>(ptr);
+                            ptr += sizeof(uint32_t);
+
+                            for (uint32_t entry = 0; entry < entryCount; entry++) {
+                                // entering "avc1" atom
+                                // REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/sampleentry/VisualSampleEntry.java
+                                assert(IsAtomType(ptr, "avc1"));
+                                //uint32_t avc1_len = GetAtomSize(ptr);
+                                ptr += HEADER_SIZE; // skip size & type
+
+                                ptr += 6; // skip first 6 bytes
+
+                                //auto dataReferenceIdx = DeSerialize<uint16_t>(ptr);
+                                ptr += sizeof(uint16_t);
+
+                                auto reserved = DeSerialize<uint16_t>(ptr);
+                                assert(reserved == 0);
+                                ptr += sizeof(uint16_t);
+
+                                reserved = DeSerialize<uint16_t>(ptr);
+                                assert(reserved == 0);
+                                ptr += sizeof(uint16_t);
+
+                                ptr += 3 * sizeof(uint32_t); // skip 3 "predefined" values that should all be zero
+
+                                //auto width = DeSerialize<uint16_t>(ptr);
+                                ptr += 2;
+                                //auto height = DeSerialize<uint16_t>(ptr);
+                                ptr += 2;
+                                //printf("avc1 atom resolution: (%u, %u)\n", width, height);
+
+                                // read horizontal and vertical video DPI in fixed-point 16+16 format
+                                m_dpi = ReadFixed1616(ptr);
+                                double vdpi = ReadFixed1616(ptr + 4);
+                                assert(m_dpi == vdpi); vdpi; // same horizontal and vertical DPI
+
+                                // ignore the remaining parameters
+                            }
+                        }
+
+                        // ignore the remaining parameters
+                    }
+                }
+
+                // NOTE: Optional "udta" atom here
+            }
+        }
+
+        //NOTE: Ignore remaining "udta", "ctab", ,"cmov", "rmra" child atoms
+
+        return true;
+    }
+
+    void ModifyMoov (std::string_view buffer) {
+        char* ptr = (char*)buffer.data();
+        // REF: https://developer.apple.com/documentation/quicktime-file-format/movie_atom
+        assert(IsAtomType(ptr, "moov"));
+        assert(GetAtomSize(ptr) == buffer.size());
+        ptr += HEADER_SIZE; // skip size & type
+
+        // NOTE: Optional "prfl" atom here
+
+        {
+            // entering "mvhd" atom
+            // REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/iso14496/part12/MovieHeaderBox.java
+            assert(IsAtomType(ptr, "mvhd"));
+            uint32_t mvhd_len = GetAtomSize(ptr);
+            ptr += HEADER_SIZE; // skip size & type
+
+            auto version = DeSerialize<uint8_t>(ptr);
+            ptr += 1;
+
+            //uint32_t flags = DeSerialize<uint24_t>(ptr);
+            ptr += sizeof(uint24_t);
+
+            ptr = UpdateCreateModifyTime(ptr, version, m_time.startTime);
+
+            // read timescale (number of time units per second)
+            m_time.timeScale = DeSerialize<uint32_t>(ptr); // 1000*fps
+            ptr += 4;
+
+            uint64_t duration = 0;
+            if (version == 1) {
+                duration = DeSerialize<uint64_t>(ptr);
+                ptr += 8;
+            } else {
+                duration = DeSerialize<uint32_t>(ptr);
+                ptr += 4;
+            }
+            
+#if 0
+            double rate = ReadFixed1616(ptr); // preferred playback rate (16+16 fraction) (typ 1.0)
+            WriteFixed1616(ptr, 2 * rate); // set 2x playback rate (doesn't seem to reduce latency)
+#endif
+            ptr += 4;
+
+            //double volume = ReadFixed88(ptr); // master volume of file (8+8 fraction) (typ 1.0)
+            ptr += 2;
+
+            ptr += sizeof(uint16_t); // reserved
+            ptr += sizeof(uint32_t) * 2; // reserved
+
+            // matrix to map points from one coordinate space into another
+            ptr = m_xform.Write(ptr);
+
+            ptr += sizeof(uint32_t) * 6; // reserved
+
+            //auto nextTrackId = DeSerialize<uint32_t>(ptr); // (typ 2)
+            ptr += 4;
+
+            // end of "mvhd" atom
+            assert(ptr == buffer.data() + HEADER_SIZE + mvhd_len); mvhd_len;
+        }
+
+        // NOTE: Optional "clip" atom here
+
+        //NOTE: It might be more than one "track" atom here
+        {
+            // entering "trak" atom
+            assert(IsAtomType(ptr, "trak"));
+            //uint32_t trak_len = GetAtomSize(ptr);
+            ptr += HEADER_SIZE; // skip size & type
+
+            // NOTE: Optional "prfl" atom here
+
+            {
+                // partially parse "tkhd" atom
+                // REF: https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/mov.c#L5478
+                assert(IsAtomType(ptr, "tkhd"));
+                uint32_t tkhd_len = GetAtomSize(ptr);
+
+                char* tkhd_ptr = ptr + HEADER_SIZE;
+
+                auto version = DeSerialize<uint8_t>(tkhd_ptr);
+                tkhd_ptr += 1;
+
+                //uint32_t flags = DeSerialize<uint24_t>(tkhd_ptr);
+                tkhd_ptr += sizeof(uint24_t);
+
+                tkhd_ptr = UpdateCreateModifyTime(tkhd_ptr, version, m_time.startTime);
+
+                ptr += tkhd_len;
+            }
+
+            // NOTE: Optional "tapt", "clip", "matt", "edts", "tref", "txas", "load", "imap" atoms here
+
+            {
+                // entring "mdia" atom
+                assert(IsAtomType(ptr, "mdia"));
+                //uint32_t mdia_len = GetAtomSize(ptr);
+                ptr += HEADER_SIZE; // skip size & type
+
+                {
+                    // partially parse "mdhd" atom
+                    // REF: https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/mov.c#L1864
+                    assert(IsAtomType(ptr, "mdhd"));
+                    uint32_t mdhd_len = GetAtomSize(ptr);
+                    char* mdhd_ptr = ptr + HEADER_SIZE;
+
+                    auto version = DeSerialize<uint8_t>(mdhd_ptr);
+                    mdhd_ptr += 1;
+
+                    //uint32_t flags = DeSerialize<uint24_t>(mdhd_ptr);
+                    mdhd_ptr += sizeof(uint24_t);
+
+                    mdhd_ptr = UpdateCreateModifyTime(mdhd_ptr, version, m_time.startTime);
+
+                    ptr += mdhd_len;
+                }
+
+                // NOTE: Optional "elng" atom here
+
+                {
+                    // skip over "hdlr" atom
+                    assert(IsAtomType(ptr, "hdlr"));
+                    uint32_t hdlr_len = GetAtomSize(ptr);
+                    ptr += hdlr_len;
+                }
+
+                {
+                    // entering "minf" atom
+                    assert(IsAtomType(ptr, "minf"));
+                    //uint32_t minf_len = GetAtomSize(ptr);
+                    ptr += HEADER_SIZE; // skip size & type
+
+                    {
+                        // skip over "vmhd" atom
+                        assert(IsAtomType(ptr, "vmhd"));
+                        uint32_t vmhd_len = GetAtomSize(ptr);
+                        ptr += vmhd_len;
+                    }
+
+                    // NOTE: Optional "hdlr" atom here
+
+                    {
+                        // skip over "dinf" atom
+                        assert(IsAtomType(ptr, "dinf"));
+                        uint32_t dinf_len = GetAtomSize(ptr);
+                        ptr += dinf_len;
+                    }
+
+                    {
+                        // entering "stbl" atmom
+                        assert(IsAtomType(ptr, "stbl"));
+                        //uint32_t stbl_len = GetAtomSize(ptr);
+                        ptr += HEADER_SIZE; // skip size & type
+
+                        {
+                            // entering "stsd" atom (see https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/movenc.c)
+                            // REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/iso14496/part12/SampleDescriptionBox.java
+                            assert(IsAtomType(ptr, "stsd"));
+                            //uint32_t stsd_len = GetAtomSize(ptr);
+                            ptr += HEADER_SIZE; // skip size & type
+
+                            auto version = DeSerialize<uint8_t>(ptr);
+                            assert(version == 0); version;
+                            ptr += sizeof(uint8_t);
+
+                            uint32_t flags = DeSerialize<uint24_t>(ptr);
+                            assert(flags == 0); flags;
+                            ptr += sizeof(uint24_t);
+
+                            uint32_t entryCount = DeSerialize<uint32_t>(ptr);
+                            ptr += sizeof(uint32_t);
+
+                            for (uint32_t entry = 0; entry < entryCount; entry++) {
+                                // entering VisualSampleEntry atom with codingname="avc1"
+                                // REF: https://github.com/sannies/mp4parser/blob/master/isoparser/src/main/java/org/mp4parser/boxes/sampleentry/VisualSampleEntry.java
+                                assert(IsAtomType(ptr, "avc1"));
+                                //uint32_t avc1_len = GetAtomSize(ptr);
+                                ptr += HEADER_SIZE; // skip size & type
+
+                                ptr += 6; // skip first 6 bytes
+
+                                //auto dataReferenceIdx = DeSerialize<uint16_t>(ptr);
+                                ptr += sizeof(uint16_t);
+
+                                auto reserved = DeSerialize<uint16_t>(ptr);
+                                assert(reserved == 0);
+                                ptr += sizeof(uint16_t);
+
+                                reserved = DeSerialize<uint16_t>(ptr);
+                                assert(reserved == 0);
+                                ptr += sizeof(uint16_t);
+
+                                ptr += 3 * sizeof(uint32_t); // skip 3 "predefined" values that should all be zero
+
+                                auto width = DeSerialize<uint16_t>(ptr);
+                                ptr += 2;
+                                auto height = DeSerialize<uint16_t>(ptr);
+                                ptr += 2;
+#ifndef NDEBUG
+                                printf("avc1 frame resolution: (%u x %u)\n", width, height);
+#endif
+
+#if 0
+                                // DPI hardcoded to 72dpi (0x00480000) in FFMPEG encoder (https://github.com/FFmpeg/FFmpeg/blob/master/libavformat/movenc.c)
+                                // It also appear to be hardocded in the MF encoder. I've at least not found a parameter for adjusting it.
+                                double dpi = ReadFixed1616(ptr);
+                                assert(dpi == 72); // 72.00 horizontal DPI
+                                dpi = ReadFixed1616(ptr + 4);
+                                assert(dpi == 72); // 72.00 vertical DPI
+#endif
+                                // update video DPI in fixed-point 16+16 format
+                                WriteFixed1616(ptr, m_dpi);    // horizontal DPI
+                                WriteFixed1616(ptr + 4, m_dpi);// vertical DPI
+
+                                // ignore the remaining parameters
+                            }
+                        }
+
+                        // ignore the remaining parameters
+                    }
+                }
+
+                // NOTE: Optional "udta" atom here
+            }
+        }
+
+        //NOTE: Ignore remaining "udta", "ctab", ,"cmov", "rmra" child atoms
+    }
+
+    static char* UpdateCreateModifyTime(char* ptr, uint8_t version, uint64_t newTime) {
+        // seconds since Fri Jan 1 00:00:00 1904
+        if (version == 1) {
+            Serialize<uint64_t>(ptr, newTime);
+            ptr += 8;
+
+            Serialize<uint64_t>(ptr, newTime);
+            ptr += 8;
+        }
+        else {
+            Serialize<uint32_t>(ptr, (uint32_t)newTime);
+            ptr += 4;
+
+            Serialize<uint32_t>(ptr, (uint32_t)newTime);
+            ptr += 4;
+        }
+
+        return ptr;
+    }
+
+    static std::tuple<uint64_t, uint64_t, const char*> ParseCreateModifyTime(const char* ptr, uint8_t version) {
+        // seconds since Fri Jan 1 00:00:00 1904
+        uint64_t creationTime = 0;
+        uint64_t modificationTime = 0;
+        if (version == 1) {
+            creationTime = DeSerialize<uint64_t>(ptr);
+            ptr += 8;
+
+            modificationTime = DeSerialize<uint64_t>(ptr);
+            ptr += 8;
+        }
+        else {
+            creationTime = DeSerialize<uint32_t>(ptr);
+            ptr += 4;
+
+            modificationTime = DeSerialize<uint32_t>(ptr);
+            ptr += 4;
+        }
+
+        return std::tie(creationTime, modificationTime, ptr);
+    }
+};
@@ -0,0 +1,883 @@
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <psapi.h>
+#include <tlhelp32.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+#include "../AppWebStream/ColorConvert.hpp"
+#include "../AppWebStream/FramePacer.hpp"
+#include "../AppWebStream/FramePipeline.hpp"
+#include "../AppWebStream/HttpParser.hpp"
+#include "../AppWebStream/MP4StreamEditor.hpp"
+#include "../AppWebStream/TileHash.hpp"
+#include "../AppWebStream/WebStream.hpp"
+#include "../UnitTests/MP4Samples.hpp"
+#include "LegacyMoovEditor.hpp"
+
+#pragma comment (lib, "Psapi.lib")
+
+
+/** Call "func" repeatedly for at least "min_duration" and return the average duration per call [seconds]. */
+template <class FUNC>
+static double TimeIt(FUNC func, std::chrono::milliseconds min_duration = std::chrono::milliseconds(500)) {
+    using clock = std::chrono::steady_clock;
+
+    func(); // warm-up
+
+    unsigned int iterations = 0;
+    auto start = clock::now();
+    auto elapsed = clock::duration::zero();
+    do {
+        func();
+        iterations++;
+        elapsed = clock::now() - start;
+    } while (elapsed < min_duration);
+
+    return std::chrono::duration<double>(elapsed).count() / iterations;
+}
+
+
+void ColorConversionBenchmark() {
+    printf("* RGBA to YUV420 conversion (1920x1080):\n");
+    const unsigned int width = 1920;
+    const unsigned int height = 1080;
+
+    std::vector<R8G8B8A8> rgba(width * height);
+    std::mt19937 rng(42);
+    for (R8G8B8A8& px : rgba)
+        px = {(unsigned char)rng(), (unsigned char)rng(), (unsigned char)rng(), 255};
+
+    // same plane alignment as av_frame_get_buffer(frame, 32)
+    const int linesize[3] = {(int)width, (int)width/2, (int)width/2};
+    std::vector<uint8_t> planes_buf[3] = {std::vector<uint8_t>(width*height), std::vector<uint8_t>(width*height/4), std::vector<uint8_t>(width*height/4)};
+    uint8_t* const planes[3] = {planes_buf[0].data(), planes_buf[1].data(), planes_buf[2].data()};
+
+    double ref_time = TimeIt([&] {
+        RGBAToYUV420_Reference(rgba.data(), width, width, height, planes, linesize);
+    });
+    printf("  Reference loop: %7.3f ms/frame\n", 1000*ref_time);
+
+    std::pair<const char*, ColorConvertKernel> kernels[] = {
+        {"Scalar", ColorConvertKernel::Scalar},
+#ifdef COLOR_CONVERT_X86
+        {"SSE2  ", ColorConvertKernel::SSE2},
+        {"AVX2  ", ColorConvertKernel::AVX2},
+#endif
+    };
+    for (auto& kernel : kernels) {
+#ifdef COLOR_CONVERT_X86
+        if ((kernel.second == ColorConvertKernel::AVX2) && !CpuSupportsAVX2())
+            continue;
+#endif
+        double time = TimeIt([&] {
+            RGBAToYUV420(kernel.second, rgba.data(), width, width, height, planes, linesize);
+        });
+        printf("  %s        : %7.3f ms/frame (%.1fx speedup)\n", kernel.first, 1000*time, ref_time/time);
+    }
+}
+
+
+void ParallelColorConversionBenchmark() {
+    printf("* Row-parallel RGBA to YUV420 conversion:\n");
+    const unsigned int RESOLUTIONS[][2] = {{1920, 1080}, {2560, 1440}, {3840, 2160}};
+    const unsigned int THREAD_COUNTS[] = {1, 2, 4, 8};
+
+    std::mt19937 rng(42);
+    for (auto& res : RESOLUTIONS) {
+        const unsigned int width = res[0];
+        const unsigned int height = res[1];
+
+        std::vector<R8G8B8A8> rgba(width * height);
+        for (R8G8B8A8& px : rgba)
+            px = {(unsigned char)rng(), (unsigned char)rng(), (unsigned char)rng(), 255};
+
+        const int linesize[3] = {(int)width, (int)width/2, (int)width/2};
+        std::vector<uint8_t> planes_buf[3] = {std::vector<uint8_t>(width*height), std::vector<uint8_t>(width*height/4), std::vector<uint8_t>(width*height/4)};
+        uint8_t* const planes[3] = {planes_buf[0].data(), planes_buf[1].data(), planes_buf[2].data()};
+
+        double single_time = 0;
+        for (unsigned int threads : THREAD_COUNTS) {
+            WorkerPool pool(threads);
+            double time = TimeIt([&] {
+                RGBAToYUV420(pool, rgba.data(), width, width, height, planes, linesize);
+            });
+            if (threads == 1)
+                single_time = time;
+
+            printf("  %ux%u, %u thread(s): %7.3f ms/frame, %7.1f frames/s, %6.0f Mpixel/s (%.1fx scaling)\n", width, height, threads, 1000*time, 1/time, width*height/time/1e6, single_time/time);
+        }
+    }
+}
+
+
+void FramePipelineBenchmark() {
+    printf("* Sequential vs. pipelined capture -> convert -> encode (1920x1080, encoding simulated):\n");
+    const unsigned int width = 1920;
+    const unsigned int height = 1080;
+    constexpr unsigned int FRAME_COUNT = 200;
+
+    std::vector<R8G8B8A8> screen(width * height);
+    std::mt19937 rng(42);
+    for (R8G8B8A8& px : screen)
+        px = {(unsigned char)rng(), (unsigned char)rng(), (unsigned char)rng(), 255};
+
+    struct Frame {
+        std::vector<R8G8B8A8> rgba;
+        std::vector<uint8_t>  planes_buf[3];
+        uint8_t*              planes[3] = {};
+    };
+    const int linesize[3] = {(int)width, (int)width/2, (int)width/2};
+    std::vector<Frame> frames(4);
+    for (Frame& f : frames) {
+        f.rgba.resize(width * height);
+        const size_t plane_sizes[3] = {width*height, width*height/4, width*height/4};
+        for (size_t p = 0; p < 3; p++) {
+            f.planes_buf[p].resize(plane_sizes[p]);
+            f.planes[p] = f.planes_buf[p].data();
+        }
+    }
+
+    // stage costs: screen copy, single-threaded SIMD color conversion & an encoder busy for ~3ms per frame
+    auto capture = [&](Frame& f) {
+        memcpy(f.rgba.data(), screen.data(), screen.size()*sizeof(R8G8B8A8));
+    };
+    auto convert = [&](Frame& f) {
+        RGBAToYUV420(f.rgba.data(), width, width, height, f.planes, linesize);
+    };
+    auto encode = [&](Frame& f) {
+        const auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(3);
+        volatile uint8_t sink = 0;
+        while (std::chrono::steady_clock::now() < until)
+            sink = sink + f.planes[0][0];
+    };
+
+    double capture_time = TimeIt([&] { capture(frames[0]); });
+    double convert_time = TimeIt([&] { convert(frames[0]); });
+    double encode_time = TimeIt([&] { encode(frames[0]); });
+    printf("  Stages    : capture %.3f ms, convert %.3f ms, encode %.3f ms\n", 1000*capture_time, 1000*convert_time, 1000*encode_time);
+
+    double seq_time = TimeIt([&] {
+        for (unsigned int i = 0; i < FRAME_COUNT; i++) {
+            capture(frames[0]);
+            convert(frames[0]);
+            encode(frames[0]);
+        }
+    }) / FRAME_COUNT;
+    printf("  Sequential: %7.3f ms/frame, %6.1f frames/s\n", 1000*seq_time, 1/seq_time);
+
+    // one thread per stage with the same handoff as Mpeg4Transmitter (convert & encode share the frame struct)
+    double pipe_time = TimeIt([&] {
+        std::vector<Frame*> captured_pool = {&frames[0], &frames[1]};
+        std::vector<Frame*> converted_pool = {&frames[2], &frames[3]};
+        FrameChannel<Frame> captured(captured_pool, QueuePolicy::BLOCK);
+        FrameChannel<Frame> converted(converted_pool, QueuePolicy::BLOCK);
+
+        std::thread convert_thread([&] {
+            while (Frame* in = captured.Receive()) {
+                Frame* out = converted.Acquire();
+                RGBAToYUV420(in->rgba.data(), width, width, height, out->planes, linesize);
+                captured.Release(in);
+                converted.Submit(out);
+            }
+            converted.Close();
+        });
+        std::thread encode_thread([&] {
+            while (Frame* f = converted.Receive()) {
+                encode(*f);
+                converted.Release(f);
+            }
+        });
+
+        for (unsigned int i = 0; i < FRAME_COUNT; i++) {
+            Frame* f = captured.Acquire();
+            capture(*f);
+            captured.Submit(f);
+        }
+        captured.Close();
+        convert_thread.join();
+        encode_thread.join();
+    }) / FRAME_COUNT;
+    printf("  Pipelined : %7.3f ms/frame, %6.1f frames/s (%.1fx throughput, slowest stage bound %.3f ms)\n", 1000*pipe_time, 1/pipe_time, seq_time/pipe_time,
+        1000*(std::max)(capture_time, (std::max)(convert_time, encode_time)));
+}
+
+
+void FramePacingBenchmark() {
+    printf("* Frame pacing with 5-15ms simulated capture & encoding (25 fps target):\n");
+    constexpr unsigned int FPS = 25;
+    constexpr unsigned int FRAME_COUNT = 2*FPS;
+    using clock = std::chrono::steady_clock;
+
+    std::mt19937 rng(42);
+    auto work = [&] {
+        const auto until = clock::now() + std::chrono::milliseconds(5 + rng() % 11);
+        while (clock::now() < until)
+            ;
+    };
+
+    // frame rate & standard deviation of the frame intervals
+    auto report = [](const char* name, const std::vector<clock::time_point>& times) {
+        double mean = std::chrono::duration<double>(times.back() - times.front()).count()/(times.size() - 1);
+        double var = 0;
+        for (size_t i = 1; i < times.size(); i++) {
+            double interval = std::chrono::duration<double>(times[i] - times[i-1]).count();
+            var += (interval - mean)*(interval - mean)/(times.size() - 1);
+        }
+        printf("  %s: %5.2f frames/s, interval jitter %6.3f ms\n", name, 1/mean, 1000*std::sqrt(var));
+    };
+
+    std::vector<clock::time_point> times;
+    for (unsigned int i = 0; i < FRAME_COUNT; i++) {
+        times.push_back(clock::now());
+        work();
+        Sleep(1000/FPS);
+    }
+    report("Sleep(1000/FPS)", times);
+
+    times.clear();
+    FILETIME start_time{};
+    GetSystemTimeAsFileTime(&start_time);
+    FramePacer pacer(FPS, start_time, clock::now());
+    for (unsigned int i = 0; i < FRAME_COUNT; i++) {
+        times.push_back(pacer.WaitNextFrame().time);
+        work();
+    }
+    report("FramePacer     ", times);
+    FramePacer::Stats stats = pacer.GetStats();
+    printf("    lateness mean %.3f ms, max %.3f ms, jitter %.3f ms, %llu skipped\n", 1000*stats.mean_lateness, 1000*stats.max_lateness, 1000*stats.jitter, stats.skipped);
+}
+
+
+void DamageDetectionBenchmark() {
+    printf("* Tile hash damage detection on synthetic screen recordings (1920x1080, 10 s at 25 fps):\n");
+    const unsigned int width = 1920;
+    const unsigned int height = 1080;
+    constexpr unsigned int FRAME_COUNT = 250;
+    constexpr unsigned int FPS = 25;
+    using clock = std::chrono::steady_clock;
+
+    // desktop with flat areas & noisy "text" regions
+    std::vector<R8G8B8A8> desktop(width * height);
+    std::mt19937 rng(42);
+    for (unsigned int y = 0; y < height; y++) {
+        for (unsigned int x = 0; x < width; x++) {
+            const bool text = ((y / 20) % 3 == 0) && (x > 200) && (x < 1600);
+            const unsigned char v = text ? (unsigned char)(rng() % 256) : (unsigned char)(200 + y/64);
+            desktop[y*width + x] = {v, v, (unsigned char)(v/2 + 64), 255};
+        }
+    }
+
+    std::vector<R8G8B8A8> rgba(width * height);
+    const int linesize[3] = {(int)width, (int)width/2, (int)width/2};
+    std::vector<uint8_t> planes_buf[3] = {std::vector<uint8_t>(width*height), std::vector<uint8_t>(width*height/4), std::vector<uint8_t>(width*height/4)};
+    uint8_t* const planes[3] = {planes_buf[0].data(), planes_buf[1].data(), planes_buf[2].data()};
+
+    {
+        TileHashGrid grid(width, height);
+        volatile uint32_t sink = 0;
+        double scalar_time = TimeIt([&] {
+            for (unsigned int y = 0; y < height; y += TileHashGrid::TILE_SIZE) {
+                for (unsigned int x = 0; x < width; x += TileHashGrid::TILE_SIZE) {
+                    TileHash hash;
+                    HashTileRows_Scalar(desktop.data() + y*width + x, width, TileHashGrid::TILE_SIZE, (std::min)(TileHashGrid::TILE_SIZE, height - y), hash);
+                    sink = sink + hash.crc[0];
+                }
+            }
+        });
+        double simd_time = TimeIt([&] {
+            grid.Compute(desktop.data(), width);
+        });
+        double convert_time = TimeIt([&] {
+            RGBAToYUV420(desktop.data(), width, width, height, planes, linesize);
+        });
+        printf("  Tile hashing: scalar %6.3f ms/frame, CRC32C instruction %6.3f ms/frame (%.1fx speedup, %.0f%% of color conversion)\n",
+            1000*scalar_time, 1000*simd_time, scalar_time/simd_time, 100*simd_time/convert_time);
+    }
+
+    // frame updates of each recording, applied to "rgba" outside of the timed sections
+    auto fill_rect = [&](unsigned int x0, unsigned int y0, unsigned int w, unsigned int h, R8G8B8A8 color) {
+        for (unsigned int y = y0; y < y0 + h; y++)
+            std::fill(rgba.begin() + y*width + x0, rgba.begin() + y*width + x0 + w, color);
+    };
+    auto cursor = [&](unsigned int frame, unsigned int x, unsigned int y) {
+        // blinks with a 1 s period
+        fill_rect(x, y, 2, 20, ((frame / 12) % 2) ? R8G8B8A8{0, 0, 0, 255} : desktop[y*width + x]);
+    };
+    std::pair<const char*, std::function<void(unsigned int)>> recordings[] = {
+        {"Idle desktop  ", [&](unsigned int frame) {
+            cursor(frame, 640, 400);
+        }},
+        {"Typing        ", [&](unsigned int frame) {
+            const unsigned int column = frame/3 % 100;
+            fill_rect(300 + 10*column, 500, 8, 16, {20, 20, 20, 255}); // one character every 3 frames
+            cursor(frame, 310 + 10*column, 498);
+        }},
+        {"Scrolling     ", [&](unsigned int frame) {
+            // 1200x800 window scrolled by 20 rows per frame
+            const unsigned int x0 = 300, y0 = 150, w = 1200, h = 800, step = 20;
+            for (unsigned int y = y0; y < y0 + h - step; y++)
+                memcpy(&rgba[y*width + x0], &rgba[(y + step)*width + x0], w*sizeof(R8G8B8A8));
+            for (unsigned int y = y0 + h - step; y < y0 + h; y++)
+                memcpy(&rgba[y*width + x0], &desktop[((y + frame*step) % height)*width + x0], w*sizeof(R8G8B8A8));
+        }},
+        {"Video playback", [&](unsigned int /*frame*/) {
+            for (unsigned int y = 300; y < 660; y++)
+                for (unsigned int x = 600; x < 1240; x++)
+                    rgba[y*width + x] = {(unsigned char)rng(), (unsigned char)rng(), (unsigned char)rng(), 255};
+        }},
+    };
+
+    for (auto& recording : recordings) {
+        TileHashGrid prev(width, height), cur(width, height);
+        std::vector<RowBand> bands;
+        bands.reserve(cur.TilesY());
+
+        // full conversion of every frame vs. hashing & conversion of changed rows
+        double full_time = 0, damage_time = 0;
+        uint64_t converted_rows = 0;
+        unsigned int unchanged_frames = 0;
+        for (int pass = 0; pass < 2; pass++) {
+            std::copy(desktop.begin(), desktop.end(), rgba.begin());
+            for (unsigned int frame = 0; frame < FRAME_COUNT; frame++) {
+                recording.second(frame);
+
+                const auto start = clock::now();
+                if (pass == 0) {
+                    RGBAToYUV420(rgba.data(), width, width, height, planes, linesize);
+                    full_time += std::chrono::duration<double>(clock::now() - start).count();
+                } else {
+                    cur.Compute(rgba.data(), width);
+                    const bool refresh = (frame % FPS == 0); // full conversion once per second, as in Mpeg4Transmitter
+                    if (refresh)
+                        prev.Invalidate();
+                    converted_rows += cur.ChangedBands(prev, bands);
+                    for (const RowBand& band : bands) {
+                        uint8_t* const band_planes[3] = {planes[0] + band.begin*linesize[0], planes[1] + band.begin/2*linesize[1], planes[2] + band.begin/2*linesize[2]};
+                        RGBAToYUV420(rgba.data() + band.begin*width, width, width, band.end - band.begin, band_planes, linesize);
+                    }
+                    if (bands.empty())
+                        unchanged_frames++; // encoded as a near-empty P-frame
+                    std::swap(prev, cur);
+                    damage_time += std::chrono::duration<double>(clock::now() - start).count();
+                }
+            }
+        }
+
+        printf("  %s: full %6.3f ms/frame, damage-aware %6.3f ms/frame (%5.1fx), %5.1f%% rows converted, %5.1f%% frames unchanged\n", recording.first,
+            1000*full_time/FRAME_COUNT, 1000*damage_time/FRAME_COUNT, full_time/damage_time, 100.0*converted_rows/(uint64_t(FRAME_COUNT)*height), 100.0*unchanged_frames/FRAME_COUNT);
+    }
+}
+
+
+void MoofEditingBenchmark() {
+    printf("* Media Foundation moof editing (copy vs. zero-copy gather):\n");
+    const uint32_t SAMPLE_COUNTS[] = {1, 30};
+
+    for (uint32_t sample_count : SAMPLE_COUNTS) {
+        std::vector<char> moof = MakeMoofMF(1, sample_count, 1000, 40000);
+        const std::string_view moof_buf(moof.data(), moof.size());
+        const unsigned int BATCH = 1000; // amortize clock overhead
+        size_t sink = 0; // prevent dead code elimination
+
+        // neither editing mode modifies the input buffer, so it can be reused
+        MP4StreamEditor copy_editor(0);
+        double copy_time = TimeIt([&] {
+            for (unsigned int i = 0; i < BATCH; i++)
+                sink += copy_editor.EditStream(moof_buf).size();
+        }) / BATCH;
+
+        MP4StreamEditor gather_editor(0);
+        double gather_time = TimeIt([&] {
+            for (unsigned int i = 0; i < BATCH; i++)
+                sink += gather_editor.EditStreamGather(moof_buf).size();
+        }) / BATCH;
+
+        printf("  %2u sample(s), %4zu bytes: copy %6.1f ns, gather %6.1f ns (%.1fx speedup) [%zu]\n", sample_count, moof.size(), 1e9*copy_time, 1e9*gather_time, copy_time/gather_time, sink % 10);
+    }
+}
+
+
+void ParseStreamBenchmark() {
+    printf("* Receiver-side ParseStream over fragment stream (64kB reads):\n");
+
+    // 60 fragments with 50kB "mdat" payload each
+    std::string stream;
+    for (uint32_t seq_nr = 1; seq_nr <= 60; seq_nr++) {
+        std::vector<char> moof = MakeMoofMF(seq_nr, 1, 1000, 50000);
+        std::vector<char> mdat = MakeMdat(50000);
+        stream.append(moof.data(), moof.size());
+        stream.append(mdat.data(), mdat.size());
+    }
+
+    const size_t READ_SIZE = 64*1024;
+    MP4StreamEditor editor;
+    double time = TimeIt([&] {
+        for (size_t pos = 0; pos < stream.size(); pos += READ_SIZE)
+            editor.ParseStream(std::string_view(stream).substr(pos, READ_SIZE));
+    });
+    printf("  %.1f MB in %.2f us (%.1f GB/s)\n", stream.size()/1e6, 1e6*time, stream.size()/time/1e9);
+}
+
+
+void MoovEditingBenchmark() {
+    printf("* Init segment (moov) editing & parsing (hand-written traversal vs. box schema):\n");
+    const double XFORM[6] = {0.5, 0, 0, 0.5, 10, 20};
+    const unsigned int BATCH = 1000; // amortize clock overhead
+
+    for (bool optional_atoms : {false, true}) {
+        std::vector<char> moov = MakeMoovMF(1920, 1080, optional_atoms);
+        const std::string_view moov_buf(moov.data(), moov.size());
+
+        MP4StreamEditor editor(3829766400);
+        editor.SetDPI(96);
+        editor.SetXform(XFORM);
+        double edit_time = TimeIt([&] {
+            for (unsigned int i = 0; i < BATCH; i++)
+                editor.EditStream(moov_buf);
+        }) / BATCH;
+
+        // receiver-side parsing, incl. box boundary tracking with the schema
+        volatile double dpi_sink = 0; // keep parsing from being optimized away
+        double parse_time = TimeIt([&] {
+            for (unsigned int i = 0; i < BATCH; i++) {
+                MP4StreamEditor receiver;
+                receiver.ParseStream(moov_buf);
+                dpi_sink = receiver.GetDPI();
+            }
+        }) / BATCH;
+
+        const char* label = optional_atoms ? " (with edts & udta)" : "";
+        if (optional_atoms) {
+            // the hand-written traversal expects a fixed atom sequence
+            printf("  %zu byte moov%s: legacy: unsupported, schema: edit %6.1f ns, parse %6.1f ns\n", moov.size(), label, 1e9*edit_time, 1e9*parse_time);
+            continue;
+        }
+
+        // same input with the hand-written traversal
+        LegacyMoovEditor legacy;
+        legacy.m_time.startTime = 3829766400;
+        legacy.m_dpi = 96;
+        legacy.m_xform.a = XFORM[0];
+        legacy.m_xform.b = XFORM[1];
+        legacy.m_xform.c = XFORM[2];
+        legacy.m_xform.d = XFORM[3];
+        legacy.m_xform.tx = XFORM[4];
+        legacy.m_xform.ty = XFORM[5];
+        double legacy_edit_time = TimeIt([&] {
+            for (unsigned int i = 0; i < BATCH; i++)
+                legacy.ModifyMoov(moov_buf);
+        }) / BATCH;
+        double legacy_parse_time = TimeIt([&] {
+            for (unsigned int i = 0; i < BATCH; i++) {
+                LegacyMoovEditor receiver;
+                receiver.ParseMoov(moov_buf);
+                dpi_sink = receiver.m_dpi;
+            }
+        }) / BATCH;
+
+        printf("  %zu byte moov%s: legacy: edit %6.1f ns, parse %6.1f ns, schema: edit %6.1f ns, parse %6.1f ns\n", moov.size(), label,
+            1e9*legacy_edit_time, 1e9*legacy_parse_time, 1e9*edit_time, 1e9*parse_time);
+    }
+}
+
+
+void MoovLayoutCacheBenchmark() {
+    printf("* Repeated init segment (moov) editing (full traversal vs. cached layout):\n");
+    const double XFORM[6] = {0.5, 0, 0, 0.5, 10, 20};
+    const unsigned int BATCH = 1000; // amortize clock overhead
+
+    std::vector<char> moovs[2] = {MakeMoovMF(1920, 1080, false), MakeMoovMF(1920, 1080, true)};
+    const std::string_view moov_bufs[2] = {std::string_view(moovs[0].data(), moovs[0].size()), std::string_view(moovs[1].data(), moovs[1].size())};
+
+    MP4StreamEditor editor(3829766400);
+    editor.SetXform(XFORM);
+
+    // alternating layouts trigger a full traversal on every init segment
+    double walk_time = TimeIt([&] {
+        for (unsigned int i = 0; i < BATCH; i++) {
+            editor.SetDPI(96 + (i & 1));
+            editor.EditStream(moov_bufs[i & 1]);
+        }
+    }) / BATCH;
+
+    // same layout with changing DPI, as after Mpeg4Transmitter::SetDPI
+    double cached_time = TimeIt([&] {
+        for (unsigned int i = 0; i < BATCH; i++) {
+            editor.SetDPI(96 + (i & 1));
+            editor.EditStream(moov_bufs[0]);
+        }
+    }) / BATCH;
+
+    printf("  full traversal %6.1f ns, cached layout %6.1f ns (%.1fx speedup)\n", 1e9*walk_time, 1e9*cached_time, walk_time/cached_time);
+}
+
+
+/** Byte-by-byte big-endian deserialization, for comparison. */
+template <typename T>
+static T DeSerializeBytewise(const char* buf) {
+    T val = {};
+    for (size_t i = 0; i < sizeof(T); ++i)
+        reinterpret_cast<unsigned char*>(&val)[i] = buf[sizeof(T) - 1 - i];
+    return val;
+}
+
+void SerializationBenchmark() {
+    printf("* Big-endian field access & moof throughput:\n");
+    const unsigned int FIELD_COUNT = 4096;
+    std::vector<char> fields(FIELD_COUNT * sizeof(uint32_t) + 1);
+    std::mt19937 rng(42);
+    for (char& c : fields)
+        c = (char)rng();
+
+    uint64_t sink = 0; // prevent dead code elimination
+    double bytewise_time = TimeIt([&] {
+        for (unsigned int i = 0; i < FIELD_COUNT; i++)
+            sink += DeSerializeBytewise<uint32_t>(fields.data() + 1 + 4*i); // unaligned
+    }) / FIELD_COUNT;
+    double byteswap_time = TimeIt([&] {
+        for (unsigned int i = 0; i < FIELD_COUNT; i++)
+            sink += DeSerialize<uint32_t>(fields.data() + 1 + 4*i); // unaligned
+    }) / FIELD_COUNT;
+    printf("  uint32 read: bytewise %5.2f ns, byteswap %5.2f ns (%.1fx speedup) [%u]\n", 1e9*bytewise_time, 1e9*byteswap_time, bytewise_time/byteswap_time, (unsigned)(sink % 10));
+
+    // full "moof" parse & patch with 30 samples per fragment
+    std::vector<char> moof = MakeMoofMF(1, 30, 1000, 40000);
+    const std::string_view moof_buf(moof.data(), moof.size());
+    MP4StreamEditor editor(0);
+    double copy_time = TimeIt([&] {
+        sink += editor.EditStream(moof_buf).size();
+    });
+    double gather_time = TimeIt([&] {
+        sink += editor.EditStreamGather(moof_buf).size();
+    });
+    printf("  moof edit: copy %5.2f M fragments/s, gather %5.2f M fragments/s [%u]\n", 1e-6/copy_time, 1e-6/gather_time, (unsigned)(sink % 10));
+}
+
+
+/** ByteWriter that counts write calls & bytes instead of sending them, as stand-in for the socket behind OutputStream. */
+class CountingWriter : public ByteWriter {
+public:
+    int WriteBytes(const std::string_view buffer) override {
+        write_calls++;
+        bytes += buffer.size();
+        return (int)buffer.size();
+    }
+
+    int WriteVectored(const GatherList& buffers) override {
+        write_calls++;
+        size_t total = 0;
+        for (const std::string_view& buffer : buffers)
+            total += buffer.size();
+        bytes += total;
+        return (int)total;
+    }
+
+    void Flush() override {
+    }
+
+    uint64_t write_calls = 0;
+    uint64_t bytes = 0;
+};
+
+void FragmentAggregationBenchmark() {
+    printf("* Fragment aggregation (25 fps, 40kB frames, one vectored write per moof & mdat):\n");
+    const uint32_t FPS = 25;
+    const uint32_t FRAME_SIZE = 40000;
+    const uint32_t FRAMES_PER_FRAGMENT[] = {1, 5, 25};
+
+    for (uint32_t frames : FRAMES_PER_FRAGMENT) {
+        std::vector<char> moof = MakeMoofMF(1, frames, 1000, FRAME_SIZE);
+        const std::string_view moof_buf(moof.data(), moof.size());
+
+        MP4StreamEditor editor(0);
+        double edit_time = TimeIt([&] {
+            for (uint32_t i = 0; i < frames; i++)
+                editor.SetNextFrameTime(1000*i);
+            editor.EditStreamGather(moof_buf);
+        });
+
+        // one second of video through the same edit & write sequence as OutputStream, with moof & mdat written separately like the Media Foundation sink
+        MP4StreamEditor stream_editor(0);
+        CountingWriter writer;
+        uint64_t payload = 0;
+        for (uint32_t seq_nr = 1; seq_nr <= FPS/frames; seq_nr++) {
+            std::vector<char> fragment_moof = MakeMoofMF(seq_nr, frames, 1000, FRAME_SIZE);
+            std::vector<char> mdat = MakeMdat(frames*FRAME_SIZE);
+            for (uint32_t i = 0; i < frames; i++)
+                stream_editor.SetNextFrameTime(1000*((seq_nr - 1)*frames + i));
+            writer.WriteVectored(stream_editor.EditStreamGather(std::string_view(fragment_moof.data(), fragment_moof.size())));
+            writer.WriteVectored(stream_editor.EditStreamGather(std::string_view(mdat.data(), mdat.size())));
+            payload += frames*FRAME_SIZE;
+        }
+
+        // container overhead & write calls per second of video
+        const double overhead = (double)(writer.bytes - payload);
+        printf("  %2u frame(s)/fragment: %6.0f overhead bytes/s (%.2f%%), %3u writes/s, edit %6.1f ns/fragment, latency %4u ms\n", frames, overhead, 100*overhead/payload, (unsigned)writer.write_calls, 1e9*edit_time, 1000*frames/FPS);
+    }
+}
+
+
+void HttpParseBenchmark() {
+    printf("* HTTP request parsing (typical browser video request):\n");
+    const std::string request =
+        "GET /movie.mp4 HTTP/1.1\r\n"
+        "Host: localhost:8080\r\n"
+        "Connection: keep-alive\r\n"
+        "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+        "Accept-Encoding: identity;q=1, *;q=0\r\n"
+        "Accept: */*\r\n"
+        "Referer: http://localhost:8080/\r\n"
+        "Accept-Language: en-US,en;q=0.9\r\n"
+        "Range: bytes=0-\r\n"
+        "\r\n";
+    const size_t CHUNK_SIZES[] = {request.size(), 64, 1};
+
+    HttpRequestParser parser;
+    for (size_t chunk_size : CHUNK_SIZES) {
+        uint64_t sink = 0;
+        double time = TimeIt([&] {
+            for (size_t pos = 0; pos < request.size(); pos += chunk_size) {
+                parser.Feed(std::string_view(request).substr(pos, chunk_size));
+                if (parser.Parse() == HttpRequestParser::Result::COMPLETE) {
+                    sink += parser.Request().range_first + parser.Request().target.size();
+                    parser.Consume();
+                }
+            }
+        });
+        printf("  %4u byte packets: %6.2f M requests/s, %7.1f MB/s [%u]\n", (unsigned)chunk_size, 1e-6/time, 1e-6*request.size()/time, (unsigned)(sink % 10));
+    }
+}
+
+
+/** Number of threads in the current process. */
+static unsigned int ProcessThreadCount() {
+    HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+    if (snapshot == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("CreateToolhelp32Snapshot failure");
+
+    const DWORD process_id = GetCurrentProcessId();
+    unsigned int count = 0;
+    THREADENTRY32 entry{};
+    entry.dwSize = sizeof(entry);
+    for (BOOL ok = Thread32First(snapshot, &entry); ok; ok = Thread32Next(snapshot, &entry)) {
+        if (entry.th32OwnerProcessID == process_id)
+            count++;
+    }
+    CloseHandle(snapshot);
+    return count;
+}
+
+/** Working set of the current process [MB]. */
+static double ProcessWorkingSetMB() {
+    PROCESS_MEMORY_COUNTERS counters{};
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.WorkingSetSize/(1024.0*1024.0);
+}
+
+void WebStreamLoadBenchmark() {
+    printf("* WebStream short request load (8 client threads, one connection per request):\n");
+    const char PORT[] = "8095";
+    const unsigned int CLIENT_THREADS = 8;
+    const auto DURATION = std::chrono::seconds(2);
+
+    WSAData wsa_data{};
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data))
+        throw std::runtime_error("WSAStartup failure");
+
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    addrinfo* addr = nullptr;
+    if (getaddrinfo("127.0.0.1", PORT, &hints, &addr))
+        throw std::runtime_error("getaddrinfo failure");
+
+    // connect, send "request" & wait for the response header
+    auto Request = [addr](const std::string& request) {
+        SOCKET sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        while (connect(sock, addr->ai_addr, (int)addr->ai_addrlen) == SOCKET_ERROR)
+            Sleep(10); // server not yet listening
+        send(sock, request.data(), (int)request.size(), 0);
+        std::string response;
+        char buf[1024];
+        while (response.find("\r\n\r\n") == std::string::npos) {
+            int res = recv(sock, buf, sizeof(buf), 0);
+            if (res <= 0)
+                break;
+            response.append(buf, res);
+        }
+        return sock; // stream connections are kept open by the caller
+    };
+
+    // long-lived stream client, connected before the load starts
+    SOCKET stream_sock = INVALID_SOCKET;
+    std::thread stream_client([&] { stream_sock = Request("GET /movie.mp4 HTTP/1.1\r\n\r\n"); });
+    {
+        WebStream server(PORT);
+        stream_client.join();
+
+        // server threads & memory before the load
+        const unsigned int idle_threads = ProcessThreadCount();
+        const double idle_memory = ProcessWorkingSetMB();
+
+        std::atomic<uint64_t> request_count = 0;
+        std::atomic<bool> stop = false;
+        std::vector<std::thread> clients;
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < CLIENT_THREADS; i++) {
+            clients.emplace_back([&] {
+                while (!stop) {
+                    closesocket(Request("GET /unknown HTTP/1.1\r\n\r\n"));
+                    request_count++;
+                }
+            });
+        }
+        std::this_thread::sleep_for(DURATION/2);
+        const unsigned int load_threads = ProcessThreadCount() - CLIENT_THREADS; // exclude the client threads of this benchmark
+        const double load_memory = ProcessWorkingSetMB();
+        std::this_thread::sleep_for(DURATION/2);
+        stop = true;
+        for (std::thread& client : clients)
+            client.join();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        for (unsigned int i = 0; (server.ConnectionCount() > 1) && (i < 100); i++)
+            Sleep(10); // wait for closed connections to be reaped
+        const unsigned int after_threads = ProcessThreadCount();
+        const double after_memory = ProcessWorkingSetMB();
+
+        printf("  %8.0f requests/s, %u open connection(s) afterwards\n", request_count/elapsed, (unsigned)server.ConnectionCount());
+        printf("  threads before/during/after load: %u/%u/%u, working set: %.1f/%.1f/%.1f MB\n", idle_threads, load_threads, after_threads, idle_memory, load_memory, after_memory);
+        if ((load_threads > idle_threads) || (after_threads > idle_threads))
+            throw std::runtime_error("server thread count grows with the number of connections");
+
+        closesocket(stream_sock);
+    }
+
+    freeaddrinfo(addr);
+    WSACleanup();
+}
+
+
+/** User + kernel CPU time of the current process [seconds]. */
+static double ProcessCpuTime() {
+    FILETIME creation{}, exit{}, kernel{}, user{};
+    GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+    ULARGE_INTEGER k{}, u{};
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return 1e-7*(k.QuadPart + u.QuadPart); // 100ns units
+}
+
+void WebStreamThroughputBenchmark() {
+    printf("* WebStream fragment delivery (20 x 1MB fragments, CPU incl. receiving clients):\n");
+    const unsigned int CLIENT_COUNTS[] = {1, 10, 100};
+    const uint32_t FRAGMENT_COUNT = 20;
+    const uint32_t FRAME_SIZE = 1024*1024;
+
+    WSAData wsa_data{};
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data))
+        throw std::runtime_error("WSAStartup failure");
+
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    std::vector<std::vector<char>> writes;
+    {
+        std::vector<char> init = MakeFtyp();
+        std::vector<char> moov = MakeMoovMF(1920, 1080);
+        init.insert(init.end(), moov.begin(), moov.end());
+        writes.push_back(init);
+    }
+    for (uint32_t seq_nr = 1; seq_nr <= FRAGMENT_COUNT; seq_nr++) {
+        writes.push_back(MakeMoofMF(seq_nr, 1, 1000, FRAME_SIZE));
+        writes.push_back(MakeMdat(FRAME_SIZE));
+    }
+
+    unsigned int port = 8100;
+    for (unsigned int client_count : CLIENT_COUNTS) {
+        for (bool zero_copy : {false, true}) {
+            const std::string port_str = std::to_string(port++);
+            addrinfo* addr = nullptr;
+            if (getaddrinfo("127.0.0.1", port_str.c_str(), &hints, &addr))
+                throw std::runtime_error("getaddrinfo failure");
+
+            std::atomic<uint64_t> received = 0;
+            std::vector<std::thread> clients;
+            for (unsigned int i = 0; i < client_count; i++) {
+                clients.emplace_back([&] {
+                    SOCKET sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+                    while (connect(sock, addr->ai_addr, (int)addr->ai_addrlen) == SOCKET_ERROR)
+                        Sleep(10); // server not yet listening
+                    const std::string request = "GET /movie.mp4 HTTP/1.1\r\n\r\n";
+                    send(sock, request.data(), (int)request.size(), 0);
+
+                    std::vector<char> buf(256*1024);
+                    for (;;) {
+                        int res = recv(sock, buf.data(), (int)buf.size(), 0);
+                        if (res <= 0)
+                            break;
+                        received += res;
+                    }
+                    closesocket(sock);
+                });
+            }
+
+            double cpu_start = 0;
+            auto start = std::chrono::steady_clock::now();
+            {
+                // queue bounds above the stream size, so that no fragments are dropped
+                WebStream server(port_str.c_str(), 1024, 512, 1024*1024*1024, zero_copy);
+                while (server.StreamClientCount() < client_count)
+                    Sleep(10);
+
+                cpu_start = ProcessCpuTime();
+                start = std::chrono::steady_clock::now();
+                for (const std::vector<char>& buf : writes)
+                    server.WriteBytes(std::string_view(buf.data(), buf.size()));
+            } // all fragments are sent before the server closes
+            for (std::thread& client : clients)
+                client.join();
+            double cpu_time = ProcessCpuTime() - cpu_start;
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            freeaddrinfo(addr);
+
+            const double gbit = 8e-9*received;
+            printf("  %3u client(s), %-9s: %5.2f CPU-s per delivered Gb, %6.2f Gb/s\n", client_count, zero_copy ? "zero-copy" : "copy", cpu_time/gbit, gbit/elapsed);
+        }
+    }
+
+    WSACleanup();
+}
+
+
+int main() {
+    printf("Running benchmarks:\n");
+
+    ColorConversionBenchmark();
+    ParallelColorConversionBenchmark();
+    FramePipelineBenchmark();
+    FramePacingBenchmark();
+    DamageDetectionBenchmark();
+    MoofEditingBenchmark();
+    ParseStreamBenchmark();
+    MoovEditingBenchmark();
+    MoovLayoutCacheBenchmark();
+    SerializationBenchmark();
+    FragmentAggregationBenchmark();
+    HttpParseBenchmark();
+    WebStreamLoadBenchmark();
+    WebStreamThroughputBenchmark();
+
+    printf("[done]\n");
+}
@@ -42,7 +42,10 @@ HRESULT StreamWrapper::GetCurrentPosition(/*out*/QWORD* position) {
 }
 
 HRESULT StreamWrapper::SetCurrentPosition(/*in*/QWORD position) {
-    return m_socket->SetCurrentPosition(position);
+    HRESULT hr = m_socket->SetCurrentPosition(position);
+    if (SUCCEEDED(hr))
+        RepositionParse(position);
+    return hr;
 }
 
 HRESULT StreamWrapper::IsEndOfStream(/*out*/BOOL* endOfStream) {
@@ -61,9 +64,16 @@ HRESULT StreamWrapper::BeginRead(/*out*/BYTE* pb, /*in*/ULONG cb, /*in*/IMFAsync
 
 HRESULT StreamWrapper::EndRead(/*in*/IMFAsyncResult* result, /*out*/ULONG* cbRead) {
     HRESULT hr = m_socket->EndRead(result, cbRead);
-    if (SUCCEEDED(hr)) {
+    if (SUCCEEDED(hr) && !m_parse_stopped) {
         // inspect MPEG4 bitstream
-        bool updated = m_stream_editor.ParseStream(m_read_buf.substr(0, *cbRead));
+        bool updated = false;
+        try {
+            updated = m_stream_editor.ParseStream(m_read_buf.substr(0, *cbRead));
+        } catch (const std::exception&) {
+            // malformed box, which must not propagate across the COM boundary. Only metadata is extracted here,
+            // so the read itself still succeeds, but box boundaries can no longer be trusted.
+            m_parse_stopped = true;
+        }
         if (m_notifier && updated) {
             double xform[6]{};
             m_stream_editor.GetXform(xform);
@@ -86,7 +96,30 @@ HRESULT StreamWrapper::EndWrite(/*in*/IMFAsyncResult* result, /*out*/ULONG* cbWr
 }
 
 HRESULT StreamWrapper::Seek(/*in*/MFBYTESTREAM_SEEK_ORIGIN SeekOrigin, /*in*/LONGLONG SeekOffset,/*in*/DWORD SeekFlags, /*out*/QWORD* CurrentPosition) {
-    return m_socket->Seek(SeekOrigin, SeekOffset, SeekFlags, CurrentPosition);
+    HRESULT hr = m_socket->Seek(SeekOrigin, SeekOffset, SeekFlags, CurrentPosition);
+    if (SUCCEEDED(hr)) {
+        QWORD position = 0;
+        if (CurrentPosition)
+            position = *CurrentPosition;
+        else if (FAILED(m_socket->GetCurrentPosition(&position)))
+            position = ~QWORD(0); // unknown
+        RepositionParse(position);
+    }
+    return hr;
+}
+
+void StreamWrapper::RepositionParse(QWORD position) {
+    if (position == 0) {
+        // stream start is always a box boundary
+        m_stream_editor.ResetParse();
+        m_parse_stopped = false;
+    } else if (m_parse_stopped || (position == m_stream_editor.ParsePosition())) {
+        // parsing already stopped or position unchanged
+    } else if (position == m_stream_editor.NextParseBoxOffset()) {
+        m_stream_editor.ResetParse(position); // skip the rest of the current box
+    } else {
+        m_parse_stopped = true; // seek target might be in the middle of a box
+    }
 }
 
 HRESULT StreamWrapper::Flush() {
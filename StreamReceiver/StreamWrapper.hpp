@@ -59,8 +59,12 @@ public:
     END_COM_MAP()
 
 private:
+    /** Continue metadata parsing after a seek only if the new position is a known box boundary. */
+    void RepositionParse(QWORD position);
+
     IMFByteStreamPtr      m_socket;   // network socket stream to intercept
     MP4StreamEditor       m_stream_editor;
+    bool                  m_parse_stopped = false; // metadata parsing stopped after a malformed box or a seek to an unknown offset
     std::string_view      m_read_buf; // set by BeginRead
     StartTimeDpiChangedCb m_notifier;
 };
@@ -0,0 +1,312 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "../AppWebStream/MP4Utils.hpp"
+
+
+/** Convert a generated atom to a string. */
+inline std::string ToString(const std::vector<char>& buf) {
+    return std::string(buf.data(), buf.size());
+}
+
+/** Append a big-endian value to a byte buffer. */
+template <typename T>
+static void Append(std::vector<char>& buf, T val) {
+    size_t pos = buf.size();
+    buf.resize(pos + sizeof(T));
+    Serialize<T>(buf.data() + pos, val);
+}
+
+/** Append an atom header with placeholder size. Returns the atom start index for use with EndAtom. */
+inline size_t BeginAtom(std::vector<char>& buf, const char type[4]) {
+    size_t start = buf.size();
+    Append<uint32_t>(buf, 0); // size placeholder
+    buf.insert(buf.end(), type, type + 4);
+    return start;
+}
+
+/** Update the size of an atom started with BeginAtom. */
+inline void EndAtom(std::vector<char>& buf, size_t start) {
+    Serialize<uint32_t>(buf.data() + start, (uint32_t)(buf.size() - start));
+}
+
+/** Generate a synthetic "moof" atom with the same layout as the Media Foundation MPEG4 file sink output:
+    mfhd, traf{tfhd with base-data-offset, trun v1 with data_offset, duration, size, flags & cts per sample}.
+    The first sample is an IDR frame if "key_frame" is set. */
+inline std::vector<char> MakeMoofMF(uint32_t seq_nr, uint32_t sample_count, uint32_t sample_duration, uint32_t sample_size, bool key_frame = true) {
+    std::vector<char> buf;
+    size_t moof = BeginAtom(buf, "moof");
+    {
+        size_t mfhd = BeginAtom(buf, "mfhd");
+        Append<uint32_t>(buf, 0); // version & flags
+        Append<uint32_t>(buf, seq_nr);
+        EndAtom(buf, mfhd);
+    }
+    {
+        size_t traf = BeginAtom(buf, "traf");
+        {
+            size_t tfhd = BeginAtom(buf, "tfhd");
+            Append<uint32_t>(buf, 0x000001); // version 0 & base-data-offset flag
+            Append<uint32_t>(buf, 1);        // track-ID
+            Append<uint64_t>(buf, 0x1000);   // base-data-offset (absolute file position)
+            EndAtom(buf, tfhd);
+        }
+        {
+            size_t trun = BeginAtom(buf, "trun");
+            Append<uint32_t>(buf, 0x01000F01); // version 1 & data-offset, duration, size, flags, cts flags
+            Append<uint32_t>(buf, sample_count);
+            Append<int32_t>(buf, 0);           // data_offset
+            for (uint32_t i = 0; i < sample_count; i++) {
+                Append<uint32_t>(buf, sample_duration);
+                Append<uint32_t>(buf, sample_size);
+                Append<uint32_t>(buf, ((i == 0) && key_frame) ? 0x02000000 : 0x01010000); // sample_flags (IDR for 1st sample)
+                Append<int32_t>(buf, 0);       // sample_composition_time_offset
+            }
+            EndAtom(buf, trun);
+        }
+        EndAtom(buf, traf);
+    }
+    EndAtom(buf, moof);
+    return buf;
+}
+
+/** Generate a synthetic "moof" atom with the same layout as the FFMPEG "mp4" muxer output with "empty_moov+default_base_moof" flags:
+    mfhd, traf{tfhd with default-base-is-moof & default duration, size & flags, tfdt v1, trun v0 with data_offset & first_sample_flags}.
+    The "trun" atom also contains per-sample sizes if "sample_count" is above one. */
+inline std::vector<char> MakeMoofFF(uint32_t seq_nr, uint64_t decode_time, uint32_t sample_count, uint32_t sample_duration, uint32_t sample_size) {
+    std::vector<char> buf;
+    size_t moof = BeginAtom(buf, "moof");
+    {
+        size_t mfhd = BeginAtom(buf, "mfhd");
+        Append<uint32_t>(buf, 0); // version & flags
+        Append<uint32_t>(buf, seq_nr);
+        EndAtom(buf, mfhd);
+    }
+    {
+        size_t traf = BeginAtom(buf, "traf");
+        {
+            size_t tfhd = BeginAtom(buf, "tfhd");
+            Append<uint32_t>(buf, 0x020038);   // version 0 & default-base-is-moof, default duration, size & flags
+            Append<uint32_t>(buf, 1);          // track-ID
+            Append<uint32_t>(buf, sample_duration);
+            Append<uint32_t>(buf, sample_size);
+            Append<uint32_t>(buf, 0x01010000); // default sample_flags (non-IDR)
+            EndAtom(buf, tfhd);
+        }
+        {
+            size_t tfdt = BeginAtom(buf, "tfdt");
+            Append<uint32_t>(buf, 0x01000000); // version 1
+            Append<uint64_t>(buf, decode_time);
+            EndAtom(buf, tfdt);
+        }
+        {
+            size_t trun = BeginAtom(buf, "trun");
+            Append<uint32_t>(buf, (sample_count > 1) ? 0x000205 : 0x000005); // version 0 & data-offset, first-sample-flags & sample-size flags
+            Append<uint32_t>(buf, sample_count);
+            size_t data_offset = buf.size();
+            Append<int32_t>(buf, 0);           // data_offset (updated below)
+            Append<uint32_t>(buf, 0x02000000); // first sample_flags (IDR)
+            if (sample_count > 1) {
+                for (uint32_t i = 0; i < sample_count; i++)
+                    Append<uint32_t>(buf, sample_size + i);
+            }
+            EndAtom(buf, trun);
+            EndAtom(buf, traf);
+            EndAtom(buf, moof);
+            Serialize<int32_t>(buf.data() + data_offset, (int32_t)buf.size() + 8); // "moof" & "mdat" header size
+        }
+    }
+    return buf;
+}
+
+/** Generate a "mdat" atom with dummy payload. Uses a 64bit largesize header if "large" is set. */
+inline std::vector<char> MakeMdat(uint32_t payload_size, bool large = false) {
+    std::vector<char> buf;
+    if (large) {
+        Append<uint32_t>(buf, 1); // largesize follows type
+        buf.insert(buf.end(), {'m', 'd', 'a', 't'});
+        Append<uint64_t>(buf, 16 + (uint64_t)payload_size);
+    } else {
+        BeginAtom(buf, "mdat");
+        Serialize<uint32_t>(buf.data(), 8 + payload_size);
+    }
+    for (uint32_t i = 0; i < payload_size; i++)
+        buf.push_back((char)i);
+    return buf;
+}
+
+/** Append "count" zero bytes. */
+inline void AppendZeros(std::vector<char>& buf, size_t count) {
+    buf.resize(buf.size() + count, 0);
+}
+
+/** Generate a "ftyp" atom. */
+inline std::vector<char> MakeFtyp() {
+    std::vector<char> buf;
+    size_t ftyp = BeginAtom(buf, "ftyp");
+    buf.insert(buf.end(), {'m', 'p', '4', '2', 0, 0, 0, 0, 'm', 'p', '4', '1', 'i', 's', 'o', 'm'});
+    EndAtom(buf, ftyp);
+    return buf;
+}
+
+/** Append an identity transformation matrix. */
+inline void AppendIdentityMatrix(std::vector<char>& buf) {
+    size_t pos = buf.size();
+    AppendZeros(buf, matrix::SIZE);
+    matrix().Write(buf.data() + pos);
+}
+
+/** Generate a synthetic "moov" atom with the same layout as the Media Foundation MPEG4 file sink output for a single H.264 track.
+    Optional "edts" & "udta" atoms are added if "optional_atoms" is set. "sample_entries" is the number of "avc1" entries in "stsd". */
+inline std::vector<char> MakeMoovMF(uint16_t width, uint16_t height, bool optional_atoms = false, uint32_t sample_entries = 1) {
+    std::vector<char> buf;
+    size_t moov = BeginAtom(buf, "moov");
+    {
+        size_t mvhd = BeginAtom(buf, "mvhd");
+        Append<uint32_t>(buf, 0);          // version 0 & flags
+        Append<uint32_t>(buf, 1);          // creation time
+        Append<uint32_t>(buf, 1);          // modification time
+        Append<uint32_t>(buf, 50000);      // timescale
+        Append<uint32_t>(buf, 0);          // duration
+        Append<uint32_t>(buf, 0x00010000); // rate 1.0
+        Append<uint16_t>(buf, 0x0100);     // volume 1.0
+        AppendZeros(buf, 2 + 2*4);         // reserved
+        AppendIdentityMatrix(buf);
+        AppendZeros(buf, 6*4);             // pre-defined
+        Append<uint32_t>(buf, 2);          // next track-ID
+        EndAtom(buf, mvhd);
+    }
+    {
+        size_t trak = BeginAtom(buf, "trak");
+        {
+            size_t tkhd = BeginAtom(buf, "tkhd");
+            Append<uint32_t>(buf, 0x00000003); // version 0 & enabled, in-movie flags
+            Append<uint32_t>(buf, 1);          // creation time
+            Append<uint32_t>(buf, 1);          // modification time
+            Append<uint32_t>(buf, 1);          // track-ID
+            AppendZeros(buf, 4);               // reserved
+            Append<uint32_t>(buf, 0);          // duration
+            AppendZeros(buf, 2*4 + 2 + 2 + 2 + 2); // reserved, layer, alternate group, volume, reserved
+            AppendIdentityMatrix(buf);
+            Append<uint32_t>(buf, width << 16);
+            Append<uint32_t>(buf, height << 16);
+            EndAtom(buf, tkhd);
+        }
+        if (optional_atoms) {
+            size_t edts = BeginAtom(buf, "edts");
+            size_t elst = BeginAtom(buf, "elst");
+            Append<uint32_t>(buf, 0); // version 0 & flags
+            Append<uint32_t>(buf, 1); // entry count
+            Append<uint32_t>(buf, 0); // segment duration
+            Append<int32_t>(buf, 0);  // media time
+            Append<uint32_t>(buf, 0x00010000); // media rate 1.0
+            EndAtom(buf, elst);
+            EndAtom(buf, edts);
+        }
+        {
+            size_t mdia = BeginAtom(buf, "mdia");
+            {
+                size_t mdhd = BeginAtom(buf, "mdhd");
+                Append<uint32_t>(buf, 0);     // version 0 & flags
+                Append<uint32_t>(buf, 1);     // creation time
+                Append<uint32_t>(buf, 1);     // modification time
+                Append<uint32_t>(buf, 50000); // timescale
+                Append<uint32_t>(buf, 0);     // duration
+                Append<uint16_t>(buf, 0x55C4); // language "und"
+                AppendZeros(buf, 2);          // pre-defined
+                EndAtom(buf, mdhd);
+            }
+            {
+                size_t hdlr = BeginAtom(buf, "hdlr");
+                AppendZeros(buf, 4 + 4);      // version & flags, pre-defined
+                buf.insert(buf.end(), {'v', 'i', 'd', 'e'});
+                AppendZeros(buf, 3*4 + 1);    // reserved & empty name
+                EndAtom(buf, hdlr);
+            }
+            {
+                size_t minf = BeginAtom(buf, "minf");
+                {
+                    size_t vmhd = BeginAtom(buf, "vmhd");
+                    Append<uint32_t>(buf, 1); // version 0 & flags
+                    AppendZeros(buf, 2 + 3*2); // graphics mode & opcolor
+                    EndAtom(buf, vmhd);
+                }
+                {
+                    size_t dinf = BeginAtom(buf, "dinf");
+                    size_t dref = BeginAtom(buf, "dref");
+                    Append<uint32_t>(buf, 0); // version 0 & flags
+                    Append<uint32_t>(buf, 1); // entry count
+                    size_t url = BeginAtom(buf, "url ");
+                    Append<uint32_t>(buf, 1); // self-contained flag
+                    EndAtom(buf, url);
+                    EndAtom(buf, dref);
+                    EndAtom(buf, dinf);
+                }
+                {
+                    size_t stbl = BeginAtom(buf, "stbl");
+                    {
+                        size_t stsd = BeginAtom(buf, "stsd");
+                        Append<uint32_t>(buf, 0); // version 0 & flags
+                        Append<uint32_t>(buf, sample_entries); // entry count
+                        for (uint32_t entry = 0; entry < sample_entries; entry++) {
+                            size_t avc1 = BeginAtom(buf, "avc1");
+                            AppendZeros(buf, 6);                // reserved
+                            Append<uint16_t>(buf, 1);           // data reference index
+                            AppendZeros(buf, 2 + 2 + 3*4);      // pre-defined & reserved
+                            Append<uint16_t>(buf, width);
+                            Append<uint16_t>(buf, height);
+                            Append<uint32_t>(buf, 0x00480000); // 72 horizontal DPI
+                            Append<uint32_t>(buf, 0x00480000); // 72 vertical DPI
+                            AppendZeros(buf, 4);                // reserved
+                            Append<uint16_t>(buf, 1);           // frame count
+                            AppendZeros(buf, 32);               // compressor name
+                            Append<uint16_t>(buf, 0x0018);      // depth
+                            Append<int16_t>(buf, -1);           // pre-defined
+                            {
+                                size_t avcC = BeginAtom(buf, "avcC");
+                                buf.insert(buf.end(), {1, 0x64, 0, 0x28, (char)0xFF, (char)0xE1, 0, 4, 0x67, 0x64, 0, 0x28, 1, 0, 4, 0x68, (char)0xEE, 0x3C, (char)0x80});
+                                EndAtom(buf, avcC);
+                            }
+                            EndAtom(buf, avc1);
+                        }
+                        EndAtom(buf, stsd);
+                    }
+                    const char* EMPTY_TABLES[] = {"stts", "stsc", "stco"};
+                    for (const char* type : EMPTY_TABLES) {
+                        size_t table = BeginAtom(buf, type);
+                        AppendZeros(buf, 4 + 4); // version & flags, entry count
+                        EndAtom(buf, table);
+                    }
+                    {
+                        size_t stsz = BeginAtom(buf, "stsz");
+                        AppendZeros(buf, 4 + 4 + 4); // version & flags, sample size, sample count
+                        EndAtom(buf, stsz);
+                    }
+                    EndAtom(buf, stbl);
+                }
+                EndAtom(buf, minf);
+            }
+            EndAtom(buf, mdia);
+        }
+        EndAtom(buf, trak);
+    }
+    if (optional_atoms) {
+        size_t udta = BeginAtom(buf, "udta");
+        size_t name = BeginAtom(buf, "name");
+        buf.insert(buf.end(), {'t', 'e', 's', 't'});
+        EndAtom(buf, name);
+        EndAtom(buf, udta);
+    }
+    {
+        size_t mvex = BeginAtom(buf, "mvex");
+        size_t trex = BeginAtom(buf, "trex");
+        Append<uint32_t>(buf, 0); // version 0 & flags
+        Append<uint32_t>(buf, 1); // track-ID
+        Append<uint32_t>(buf, 1); // default sample description index
+        AppendZeros(buf, 3*4);    // default sample duration, size & flags
+        EndAtom(buf, trex);
+        EndAtom(buf, mvex);
+    }
+    EndAtom(buf, moov);
+    return buf;
+}
@@ -1,6 +1,42 @@
+#define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#include <atomic>
 #include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
 #include "../AppWebStream/MP4Utils.hpp"
+#include "../AppWebStream/BoxTracker.hpp"
+#include "../AppWebStream/ColorConvert.hpp"
+#include "../AppWebStream/FramePacer.hpp"
+#include "../AppWebStream/FramePipeline.hpp"
+#include "../AppWebStream/HttpParser.hpp"
+#include "../AppWebStream/Metrics.hpp"
+#include "../AppWebStream/StaticAssets.hpp"
+#include "../AppWebStream/TileHash.hpp"
+#include "../AppWebStream/MP4StreamEditor.hpp"
+#include "../AppWebStream/WebStream.hpp"
+#include "../AppWebStream/WebSocketProtocol.hpp"
+#include "MP4Samples.hpp"
+
+
+/** Counting replacement of the global allocator, for verifying allocation-free code paths. */
+static std::atomic<uint64_t> s_allocation_count = 0;
+
+void* operator new(size_t size) {
+    s_allocation_count++;
+    if (void* ptr = malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t /*size*/) noexcept {
+    free(ptr);
+}
 
 
 void TimeConvTests() {
@@ -96,6 +132,35 @@ void SerializationTests() {
         if (val2 != val1)
             throw std::runtime_error("serialization error");
     }
+    {
+        // big-endian byte order for all field types
+        char buffer[8] = {};
+        Serialize<uint64_t>(buffer, 0x0102030405060708);
+        if (memcmp(buffer, "\x01\x02\x03\x04\x05\x06\x07\x08", 8) != 0)
+            throw std::runtime_error("serialization error");
+
+        char* end = Serialize<uint24_t>(buffer, 0x0A0B0C);
+        if ((end != buffer + 3) || (memcmp(buffer, "\x0A\x0B\x0C\x04", 4) != 0))
+            throw std::runtime_error("serialization error");
+        if (DeSerialize<uint24_t>(buffer) != 0x0A0B0Cu)
+            throw std::runtime_error("serialization error");
+
+        Serialize<int32_t>(buffer, -2);
+        if ((memcmp(buffer, "\xFF\xFF\xFF\xFE", 4) != 0) || (DeSerialize<int32_t>(buffer) != -2))
+            throw std::runtime_error("serialization error");
+
+        // unaligned access
+        Serialize<uint32_t>(buffer + 1, 0x11223344);
+        if (DeSerialize<uint32_t>(buffer + 1) != 0x11223344)
+            throw std::runtime_error("serialization error");
+    }
+
+    // compile-time evaluation
+    static_assert(ByteSwap<uint16_t>(0x1122) == 0x2211);
+    static_assert(ByteSwap<uint64_t>(0x1122334455667788) == 0x8877665544332211);
+    static_assert(DeSerialize<uint32_t>("\x11\x22\x33\x44") == 0x11223344);
+    static_assert(DeSerialize<uint24_t>("\x11\x22\x33") == 0x112233u);
+    static_assert(ReadFixed1616("\x00\x48\x00\x00") == 72.0);
 }
 
 void FixedPointTests() {
@@ -134,12 +199,1903 @@ void FixedPointTests() {
 
 }
 
+void ColorConversionTests() {
+    printf("* Color conversion tests.\n");
+
+    std::mt19937 rng(42);
+    const unsigned int DIMS[][2] = {{2, 2}, {6, 4}, {16, 2}, {30, 10}, {64, 64}, {1282, 6}}; // covers SIMD tails
+    for (auto& dims : DIMS) {
+        const unsigned int width = dims[0];
+        const unsigned int height = dims[1];
+        const unsigned int stride = width + 3; // padded source rows
+
+        std::vector<R8G8B8A8> rgba(stride * height);
+        for (R8G8B8A8& px : rgba) {
+            px.r = (unsigned char)rng();
+            px.g = (unsigned char)rng();
+            px.b = (unsigned char)rng();
+            px.a = (unsigned char)rng();
+        }
+        // include saturated colors
+        rgba[0] = {255, 255, 255, 255};
+        rgba[1] = {0, 0, 0, 0};
+
+        const int linesize[3] = {(int)width + 5, (int)width/2 + 7, (int)width/2 + 1};
+        std::vector<uint8_t> expected[3], actual[3];
+        for (int i = 0; i < 3; i++) {
+            expected[i].resize(linesize[i] * (i ? height/2 : height));
+            actual[i].resize(expected[i].size());
+        }
+        uint8_t* const expected_planes[3] = {expected[0].data(), expected[1].data(), expected[2].data()};
+        uint8_t* const actual_planes[3] = {actual[0].data(), actual[1].data(), actual[2].data()};
+
+        RGBAToYUV420_Reference(rgba.data(), stride, width, height, expected_planes, linesize);
+
+        std::vector<ColorConvertKernel> kernels = {ColorConvertKernel::Scalar};
+#ifdef COLOR_CONVERT_X86
+        kernels.push_back(ColorConvertKernel::SSE2);
+        if (CpuSupportsAVX2())
+            kernels.push_back(ColorConvertKernel::AVX2);
+#endif
+        for (ColorConvertKernel kernel : kernels) {
+            for (auto& plane : actual)
+                std::fill(plane.begin(), plane.end(), (uint8_t)0);
+
+            RGBAToYUV420(kernel, rgba.data(), stride, width, height, actual_planes, linesize);
+
+            for (int i = 0; i < 3; i++) {
+                if (actual[i] != expected[i])
+                    throw std::runtime_error("color conversion mismatch");
+            }
+        }
+
+        // row-parallel conversion
+        WorkerPool pool(4);
+        for (auto& plane : actual)
+            std::fill(plane.begin(), plane.end(), (uint8_t)0);
+
+        RGBAToYUV420(pool, rgba.data(), stride, width, height, actual_planes, linesize);
+
+        for (int i = 0; i < 3; i++) {
+            if (actual[i] != expected[i])
+                throw std::runtime_error("parallel color conversion mismatch");
+        }
+
+        // same image as bottom-up RGBA rows, addressed from the top row with a negative stride
+        std::vector<R8G8B8A8> flipped(rgba.size());
+        for (unsigned int y = 0; y < height; y++) {
+            for (unsigned int x = 0; x < stride; x++) {
+                const R8G8B8A8 px = rgba[y*stride + x];
+                flipped[(height - 1 - y)*stride + x] = {px.b, px.g, px.r, px.a};
+            }
+        }
+        const R8G8B8A8* flipped_top = flipped.data() + (height - 1)*stride;
+        for (ColorConvertKernel kernel : kernels) {
+            for (auto& plane : actual)
+                std::fill(plane.begin(), plane.end(), (uint8_t)0);
+
+            RGBAToYUV420(kernel, flipped_top, -(ptrdiff_t)stride, width, height, actual_planes, linesize, PixelFormat::RGBA);
+
+            for (int i = 0; i < 3; i++) {
+                if (actual[i] != expected[i])
+                    throw std::runtime_error("bottom-up RGBA color conversion mismatch");
+            }
+        }
+
+        for (auto& plane : actual)
+            std::fill(plane.begin(), plane.end(), (uint8_t)0);
+
+        RGBAToYUV420(pool, flipped_top, -(ptrdiff_t)stride, width, height, actual_planes, linesize, PixelFormat::RGBA);
+
+        for (int i = 0; i < 3; i++) {
+            if (actual[i] != expected[i])
+                throw std::runtime_error("parallel bottom-up RGBA color conversion mismatch");
+        }
+
+        // swizzle & flip back into the original layout
+        std::vector<R8G8B8A8> copy(rgba.size());
+        CopyToBGRA(flipped_top, -(ptrdiff_t)stride, PixelFormat::RGBA, stride, height, copy.data(), stride);
+        if (memcmp(copy.data(), rgba.data(), rgba.size()*sizeof(R8G8B8A8)))
+            throw std::runtime_error("CopyToBGRA mismatch");
+    }
+}
+
+void MoofGatherTests() {
+    printf("* Zero-copy moof editing tests.\n");
+
+    const uint64_t START_TIME = 3829766400; // 2025-05-11 in MPEG4 epoch
+    MP4StreamEditor copy_editor(START_TIME);
+    MP4StreamEditor gather_editor(START_TIME);
+
+    const uint32_t SAMPLE_COUNTS[] = {1, 1, 3, 1, 5};
+    uint32_t seq_nr = 1;
+    uint64_t decode_time = 0;
+    for (uint32_t sample_count : SAMPLE_COUNTS) {
+        std::vector<char> moof = MakeMoofMF(seq_nr++, sample_count, 1000, 4321);
+        const std::vector<char> original = moof;
+
+        std::string_view expected = copy_editor.EditStream(std::string_view(moof.data(), moof.size()));
+
+        const GatherList& ranges = gather_editor.EditStreamGather(std::string_view(moof.data(), moof.size()));
+        std::string actual;
+        for (const std::string_view& range : ranges)
+            actual += range;
+
+        if (actual != expected)
+            throw std::runtime_error("gather moof mismatch");
+        if (ranges.ByteCount() != original.size() - 8 + 20)
+            throw std::runtime_error("gather moof size mismatch");
+        if (moof != original)
+            throw std::runtime_error("gather moof modified input buffer");
+
+        // "tfdt" follows moof & traf headers, mfhd and shortened tfhd
+        const char* tfdt = actual.data() + 8 + 16 + 8 + 16;
+        if (!IsAtomType(tfdt, "tfdt") || (DeSerialize<uint64_t>(tfdt + 12) != decode_time))
+            throw std::runtime_error("gather moof tfdt mismatch");
+        decode_time += sample_count * 1000;
+    }
+}
+
+void MuxerProbeTests() {
+    printf("* Muxer flavor detection tests.\n");
+
+    {
+        // FFMPEG fragments are passed through unchanged
+        MP4StreamEditor editor(0);
+        for (uint32_t seq_nr = 1; seq_nr <= 3; seq_nr++) {
+            std::vector<char> moof = MakeMoofFF(seq_nr, 1024*(seq_nr-1), seq_nr, 1024, 4321);
+            const std::vector<char> original = moof;
+
+            std::string_view edited = editor.EditStream(std::string_view(moof.data(), moof.size()));
+            if (editor.GetMuxerFlavor() != MP4StreamEditor::MuxerFlavor::FFMPEG)
+                throw std::runtime_error("FFMPEG muxer not detected");
+            if ((edited.data() != moof.data()) || (edited.size() != moof.size()) || (moof != original))
+                throw std::runtime_error("FFMPEG moof not passed through");
+
+            const GatherList& ranges = editor.EditStreamGather(std::string_view(moof.data(), moof.size()));
+            if ((ranges.size() != 1) || (ranges[0].data() != moof.data()) || (ranges.ByteCount() != moof.size()))
+                throw std::runtime_error("FFMPEG moof gather not passed through");
+        }
+    }
+    {
+        // Media Foundation fragments are rewritten
+        MP4StreamEditor editor(0);
+        std::vector<char> moof = MakeMoofMF(1, 1, 1000, 4321);
+        std::string_view edited = editor.EditStream(std::string_view(moof.data(), moof.size()));
+        if (editor.GetMuxerFlavor() != MP4StreamEditor::MuxerFlavor::MediaFoundation)
+            throw std::runtime_error("Media Foundation muxer not detected");
+        if (edited.size() != moof.size() - 8 + 20)
+            throw std::runtime_error("Media Foundation moof not rewritten");
+    }
+}
+
+void FragmentAggregationTests() {
+    printf("* Multi-sample fragment tests.\n");
+
+    // Media Foundation fragments get the time of their first frame as baseMediaDecodeTime
+    MP4StreamEditor copy_editor(0);
+    MP4StreamEditor gather_editor(0);
+    struct Fragment {
+        std::vector<uint64_t> frame_times; // frame times registered before the fragment is emitted
+        uint32_t              sample_count;
+        uint64_t              decode_time; // expected baseMediaDecodeTime
+    };
+    const Fragment FRAGMENTS[] = {
+        {{0, 1000, 2000, 3000}, 3, 0},    // fragment emitted after the next frame time is set
+        {{4000},                2, 3000},
+        {{},                    1, 5000}, // no frame times (continue from sample durations)
+        {{6500, 7500},          2, 6500},
+    };
+    uint32_t seq_nr = 1;
+    for (const Fragment& fragment : FRAGMENTS) {
+        for (uint64_t time : fragment.frame_times) {
+            copy_editor.SetNextFrameTime(time);
+            gather_editor.SetNextFrameTime(time);
+        }
+
+        std::vector<char> moof = MakeMoofMF(seq_nr++, fragment.sample_count, 1000, 4321);
+        std::string_view edited = copy_editor.EditStream(std::string_view(moof.data(), moof.size()));
+
+        std::string gathered;
+        for (const std::string_view& range : gather_editor.EditStreamGather(std::string_view(moof.data(), moof.size())))
+            gathered += range;
+
+        // "tfdt" follows moof & traf headers, mfhd and shortened tfhd
+        const size_t TFDT_POS = 8 + 16 + 8 + 16;
+        if ((DeSerialize<uint64_t>(edited.data() + TFDT_POS + 12) != fragment.decode_time) || (gathered != edited))
+            throw std::runtime_error("multi-sample moof tfdt mismatch");
+    }
+
+    // FFMPEG multi-sample fragments are passed through
+    MP4StreamEditor ff_editor(0);
+    for (uint32_t sample_count : {5, 1, 25}) {
+        std::vector<char> moof = MakeMoofFF(seq_nr++, 0, sample_count, 1024, 4321);
+        std::string_view edited = ff_editor.EditStream(std::string_view(moof.data(), moof.size()));
+        if (edited.data() != moof.data())
+            throw std::runtime_error("multi-sample FFMPEG moof not passed through");
+    }
+}
+
+void HttpParserTests() {
+    printf("* HTTP request parser tests.\n");
+
+    struct Expected {
+        const char* method;
+        const char* target;
+        bool        keep_alive;
+        bool        has_range;
+        uint64_t    range_first;
+        uint64_t    range_last;
+    };
+    struct Case {
+        const char* request;
+        Expected    expected;
+    };
+    const Case corpus[] = {
+        {"GET /movie.mp4 HTTP/1.1\r\nHost: localhost\r\n\r\n", {"GET", "/movie.mp4", true, false, 0, UINT64_MAX}},
+        {"GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n", {"GET", "/", false, false, 0, UINT64_MAX}},
+        {"GET /video HTTP/1.1\r\nrange:  bytes=0-\r\n\r\n", {"GET", "/video", true, true, 0, UINT64_MAX}},
+        {"GET /video HTTP/1.1\r\nRange: bytes=100-199\r\n\r\n", {"GET", "/video", true, true, 100, 199}},
+        {"GET /video HTTP/1.1\r\nRange: bytes=0-1,5-6\r\n\r\n", {"GET", "/video", true, false, 0, UINT64_MAX}}, // multiple ranges ignored
+        {"GET / HTTP/1.0\r\n\r\n", {"GET", "/", false, false, 0, UINT64_MAX}},
+        {"GET / HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n", {"GET", "/", true, false, 0, UINT64_MAX}},
+        {"GET / HTTP/1.1\r\nConnection: Upgrade, close\r\n\r\n", {"GET", "/", false, false, 0, UINT64_MAX}},
+        {"\r\nHEAD /x HTTP/1.1\nUser-Agent: test\n\n", {"HEAD", "/x", true, false, 0, UINT64_MAX}}, // leading CRLF & bare LF
+    };
+
+    auto Verify = [](const HttpRequest& req, const Expected& exp) {
+        if ((req.method != exp.method) || (req.target != exp.target) || (req.keep_alive != exp.keep_alive))
+            throw std::runtime_error("HttpRequestParser request line or Connection mismatch");
+        if ((req.has_range != exp.has_range) || (req.range_first != exp.range_first) || (req.range_last != exp.range_last))
+            throw std::runtime_error("HttpRequestParser Range mismatch");
+    };
+
+    // every request split at every byte position
+    for (const Case& c : corpus) {
+        const std::string_view request = c.request;
+        for (size_t split = 0; split <= request.size(); split++) {
+            HttpRequestParser parser;
+            parser.Feed(request.substr(0, split));
+            HttpRequestParser::Result res = parser.Parse();
+            if ((split < request.size()) && (res != HttpRequestParser::Result::INCOMPLETE))
+                throw std::runtime_error("HttpRequestParser completed a partial request");
+
+            parser.Feed(request.substr(split));
+            if (parser.Parse() != HttpRequestParser::Result::COMPLETE)
+                throw std::runtime_error("HttpRequestParser did not complete the request");
+            Verify(parser.Request(), c.expected);
+        }
+    }
+
+    {
+        // all requests pipelined & delivered one byte at a time
+        std::string pipelined;
+        for (const Case& c : corpus)
+            pipelined += c.request;
+
+        HttpRequestParser parser;
+        size_t index = 0;
+        for (char byte : pipelined) {
+            parser.Feed(std::string_view(&byte, 1));
+            while (parser.Parse() == HttpRequestParser::Result::COMPLETE) {
+                Verify(parser.Request(), corpus[index++].expected);
+                parser.Consume();
+            }
+        }
+        if ((index != std::size(corpus)) || (parser.BufferedBytes() != 0))
+            throw std::runtime_error("HttpRequestParser pipelining failure");
+    }
+
+    // malformed requests
+    const char* malformed[] = {
+        "GET /\r\n\r\n",                        // missing version
+        "GET  / HTTP/1.1\r\n\r\n",              // empty target
+        "GET / HTTP/2.0\r\n\r\n",               // unsupported version
+        "GET / HTTP/1.1\r\nNoColon\r\n\r\n",    // malformed header
+    };
+    for (const char* request : malformed) {
+        HttpRequestParser parser;
+        parser.Feed(request);
+        if (parser.Parse() != HttpRequestParser::Result::INVALID)
+            throw std::runtime_error("HttpRequestParser accepted a malformed request");
+    }
+
+    {
+        // header exceeding the buffer
+        HttpRequestParser parser;
+        parser.Feed("GET / HTTP/1.1\r\nCookie: ");
+        while (parser.FreeSize() > 0)
+            parser.Feed(std::string(parser.FreeSize(), 'x'));
+        if (parser.Parse() != HttpRequestParser::Result::INVALID)
+            throw std::runtime_error("HttpRequestParser accepted an oversized request");
+    }
+}
+
+
+/** Masked client-to-server frame. */
+static std::string MaskedFrame(uint8_t first_byte, std::string_view payload) {
+    const char MASK[4] = {0x12, 0x34, 0x56, 0x78};
+    std::string frame = WebSocketProtocol::FrameHeader(WebSocketProtocol::OP_CONTINUATION, payload.size());
+    frame[0] = (char)first_byte;
+    frame[1] |= (char)0x80; // mask bit
+    frame.append(MASK, sizeof(MASK));
+    for (size_t i = 0; i < payload.size(); i++)
+        frame.push_back(payload[i] ^ MASK[i % 4]);
+    return frame;
+}
+
+void WebSocketProtocolTests() {
+    printf("* WebSocket protocol tests.\n");
+
+    // FIPS 180 test vectors
+    if (WebSocketProtocol::Base64Encode(WebSocketProtocol::Sha1("abc")) != "qZk+NkcGgWq6PiVxeFDCbJzQ2J0=")
+        throw std::runtime_error("SHA-1 mismatch");
+    if (WebSocketProtocol::Base64Encode(WebSocketProtocol::Sha1("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq")) != "hJg+RBw70m66rkqh+VEp5eVGcPE=")
+        throw std::runtime_error("SHA-1 multi-block mismatch");
+    if ((WebSocketProtocol::Base64Encode("f") != "Zg==") || (WebSocketProtocol::Base64Encode("fo") != "Zm8=") || (WebSocketProtocol::Base64Encode("foo") != "Zm9v"))
+        throw std::runtime_error("Base64 mismatch");
+
+    // handshake example from RFC 6455 section 1.3
+    if (WebSocketProtocol::AcceptKey("dGhlIHNhbXBsZSBub25jZQ==") != "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=")
+        throw std::runtime_error("WebSocket accept key mismatch");
+
+    // payload length encodings
+    if (WebSocketProtocol::FrameHeader(WebSocketProtocol::OP_BINARY, 125) != std::string("\x82\x7D", 2))
+        throw std::runtime_error("WebSocket 7bit length mismatch");
+    if (WebSocketProtocol::FrameHeader(WebSocketProtocol::OP_BINARY, 126) != std::string("\x82\x7E\x00\x7E", 4))
+        throw std::runtime_error("WebSocket 16bit length mismatch");
+    if (WebSocketProtocol::FrameHeader(WebSocketProtocol::OP_BINARY, 0x10000) != std::string("\x82\x7F\x00\x00\x00\x00\x00\x01\x00\x00", 10))
+        throw std::runtime_error("WebSocket 64bit length mismatch");
+
+    {
+        // data frame skipped, ping & close parsed across byte-sized chunks
+        const std::string frames = MaskedFrame(0x82, std::string(300, 'x')) + MaskedFrame(0x89, "ping") + MaskedFrame(0x88, std::string("\x03\xE8", 2));
+        WebSocketProtocol::FrameParser parser;
+        std::vector<std::pair<WebSocketProtocol::Opcode, std::string>> control;
+        for (size_t i = 0; i < frames.size(); i++) {
+            std::string_view data(frames.data() + i, 1);
+            while (!data.empty()) {
+                WebSocketProtocol::FrameParser::Result state = parser.Parse(data);
+                if (state == WebSocketProtocol::FrameParser::Result::INVALID)
+                    throw std::runtime_error("WebSocket frame rejected");
+                if (state == WebSocketProtocol::FrameParser::Result::CONTROL)
+                    control.emplace_back(parser.FrameOpcode(), parser.Payload());
+            }
+        }
+        if ((control.size() != 2) || (control[0].first != WebSocketProtocol::OP_PING) || (control[0].second != "ping")
+            || (control[1].first != WebSocketProtocol::OP_CLOSE) || (control[1].second != std::string("\x03\xE8", 2)))
+            throw std::runtime_error("WebSocket control frames not parsed");
+    }
+    {
+        // unmasked frames, fragmented & oversized control frames are rejected
+        const std::string invalid[] = {
+            WebSocketProtocol::FrameHeader(WebSocketProtocol::OP_PING, 0),
+            MaskedFrame(0x09, ""),
+            MaskedFrame(0x89, std::string(126, 'x')),
+        };
+        for (const std::string& frame : invalid) {
+            WebSocketProtocol::FrameParser parser;
+            std::string_view data(frame);
+            if (parser.Parse(data) != WebSocketProtocol::FrameParser::Result::INVALID)
+                throw std::runtime_error("WebSocket invalid frame accepted");
+        }
+    }
+}
+
+
+void StaticAssetTests() {
+    printf("* Static asset cache tests.\n");
+
+    if (Crc32("123456789") != 0xCBF43926)
+        throw std::runtime_error("CRC-32 mismatch");
+
+    // header, fixed Huffman deflate block & trailer
+    if (GzipCompressor::Compress("a") != std::string("\x1F\x8B\x08\0\0\0\0\0\0\xFF" "\x4B\x04\x00" "\x43\xBE\xB7\xE8" "\x01\0\0\0", 21))
+        throw std::runtime_error("gzip single literal mismatch");
+
+    std::string html = "<html>\n<body>\n";
+    for (int i = 0; i < 100; i++)
+        html += "    <div class=\"row\">" + std::to_string(i) + "</div>\n";
+    html += "</body>\n</html>\n";
+
+    StaticAssetCache cache;
+    cache.Add("/", "text/html; charset=utf-8", html);
+
+    auto Find = [&cache](const std::string& request_str) {
+        HttpRequestParser parser;
+        parser.Feed(request_str);
+        if (parser.Parse() != HttpRequestParser::Result::COMPLETE)
+            throw std::runtime_error("StaticAssetCache test request incomplete");
+        return cache.Find(parser.Request());
+    };
+
+    const StaticAssetCache::Response* identity = Find("GET / HTTP/1.1\r\n\r\n");
+    if (!identity || (*identity->body != html) || (identity->header->find("Content-Length: " + std::to_string(html.size()) + "\r\n") == std::string::npos))
+        throw std::runtime_error("StaticAssetCache uncompressed response mismatch");
+    if (Find("GET / HTTP/1.1\r\nAccept-Encoding: br, gzip;q=0\r\n\r\n") != identity)
+        throw std::runtime_error("StaticAssetCache ignored gzip;q=0");
+
+    const StaticAssetCache::Response* gzip = Find("GET / HTTP/1.1\r\nAccept-Encoding: gzip, deflate, br\r\n\r\n");
+    if (!gzip || (gzip == identity) || (gzip->header->find("Content-Encoding: gzip\r\n") == std::string::npos))
+        throw std::runtime_error("StaticAssetCache gzip response missing");
+    if (gzip->body->size() > html.size()/4)
+        throw std::runtime_error("StaticAssetCache gzip compression ineffective");
+    if ((DeSerialize<uint16_t>(gzip->body->data()) != 0x1F8B) || (Crc32(html) != ByteSwap(DeSerialize<uint32_t>(gzip->body->data() + gzip->body->size() - 8))))
+        throw std::runtime_error("StaticAssetCache gzip framing mismatch");
+
+    // revalidation with the ETag from the response
+    size_t etag_pos = identity->header->find("ETag: ") + 6;
+    std::string etag = identity->header->substr(etag_pos, identity->header->find("\r\n", etag_pos) - etag_pos);
+    const StaticAssetCache::Response* not_modified = Find("GET / HTTP/1.1\r\nIf-None-Match: \"other\", W/" + etag + "\r\n\r\n");
+    if (!not_modified || not_modified->body || (not_modified->header->find("HTTP/1.1 304") != 0))
+        throw std::runtime_error("StaticAssetCache not modified response mismatch");
+    if (Find("GET / HTTP/1.1\r\nIf-None-Match: \"other\"\r\n\r\n") != identity)
+        throw std::runtime_error("StaticAssetCache ETag mismatch ignored");
+
+    if (Find("GET /missing.js HTTP/1.1\r\n\r\n"))
+        throw std::runtime_error("StaticAssetCache unknown asset found");
+}
+
+
+void MetricsTests() {
+    printf("* Metrics tests.\n");
+
+    // concurrent updates from more threads than accumulator slots
+    MetricCounter counter;
+    MetricHistogram histogram({10, 100}, 0.5);
+    {
+        std::vector<std::thread> threads;
+        for (unsigned int t = 0; t < 2*MetricCounter::SLOTS; t++) {
+            threads.emplace_back([&] {
+                for (uint64_t i = 0; i < 1000; i++) {
+                    counter.Add();
+                    histogram.Observe(i % 200); // 11 values <= 10, 90 values <= 100 & 99 values above per 200
+                }
+            });
+        }
+        for (std::thread& t : threads)
+            t.join();
+    }
+    if (counter.Value() != 2*MetricCounter::SLOTS*1000)
+        throw std::runtime_error("MetricCounter lost updates");
+
+    MetricHistogram::Snapshot snapshot = histogram.Read();
+    const uint64_t per_thread[] = {5*11, 5*90, 5*99};
+    for (size_t b = 0; b < 3; b++) {
+        if (snapshot.counts[b] != 2*MetricCounter::SLOTS*per_thread[b])
+            throw std::runtime_error("MetricHistogram bucket count mismatch");
+    }
+    if ((snapshot.count != 2*MetricCounter::SLOTS*1000) || (snapshot.sum != 2*MetricCounter::SLOTS*5*(199*200/2)))
+        throw std::runtime_error("MetricHistogram count or sum mismatch");
+
+    // Prometheus text format with cumulative buckets & scaled bounds
+    MetricHistogram latency({1000, 2000}, 1e-3);
+    latency.Observe(500);
+    latency.Observe(1500);
+    latency.Observe(5000);
+    PrometheusWriter writer;
+    writer.Counter("frames_total", "Frames.", 42);
+    writer.Histogram("latency_seconds", "Latency.", latency);
+    const std::string expected =
+        "# HELP frames_total Frames.\n"
+        "# TYPE frames_total counter\n"
+        "frames_total 42\n"
+        "# HELP latency_seconds Latency.\n"
+        "# TYPE latency_seconds histogram\n"
+        "latency_seconds_bucket{le=\"1\"} 1\n"
+        "latency_seconds_bucket{le=\"2\"} 2\n"
+        "latency_seconds_bucket{le=\"+Inf\"} 3\n"
+        "latency_seconds_sum 7\n"
+        "latency_seconds_count 3\n";
+    if (writer.Text() != expected)
+        throw std::runtime_error("Prometheus text format mismatch");
+}
+
+
+void FramePipelineTests() {
+    printf("* Frame pipeline tests.\n");
+
+    // SPSC queue: items arrive in order under concurrent push & pop
+    {
+        constexpr uintptr_t ITEM_COUNT = 100000;
+        SpscQueue<void*> queue(4);
+        std::thread consumer([&] {
+            for (uintptr_t expected = 1; expected <= ITEM_COUNT; ) {
+                void* item = nullptr;
+                if (!queue.TryPop(item)) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                if ((uintptr_t)item != expected)
+                    throw std::runtime_error("SpscQueue reordered or lost items");
+                expected++;
+            }
+        });
+        for (uintptr_t i = 1; i <= ITEM_COUNT; ) {
+            if (queue.TryPush((void*)i))
+                i++;
+            else
+                std::this_thread::yield();
+        }
+        consumer.join();
+        if (queue.Size() != 0)
+            throw std::runtime_error("SpscQueue not drained");
+    }
+
+    // SPSC queue: producer reclaims the oldest item when full
+    {
+        int items[3] = {};
+        SpscQueue<int*> queue(2);
+        if (!queue.TryPush(&items[0]) || !queue.TryPush(&items[1]) || queue.TryPush(&items[2]))
+            throw std::runtime_error("SpscQueue capacity mismatch");
+        int* oldest = nullptr;
+        if (!queue.TryPop(oldest) || (oldest != &items[0]) || !queue.TryPush(&items[2]) || (queue.Size() != 2))
+            throw std::runtime_error("SpscQueue reclaim failed");
+    }
+
+    struct Frame {
+        uint64_t seq = 0;
+    };
+    constexpr uint64_t FRAME_COUNT = 20000;
+
+    // BLOCK policy: slow consumer throttles the producer without losing frames
+    {
+        std::vector<Frame> frames(4);
+        std::vector<Frame*> pool;
+        for (Frame& f : frames)
+            pool.push_back(&f);
+        MetricGauge occupancy;
+        FrameChannel<Frame> channel(pool, QueuePolicy::BLOCK, &occupancy);
+        if (channel.Capacity() != 4)
+            throw std::runtime_error("FrameChannel capacity mismatch");
+
+        std::thread consumer([&] {
+            uint64_t expected = 0;
+            while (Frame* f = channel.Receive()) {
+                if (f->seq != expected++)
+                    throw std::runtime_error("FrameChannel lost or reordered frames");
+                if (expected % 1000 == 0)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1)); // slow consumer
+                channel.Release(f);
+            }
+            if (expected != FRAME_COUNT)
+                throw std::runtime_error("FrameChannel frame count mismatch");
+        });
+        for (uint64_t i = 0; i < FRAME_COUNT; i++) {
+            Frame* f = channel.Acquire();
+            if ((i % 7) == 3) {
+                channel.Discard(f); // aborted frame is handed out again
+                f = channel.Acquire();
+            }
+            f->seq = i;
+            channel.Submit(f);
+        }
+        channel.Close();
+        consumer.join();
+        if ((channel.Dropped() != 0) || (occupancy.Value() != 0))
+            throw std::runtime_error("FrameChannel BLOCK policy dropped frames");
+    }
+
+    // DROP_OLDEST policy: producer never waits, and consumer sees an increasing subsequence
+    {
+        std::vector<Frame> frames(4);
+        std::vector<Frame*> pool;
+        for (Frame& f : frames)
+            pool.push_back(&f);
+        MetricGauge occupancy;
+        MetricCounter drops;
+        FrameChannel<Frame> channel(pool, QueuePolicy::DROP_OLDEST, &occupancy, &drops);
+
+        uint64_t received = 0;
+        std::thread consumer([&] {
+            uint64_t prev = 0;
+            while (Frame* f = channel.Receive()) {
+                if ((received > 0) && (f->seq <= prev))
+                    throw std::runtime_error("FrameChannel reordered frames");
+                prev = f->seq;
+                received++;
+                if (received % 100 == 0)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1)); // slow consumer
+                channel.Release(f);
+            }
+            if (prev != FRAME_COUNT - 1)
+                throw std::runtime_error("FrameChannel lost the latest frame");
+        });
+        for (uint64_t i = 0; i < FRAME_COUNT; i++) {
+            Frame* f = channel.Acquire();
+            f->seq = i;
+            channel.Submit(f);
+        }
+        channel.Close();
+        consumer.join();
+        if ((received + channel.Dropped() != FRAME_COUNT) || (drops.Value() != channel.Dropped()) || (occupancy.Value() != 0))
+            throw std::runtime_error("FrameChannel DROP_OLDEST accounting mismatch");
+    }
+}
+
+
+void FramePoolTests() {
+    printf("* Frame pool tests.\n");
+    constexpr unsigned int WIDTH = 64;
+    constexpr unsigned int HEIGHT = 32;
+
+    struct Frame {
+        Frame() : pixels(WIDTH*HEIGHT) {
+        }
+
+        AlignedArray<R8G8B8A8> pixels;
+        uint64_t               seq = 0;
+    };
+    Frame frames[4];
+    std::vector<Frame*> pool;
+    for (Frame& f : frames) {
+        if (((uintptr_t)f.pixels.data() % AlignedArray<R8G8B8A8>::ALIGNMENT) != 0)
+            throw std::runtime_error("AlignedArray misaligned");
+        pool.push_back(&f);
+    }
+    FrameChannel<Frame> channel(pool, QueuePolicy::BLOCK);
+
+    // consumer checks the submission order & pixel content
+    std::atomic<uint64_t> received = 0;
+    std::thread consumer([&] {
+        uint64_t expected = 0;
+        while (Frame* f = channel.Receive()) {
+            if ((f->seq != expected++) || (f->pixels.data()[WIDTH*HEIGHT - 1].r != (unsigned char)f->seq))
+                throw std::runtime_error("FrameChannel frame mismatch");
+            channel.Release(f);
+            received++;
+        }
+    });
+
+    // producer with two frames in flight, and every 5th frame released without submission
+    uint64_t seq = 0;
+    auto produce = [&] (unsigned int iterations) {
+        for (unsigned int i = 0; i < iterations; i++) {
+            Frame* first = channel.Acquire();
+            Frame* second = channel.Acquire();
+            Frame* filled[2] = {first, second};
+            if (i % 5 == 0) {
+                channel.Discard(second);
+                filled[1] = nullptr;
+            }
+            for (Frame* f : filled) {
+                if (!f)
+                    continue;
+                f->seq = seq++;
+                memset(f->pixels.data(), (unsigned char)f->seq, f->pixels.size()*sizeof(R8G8B8A8));
+                channel.Submit(f);
+            }
+        }
+    };
+    // banded color conversion into preallocated planes, like the conversion stage does per frame
+    WorkerPool workers(4);
+    AlignedArray<uint8_t> yuv(WIDTH*HEIGHT*3/2);
+    uint8_t* const planes[3] = {yuv.data(), yuv.data() + WIDTH*HEIGHT, yuv.data() + WIDTH*HEIGHT*5/4};
+    const int linesize[3] = {(int)WIDTH, (int)WIDTH/2, (int)WIDTH/2};
+    auto convert = [&] (unsigned int iterations) {
+        for (unsigned int i = 0; i < iterations; i++)
+            RGBAToYUV420(workers, frames[0].pixels.data(), WIDTH, WIDTH, HEIGHT, planes, linesize);
+    };
+
+    produce(100); // warm-up
+    convert(10);
+
+    // steady state without heap allocations in either thread
+    const uint64_t allocations = s_allocation_count;
+    produce(1000);
+    while (received < seq)
+        std::this_thread::yield();
+    if (s_allocation_count != allocations)
+        throw std::runtime_error("Frame pool allocated memory in steady state");
+    convert(100);
+    if (s_allocation_count != allocations)
+        throw std::runtime_error("Banded color conversion allocated memory");
+
+    channel.Close();
+    consumer.join();
+}
+
+
+void FramePacerTests() {
+    printf("* Frame pacing tests.\n");
+    using namespace std::chrono_literals;
+    const FILETIME START_TIME = U64ToFileTime(1000*FILETIME_PER_SECONDS);
+
+    {
+        // deterministic release times with a start in the future
+        const FramePacer::clock::time_point start = FramePacer::clock::now() + 1h;
+        FramePacer pacer(25, START_TIME, start); // 40ms frame interval
+        if (pacer.NextDeadline() != start)
+            throw std::runtime_error("FramePacer first deadline mismatch");
+
+        FramePacer::Tick tick = pacer.Advance(start);
+        if ((tick.index != 0) || (tick.skipped != 0) || (pacer.NextDeadline() != start + 40ms))
+            throw std::runtime_error("FramePacer punctual tick mismatch");
+
+        // late by less than an interval: released without skipping, and the next deadline is not shifted
+        tick = pacer.Advance(start + 75ms);
+        if ((tick.index != 1) || (tick.skipped != 0) || (tick.deadline != start + 40ms) || (pacer.NextDeadline() != start + 80ms))
+            throw std::runtime_error("FramePacer late tick mismatch");
+
+        // late by more than an interval: missed deadlines are skipped
+        tick = pacer.Advance(start + 210ms);
+        if ((tick.index != 5) || (tick.skipped != 3) || (tick.deadline != start + 200ms) || (pacer.NextDeadline() != start + 240ms))
+            throw std::runtime_error("FramePacer skipped tick mismatch");
+        if (FileTimeToU64(tick.capture_time) != FileTimeToU64(START_TIME) + 210*FILETIME_PER_SECONDS/1000)
+            throw std::runtime_error("FramePacer capture time mismatch");
+
+        // lateness 0ms, 35ms & 10ms
+        FramePacer::Stats stats = pacer.GetStats();
+        if ((stats.ticks != 3) || (stats.skipped != 3) || (std::abs(stats.mean_lateness - 0.015) > 1e-9) || (std::abs(stats.max_lateness - 0.035) > 1e-9))
+            throw std::runtime_error("FramePacer stats mismatch");
+        if (std::abs(stats.jitter - std::sqrt((0.015*0.015 + 0.020*0.020 + 0.005*0.005)/3)) > 1e-9)
+            throw std::runtime_error("FramePacer jitter mismatch");
+
+        // deadlines are computed from the index, so that non-integer intervals don't drift
+        FramePacer pacer30(30, START_TIME, start);
+        for (int i = 0; i < 3000; i++)
+            pacer30.Advance(pacer30.NextDeadline());
+        if (pacer30.NextDeadline() != start + 100s)
+            throw std::runtime_error("FramePacer deadline drift");
+    }
+    {
+        // construction after the stream start: first deadline is the next one on the stream's frame grid
+        const FramePacer::clock::time_point start = FramePacer::clock::now() - 1010ms;
+        FramePacer pacer(25, START_TIME, start);
+        if ((pacer.NextDeadline() != start + 1040ms) && (pacer.NextDeadline() != start + 1080ms)) // depending on scheduling delays
+            throw std::runtime_error("FramePacer grid alignment mismatch");
+    }
+    {
+        // real-time pacing: no frame released before its deadline
+        const FramePacer::clock::time_point start = FramePacer::clock::now();
+        FramePacer pacer(100, START_TIME, start);
+        FramePacer::Tick tick;
+        for (int i = 0; i < 20; i++) {
+            tick = pacer.WaitNextFrame();
+            if (tick.time < tick.deadline)
+                throw std::runtime_error("FramePacer released a frame early");
+        }
+        if (tick.index + 1 < 20)
+            throw std::runtime_error("FramePacer index mismatch");
+    }
+}
+
+
+void TileHashTests() {
+    printf("* Tile hash damage detection tests.\n");
+
+    std::mt19937 rng(7);
+    auto random_image = [&](unsigned int stride, unsigned int height) {
+        std::vector<R8G8B8A8> img(stride*height);
+        for (R8G8B8A8& px : img)
+            px = {(unsigned char)rng(), (unsigned char)rng(), (unsigned char)rng(), 255};
+        return img;
+    };
+
+    // SIMD kernel matches the scalar kernel, also for partial tiles
+    const unsigned int TILE_DIMS[][2] = {{64, 64}, {2, 2}, {6, 4}, {30, 10}, {62, 64}};
+    for (auto& dims : TILE_DIMS) {
+        const unsigned int stride = dims[0] + 3; // padded rows
+        std::vector<R8G8B8A8> img = random_image(stride, dims[1]);
+        TileHash scalar, simd;
+        HashTileRows_Scalar(img.data(), stride, dims[0], dims[1], scalar);
+        HashTileRows(img.data(), stride, dims[0], dims[1], simd);
+        if (scalar != simd)
+            throw std::runtime_error("tile hash kernel mismatch");
+    }
+
+    const unsigned int width = 200;  // partial tile column
+    const unsigned int height = 230; // partial tile row
+    std::vector<R8G8B8A8> img = random_image(width, height);
+    TileHashGrid prev(width, height), cur(width, height);
+    std::vector<RowBand> bands;
+    bands.reserve(cur.TilesY());
+    if ((cur.TilesX() != 4) || (cur.TilesY() != 4))
+        throw std::runtime_error("tile grid size mismatch");
+
+    // invalid grid counts as fully changed
+    cur.Compute(img.data(), width);
+    if ((cur.ChangedBands(prev, bands) != height) || (bands.size() != 1) || (bands[0].begin != 0) || (bands[0].end != height))
+        throw std::runtime_error("invalid tile grid not fully changed");
+    if (cur.Equals(prev))
+        throw std::runtime_error("invalid tile grid equals valid grid");
+
+    // unchanged frame
+    prev.Compute(img.data(), width);
+    if (!cur.Equals(prev) || (cur.ChangedBands(prev, bands) != 0) || !bands.empty())
+        throw std::runtime_error("unchanged frame detected as changed");
+
+    // single pixel change in the last tile row
+    img[229*width + 199].g ^= 1;
+    cur.Compute(img.data(), width);
+    if (cur.Equals(prev) || (cur.ChangedBands(prev, bands) != 230 - 192) || (bands.size() != 1) || (bands[0].begin != 192) || (bands[0].end != 230))
+        throw std::runtime_error("single pixel change not detected");
+
+    // adjacent tile rows are merged into one band, separate ones are not
+    prev.Compute(img.data(), width);
+    img[10*width + 5].r ^= 0x80;
+    img[70*width + 150].b ^= 0x01;
+    img[200*width + 64].r ^= 0x10;
+    cur.Compute(img.data(), width);
+    if ((cur.ChangedBands(prev, bands) != 128 + 38) || (bands.size() != 2) || (bands[0].begin != 0) || (bands[0].end != 128) || (bands[1].begin != 192))
+        throw std::runtime_error("changed tile rows mismatch");
+
+    // changes with zero sum & zero first moment within a hash lane
+    for (unsigned int x = 20; x <= 28; x += 4)
+        img[8*width + x].g = 100;
+    prev.Compute(img.data(), width);
+    img[8*width + 20].g += 1;
+    img[8*width + 24].g -= 2;
+    img[8*width + 28].g += 1;
+    cur.Compute(img.data(), width);
+    if (cur.Equals(prev))
+        throw std::runtime_error("balanced pixel changes not detected");
+
+    // moved content with an unchanged pixel sum
+    img[4*width + 0] = {10, 20, 30, 255};
+    img[4*width + 4] = {40, 50, 60, 255}; // same hash lane
+    prev.Compute(img.data(), width);
+    std::swap(img[4*width + 0], img[4*width + 4]);
+    cur.Compute(img.data(), width);
+    if (cur.Equals(prev))
+        throw std::runtime_error("moved pixels not detected");
+
+    // bottom-up image addressed from the top row gives the same hashes
+    std::vector<R8G8B8A8> flipped(img.size());
+    for (unsigned int y = 0; y < height; y++)
+        memcpy(&flipped[(height - 1 - y)*width], &img[y*width], width*sizeof(R8G8B8A8));
+    prev.Compute(img.data(), width);
+    cur.Compute(flipped.data() + (height - 1)*width, -(ptrdiff_t)width);
+    if (!cur.Equals(prev))
+        throw std::runtime_error("bottom-up tile hash mismatch");
+
+    // converting only the changed bands into the previous conversion gives the same result as a full conversion
+    const int linesize[3] = {(int)width, (int)width/2, (int)width/2};
+    std::vector<uint8_t> expected[3], actual[3];
+    for (int i = 0; i < 3; i++) {
+        expected[i].resize(linesize[i] * (i ? height/2 : height));
+        actual[i].resize(expected[i].size());
+    }
+    uint8_t* const expected_planes[3] = {expected[0].data(), expected[1].data(), expected[2].data()};
+    uint8_t* const actual_planes[3] = {actual[0].data(), actual[1].data(), actual[2].data()};
+
+    RGBAToYUV420(img.data(), width, width, height, actual_planes, linesize);
+    prev.Compute(img.data(), width);
+    img[100*width + 20] = {1, 2, 3, 255};
+    cur.Compute(img.data(), width);
+    cur.ChangedBands(prev, bands);
+    for (const RowBand& band : bands) {
+        uint8_t* const band_planes[3] = {actual_planes[0] + band.begin*linesize[0], actual_planes[1] + band.begin/2*linesize[1], actual_planes[2] + band.begin/2*linesize[2]};
+        RGBAToYUV420(img.data() + band.begin*width, width, width, band.end - band.begin, band_planes, linesize);
+    }
+    RGBAToYUV420(img.data(), width, width, height, expected_planes, linesize);
+    for (int i = 0; i < 3; i++) {
+        if (actual[i] != expected[i])
+            throw std::runtime_error("partial color conversion mismatch");
+    }
+
+    // hashing & comparing without heap allocations
+    const uint64_t allocations = s_allocation_count;
+    for (int i = 0; i < 10; i++) {
+        cur.Compute(img.data(), width);
+        cur.ChangedBands(prev, bands);
+        prev = cur;
+    }
+    if (s_allocation_count != allocations)
+        throw std::runtime_error("tile hashing allocated memory");
+}
+
+void BoxTrackerTests() {
+    printf("* Incremental box tracker tests.\n");
+
+    // build stream with boxes of various kinds
+    std::vector<std::vector<char>> boxes;
+    {
+        std::vector<char> ftyp;
+        size_t start = BeginAtom(ftyp, "ftyp");
+        ftyp.insert(ftyp.end(), {'m', 'p', '4', '2', 0, 0, 0, 0, 'm', 'p', '4', '1', 'i', 's', 'o', 'm'});
+        EndAtom(ftyp, start);
+        boxes.push_back(ftyp);
+    }
+    {
+        std::vector<char> moov;
+        size_t start = BeginAtom(moov, "moov");
+        for (int i = 0; i < 100; i++)
+            moov.push_back((char)(3*i));
+        EndAtom(moov, start);
+        boxes.push_back(moov);
+    }
+    for (uint32_t seq_nr = 1; seq_nr <= 3; seq_nr++) {
+        boxes.push_back(MakeMoofMF(seq_nr, seq_nr, 1000, 5000));
+        boxes.push_back(MakeMdat(5000*seq_nr, seq_nr == 2));
+    }
+    {
+        std::vector<char> free; // box without payload
+        EndAtom(free, BeginAtom(free, "free"));
+        boxes.push_back(free);
+    }
+
+    std::string stream;
+    for (auto& box : boxes)
+        stream.append(box.data(), box.size());
+
+    const size_t CHUNK_SIZES[] = {1, 2, 3, 7, 15, 64, 1000, stream.size()};
+    for (size_t chunk_size : CHUNK_SIZES) {
+        BoxTracker tracker{"moov"};
+        size_t box_idx = 0;
+        uint64_t offset = 0;
+        auto on_box = [&](const BoxTracker::Box& box, std::string_view data) {
+            if (box_idx >= boxes.size())
+                throw std::runtime_error("box tracker: too many boxes");
+
+            const std::vector<char>& expected = boxes[box_idx++];
+            if ((memcmp(box.type, GetAtomType(expected.data()), 4) != 0) || (box.size != expected.size()) || (box.offset != offset))
+                throw std::runtime_error("box tracker: box mismatch");
+            offset += box.size;
+
+            bool is_moov = (memcmp(box.type, "moov", 4) == 0);
+            if (is_moov != (data == std::string_view(expected.data(), expected.size())))
+                throw std::runtime_error("box tracker: captured data mismatch");
+            if (!is_moov && !data.empty())
+                throw std::runtime_error("box tracker: unexpected capture");
+        };
+
+        for (size_t pos = 0; pos < stream.size(); pos += chunk_size)
+            tracker.Feed(std::string_view(stream).substr(pos, chunk_size), on_box);
+
+        if ((box_idx != boxes.size()) || (tracker.Position() != stream.size()) || tracker.InsideBox())
+            throw std::runtime_error("box tracker: incomplete stream");
+    }
+
+    // captured boxes with a huge or open-ended declared size are rejected before allocating
+    const char HUGE_MOOV[16] = {0, 0, 0, 1, 'm', 'o', 'o', 'v', 0x7F, 0, 0, 0, 0, 0, 0, 0};
+    const char OPEN_MOOV[8] = {0, 0, 0, 0, 'm', 'o', 'o', 'v'};
+    for (std::string_view header : {std::string_view(HUGE_MOOV, sizeof(HUGE_MOOV)), std::string_view(OPEN_MOOV, sizeof(OPEN_MOOV))}) {
+        BoxTracker tracker{"moov"};
+        bool rejected = false;
+        try {
+            tracker.Feed(header, [](const BoxTracker::Box&, std::string_view) {});
+        } catch (const std::runtime_error&) {
+            rejected = true;
+        }
+        if (!rejected)
+            throw std::runtime_error("box tracker: oversized capture not rejected");
+    }
+}
+
+void MoovEditingTests() {
+    printf("* Init segment (moov) editing tests.\n");
+
+    const uint64_t START_TIME = 3829766400; // 2025-05-11 in MPEG4 epoch
+    const double DPI = 96;
+    const double XFORM[6] = {0.5, 0, 0, 0.25, 10, -20};
+
+    for (bool optional_atoms : {false, true}) {
+        std::vector<char> moov = MakeMoovMF(1920, 1080, optional_atoms);
+
+        // sender-side editing
+        MP4StreamEditor sender(START_TIME);
+        sender.SetDPI(DPI);
+        sender.SetXform(XFORM);
+        std::string_view edited = sender.EditStream(std::string_view(moov.data(), moov.size()));
+        if (sender.GetTimeScale() != 50000)
+            throw std::runtime_error("moov timescale mismatch");
+
+        // receiver-side parsing
+        std::vector<char> init_segment = MakeFtyp();
+        init_segment.insert(init_segment.end(), edited.begin(), edited.end());
+
+        MP4StreamEditor receiver;
+        if (!receiver.ParseStream(std::string_view(init_segment.data(), init_segment.size())))
+            throw std::runtime_error("moov not parsed");
+
+        double xform[6]{};
+        receiver.GetXform(xform);
+        if ((receiver.GetStartTime() != START_TIME) || (receiver.GetDPI() != DPI) || !std::equal(xform, xform + 6, XFORM))
+            throw std::runtime_error("moov parameter mismatch");
+
+        // restart at the next box boundary, like after a receiver-side seek past the rest of the current box
+        {
+            const char free_box[16] = {0, 0, 0, 16, 'f', 'r', 'e', 'e'};
+            MP4StreamEditor skipped;
+            skipped.ParseStream(std::string_view(free_box, 10)); // header & partial payload
+            if ((skipped.ParsePosition() != 10) || (skipped.NextParseBoxOffset() != sizeof(free_box)))
+                throw std::runtime_error("next box boundary mismatch");
+            skipped.ResetParse(skipped.NextParseBoxOffset());
+            if (!skipped.ParseStream(std::string_view(init_segment.data(), init_segment.size())))
+                throw std::runtime_error("moov not parsed after skipping to the next box");
+        }
+
+        // restart at the stream start after a malformed box
+        const char malformed[8] = {0, 0, 0, 4, 'f', 'r', 'e', 'e'}; // size smaller than the header
+        MP4StreamEditor recovered;
+        bool rejected = false;
+        try {
+            recovered.ParseStream(std::string_view(malformed, sizeof(malformed)));
+        } catch (const std::exception&) {
+            rejected = true;
+        }
+        if (!rejected)
+            throw std::runtime_error("malformed box not rejected");
+        recovered.ResetParse();
+        if (!recovered.ParseStream(std::string_view(init_segment.data(), init_segment.size())))
+            throw std::runtime_error("moov not parsed after reset");
+    }
+
+    // all "avc1" sample entries are patched, also in repeated init segments with the same layout
+    MP4StreamEditor sender(START_TIME);
+    sender.SetDPI(DPI);
+    for (int segment = 0; segment < 2; segment++) {
+        std::vector<char> moov = MakeMoovMF(1920, 1080, false, 2);
+        sender.EditStream(std::string_view(moov.data(), moov.size()));
+
+        const char AVC1[] = {'a', 'v', 'c', '1'};
+        unsigned int entries = 0;
+        for (auto it = std::search(moov.begin(), moov.end(), AVC1, AVC1 + 4); it != moov.end(); it = std::search(it + 4, moov.end(), AVC1, AVC1 + 4)) {
+            const char* avc1 = &*it - 4; // atom start
+            if ((ReadFixed1616(avc1 + 36) != DPI) || (ReadFixed1616(avc1 + 40) != DPI))
+                throw std::runtime_error("avc1 DPI not updated");
+            entries++;
+        }
+        if (entries != 2)
+            throw std::runtime_error("avc1 entry count mismatch");
+    }
+}
+
+void MoovLayoutCacheTests() {
+    printf("* Init segment (moov) layout cache tests.\n");
+
+    const uint64_t START_TIME = 3829766400; // 2025-05-11 in MPEG4 epoch
+    const double XFORM[6] = {0.5, 0, 0, 0.25, 10, -20};
+
+    // repeated init segments with DPI changes, alternating between layouts with and without optional atoms
+    MP4StreamEditor sender(START_TIME);
+    sender.SetXform(XFORM);
+    const std::pair<bool, double> SEQUENCE[] = {{false, 96}, {false, 120}, {true, 120}, {false, 144}, {false, 72}};
+    for (auto [optional_atoms, dpi] : SEQUENCE) {
+        std::vector<char> moov = MakeMoovMF(1920, 1080, optional_atoms);
+        std::vector<char> ref_moov = moov;
+
+        sender.SetDPI(dpi);
+        std::string_view edited = sender.EditStream(std::string_view(moov.data(), moov.size()));
+
+        // compare against full traversal by a fresh editor
+        MP4StreamEditor ref_editor(START_TIME);
+        ref_editor.SetDPI(dpi);
+        ref_editor.SetXform(XFORM);
+        std::string_view ref_edited = ref_editor.EditStream(std::string_view(ref_moov.data(), ref_moov.size()));
+
+        if (edited != ref_edited)
+            throw std::runtime_error("cached moov patching mismatch");
+        if (sender.GetTimeScale() != ref_editor.GetTimeScale())
+            throw std::runtime_error("cached moov timescale mismatch");
+    }
+}
+
+/** Connect to a local HTTP server. Optionally limit the socket receive buffer size. */
+static SOCKET ConnectClient(const char* port, int receive_buffer_size = 0) {
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    addrinfo* addr = nullptr;
+    if (getaddrinfo("127.0.0.1", port, &hints, &addr))
+        throw std::runtime_error("getaddrinfo failure");
+
+    SOCKET sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (receive_buffer_size)
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char*)&receive_buffer_size, sizeof(receive_buffer_size));
+    while (connect(sock, addr->ai_addr, (int)addr->ai_addrlen) == SOCKET_ERROR)
+        Sleep(10); // server not yet listening
+    freeaddrinfo(addr);
+    return sock;
+}
+
+/** Connect to a local HTTP server and request the video stream. Optionally limit the socket receive buffer size. */
+static SOCKET RequestStream(const char* port, int receive_buffer_size = 0) {
+    SOCKET sock = ConnectClient(port, receive_buffer_size);
+    const std::string request = "GET /movie.mp4 HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    send(sock, request.data(), (int)request.size(), 0);
+    return sock;
+}
+
+/** Receive the video stream until the server closes the connection. Returns the stream content without HTTP header. */
+static std::string ReceiveStream(SOCKET sock) {
+    std::string response;
+    char buf[16*1024];
+    for (;;) {
+        int res = recv(sock, buf, sizeof(buf), 0);
+        if (res <= 0)
+            break;
+        response.append(buf, res);
+    }
+    closesocket(sock);
+
+    size_t header_end = response.find("\r\n\r\n");
+    if (header_end == std::string::npos)
+        return "";
+    return response.substr(header_end + 4);
+}
+
+static std::string ReceiveStream(const char* port) {
+    return ReceiveStream(RequestStream(port));
+}
+
+/** Send a request on a new connection and close it after receiving the response header. Returns the response header. */
+static std::string ShortRequest(const char* port, const std::string& request) {
+    SOCKET sock = ConnectClient(port);
+    send(sock, request.data(), (int)request.size(), 0);
+
+    std::string response;
+    char buf[1024];
+    while (response.find("\r\n\r\n") == std::string::npos) {
+        int res = recv(sock, buf, sizeof(buf), 0);
+        if (res <= 0)
+            break;
+        response.append(buf, res);
+    }
+    closesocket(sock);
+    return response;
+}
+
+void WebStreamFanOutTests() {
+    printf("* WebStream multi-client fan-out tests.\n");
+    const char PORT[] = "8091";
+    const unsigned int CLIENT_COUNT = 50;
+
+    WSAData wsa_data{};
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data))
+        throw std::runtime_error("WSAStartup failure");
+
+    // init segment followed by fragments
+    std::vector<std::vector<char>> writes;
+    {
+        std::vector<char> init = MakeFtyp();
+        std::vector<char> moov = MakeMoovMF(1920, 1080);
+        init.insert(init.end(), moov.begin(), moov.end());
+        writes.push_back(init);
+    }
+    for (uint32_t seq_nr = 1; seq_nr <= 100; seq_nr++) {
+        writes.push_back(MakeMoofMF(seq_nr, 1, 1000, 10000 + seq_nr));
+        writes.push_back(MakeMdat(10000 + seq_nr));
+    }
+    std::string expected;
+    for (const std::vector<char>& buf : writes)
+        expected.append(buf.data(), buf.size());
+
+    std::vector<std::string> received(CLIENT_COUNT);
+    std::vector<std::thread> clients;
+    for (unsigned int i = 0; i < CLIENT_COUNT; i++)
+        clients.emplace_back([&received, &PORT, i] { received[i] = ReceiveStream(PORT); });
+
+    {
+        // client queue bounds above the stream size, since all fragments are written at once
+        WebStream server(PORT, /*ring_capacity*/512, /*queue_fragments*/256);
+        while (server.StreamClientCount() < CLIENT_COUNT)
+            Sleep(10);
+
+        for (const std::vector<char>& buf : writes)
+            server.WriteBytes(std::string_view(buf.data(), buf.size()));
+    } // all fragments are sent before the server closes
+
+    for (std::thread& client : clients)
+        client.join();
+
+    for (const std::string& stream : received) {
+        if (stream != expected)
+            throw std::runtime_error("WebStream client did not receive the full stream");
+    }
+
+    WSACleanup();
+}
+
+void LateJoinTests() {
+    printf("* WebStream late-joining client tests.\n");
+    const char PORT[] = "8092";
+    const uint32_t GOP_SIZE = 5;
+
+    // key frame detection from sample flags, before and after editing
+    {
+        MP4StreamEditor editor(0);
+        for (bool key_frame : {true, false}) {
+            std::vector<char> moof = MakeMoofMF(1, 3, 1000, 4321, key_frame);
+            std::string_view moof_buf(moof.data(), moof.size());
+            if (MP4StreamEditor::IsKeyFrameFragment(moof_buf) != key_frame)
+                throw std::runtime_error("key frame detection failure");
+            if (MP4StreamEditor::IsKeyFrameFragment(editor.EditStream(moof_buf)) != key_frame)
+                throw std::runtime_error("key frame detection failure after editing");
+        }
+
+        std::vector<char> moof = MakeMoofFF(1, 0, 3, 1024, 4321);
+        if (!MP4StreamEditor::IsKeyFrameFragment(std::string_view(moof.data(), moof.size())))
+            throw std::runtime_error("FFMPEG key frame detection failure");
+    }
+
+    WSAData wsa_data{};
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data))
+        throw std::runtime_error("WSAStartup failure");
+
+    // init segment followed by fragments with a key frame every GOP_SIZE frames
+    std::string init = ToString(MakeFtyp()) + ToString(MakeMoovMF(1920, 1080));
+    auto make_fragment = [](uint32_t seq_nr) {
+        return ToString(MakeMoofMF(seq_nr, 1, 1000, 1000 + seq_nr, (seq_nr - 1) % GOP_SIZE == 0)) + ToString(MakeMdat(1000 + seq_nr));
+    };
+    const uint32_t JOIN_SEQ_NR = 13; // late client joins after this fragment (mid-GOP)
+
+    std::string stream_before = init;
+    for (uint32_t seq_nr = 1; seq_nr <= JOIN_SEQ_NR; seq_nr++)
+        stream_before += make_fragment(seq_nr);
+    std::string stream_after;
+    for (uint32_t seq_nr = JOIN_SEQ_NR + 1; seq_nr <= 2*JOIN_SEQ_NR; seq_nr++)
+        stream_after += make_fragment(seq_nr);
+
+    // late client expects the init segment & current GOP, followed by the rest of the stream
+    std::string expected_late = init;
+    for (uint32_t seq_nr = JOIN_SEQ_NR - (JOIN_SEQ_NR - 1) % GOP_SIZE; seq_nr <= JOIN_SEQ_NR; seq_nr++)
+        expected_late += make_fragment(seq_nr);
+    expected_late += stream_after;
+
+    std::string received_early, received_late;
+    std::thread early_client([&] { received_early = ReceiveStream(PORT); });
+    std::thread late_client;
+    {
+        WebStream server(PORT);
+        while (server.StreamClientCount() < 1)
+            Sleep(10); // construction doesn't wait for clients
+
+        // write in chunks that don't align with box boundaries
+        auto write_chunked = [&server](const std::string& data) {
+            const size_t CHUNK_SIZE = 777;
+            for (size_t pos = 0; pos < data.size(); pos += CHUNK_SIZE)
+                server.WriteBytes(std::string_view(data).substr(pos, CHUNK_SIZE));
+        };
+        write_chunked(stream_before);
+
+        late_client = std::thread([&] { received_late = ReceiveStream(PORT); });
+        while (server.StreamClientCount() < 2)
+            Sleep(10);
+
+        write_chunked(stream_after);
+    }
+    early_client.join();
+    late_client.join();
+
+    if (received_early != stream_before + stream_after)
+        throw std::runtime_error("WebStream first client did not receive the full stream");
+    if (received_late != expected_late)
+        throw std::runtime_error("WebStream late client did not start with init segment & current GOP");
+
+    WSACleanup();
+}
+
+void NonBlockingStartupTests() {
+    printf("* WebStream non-blocking startup tests.\n");
+    const char PORT[] = "8090";
+
+    WSAData wsa_data{};
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data))
+        throw std::runtime_error("WSAStartup failure");
+
+    std::string init = ToString(MakeFtyp()) + ToString(MakeMoovMF(1920, 1080));
+    auto make_fragment = [](uint32_t seq_nr, bool key_frame) {
+        return ToString(MakeMoofMF(seq_nr, 1, 1000, 1000 + seq_nr, key_frame)) + ToString(MakeMdat(1000 + seq_nr));
+    };
+
+    std::string received_first, received_second;
+    std::thread first_client, second_client;
+    {
+        // construction & writing without clients
+        WebStream server(PORT);
+        if (!server.Idle())
+            throw std::runtime_error("WebStream not idle without clients");
+        server.WriteBytes(init);
+        server.WriteBytes(make_fragment(1, true)); // idle GOP
+
+        // first client discards the GOP encoded while idle and requests a key frame
+        first_client = std::thread([&] { received_first = ReceiveStream(PORT); });
+        while (server.StreamClientCount() < 1)
+            Sleep(10);
+        if (server.Idle())
+            throw std::runtime_error("WebStream idle with a streaming client");
+        if (!server.ConsumeKeyFrameRequest() || server.ConsumeKeyFrameRequest())
+            throw std::runtime_error("WebStream key frame request not returned exactly once");
+
+        // client joining after the key frame starts with the cached GOP
+        server.WriteBytes(make_fragment(2, true));
+        server.WriteBytes(make_fragment(3, false));
+        second_client = std::thread([&] { received_second = ReceiveStream(PORT); });
+        while (server.StreamClientCount() < 2)
+            Sleep(10);
+        if (server.ConsumeKeyFrameRequest())
+            throw std::runtime_error("WebStream key frame requested despite cached GOP");
+        server.WriteBytes(make_fragment(4, false));
+    }
+    first_client.join();
+    second_client.join();
+
+    const std::string expected = init + make_fragment(2, true) + make_fragment(3, false) + make_fragment(4, false);
+    if ((received_first != expected) || (received_second != expected))
+        throw std::runtime_error("WebStream clients did not start with init segment & cached GOP");
+
+    WSACleanup();
+}
+
+void SlowClientTests() {
+    printf("* WebStream slow client tests.\n");
+    const char PORT[] = "8093";
+    const unsigned int FAST_CLIENT_COUNT = 4;
+    const uint32_t FRAGMENT_COUNT = 150;
+    const uint32_t GOP_SIZE = 10;
+    const uint32_t FRAME_SIZE = 100000;
+
+    WSAData wsa_data{};
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data))
+        throw std::runtime_error("WSAStartup failure");
+
+    std::vector<std::string> boxes = {ToString(MakeFtyp()), ToString(MakeMoovMF(1920, 1080))};
+    for (uint32_t seq_nr = 1; seq_nr <= FRAGMENT_COUNT; seq_nr++) {
+        boxes.push_back(ToString(MakeMoofMF(seq_nr, 1, 1000, FRAME_SIZE, (seq_nr - 1) % GOP_SIZE == 0)));
+        boxes.push_back(ToString(MakeMdat(FRAME_SIZE)));
+    }
+    std::string expected;
+    for (const std::string& box : boxes)
+        expected += box;
+
+    std::vector<std::string> received_fast(FAST_CLIENT_COUNT);
+    std::vector<std::thread> fast_clients;
+    for (unsigned int i = 0; i < FAST_CLIENT_COUNT; i++)
+        fast_clients.emplace_back([&received_fast, &PORT, i] { received_fast[i] = ReceiveStream(PORT); });
+
+    // slow client that doesn't read until all fragments have been written
+    std::atomic<bool> throttle = true;
+    std::string received_slow;
+    std::thread slow_client([&] {
+        SOCKET sock = RequestStream(PORT, 8*1024);
+        while (throttle)
+            Sleep(10);
+        received_slow = ReceiveStream(sock);
+    });
+
+    uint64_t dropped = 0;
+    {
+        WebStream server(PORT, /*ring_capacity*/1024, /*queue_fragments*/16, /*queue_bytes*/1024*1024);
+        while (server.StreamClientCount() < FAST_CLIENT_COUNT + 1)
+            Sleep(10);
+
+        for (size_t i = 0; i < boxes.size(); i++) {
+            server.WriteBytes(boxes[i]); // shall never block
+            if (IsAtomType(boxes[i].data(), "mdat"))
+                Sleep(2); // pace fragments like an encoder
+        }
+
+        throttle = false;
+        for (int i = 0; (i < 1000) && (dropped == 0); i++) {
+            for (const WebStream::StreamClientStats& stats : server.GetStreamClientStats())
+                dropped += stats.dropped_fragments;
+            Sleep(10);
+        }
+    }
+    for (std::thread& client : fast_clients)
+        client.join();
+    slow_client.join();
+
+    // other clients receive all frames
+    for (const std::string& stream : received_fast) {
+        if (stream != expected)
+            throw std::runtime_error("WebStream fast client did not receive the full stream");
+    }
+    if (dropped == 0)
+        throw std::runtime_error("WebStream slow client didn't drop fragments");
+
+    // slow client receives complete fragments, and resumes at a key frame after dropping
+    BoxTracker tracker;
+    std::vector<std::string> slow_boxes;
+    tracker.Feed(received_slow, [&](const BoxTracker::Box& box, std::string_view) {
+        slow_boxes.push_back(received_slow.substr((size_t)box.offset, (size_t)box.size));
+    });
+    if ((tracker.Position() != received_slow.size()) || tracker.InsideBox())
+        throw std::runtime_error("WebStream slow client received partial box");
+    if ((slow_boxes.size() < 2) || (slow_boxes[0] != boxes[0]) || (slow_boxes[1] != boxes[1]))
+        throw std::runtime_error("WebStream slow client did not receive the init segment");
+
+    uint32_t prev_seq_nr = 0;
+    for (size_t i = 2; i < slow_boxes.size(); i += 2) {
+        const std::string& moof = slow_boxes[i];
+        if (!IsAtomType(moof.data(), "moof") || (i + 1 >= slow_boxes.size()) || !IsAtomType(slow_boxes[i + 1].data(), "mdat"))
+            throw std::runtime_error("WebStream slow client received incomplete fragment");
+
+        uint32_t seq_nr = DeSerialize<uint32_t>(moof.data() + 20); // mfhd sequence_number
+        if ((seq_nr != prev_seq_nr + 1) && !MP4StreamEditor::IsKeyFrameFragment(moof))
+            throw std::runtime_error("WebStream slow client did not resume at a key frame");
+        prev_seq_nr = seq_nr;
+    }
+    if (slow_boxes.size() >= boxes.size())
+        throw std::runtime_error("WebStream slow client fragments not dropped");
+
+    WSACleanup();
+}
+
+
+void ConnectionReapTests() {
+    printf("* WebStream connection reaping tests.\n");
+    const char PORT[] = "8094";
+    const unsigned int REQUEST_THREADS = 8;
+    const unsigned int REQUESTS_PER_THREAD = 250;
+    const unsigned int STREAM_CLIENT_COUNT = 200;
+
+    WSAData wsa_data{};
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data))
+        throw std::runtime_error("WSAStartup failure");
+
+    std::vector<std::vector<char>> writes;
+    {
+        std::vector<char> init = MakeFtyp();
+        std::vector<char> moov = MakeMoovMF(1920, 1080);
+        init.insert(init.end(), moov.begin(), moov.end());
+        writes.push_back(init);
+    }
+    for (uint32_t seq_nr = 1; seq_nr <= 20; seq_nr++) {
+        writes.push_back(MakeMoofMF(seq_nr, 1, 1000, 1000 + seq_nr));
+        writes.push_back(MakeMdat(1000 + seq_nr));
+    }
+    std::string expected;
+    for (const std::vector<char>& buf : writes)
+        expected.append(buf.data(), buf.size());
+
+    std::vector<std::string> received(STREAM_CLIENT_COUNT);
+    std::vector<std::thread> stream_clients;
+    stream_clients.emplace_back([&received, &PORT] { received[0] = ReceiveStream(PORT); });
+
+    {
+        WebStream server(PORT);
+        while (server.StreamClientCount() < 1)
+            Sleep(10); // construction doesn't wait for clients
+
+        // many short-lived connections, served concurrently with the stream clients
+        std::atomic<unsigned int> not_found_count = 0;
+        std::vector<std::thread> request_threads;
+        for (unsigned int t = 0; t < REQUEST_THREADS; t++) {
+            request_threads.emplace_back([&not_found_count, &PORT] {
+                for (unsigned int i = 0; i < REQUESTS_PER_THREAD; i++) {
+                    std::string response = ShortRequest(PORT, "GET /unknown HTTP/1.1\r\nHost: localhost\r\n\r\n");
+                    if (response.find("HTTP/1.1 404") == 0)
+                        not_found_count++;
+                }
+            });
+        }
+        for (unsigned int i = 1; i < STREAM_CLIENT_COUNT; i++)
+            stream_clients.emplace_back([&received, &PORT, i] { received[i] = ReceiveStream(PORT); });
+
+        for (std::thread& thread : request_threads)
+            thread.join();
+        if (not_found_count != REQUEST_THREADS*REQUESTS_PER_THREAD)
+            throw std::runtime_error("WebStream short request not answered");
+
+        while (server.StreamClientCount() < STREAM_CLIENT_COUNT)
+            Sleep(10);
+
+        // closed connections shall be released without waiting for stream data
+        for (unsigned int i = 0; (server.ConnectionCount() > STREAM_CLIENT_COUNT) && (i < 500); i++)
+            Sleep(10);
+        if (server.ConnectionCount() != STREAM_CLIENT_COUNT)
+            throw std::runtime_error("WebStream closed connections not reaped");
+
+        for (const std::vector<char>& buf : writes)
+            server.WriteBytes(std::string_view(buf.data(), buf.size()));
+    } // all fragments are sent before the server closes
+
+    for (std::thread& client : stream_clients)
+        client.join();
+
+    for (const std::string& stream : received) {
+        if (stream != expected)
+            throw std::runtime_error("WebStream client did not receive the full stream");
+    }
+
+    WSACleanup();
+}
+
+
+void KeepAliveTests() {
+    printf("* WebStream persistent connection tests.\n");
+    const char PORT[] = "8096";
+
+    WSAData wsa_data{};
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data))
+        throw std::runtime_error("WSAStartup failure");
+
+    std::thread stream_client([&PORT] { ReceiveStream(PORT); });
+    {
+        WebStream server(PORT);
+        while (server.StreamClientCount() < 1)
+            Sleep(10); // construction doesn't wait for clients
+
+        // pipelined requests on one connection, with the last request split across packets
+        SOCKET sock = ConnectClient(PORT);
+        const std::string requests[] = {
+            "GET /a HTTP/1.1\r\nHost: localhost\r\n\r\nGET /b HTTP/1.1\r\nHost: localhost\r\n\r\nGET /c HT",
+            "TP/1.1\r\nHost: local",
+            "host\r\nConnection: close\r\n\r\n",
+        };
+        for (const std::string& request : requests) {
+            send(sock, request.data(), (int)request.size(), 0);
+            Sleep(20);
+        }
+
+        // receive until the server closes the connection
+        std::string response;
+        char buf[1024];
+        for (;;) {
+            int res = recv(sock, buf, sizeof(buf), 0);
+            if (res <= 0)
+                break;
+            response.append(buf, res);
+        }
+        closesocket(sock);
+
+        size_t count = 0;
+        for (size_t pos = response.find("HTTP/1.1 404"); pos != std::string::npos; pos = response.find("HTTP/1.1 404", pos + 1))
+            count++;
+        if (count != 3)
+            throw std::runtime_error("WebStream pipelined requests not answered");
+        if (response.find("Connection: close") == std::string::npos)
+            throw std::runtime_error("WebStream did not confirm connection close");
+    }
+    stream_client.join();
+
+    WSACleanup();
+}
+
+
+/** Request the video stream over WebSocket and receive until the server closes the connection.
+    Returns the payload of each received message. */
+static std::vector<std::string> ReceiveWebSocketMessages(const char* port) {
+    SOCKET sock = ConnectClient(port);
+    const std::string request = "GET /ws HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                                "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+    send(sock, request.data(), (int)request.size(), 0);
+
+    std::string response;
+    char buf[16*1024];
+    for (;;) {
+        int res = recv(sock, buf, sizeof(buf), 0);
+        if (res <= 0)
+            break;
+        response.append(buf, res);
+    }
+    closesocket(sock);
+
+    // handshake example from RFC 6455 section 1.3
+    size_t header_end = response.find("\r\n\r\n");
+    if ((response.find("HTTP/1.1 101") != 0) || (response.find("Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n") > header_end))
+        throw std::runtime_error("WebSocket handshake failure");
+
+    std::vector<std::string> messages;
+    std::string_view frames(response);
+    frames.remove_prefix(header_end + 4);
+    while (!frames.empty()) {
+        if ((frames.size() < 2) || ((uint8_t)frames[0] != 0x82))
+            throw std::runtime_error("WebSocket binary frame missing");
+        uint64_t size = (uint8_t)frames[1];
+        size_t header_size = 2;
+        if (size == 126) {
+            size = DeSerialize<uint16_t>(frames.data() + 2);
+            header_size = 4;
+        } else if (size == 127) {
+            size = DeSerialize<uint64_t>(frames.data() + 2);
+            header_size = 10;
+        }
+        if (frames.size() < header_size + size)
+            throw std::runtime_error("WebSocket frame truncated");
+
+        messages.emplace_back(frames.substr(header_size, (size_t)size));
+        frames.remove_prefix(header_size + (size_t)size);
+    }
+    return messages;
+}
+
+void WebSocketStreamTests() {
+    printf("* WebStream WebSocket transport tests.\n");
+    const char PORT[] = "8097";
+    const char CONTROL_PORT[] = "8101"; // separate port, since the first server's port can linger in TIME_WAIT
+    const uint32_t LATE_JOIN_SEQ_NR = 10; // late client connects after this "moof", before its "mdat"
+
+    WSAData wsa_data{};
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data))
+        throw std::runtime_error("WSAStartup failure");
+
+    // expect one binary message per init segment & fragment
+    std::vector<std::string> messages;
+    {
+        std::vector<char> init = MakeFtyp();
+        std::vector<char> moov = MakeMoovMF(1920, 1080);
+        init.insert(init.end(), moov.begin(), moov.end());
+        messages.push_back(ToString(init));
+    }
+    for (uint32_t seq_nr = 1; seq_nr <= 20; seq_nr++) {
+        // messages with both 16bit & 64bit length encoding
+        messages.push_back(ToString(MakeMoofMF(seq_nr, 1, 1000, 4000*seq_nr)) + ToString(MakeMdat(4000*seq_nr)));
+    }
+
+    std::vector<std::string> received_early, received_late;
+    std::thread early_client([&] { received_early = ReceiveWebSocketMessages(PORT); });
+    std::thread late_client;
+    {
+        WebStream server(PORT);
+        while (server.StreamClientCount() < 1)
+            Sleep(10); // construction doesn't wait for clients
+        for (size_t i = 0; i < messages.size(); i++) {
+            const std::string& message = messages[i];
+            if (i == LATE_JOIN_SEQ_NR) {
+                // write "moof" & "mdat" separately, with a client joining in between
+                const size_t moof_size = DeSerialize<uint32_t>(message.data());
+                server.WriteBytes(std::string_view(message).substr(0, moof_size));
+                late_client = std::thread([&] { received_late = ReceiveWebSocketMessages(PORT); });
+                while (server.StreamClientCount() < 2)
+                    Sleep(10);
+                server.WriteBytes(std::string_view(message).substr(moof_size));
+            } else {
+                server.WriteBytes(message);
+            }
+        }
+    } // all fragments are sent before the server closes
+    early_client.join();
+    late_client.join();
+
+    if (received_early != messages)
+        throw std::runtime_error("WebSocket messages do not match the stream");
+
+    // late client receives the cached init segment, followed by the fragment in progress
+    std::vector<std::string> expected_late = {messages[0]};
+    expected_late.insert(expected_late.end(), messages.begin() + LATE_JOIN_SEQ_NR, messages.end());
+    if (received_late != expected_late)
+        throw std::runtime_error("WebSocket late-joining client messages do not match the stream");
+
+    {
+        // ping answered with pong, close echoed before the server closes the connection
+        WebStream server(CONTROL_PORT);
+        SOCKET sock = ConnectClient(CONTROL_PORT);
+        const std::string request = "GET /ws HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                                    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+        send(sock, request.data(), (int)request.size(), 0);
+        while (server.StreamClientCount() < 1)
+            Sleep(10);
+
+        const std::string control = MaskedFrame(0x89, "ping") + MaskedFrame(0x88, std::string("\x03\xE8", 2));
+        send(sock, control.data(), (int)control.size(), 0);
+
+        std::string response;
+        char buf[1024];
+        for (;;) {
+            int res = recv(sock, buf, sizeof(buf), 0);
+            if (res <= 0)
+                break;
+            response.append(buf, res);
+        }
+        closesocket(sock);
+
+        const std::string expected = std::string("\x8A\x04" "ping" "\x88\x02\x03\xE8", 10);
+        if (response.substr(response.find("\r\n\r\n") + 4) != expected)
+            throw std::runtime_error("WebSocket ping or close not answered");
+    }
+
+    WSACleanup();
+}
+
+
+void GatherSendTests() {
+    printf("* WebStream gather send tests.\n");
+    const char PORT[] = "8098";
+    const uint32_t FRAGMENT_COUNT = 50;
+
+    WSAData wsa_data{};
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data))
+        throw std::runtime_error("WSAStartup failure");
+
+    std::string expected;
+    std::string received;
+    std::thread client([&] { received = ReceiveStream(PORT); });
+    {
+        WebStream server(PORT);
+        while (server.StreamClientCount() < 1)
+            Sleep(10); // construction doesn't wait for clients
+
+        std::vector<char> init = MakeFtyp();
+        std::vector<char> moov = MakeMoovMF(1920, 1080);
+        init.insert(init.end(), moov.begin(), moov.end());
+        server.WriteBytes(std::string_view(init.data(), init.size()));
+        expected += ToString(init);
+
+        for (uint32_t seq_nr = 1; seq_nr <= FRAGMENT_COUNT; seq_nr++) {
+            // moof & mdat written separately, like the Media Foundation sink does
+            std::vector<char> moof = MakeMoofMF(seq_nr, 1, 1000, 10000);
+            std::vector<char> mdat = MakeMdat(10000);
+            server.WriteBytes(std::string_view(moof.data(), moof.size()));
+            Sleep(1); // let the server observe the incomplete fragment
+            server.WriteBytes(std::string_view(mdat.data(), mdat.size()));
+            expected += ToString(moof) + ToString(mdat);
+            Sleep(2);
+        }
+
+        // wait for transmission
+        std::vector<WebStream::StreamClientStats> stats;
+        for (unsigned int i = 0; i < 500; i++) {
+            stats = server.GetStreamClientStats();
+            if ((stats.size() == 1) && (stats[0].sent_fragments == 2 + 2*FRAGMENT_COUNT))
+                break;
+            Sleep(10);
+        }
+        if ((stats.size() != 1) || (stats[0].sent_fragments != 2 + 2*FRAGMENT_COUNT))
+            throw std::runtime_error("WebStream fragments not sent");
+
+        // at most one send call for the HTTP header, one for the init segment & one per fragment (fewer if fragments are
+        // queued together). Retries after WSAEWOULDBLOCK are not counted.
+        if (stats[0].send_calls > 2 + FRAGMENT_COUNT)
+            throw std::runtime_error("WebStream fragment not sent with a single send call");
+    }
+    client.join();
+
+    if (received != expected)
+        throw std::runtime_error("WebStream client did not receive the full stream");
+
+    WSACleanup();
+}
+
+
+void ZeroCopyShutdownTests() {
+    printf("* WebStream zero-copy shutdown tests.\n");
+    const char PORT[] = "8100";
+
+    WSAData wsa_data{};
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data))
+        throw std::runtime_error("WSAStartup failure");
+
+    // loopback connection where the client never reads, so that a large overlapped send stays pending
+    SOCKET listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((u_short)atoi(PORT));
+    if ((bind(listen_sock, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) || (listen(listen_sock, 1) == SOCKET_ERROR))
+        throw std::runtime_error("listen failure");
+    SOCKET client = ConnectClient(PORT, 4*1024);
+    SOCKET server_sock = accept(listen_sock, nullptr, nullptr);
+    closesocket(listen_sock);
+
+    auto fragment = std::make_shared<const std::string>(16*1024*1024, 'x');
+    WakeupSock wakeup;
+    auto sock = std::make_unique<ClientSock>(server_sock);
+    sock->EnableZeroCopy(wakeup);
+    sock->Queue(fragment);
+    if (!sock->Flush() || sock->WantsWrite())
+        throw std::runtime_error("zero-copy send not pending");
+
+    // the destructor shall cancel the pending send & release the buffer without hanging
+    std::atomic<bool> destroyed = false;
+    std::thread destroy([&] {
+        sock.reset();
+        destroyed = true;
+    });
+    for (unsigned int i = 0; (i < 500) && !destroyed; i++)
+        Sleep(10);
+    if (!destroyed) {
+        destroy.detach();
+        throw std::runtime_error("ClientSock destructor hangs with a pending zero-copy send");
+    }
+    destroy.join();
+    if (fragment.use_count() != 1)
+        throw std::runtime_error("ClientSock did not release the queued buffer");
+
+    closesocket(client);
+    WSACleanup();
+}
+
+void MetricsEndpointTests() {
+    printf("* WebStream metrics endpoint tests.\n");
+    const char PORT[] = "8099";
+    const uint32_t FRAGMENT_COUNT = 10;
+
+    WSAData wsa_data{};
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data))
+        throw std::runtime_error("WSAStartup failure");
+
+    std::thread client([&PORT] { ReceiveStream(PORT); });
+    {
+        WebStream server(PORT);
+        while (server.StreamClientCount() < 1)
+            Sleep(10); // construction doesn't wait for clients
+
+        std::vector<char> init = MakeFtyp();
+        std::vector<char> moov = MakeMoovMF(1920, 1080);
+        init.insert(init.end(), moov.begin(), moov.end());
+        server.WriteBytes(std::string_view(init.data(), init.size()));
+        for (uint32_t seq_nr = 1; seq_nr <= FRAGMENT_COUNT; seq_nr++) {
+            std::vector<char> fragment = MakeMoofMF(seq_nr, 1, 1000, 10000);
+            std::vector<char> mdat = MakeMdat(10000);
+            fragment.insert(fragment.end(), mdat.begin(), mdat.end());
+            server.WriteBytes(std::string_view(fragment.data(), fragment.size()));
+        }
+
+        // wait for transmission
+        std::vector<WebStream::StreamClientStats> stats;
+        for (unsigned int i = 0; i < 500; i++) {
+            stats = server.GetStreamClientStats();
+            if ((stats.size() == 1) && (stats[0].sent_fragments == 2 + 2*FRAGMENT_COUNT))
+                break;
+            Sleep(10);
+        }
+        if ((stats.size() != 1) || (stats[0].sent_fragments != 2 + 2*FRAGMENT_COUNT))
+            throw std::runtime_error("WebStream fragments not sent");
+
+        // receive until the server closes the connection
+        SOCKET sock = ConnectClient(PORT);
+        const std::string request = "GET /metrics HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+        send(sock, request.data(), (int)request.size(), 0);
+        std::string response;
+        char buf[1024];
+        for (;;) {
+            int res = recv(sock, buf, sizeof(buf), 0);
+            if (res <= 0)
+                break;
+            response.append(buf, res);
+        }
+        closesocket(sock);
+
+        if ((response.find("HTTP/1.1 200 OK\r\n") != 0) || (response.find("Content-Type: text/plain; version=0.0.4") == std::string::npos))
+            throw std::runtime_error("WebStream metrics response header mismatch");
+
+        const uint64_t fragment_count = TransmitterMetrics::Instance().fragment_bytes.Read().count;
+        const std::string samples[] = {
+            "\nwebstream_fragment_bytes_count " + std::to_string(fragment_count) + "\n",
+            "\nwebstream_client_sent_bytes_total{client=\"1\"} " + std::to_string(stats[0].sent_bytes) + "\n",
+            "\nwebstream_client_queue_fragments{client=\"1\"} 0\n",
+            "\nwebstream_client_send_latency_seconds_count{client=\"1\"} ",
+            "\nwebstream_editor_rewrites_total{atom=\"moof\",mode=\"gather\"} ",
+        };
+        for (const std::string& sample : samples) {
+            if (response.find(sample) == std::string::npos)
+                throw std::runtime_error("WebStream metrics sample missing");
+        }
+        if (fragment_count < FRAGMENT_COUNT)
+            throw std::runtime_error("WebStream fragment sizes not recorded");
+    }
+    client.join();
+
+    WSACleanup();
+}
+
+
 int main() {
     printf("Running unit tests:\n");
 
     SerializationTests();
     TimeConvTests();
     FixedPointTests();
+    ColorConversionTests();
+    MoofGatherTests();
+    MuxerProbeTests();
+    FragmentAggregationTests();
+    HttpParserTests();
+    WebSocketProtocolTests();
+    StaticAssetTests();
+    MetricsTests();
+    FramePipelineTests();
+    FramePoolTests();
+    FramePacerTests();
+    TileHashTests();
+    BoxTrackerTests();
+    MoovEditingTests();
+    MoovLayoutCacheTests();
+    WebStreamFanOutTests();
+    LateJoinTests();
+    NonBlockingStartupTests();
+    SlowClientTests();
+    ConnectionReapTests();
+    KeepAliveTests();
+    WebSocketStreamTests();
+    GatherSendTests();
+    ZeroCopyShutdownTests();
+    MetricsEndpointTests();
 
     printf("[success]\n");
 }